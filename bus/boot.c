@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -13,7 +14,7 @@
 #include "prof.h"
 #include "elf.h"
 #include "cpu-elf.h"
-
+#include "util.h"
 
 static
 void
@@ -38,6 +39,86 @@ doread(int fd, uint32_t pos, void *buf, size_t len)
 }
 
 
+#ifdef USE_TRACE
+/*
+ * Hand the kernel's function symbols to the profiler, so it can write
+ * symbolized output. Kernels without a symbol table (stripped) are
+ * fine; the profile just has addresses instead of names.
+ */
+static
+void
+load_syms(int fd, const Elf_Ehdr *eh)
+{
+	Elf_Shdr sh, strsh;
+	Elf_Sym *syms, *sym;
+	char *strs;
+	uint32_t i, nsyms;
+	unsigned type;
+
+	if (eh->e_shoff == 0 || eh->e_shentsize < sizeof(Elf_Shdr)) {
+		return;
+	}
+
+	for (i=0; i<eh->e_shnum; i++) {
+		doread(fd, eh->e_shoff + i*eh->e_shentsize, &sh, sizeof(sh));
+		if (ntohl(sh.sh_type) == SHT_SYMTAB) {
+			break;
+		}
+	}
+	if (i == eh->e_shnum) {
+		return;
+	}
+	sh.sh_offset = ntohl(sh.sh_offset);
+	sh.sh_size = ntohl(sh.sh_size);
+	sh.sh_link = ntohl(sh.sh_link);
+	sh.sh_entsize = ntohl(sh.sh_entsize);
+	if (sh.sh_link >= eh->e_shnum || sh.sh_entsize < sizeof(Elf_Sym)) {
+		msg("Boot image has invalid symbol table (ignored)");
+		return;
+	}
+
+	doread(fd, eh->e_shoff + sh.sh_link*eh->e_shentsize,
+	       &strsh, sizeof(strsh));
+	strsh.sh_offset = ntohl(strsh.sh_offset);
+	strsh.sh_size = ntohl(strsh.sh_size);
+	if (ntohl(strsh.sh_type) != SHT_STRTAB || strsh.sh_size == 0) {
+		msg("Boot image has invalid symbol table (ignored)");
+		return;
+	}
+
+	nsyms = sh.sh_size / sh.sh_entsize;
+	syms = domalloc(sh.sh_size);
+	strs = domalloc(strsh.sh_size);
+	doread(fd, sh.sh_offset, syms, sh.sh_size);
+	doread(fd, strsh.sh_offset, strs, strsh.sh_size);
+	/* make sure every name is terminated */
+	strs[strsh.sh_size - 1] = 0;
+
+	for (i=0; i<nsyms; i++) {
+		sym = (Elf_Sym *)((char *)syms + i*sh.sh_entsize);
+
+		/* Assembler labels are often NOTYPE; take them too. */
+		type = ELF_ST_TYPE(sym->st_info);
+		if (type != STT_FUNC && type != STT_NOTYPE) {
+			continue;
+		}
+		if (ntohs(sym->st_shndx) == SHN_UNDEF ||
+		    ntohs(sym->st_shndx) == SHN_ABS) {
+			continue;
+		}
+		if (ntohl(sym->st_name) == 0 ||
+		    ntohl(sym->st_name) >= strsh.sh_size) {
+			continue;
+		}
+		prof_addsym(ntohl(sym->st_value), ntohl(sym->st_size),
+			    strs + ntohl(sym->st_name));
+	}
+
+	free(strs);
+	free(syms);
+}
+#endif
+
 static
 void
 load_elf(int fd)
@@ -146,6 +227,13 @@ load_elf(int fd)
 	}
 
 	cpu_set_entrypoint(0, eh.e_entry);
+
+#ifdef USE_TRACE
+	eh.e_shoff = ntohl(eh.e_shoff);
+	eh.e_shentsize = ntohs(eh.e_shentsize);
+	eh.e_shnum = ntohs(eh.e_shnum);
+	load_syms(fd, &eh);
+#endif
 }
 
 static
@@ -183,6 +271,9 @@ load_kernel(const char *image, const char *argument)
 		die();
 	}
 
+#ifdef USE_TRACE
+	prof_setimage(image);
+#endif
 	load_elf(fd);
 	close(fd);
 
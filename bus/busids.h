@@ -24,10 +24,10 @@
 #define MAINBOARD_REVISION       1
 
 #define TIMER_REVISION     1
-#define DISK_REVISION      2
+#define DISK_REVISION      3
 #define SERIAL_REVISION    1
 #define SCREEN_REVISION    1
-#define NET_REVISION       1
-#define EMUFS_REVISION     1
-#define TRACE_REVISION     3
+#define NET_REVISION       2
+#define EMUFS_REVISION     2
+#define TRACE_REVISION     4
 #define RANDOM_REVISION    1
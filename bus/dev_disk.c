@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 
 /*
  * On Linux, or at least in some glibc versions, fcntl.h defines the
@@ -19,19 +20,26 @@
 
 #include "config.h"
 
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
 #include "console.h"
 #include "clock.h"
 #include "doom.h"
 #include "main.h"
+#include "flight.h"
 #include "util.h"
+#include "thread.h"
+#include "diskfmt.h"
 
 #include "lamebus.h"
 #include "busids.h"
 
 
 /* Disk underlying I/O definitions */
-#define HEADER_MESSAGE  "System/161 Disk Image"
-#define HEADERSIZE      SECTSIZE
+#define HEADER_MESSAGE  DISKFMT_RAW_MAGIC
+#define HEADERSIZE      DISKFMT_HEADERSIZE
 
 /* Disk physical parameters */
 #define SECTSIZE               512   /* bytes */
@@ -49,6 +57,8 @@
 /* Disk timing parameters */
 #define CACHE_READ_TIME      500       /* ns */
 #define CACHE_WRITE_TIME     500       /* ns */
+#define DISCARD_TIME         20000     /* ns */
+#define DISCARD_SECTOR_TIME  2         /* ns per sector discarded */
 
 /* Number of tries after which we assume the timing code has lost its marbles*/
 #define MAX_WORKTRIES    10
@@ -58,22 +68,36 @@
 #define DISKREG_STAT  4
 #define DISKREG_SECT  8
 #define DISKREG_RPM   12
+#define DISKREG_COUNT 16
 
 /* Transfer buffer offsets */
 #define DISK_BUF_START  32768
 #define DISK_BUF_END    (DISK_BUF_START + SECTSIZE)
 
+/* Kinds of image file (see diskfmt.h) */
+#define IMG_RAW         0
+#define IMG_OVERLAY     1
+#define IMG_SPARSE      2
+
+/* States for the async I/O thread */
+#define AIO_IDLE        0     /* nothing submitted */
+#define AIO_PENDING     1     /* submitted, not yet picked up or finished */
+#define AIO_DONE        2     /* finished; result in da_err */
+#define AIO_EXIT        3     /* thread should exit */
+
 /* Bits for status registers */
 #define DISKBIT_INPROGRESS    1
 #define DISKBIT_ISWRITE       2
 #define DISKBIT_COMPLETE      4
 #define DISKBIT_INVSECT       8
 #define DISKBIT_MEDIAERR      16
+#define DISKBIT_DISCARD       32
 
 /* The legal values that can be written to the status register */
 #define DISKSTAT_IDLE          0
 #define DISKSTAT_READING       (DISKBIT_INPROGRESS)
 #define DISKSTAT_WRITING       (DISKBIT_INPROGRESS|DISKBIT_ISWRITE)
+#define DISKSTAT_DISCARDING    (DISKBIT_INPROGRESS|DISKBIT_DISCARD)
 
 /* Masks for the other values for the status register */
 #define DISKSTAT_COMPLETE      (DISKBIT_COMPLETE)
@@ -86,6 +110,93 @@
 #define INVSECT(r)        FINISH(r, DISKSTAT_INVSECT)
 #define MEDIAERR(r)       FINISH(r, DISKSTAT_MEDIAERR)
 
+/*
+ * Host I/O thread state. If the disk is configured "async", host I/O
+ * is started when the simulated operation starts and only needs to be
+ * finished when the simulated operation completes, so host latency
+ * overlaps with the modeled seek and rotation time.
+ *
+ * da_state, da_err, and the contents of da_buf while da_state is
+ * AIO_PENDING belong to the I/O thread; everything else belongs to
+ * the main thread. All of it is protected by da_lock. While an
+ * operation is pending, the I/O thread also owns the file and the
+ * overlay or sparse image metadata (dd_overlay, dd_sparse).
+ */
+struct disk_aio {
+	pthread_t da_thread;
+	pthread_mutex_t da_lock;
+	pthread_cond_t da_cv;
+	int da_state;
+	int da_iswrite;
+	uint32_t da_sect;
+	int da_err;
+	char *da_buf;
+};
+
+/*
+ * Copy-on-write overlay state. If the image file is an overlay, sectors
+ * whose bit is set in do_bitmap are in the image file; the rest are
+ * read from the base image. See diskfmt.h.
+ */
+struct disk_overlay {
+	int do_basefd;
+	off_t do_bitmapoffset;     /* byte offset of bitmap in image */
+	off_t do_dataoffset;       /* byte offset of data area in image */
+	uint32_t do_nsectors;
+	uint32_t do_dirtysectors;  /* number of bits set */
+	unsigned char *do_bitmap;
+};
+
+/*
+ * Sparse image state. ds_table is the cluster table in host byte
+ * order. ds_cluster caches the most recently decompressed cluster
+ * (ds_cached is its number, or NOCLUSTER) so sequential reads of a
+ * compressed cluster only decompress it once.
+ */
+struct disk_sparse {
+	uint32_t ds_clustersectors;
+	uint32_t ds_nclusters;
+	off_t ds_tableoffset;        /* byte offset of table in image */
+	struct diskfmt_sparse_entry *ds_table;
+	uint32_t ds_end;             /* first free sector at end of file */
+	uint32_t ds_allocated;       /* number of clusters allocated */
+	uint32_t ds_compressed;      /* number of those compressed */
+	char *ds_cluster;
+	char *ds_cbuf;               /* compressed data */
+	uint32_t ds_cached;
+};
+
+#define NOCLUSTER  0xffffffff
+
+/*
+ * On-drive track cache. This is only a timing model; the data always
+ * comes from the image file. After a read the drive keeps the whole
+ * track, and prefetches dc_readahead following tracks in the
+ * background. dt_start is when the head got to a track (in clock_time
+ * nanoseconds, so rotational position works as in disk_readrotdelay);
+ * a sector is in the cache once it has passed under the head after
+ * that. Tracks are replaced LRU; the list is threaded through
+ * dc_tracks by track number, most recently used first.
+ */
+struct disk_cachetrack {
+	int dt_valid;
+	uint64_t dt_start;           /* time reading starts */
+	int dt_prev, dt_next;        /* LRU list; -1 at the ends */
+};
+
+struct disk_cache {
+	uint32_t dc_capacity;        /* sectors */
+	uint32_t dc_used;            /* sectors */
+	unsigned dc_readahead;       /* tracks */
+	struct disk_cachetrack *dc_tracks;
+	int dc_head, dc_tail;
+	uint32_t dc_hits, dc_misses;
+};
+
+#define CACHE_UNCHECKED  -1
+#define CACHE_MISS        0
+#define CACHE_HIT         1
+
 /*
  * Data for holding the device state
  */
@@ -100,6 +211,16 @@ struct disk_data {
 	 */
 	int dd_fd;
 	int dd_paranoid;     /* if nonzero, fsync on every write */
+	struct disk_aio *dd_aio;  /* async host I/O (null if synchronous) */
+	struct disk_overlay *dd_overlay;  /* overlay info (null if raw) */
+	struct disk_sparse *dd_sparse;    /* sparse info (null if raw) */
+
+	/*
+	 * Track cache (null if none); dd_cachestate is CACHE_* for the
+	 * current read.
+	 */
+	struct disk_cache *dd_cache;
+	int dd_cachestate;
 
 	/* 
 	 * Geometry:
@@ -137,6 +258,7 @@ struct disk_data {
 	 */
 	uint32_t dd_stat;
 	uint32_t dd_sect;
+	uint32_t dd_count;	/* sectors to discard */
 
 	/*
 	 * I/O buffer
@@ -191,7 +313,7 @@ doom_establish(unsigned count)
  */
 #ifndef LOCK_EX
 
-/*      LOCK_SH F_RDLCK - we don't use this */
+#define LOCK_SH F_RDLCK
 #define LOCK_EX F_WRLCK
 #define LOCK_UN F_UNLCK
 #define LOCK_NB 0  /* assume we always want this */
@@ -226,12 +348,8 @@ doread(int fd, off_t offset, char *buf, size_t bufsize)
 	size_t tot=0;
 	int r;
 
-	if (lseek(fd, offset, SEEK_SET)<0) {
-		return -1;
-	}
-
 	while (tot < bufsize) {
-		r = read(fd, buf + tot, bufsize - tot);
+		r = pread(fd, buf + tot, bufsize - tot, offset + tot);
 		if (r<0 && (errno==EINTR || errno==EAGAIN)) {
 			continue;
 		}
@@ -263,12 +381,8 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 	size_t tot=0;
 	int r;
 
-	if (lseek(fd, offset, SEEK_SET)<0) {
-		return -1;
-	}
-
 	while (tot < bufsize) {
-		r = write(fd, buf + tot, bufsize - tot);
+		r = pwrite(fd, buf + tot, bufsize - tot, offset + tot);
 		if (r<0 && (errno==EINTR || errno==EAGAIN)) {
 			continue;
 		}
@@ -278,13 +392,10 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 		if (r==0) {
 			/*
 			 * :-?
+			 *
+			 * This may be running on the I/O thread, so
+			 * don't complain here; the caller reports it.
 			 */
-
-			msg("disk: unexpected short write");
-			msg("disk: fd %d, offset %ld, tot %lu, tried %lu",
-			    fd, (long) offset, (unsigned long) tot,
-			    (unsigned long) (bufsize - tot));
-
 			errno = EIO;
 			return -1;
 		}
@@ -300,6 +411,35 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 	return 0;
 }
 
+/*
+ * Give back the host space for a range of the image file. This is
+ * only an optimization: if the host can't do it, the data is left
+ * where it is.
+ */
+static
+int
+punchhole(int fd, off_t offset, off_t len, int paranoid)
+{
+#ifdef HAS_PUNCHHOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		      offset, len) == -1) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			return 0;
+		}
+		return -1;
+	}
+	if (paranoid) {
+		return fsync(fd);
+	}
+#else
+	(void)fd;
+	(void)offset;
+	(void)len;
+	(void)paranoid;
+#endif
+	return 0;
+}
+
 static
 void
 writeheader(struct disk_data *dd, const char *filename, uint32_t configsectors)
@@ -327,11 +467,13 @@ writeheader(struct disk_data *dd, const char *filename, uint32_t configsectors)
 	}
 }
 
+/*
+ * Read the header into BUF and return what kind of image it is.
+ */
 static
-void
-readheader(struct disk_data *dd, const char *filename)
+int
+readheader(struct disk_data *dd, const char *filename, char *buf)
 {
-	char buf[HEADERSIZE];
 	if (doread(dd->dd_fd, 0, buf, HEADERSIZE)) {
 		msg("disk: slot %d: %s: Reading header: %s",
 		    dd->dd_slot, filename, strerror(errno));
@@ -341,11 +483,18 @@ readheader(struct disk_data *dd, const char *filename)
 	/* just in case */
 	buf[HEADERSIZE-1] = 0;
 
-	if (strcmp(buf, HEADER_MESSAGE)) {
-		msg("disk: slot %d: %s is not a disk image",
-		    dd->dd_slot, filename);
-		die();
+	if (!strcmp(buf, HEADER_MESSAGE)) {
+		return IMG_RAW;
+	}
+	if (!strcmp(buf, DISKFMT_OVERLAY_MAGIC)) {
+		return IMG_OVERLAY;
 	}
+	if (!strcmp(buf, DISKFMT_SPARSE_MAGIC)) {
+		return IMG_SPARSE;
+	}
+	msg("disk: slot %d: %s is not a disk image",
+	    dd->dd_slot, filename);
+	die();
 }
 
 static
@@ -371,11 +520,635 @@ disk_unlock(struct disk_data *dd)
 	(void)fcntl(dd->dd_fd, LOCK_UN);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Overlays
+
+/*
+ * Open the base image of an overlay. It is only read, so it can be
+ * shared among any number of overlays (and sys161 processes); take a
+ * shared lock to keep disk161 from merging into it while in use.
+ * Returns the size in sectors.
+ */
+static
+uint32_t
+overlay_openbase(struct disk_data *dd, const char *basename)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+	char buf[HEADERSIZE];
+	struct stat st;
+
+	dov->do_basefd = open(basename, O_RDONLY);
+	if (dov->do_basefd < 0) {
+		msg("disk: slot %d: %s: %s",
+		    dd->dd_slot, basename, strerror(errno));
+		die();
+	}
+	if (flock(dov->do_basefd, LOCK_SH|LOCK_NB) < 0) {
+		if (errno == EAGAIN) {
+			msg("disk: slot %d: %s: Locked by another process",
+			    dd->dd_slot, basename);
+			die();
+		}
+		msg("disk: slot %d: %s: flock: %s",
+		    dd->dd_slot, basename, strerror(errno));
+		die();
+	}
+	if (doread(dov->do_basefd, 0, buf, HEADERSIZE)) {
+		msg("disk: slot %d: %s: Reading header: %s",
+		    dd->dd_slot, basename, strerror(errno));
+		die();
+	}
+	buf[HEADERSIZE-1] = 0;
+	if (strcmp(buf, HEADER_MESSAGE)) {
+		msg("disk: slot %d: %s is not a raw disk image",
+		    dd->dd_slot, basename);
+		die();
+	}
+	if (fstat(dov->do_basefd, &st) == -1) {
+		msg("disk: slot %d: %s: fstat: %s",
+		    dd->dd_slot, basename, strerror(errno));
+		die();
+	}
+	st.st_size -= HEADERSIZE;
+	if (st.st_size < 0 || st.st_size > 0xffffffff) {
+		msg("disk: slot %d: %s: Invalid base image size",
+		    dd->dd_slot, basename);
+		die();
+	}
+	return st.st_size / SECTSIZE;
+}
+
+static
+void
+overlay_alloc(struct disk_data *dd)
+{
+	struct disk_overlay *dov;
+
+	dov = domalloc(sizeof(*dov));
+	dov->do_basefd = -1;
+	dov->do_bitmapoffset = 0;
+	dov->do_dataoffset = 0;
+	dov->do_nsectors = 0;
+	dov->do_dirtysectors = 0;
+	dov->do_bitmap = NULL;
+	dd->dd_overlay = dov;
+}
+
+static
+void
+overlay_setup(struct disk_data *dd, const struct diskfmt_overlay_header *oh)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+	size_t bitmapsize;
+
+	dov->do_nsectors = oh->oh_sectors;
+	dov->do_bitmapoffset = (off_t)oh->oh_bitmapstart * SECTSIZE;
+	dov->do_dataoffset = (off_t)oh->oh_datastart * SECTSIZE;
+
+	bitmapsize = oh->oh_bitmapsectors * SECTSIZE;
+	dov->do_bitmap = domalloc(bitmapsize);
+	memset(dov->do_bitmap, 0, bitmapsize);
+}
+
+/*
+ * Create a new (empty) overlay in the just-created image file.
+ */
+static
+void
+overlay_create(struct disk_data *dd, const char *filename,
+	       const char *basename)
+{
+	struct diskfmt_overlay_header oh;
+	char buf[HEADERSIZE];
+	uint32_t nsectors;
+	off_t fsize;
+
+	overlay_alloc(dd);
+	nsectors = overlay_openbase(dd, basename);
+
+	if (strlen(basename) >= DISKFMT_PATHLEN) {
+		msg("disk: slot %d: %s: Base image path too long",
+		    dd->dd_slot, basename);
+		die();
+	}
+
+	memset(&oh, 0, sizeof(oh));
+	strcpy(oh.oh_magic, DISKFMT_OVERLAY_MAGIC);
+	oh.oh_version = DISKFMT_OVERLAY_VERSION;
+	oh.oh_sectors = nsectors;
+	oh.oh_bitmapstart = 1;
+	oh.oh_bitmapsectors = DISKFMT_BITMAPSECTORS(nsectors);
+	oh.oh_datastart = oh.oh_bitmapstart + oh.oh_bitmapsectors;
+	strcpy(oh.oh_base, basename);
+	overlay_setup(dd, &oh);
+
+	oh.oh_version = htonl(oh.oh_version);
+	oh.oh_sectors = htonl(oh.oh_sectors);
+	oh.oh_bitmapstart = htonl(oh.oh_bitmapstart);
+	oh.oh_bitmapsectors = htonl(oh.oh_bitmapsectors);
+	oh.oh_datastart = htonl(oh.oh_datastart);
+	memset(buf, 0, HEADERSIZE);
+	memcpy(buf, &oh, sizeof(oh));
+
+	if (dowrite(dd->dd_fd, 0, buf, HEADERSIZE, dd->dd_paranoid)) {
+		msg("disk: slot %d: %s: Write of header: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+
+	fsize = dd->dd_overlay->do_dataoffset;
+	fsize += (off_t)nsectors * SECTSIZE;
+	if (ftruncate(dd->dd_fd, fsize)) {
+		msg("disk: slot %d: %s: ftruncate: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+}
+
+/*
+ * Attach to an existing overlay.
+ */
+static
+void
+overlay_open(struct disk_data *dd, const char *filename,
+	     const char *basename, const char *hdr)
+{
+	struct diskfmt_overlay_header ohbuf, *oh = &ohbuf;
+	struct disk_overlay *dov;
+	uint32_t nsectors, i;
+
+	memcpy(oh, hdr, sizeof(*oh));
+	oh->oh_version = ntohl(oh->oh_version);
+	oh->oh_sectors = ntohl(oh->oh_sectors);
+	oh->oh_bitmapstart = ntohl(oh->oh_bitmapstart);
+	oh->oh_bitmapsectors = ntohl(oh->oh_bitmapsectors);
+	oh->oh_datastart = ntohl(oh->oh_datastart);
+	oh->oh_base[DISKFMT_PATHLEN-1] = 0;
+
+	if (oh->oh_version != DISKFMT_OVERLAY_VERSION) {
+		msg("disk: slot %d: %s: Unsupported overlay version %u",
+		    dd->dd_slot, filename, oh->oh_version);
+		die();
+	}
+	if (oh->oh_bitmapstart < 1 ||
+	    oh->oh_bitmapsectors < DISKFMT_BITMAPSECTORS(oh->oh_sectors) ||
+	    oh->oh_datastart < oh->oh_bitmapstart + oh->oh_bitmapsectors) {
+		msg("disk: slot %d: %s: Corrupt overlay header",
+		    dd->dd_slot, filename);
+		die();
+	}
+
+	if (basename == NULL) {
+		basename = oh->oh_base;
+	}
+	overlay_alloc(dd);
+	dov = dd->dd_overlay;
+	nsectors = overlay_openbase(dd, basename);
+	if (nsectors != oh->oh_sectors) {
+		msg("disk: slot %d: %s: Overlay is %u sectors but base "
+		    "image %s is %u", dd->dd_slot, filename,
+		    oh->oh_sectors, basename, nsectors);
+		die();
+	}
+
+	overlay_setup(dd, oh);
+	if (doread(dd->dd_fd, dov->do_bitmapoffset, (char *)dov->do_bitmap,
+		   oh->oh_bitmapsectors * SECTSIZE)) {
+		msg("disk: slot %d: %s: Reading overlay bitmap: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+
+	dov->do_dirtysectors = 0;
+	for (i=0; i<nsectors; i++) {
+		if (dov->do_bitmap[i/8] & (1 << (i%8))) {
+			dov->do_dirtysectors++;
+		}
+	}
+}
+
+static
+int
+overlay_readsector(struct disk_data *dd, uint32_t sect, char *buf)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+	off_t offset = sect;
+
+	offset *= SECTSIZE;
+	if (dov->do_bitmap[sect/8] & (1 << (sect%8))) {
+		return doread(dd->dd_fd, dov->do_dataoffset + offset,
+			      buf, SECTSIZE);
+	}
+	return doread(dov->do_basefd, HEADERSIZE + offset, buf, SECTSIZE);
+}
+
+/*
+ * Write the data first and the bitmap second, so a crash in between
+ * leaves the old contents visible rather than a garbage sector.
+ */
+static
+int
+overlay_writesector(struct disk_data *dd, uint32_t sect, const char *buf)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+	off_t offset = sect;
+	unsigned char *bits;
+
+	offset *= SECTSIZE;
+	if (dowrite(dd->dd_fd, dov->do_dataoffset + offset, buf, SECTSIZE,
+		    dd->dd_paranoid)) {
+		return -1;
+	}
+
+	bits = &dov->do_bitmap[sect/8];
+	if ((*bits & (1 << (sect%8))) == 0) {
+		*bits |= 1 << (sect%8);
+		if (dowrite(dd->dd_fd, dov->do_bitmapoffset + sect/8,
+			    (const char *)bits, 1, dd->dd_paranoid)) {
+			*bits &= ~(1 << (sect%8));
+			return -1;
+		}
+		dov->do_dirtysectors++;
+	}
+	return 0;
+}
+
+/*
+ * Discarding drops sectors from the overlay, so they read from the
+ * base image again. The bitmap goes out before the data is dropped.
+ */
+static
+int
+overlay_discard(struct disk_data *dd, uint32_t sect, uint32_t count)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+	uint32_t first = sect/8, last = (sect + count - 1)/8;
+	unsigned char *bits;
+	uint32_t i, cleared = 0;
+
+	bits = domalloc(last - first + 1);
+	memcpy(bits, &dov->do_bitmap[first], last - first + 1);
+	for (i=sect; i<sect + count; i++) {
+		if (bits[i/8 - first] & (1 << (i%8))) {
+			bits[i/8 - first] &= ~(1 << (i%8));
+			cleared++;
+		}
+	}
+	if (cleared == 0) {
+		free(bits);
+		return 0;
+	}
+
+	if (dowrite(dd->dd_fd, dov->do_bitmapoffset + first,
+		    (const char *)bits, last - first + 1, dd->dd_paranoid)) {
+		free(bits);
+		return -1;
+	}
+	memcpy(&dov->do_bitmap[first], bits, last - first + 1);
+	dov->do_dirtysectors -= cleared;
+	free(bits);
+
+	return punchhole(dd->dd_fd, dov->do_dataoffset + (off_t)sect*SECTSIZE,
+			 (off_t)count * SECTSIZE, dd->dd_paranoid);
+}
+
+static
+void
+overlay_close(struct disk_data *dd)
+{
+	struct disk_overlay *dov = dd->dd_overlay;
+
+	(void)flock(dov->do_basefd, LOCK_UN);
+	if (close(dov->do_basefd)) {
+		smoke("disk: slot %d: close base: %s",
+		      dd->dd_slot, strerror(errno));
+	}
+	free(dov->do_bitmap);
+	free(dov);
+	dd->dd_overlay = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sparse images
+
+static
+void
+sparse_open(struct disk_data *dd, const char *filename, const char *hdr)
+{
+	struct diskfmt_sparse_header sh;
+	struct disk_sparse *ds;
+	struct diskfmt_sparse_entry *se;
+	size_t clustersize;
+	struct stat st;
+	uint32_t i;
+
+	memcpy(&sh, hdr, sizeof(sh));
+	sh.sh_version = ntohl(sh.sh_version);
+	sh.sh_sectors = ntohl(sh.sh_sectors);
+	sh.sh_clustersectors = ntohl(sh.sh_clustersectors);
+	sh.sh_tablestart = ntohl(sh.sh_tablestart);
+	sh.sh_tablesectors = ntohl(sh.sh_tablesectors);
+
+	if (sh.sh_version != DISKFMT_SPARSE_VERSION) {
+		msg("disk: slot %d: %s: Unsupported sparse image version %u",
+		    dd->dd_slot, filename, sh.sh_version);
+		die();
+	}
+	if (sh.sh_clustersectors < 1 ||
+	    sh.sh_clustersectors > DISKFMT_SPARSE_MAXCLUSTER ||
+	    sh.sh_tablestart < 1 ||
+	    sh.sh_tablesectors < DISKFMT_TABLESECTORS(
+		    DISKFMT_NCLUSTERS(sh.sh_sectors, sh.sh_clustersectors))) {
+		msg("disk: slot %d: %s: Corrupt sparse image header",
+		    dd->dd_slot, filename);
+		die();
+	}
+
+	ds = domalloc(sizeof(*ds));
+	ds->ds_clustersectors = sh.sh_clustersectors;
+	ds->ds_nclusters = DISKFMT_NCLUSTERS(sh.sh_sectors,
+					     sh.sh_clustersectors);
+	ds->ds_tableoffset = (off_t)sh.sh_tablestart * SECTSIZE;
+	ds->ds_table = domalloc(sh.sh_tablesectors * SECTSIZE);
+	ds->ds_allocated = 0;
+	ds->ds_compressed = 0;
+	clustersize = ds->ds_clustersectors * SECTSIZE;
+	ds->ds_cluster = domalloc(clustersize);
+	ds->ds_cbuf = domalloc(clustersize);
+	ds->ds_cached = NOCLUSTER;
+	dd->dd_sparse = ds;
+
+	if (doread(dd->dd_fd, ds->ds_tableoffset, (char *)ds->ds_table,
+		   sh.sh_tablesectors * SECTSIZE)) {
+		msg("disk: slot %d: %s: Reading cluster table: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+
+	if (fstat(dd->dd_fd, &st) == -1) {
+		msg("disk: slot %d: %s: fstat: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+	ds->ds_end = (st.st_size + SECTSIZE - 1) / SECTSIZE;
+	if (ds->ds_end < sh.sh_tablestart + sh.sh_tablesectors) {
+		ds->ds_end = sh.sh_tablestart + sh.sh_tablesectors;
+	}
+
+	for (i=0; i<ds->ds_nclusters; i++) {
+		se = &ds->ds_table[i];
+		se->se_start = ntohl(se->se_start);
+		se->se_length = ntohl(se->se_length);
+		if (se->se_start == 0) {
+			continue;
+		}
+		ds->ds_allocated++;
+		if (se->se_length & DISKFMT_SPARSE_COMPRESSED) {
+			ds->ds_compressed++;
+#ifndef HAS_ZLIB
+			msg("disk: slot %d: %s: Compressed images are not "
+			    "supported in this build", dd->dd_slot, filename);
+			die();
+#endif
+		}
+		if ((se->se_length & DISKFMT_SPARSE_LENGTH) > clustersize) {
+			msg("disk: slot %d: %s: Corrupt cluster table",
+			    dd->dd_slot, filename);
+			die();
+		}
+	}
+
+	dd->dd_totsectors = sh.sh_sectors;
+}
+
+/*
+ * Load cluster CL, which must be compressed, into ds_cluster.
+ */
+static
+int
+sparse_loadcluster(struct disk_data *dd, uint32_t cl)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+	struct diskfmt_sparse_entry *se = &ds->ds_table[cl];
+	size_t len = se->se_length & DISKFMT_SPARSE_LENGTH;
+
+	if (ds->ds_cached == cl) {
+		return 0;
+	}
+	ds->ds_cached = NOCLUSTER;
+
+	if (doread(dd->dd_fd, (off_t)se->se_start * SECTSIZE,
+		   ds->ds_cbuf, len)) {
+		return -1;
+	}
+#ifdef HAS_ZLIB
+	{
+		uLongf outlen = ds->ds_clustersectors * SECTSIZE;
+
+		if (uncompress((Bytef *)ds->ds_cluster, &outlen,
+			       (const Bytef *)ds->ds_cbuf, len) != Z_OK ||
+		    outlen != ds->ds_clustersectors * SECTSIZE) {
+			errno = EIO;
+			return -1;
+		}
+	}
+#else
+	errno = EIO;
+	return -1;
+#endif
+	ds->ds_cached = cl;
+	return 0;
+}
+
+static
+int
+sparse_readsector(struct disk_data *dd, uint32_t sect, char *buf)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+	uint32_t cl = sect / ds->ds_clustersectors;
+	uint32_t within = sect % ds->ds_clustersectors;
+	struct diskfmt_sparse_entry *se = &ds->ds_table[cl];
+
+	if (se->se_start == 0) {
+		memset(buf, 0, SECTSIZE);
+		return 0;
+	}
+	if (se->se_length & DISKFMT_SPARSE_COMPRESSED) {
+		if (sparse_loadcluster(dd, cl)) {
+			return -1;
+		}
+		memcpy(buf, ds->ds_cluster + within * SECTSIZE, SECTSIZE);
+		return 0;
+	}
+	return doread(dd->dd_fd, ((off_t)se->se_start + within) * SECTSIZE,
+		      buf, SECTSIZE);
+}
+
+/*
+ * Write out a cluster table entry.
+ */
+static
+int
+sparse_writeentry(struct disk_data *dd, uint32_t cl)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+	struct diskfmt_sparse_entry se;
+
+	se.se_start = htonl(ds->ds_table[cl].se_start);
+	se.se_length = htonl(ds->ds_table[cl].se_length);
+	return dowrite(dd->dd_fd, ds->ds_tableoffset + cl * sizeof(se),
+		       (const char *)&se, sizeof(se), dd->dd_paranoid);
+}
+
+/*
+ * Writing to an unallocated cluster appends a new uncompressed
+ * cluster to the file; the rest of it is left as a hole and reads
+ * back as zeros. Writing to a compressed cluster decompresses it into
+ * a new uncompressed cluster. In both cases the data goes out before
+ * the table entry that points to it.
+ */
+static
+int
+sparse_writesector(struct disk_data *dd, uint32_t sect, const char *buf)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+	uint32_t cl = sect / ds->ds_clustersectors;
+	uint32_t within = sect % ds->ds_clustersectors;
+	struct diskfmt_sparse_entry *se = &ds->ds_table[cl];
+	size_t clustersize = ds->ds_clustersectors * SECTSIZE;
+	struct diskfmt_sparse_entry old;
+
+	if (se->se_start != 0 &&
+	    (se->se_length & DISKFMT_SPARSE_COMPRESSED) == 0) {
+		return dowrite(dd->dd_fd,
+			       ((off_t)se->se_start + within) * SECTSIZE,
+			       buf, SECTSIZE, dd->dd_paranoid);
+	}
+
+	if (se->se_start != 0) {
+		if (sparse_loadcluster(dd, cl)) {
+			return -1;
+		}
+	}
+	else {
+		memset(ds->ds_cluster, 0, clustersize);
+	}
+	memcpy(ds->ds_cluster + within * SECTSIZE, buf, SECTSIZE);
+	ds->ds_cached = NOCLUSTER;
+
+	if (dowrite(dd->dd_fd, (off_t)ds->ds_end * SECTSIZE,
+		    ds->ds_cluster, clustersize, dd->dd_paranoid)) {
+		return -1;
+	}
+
+	old = *se;
+	se->se_start = ds->ds_end;
+	se->se_length = clustersize;
+	if (sparse_writeentry(dd, cl)) {
+		*se = old;
+		return -1;
+	}
+	ds->ds_end += ds->ds_clustersectors;
+	if (old.se_start == 0) {
+		ds->ds_allocated++;
+	}
+	else {
+		ds->ds_compressed--;
+	}
+	return 0;
+}
+
+/*
+ * Clusters wholly inside the range are unallocated, so they read as
+ * zeros again, and their space in the file is given back. Parts of
+ * uncompressed clusters are punched out, which also makes them read
+ * as zeros. Parts of compressed clusters are left alone.
+ */
+static
+int
+sparse_discard(struct disk_data *dd, uint32_t sect, uint32_t count)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+	struct diskfmt_sparse_entry *se, old;
+	uint32_t cl, first, last, start, end;
+	off_t len;
+
+	first = sect / ds->ds_clustersectors;
+	last = (sect + count - 1) / ds->ds_clustersectors;
+	for (cl = first; cl <= last; cl++) {
+		se = &ds->ds_table[cl];
+		if (se->se_start == 0) {
+			continue;
+		}
+
+		start = cl * ds->ds_clustersectors;
+		end = start + ds->ds_clustersectors;
+		if (start >= sect && end <= sect + count) {
+			old = *se;
+			se->se_start = 0;
+			se->se_length = 0;
+			if (sparse_writeentry(dd, cl)) {
+				*se = old;
+				return -1;
+			}
+			ds->ds_allocated--;
+			if (old.se_length & DISKFMT_SPARSE_COMPRESSED) {
+				ds->ds_compressed--;
+			}
+			if (ds->ds_cached == cl) {
+				ds->ds_cached = NOCLUSTER;
+			}
+			len = old.se_length & DISKFMT_SPARSE_LENGTH;
+			len = (len + SECTSIZE - 1) / SECTSIZE * SECTSIZE;
+			if (punchhole(dd->dd_fd, (off_t)old.se_start * SECTSIZE,
+				      len, dd->dd_paranoid)) {
+				return -1;
+			}
+		}
+		else if ((se->se_length & DISKFMT_SPARSE_COMPRESSED) == 0) {
+			if (start < sect) {
+				start = sect;
+			}
+			if (end > sect + count) {
+				end = sect + count;
+			}
+			if (punchhole(dd->dd_fd, ((off_t)se->se_start + start -
+					       cl * ds->ds_clustersectors) *
+				      SECTSIZE, (off_t)(end - start) * SECTSIZE,
+				      dd->dd_paranoid)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static
+void
+sparse_close(struct disk_data *dd)
+{
+	struct disk_sparse *ds = dd->dd_sparse;
+
+	free(ds->ds_table);
+	free(ds->ds_cluster);
+	free(ds->ds_cbuf);
+	free(ds);
+	dd->dd_sparse = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Image files
+
 static
 void
-disk_open(struct disk_data *dd, const char *filename, uint32_t configsectors)
+disk_open(struct disk_data *dd, const char *filename, const char *basename,
+	  uint32_t configsectors)
 {
-	int create = 0;
+	char hdr[HEADERSIZE];
+	int create = 0, kind = IMG_RAW;
 	struct stat st;
 
 	dd->dd_fd = open(filename, O_RDWR);
@@ -389,11 +1162,31 @@ disk_open(struct disk_data *dd, const char *filename, uint32_t configsectors)
 		die();
 	}
 	disk_lock(dd, filename);
-	if (create) {
+	if (create && basename != NULL) {
+		overlay_create(dd, filename, basename);
+	}
+	else if (create) {
 		writeheader(dd, filename, configsectors);
 	}
 	else {
-		readheader(dd, filename);
+		kind = readheader(dd, filename, hdr);
+		if (basename != NULL && kind != IMG_OVERLAY) {
+			msg("disk: slot %d: %s: base= given but this is not "
+			    "an overlay", dd->dd_slot, filename);
+			die();
+		}
+	}
+
+	if (kind == IMG_OVERLAY) {
+		overlay_open(dd, filename, basename, hdr);
+	}
+	else if (kind == IMG_SPARSE) {
+		sparse_open(dd, filename, hdr);
+		return;
+	}
+	if (dd->dd_overlay != NULL) {
+		dd->dd_totsectors = dd->dd_overlay->do_nsectors;
+		return;
 	}
 
 	if (fstat(dd->dd_fd, &st) == -1) {
@@ -421,6 +1214,12 @@ static
 void
 disk_close(struct disk_data *dd)
 {
+	if (dd->dd_overlay != NULL) {
+		overlay_close(dd);
+	}
+	if (dd->dd_sparse != NULL) {
+		sparse_close(dd);
+	}
 	disk_unlock(dd);
 	if (close(dd->dd_fd)) {
 		smoke("disk: slot %d: close: %s", 
@@ -428,31 +1227,242 @@ disk_close(struct disk_data *dd)
 	}
 }
 
+/*
+ * Note: these may be called from the I/O thread. Besides the file,
+ * for overlay and sparse images they update the bitmap or cluster
+ * table and the counts that go with it, so the main thread must
+ * wait for pending I/O (disk_aio_drain) before looking at those.
+ */
 static
 int
-disk_readsector(struct disk_data *dd)
+disk_readsector(struct disk_data *dd, uint32_t sect, char *buf)
 {
-	off_t offset = dd->dd_sect;
+	off_t offset = sect;
+
+	if (dd->dd_overlay != NULL) {
+		return overlay_readsector(dd, sect, buf);
+	}
+	if (dd->dd_sparse != NULL) {
+		return sparse_readsector(dd, sect, buf);
+	}
+
 	offset *= SECTSIZE;
 	offset += HEADERSIZE;
 
-	g_stats.s_rsects++;
-
-	return doread(dd->dd_fd, offset, dd->dd_buf, SECTSIZE);
+	return doread(dd->dd_fd, offset, buf, SECTSIZE);
 }
 
 static
 int
-disk_writesector(struct disk_data *dd)
+disk_writesector(struct disk_data *dd, uint32_t sect, const char *buf)
 {
-	off_t offset = dd->dd_sect;
+	off_t offset = sect;
+
+	if (dd->dd_overlay != NULL) {
+		return overlay_writesector(dd, sect, buf);
+	}
+	if (dd->dd_sparse != NULL) {
+		return sparse_writesector(dd, sect, buf);
+	}
+
 	offset *= SECTSIZE;
 	offset += HEADERSIZE;
 
-	g_stats.s_wsects++;
+	return dowrite(dd->dd_fd, offset, buf, SECTSIZE, dd->dd_paranoid);
+}
+
+/*
+ * Discard COUNT sectors starting at SECT. The caller has checked the
+ * range. Always done from the main thread.
+ */
+static
+int
+disk_discard(struct disk_data *dd, uint32_t sect, uint32_t count)
+{
+	if (dd->dd_overlay != NULL) {
+		return overlay_discard(dd, sect, count);
+	}
+	if (dd->dd_sparse != NULL) {
+		return sparse_discard(dd, sect, count);
+	}
+	return punchhole(dd->dd_fd, HEADERSIZE + (off_t)sect * SECTSIZE,
+			 (off_t)count * SECTSIZE, dd->dd_paranoid);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Async host I/O
+
+static
+void *
+disk_aio_thread(void *data)
+{
+	struct disk_data *dd = data;
+	struct disk_aio *da = dd->dd_aio;
+	int err;
+
+	pthread_mutex_lock(&da->da_lock);
+	while (1) {
+		while (da->da_state != AIO_PENDING &&
+		       da->da_state != AIO_EXIT) {
+			pthread_cond_wait(&da->da_cv, &da->da_lock);
+		}
+		if (da->da_state == AIO_EXIT) {
+			break;
+		}
+		pthread_mutex_unlock(&da->da_lock);
+
+		if (da->da_iswrite) {
+			err = disk_writesector(dd, da->da_sect, da->da_buf);
+		}
+		else {
+			err = disk_readsector(dd, da->da_sect, da->da_buf);
+		}
+
+		pthread_mutex_lock(&da->da_lock);
+		da->da_err = err ? errno : 0;
+		da->da_state = AIO_DONE;
+		pthread_cond_broadcast(&da->da_cv);
+	}
+	pthread_mutex_unlock(&da->da_lock);
+	return NULL;
+}
+
+/*
+ * Wait for any outstanding I/O to finish. Call with da_lock held.
+ */
+static
+void
+disk_aio_drain(struct disk_aio *da)
+{
+	while (da->da_state == AIO_PENDING) {
+		pthread_cond_wait(&da->da_cv, &da->da_lock);
+	}
+}
+
+/*
+ * Submit the host side of the operation just started. For writes the
+ * data is taken from the transfer buffer now; as with a real drive,
+ * changing the buffer while the write is in progress has undefined
+ * results, and a write that is abandoned by going back to idle may
+ * or may not reach the media.
+ */
+static
+void
+disk_aio_start(struct disk_data *dd)
+{
+	struct disk_aio *da = dd->dd_aio;
+
+	pthread_mutex_lock(&da->da_lock);
+	disk_aio_drain(da);
+	da->da_iswrite = (dd->dd_stat & DISKBIT_ISWRITE) != 0;
+	da->da_sect = dd->dd_sect;
+	if (da->da_iswrite) {
+		memcpy(da->da_buf, dd->dd_buf, SECTSIZE);
+	}
+	da->da_err = 0;
+	da->da_state = AIO_PENDING;
+	pthread_cond_broadcast(&da->da_cv);
+	pthread_mutex_unlock(&da->da_lock);
+}
+
+/*
+ * Collect the result of the operation now completing, blocking if the
+ * host hasn't finished it yet. If the registers no longer match what
+ * was submitted (the OS changed the sector number partway through)
+ * fall back to doing the I/O synchronously.
+ */
+static
+int
+disk_aio_finish(struct disk_data *dd)
+{
+	struct disk_aio *da = dd->dd_aio;
+	int iswrite = (dd->dd_stat & DISKBIT_ISWRITE) != 0;
+	int matched, err = 0;
+
+	pthread_mutex_lock(&da->da_lock);
+	disk_aio_drain(da);
+	matched = da->da_state == AIO_DONE &&
+		da->da_sect == dd->dd_sect && da->da_iswrite == iswrite;
+	if (matched) {
+		err = da->da_err;
+		if (!err && !iswrite) {
+			memcpy(dd->dd_buf, da->da_buf, SECTSIZE);
+		}
+	}
+	da->da_state = AIO_IDLE;
+	pthread_mutex_unlock(&da->da_lock);
+
+	if (!matched) {
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: async I/O mismatch",
+			dd->dd_slot);
+		if (iswrite) {
+			return disk_writesector(dd, dd->dd_sect, dd->dd_buf);
+		}
+		return disk_readsector(dd, dd->dd_sect, dd->dd_buf);
+	}
+	if (err) {
+		msg("disk: slot %d: %s of sector %u: %s", dd->dd_slot,
+		    iswrite ? "write" : "read", dd->dd_sect, strerror(err));
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Wait for the I/O thread to let go of the file, if it has anything
+ * left over from an abandoned operation.
+ */
+static
+void
+disk_aio_wait(struct disk_data *dd)
+{
+	struct disk_aio *da = dd->dd_aio;
+
+	pthread_mutex_lock(&da->da_lock);
+	disk_aio_drain(da);
+	da->da_state = AIO_IDLE;
+	pthread_mutex_unlock(&da->da_lock);
+}
+
+static
+void
+disk_aio_init(struct disk_data *dd)
+{
+	struct disk_aio *da;
+
+	da = domalloc(sizeof(*da));
+	pthread_mutex_init(&da->da_lock, NULL);
+	pthread_cond_init(&da->da_cv, NULL);
+	da->da_state = AIO_IDLE;
+	da->da_iswrite = 0;
+	da->da_sect = 0;
+	da->da_err = 0;
+	da->da_buf = domalloc(SECTSIZE);
+
+	dd->dd_aio = da;
+	dothread(&da->da_thread, disk_aio_thread, dd);
+}
 
-	return dowrite(dd->dd_fd, offset, dd->dd_buf, SECTSIZE,
-		       dd->dd_paranoid);
+static
+void
+disk_aio_cleanup(struct disk_data *dd)
+{
+	struct disk_aio *da = dd->dd_aio;
+
+	pthread_mutex_lock(&da->da_lock);
+	disk_aio_drain(da);
+	da->da_state = AIO_EXIT;
+	pthread_cond_broadcast(&da->da_cv);
+	pthread_mutex_unlock(&da->da_lock);
+	pthread_join(da->da_thread, NULL);
+
+	pthread_cond_destroy(&da->da_cv);
+	pthread_mutex_destroy(&da->da_lock);
+	free(da->da_buf);
+	free(da);
+	dd->dd_aio = NULL;
 }
 
 ////////////////////////////////////////////////////////////
@@ -684,6 +1694,208 @@ disk_writerotdelay(struct disk_data *dd, uint32_t cyl, uint32_t rotoffset)
 	return delay;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Track cache
+
+static
+uint64_t
+disk_cache_now(void)
+{
+	uint32_t secs, nsecs;
+
+	clock_time(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+disk_cache_unlink(struct disk_cache *dc, int t)
+{
+	struct disk_cachetrack *dt = &dc->dc_tracks[t];
+
+	if (dt->dt_prev >= 0) {
+		dc->dc_tracks[dt->dt_prev].dt_next = dt->dt_next;
+	}
+	else {
+		dc->dc_head = dt->dt_next;
+	}
+	if (dt->dt_next >= 0) {
+		dc->dc_tracks[dt->dt_next].dt_prev = dt->dt_prev;
+	}
+	else {
+		dc->dc_tail = dt->dt_prev;
+	}
+	dt->dt_prev = dt->dt_next = -1;
+}
+
+static
+void
+disk_cache_pushfront(struct disk_cache *dc, int t)
+{
+	struct disk_cachetrack *dt = &dc->dc_tracks[t];
+
+	dt->dt_prev = -1;
+	dt->dt_next = dc->dc_head;
+	if (dc->dc_head >= 0) {
+		dc->dc_tracks[dc->dc_head].dt_prev = t;
+	}
+	else {
+		dc->dc_tail = t;
+	}
+	dc->dc_head = t;
+}
+
+/*
+ * Put track T in the cache, read starting at time START, evicting
+ * older tracks as needed. If it's already there, just mark it used.
+ * Tracks bigger than the whole cache are not kept.
+ */
+static
+void
+disk_cache_insert(struct disk_data *dd, int t, uint64_t start)
+{
+	struct disk_cache *dc = dd->dd_cache;
+	struct disk_cachetrack *dt = &dc->dc_tracks[t];
+	int victim;
+
+	if (dt->dt_valid) {
+		disk_cache_unlink(dc, t);
+		disk_cache_pushfront(dc, t);
+		return;
+	}
+
+	if (dd->dd_sectors[t] > dc->dc_capacity) {
+		return;
+	}
+	while (dc->dc_used + dd->dd_sectors[t] > dc->dc_capacity) {
+		victim = dc->dc_tail;
+		Assert(victim >= 0);
+		disk_cache_unlink(dc, victim);
+		dc->dc_tracks[victim].dt_valid = 0;
+		dc->dc_used -= dd->dd_sectors[victim];
+	}
+
+	dt->dt_valid = 1;
+	dt->dt_start = start;
+	dc->dc_used += dd->dd_sectors[t];
+	disk_cache_pushfront(dc, t);
+}
+
+/*
+ * Look up sector ROTOFFSET of track T for a read, counting a hit or
+ * miss. On a hit, return in *DELAY how long until the sector has been
+ * read into the cache.
+ */
+static
+int
+disk_cache_lookup(struct disk_data *dd, int t, uint32_t rotoffset,
+		  uint32_t *delay)
+{
+	struct disk_cache *dc = dd->dd_cache;
+	struct disk_cachetrack *dt = &dc->dc_tracks[t];
+	uint64_t now, ready, nsecs_per_sector, phase, rev;
+
+	if (!dt->dt_valid) {
+		dc->dc_misses++;
+		g_stats.s_dcmisses++;
+		return CACHE_MISS;
+	}
+
+	dc->dc_hits++;
+	g_stats.s_dchits++;
+	disk_cache_unlink(dc, t);
+	disk_cache_pushfront(dc, t);
+
+	/*
+	 * The sector is read when the start of the next sector first
+	 * comes around after the head got there.
+	 */
+	now = disk_cache_now();
+	rev = dd->dd_nsecs_per_rev;
+	nsecs_per_sector = rev / dd->dd_sectors[t];
+	phase = ((rotoffset + 1) % dd->dd_sectors[t]) * nsecs_per_sector;
+	ready = dt->dt_start + (phase + rev - dt->dt_start % rev) % rev;
+	*delay = ready > now ? ready - now : 0;
+	return CACHE_HIT;
+}
+
+/*
+ * A read from track T has finished: keep the track, and queue
+ * readahead of the tracks that follow it in sector order (that is,
+ * inward) so there are always dc_readahead of them in the cache.
+ * Reading each one starts after the one before it has been read in
+ * full and the head has moved over by a track.
+ */
+static
+void
+disk_cache_fill(struct disk_data *dd, int t)
+{
+	struct disk_cache *dc = dd->dd_cache;
+	uint64_t start, step;
+	unsigned i;
+	int u;
+
+	/* a track read after a miss is what the head saw since it got there */
+	start = (uint64_t)dd->dd_trackarrival_secs * 1000000000 +
+		dd->dd_trackarrival_nsecs;
+	if (dd->dd_current_track != t) {
+		/* forced I/O without timing */
+		start = disk_cache_now();
+	}
+	disk_cache_insert(dd, t, start);
+	if (dc->dc_tracks[t].dt_valid) {
+		start = dc->dc_tracks[t].dt_start;
+	}
+
+	step = dd->dd_nsecs_per_rev + disk_seektime(dd, 1);
+	for (i=1; i<=dc->dc_readahead; i++) {
+		u = t - (int)i;
+		if (u < 0) {
+			break;
+		}
+		if (dc->dc_tracks[u].dt_valid) {
+			start = dc->dc_tracks[u].dt_start;
+		}
+		else {
+			start += step;
+		}
+		disk_cache_insert(dd, u, start);
+	}
+}
+
+static
+void
+disk_cache_init(struct disk_data *dd, uint32_t capacity, unsigned readahead)
+{
+	struct disk_cache *dc;
+	uint32_t i;
+
+	dc = domalloc(sizeof(*dc));
+	dc->dc_capacity = capacity;
+	dc->dc_used = 0;
+	dc->dc_readahead = readahead;
+	dc->dc_tracks = domalloc(dd->dd_tracks * sizeof(dc->dc_tracks[0]));
+	for (i=0; i<dd->dd_tracks; i++) {
+		dc->dc_tracks[i].dt_valid = 0;
+		dc->dc_tracks[i].dt_start = 0;
+		dc->dc_tracks[i].dt_prev = -1;
+		dc->dc_tracks[i].dt_next = -1;
+	}
+	dc->dc_head = dc->dc_tail = -1;
+	dc->dc_hits = dc->dc_misses = 0;
+	dd->dd_cache = dc;
+}
+
+static
+void
+disk_cache_cleanup(struct disk_data *dd)
+{
+	free(dd->dd_cache->dc_tracks);
+	free(dd->dd_cache);
+	dd->dd_cache = NULL;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Setup
@@ -695,10 +1907,13 @@ disk_init(int slot, int argc, char *argv[])
 {
 	struct disk_data *dd;
 	const char *filename = NULL;
+	const char *basename = NULL;
 	off_t size;
 	uint32_t totsectors=0;
 	uint32_t rpm = 3600;
-	int i, paranoid=0, usedoom = 1;
+	int i, paranoid=0, usedoom = 1, async = 0;
+	off_t cachesize = 0;
+	int readahead = -1;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "rpm=", 4)) {
@@ -719,6 +1934,9 @@ disk_init(int slot, int argc, char *argv[])
 		else if (!strncmp(argv[i], "file=", 5)) {
 			filename = argv[i]+5;
 		}
+		else if (!strncmp(argv[i], "base=", 5)) {
+			basename = argv[i]+5;
+		}
 		else if (!strcmp(argv[i], "paranoid")) {
 			paranoid = 1;
 		}
@@ -728,6 +1946,18 @@ disk_init(int slot, int argc, char *argv[])
 		else if (!strcmp(argv[i], "nodoom")) {
 			usedoom = 0;
 		}
+		else if (!strcmp(argv[i], "async")) {
+			async = 1;
+		}
+		else if (!strcmp(argv[i], "noasync")) {
+			async = 0;
+		}
+		else if (!strncmp(argv[i], "cache=", 6)) {
+			cachesize = getsize(argv[i]+6);
+		}
+		else if (!strncmp(argv[i], "readahead=", 10)) {
+			readahead = atoi(argv[i]+10);
+		}
 		else {
 			msg("disk: slot %d: invalid option %s", slot, argv[i]);
 			die();
@@ -748,6 +1978,18 @@ disk_init(int slot, int argc, char *argv[])
 		die();
 	}
 
+	if (cachesize == 0 && readahead > 0) {
+		msg("disk: slot %d: readahead requires cache", slot);
+		die();
+	}
+	if (cachesize / SECTSIZE > 0xffffffff) {
+		msg("disk: slot %d: Cache too large", slot);
+		die();
+	}
+	if (readahead < 0) {
+		readahead = 1;
+	}
+
 	/*
 	 * Set up the disk
 	 */
@@ -758,6 +2000,11 @@ disk_init(int slot, int argc, char *argv[])
 
 	dd->dd_fd = -1;
 	dd->dd_paranoid = paranoid;
+	dd->dd_aio = NULL;
+	dd->dd_overlay = NULL;
+	dd->dd_sparse = NULL;
+	dd->dd_cache = NULL;
+	dd->dd_cachestate = CACHE_UNCHECKED;
 
 	dd->dd_sectors = NULL;
 	dd->dd_tracks = 0;
@@ -776,10 +2023,11 @@ disk_init(int slot, int argc, char *argv[])
 
 	dd->dd_stat = DISKSTAT_IDLE;
 	dd->dd_sect = 0;
+	dd->dd_count = 1;
 
 	dd->dd_buf = domalloc(SECTSIZE);
 
-	disk_open(dd, filename, totsectors);
+	disk_open(dd, filename, basename, totsectors);
 	if (dd->dd_totsectors != totsectors && totsectors > 0) {
 		msg("disk: slot %d: %s: Wrong configured size %u (%uK)",
 		    slot, filename, totsectors,
@@ -801,6 +2049,13 @@ disk_init(int slot, int argc, char *argv[])
 		die();
 	}
 
+	if (async) {
+		disk_aio_init(dd);
+	}
+	if (cachesize > 0) {
+		disk_cache_init(dd, cachesize / SECTSIZE, readahead);
+	}
+
 	return dd;
 }
 
@@ -809,6 +2064,12 @@ void
 disk_cleanup(void *data)
 {
 	struct disk_data *dd = data;
+	if (dd->dd_aio != NULL) {
+		disk_aio_cleanup(dd);
+	}
+	if (dd->dd_cache != NULL) {
+		disk_cache_cleanup(dd);
+	}
 	disk_close(dd);
 	free(dd->dd_buf);
 	free(dd);
@@ -845,12 +2106,55 @@ disk_waitdone(void *data, uint32_t status)
 	disk_update(dd);
 }
 
+/*
+ * Discards don't move the head or wait for the platter; the drive
+ * just updates its mapping, which takes a fixed time plus a little
+ * per sector.
+ */
+static
+void
+disk_work_discard(struct disk_data *dd)
+{
+	uint32_t count = dd->dd_count;
+	uint64_t nsecs;
+
+	if (count == 0 || count > dd->dd_totsectors - dd->dd_sect) {
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: Invalid discard range",
+			dd->dd_slot);
+		INVSECT(dd->dd_stat);
+		return;
+	}
+
+	if (dd->dd_iostatus < 1) {
+		nsecs = DISCARD_TIME + (uint64_t)count * DISCARD_SECTOR_TIME;
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: discard time %llu ns",
+			dd->dd_slot, (unsigned long long) nsecs);
+		dd->dd_timedop = 1;
+		schedule_event(nsecs, dd, 1, disk_waitdone, "disk discard");
+		return;
+	}
+
+	HWTRACE(DOTRACE_DISK, "disk: slot %d: discard sectors %u-%u",
+		dd->dd_slot, dd->dd_sect, dd->dd_sect + count - 1);
+	if (dd->dd_aio != NULL) {
+		disk_aio_wait(dd);
+	}
+	if (disk_discard(dd, dd->dd_sect, count)) {
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: media error", 
+			dd->dd_slot);
+		MEDIAERR(dd->dd_stat);
+	}
+	else {
+		COMPLETE(dd->dd_stat);
+	}
+}
+
 static
 void
 disk_work(struct disk_data *dd)
 {
 	int cyl, rotoffset;
-	uint32_t rotdelay;
+	uint32_t rotdelay, delay;
 	int err;
 
 	if (dd->dd_timedop) {
@@ -876,6 +2180,11 @@ disk_work(struct disk_data *dd)
 		return;
 	}
 
+	if (dd->dd_stat & DISKBIT_DISCARD) {
+		disk_work_discard(dd);
+		return;
+	}
+
 	dd->dd_worktries++;
 	if (dd->dd_worktries > MAX_WORKTRIES) {
 		msg("Geometry modeling fault! Please report to maintainer.");
@@ -901,7 +2210,26 @@ disk_work(struct disk_data *dd)
 
 	locate_sector(dd, dd->dd_sect, &cyl, &rotoffset);
 
-	if (dd->dd_current_track != cyl) {
+	if (dd->dd_cache != NULL && (dd->dd_stat & DISKBIT_ISWRITE) == 0 &&
+	    dd->dd_cachestate == CACHE_UNCHECKED) {
+		dd->dd_cachestate = disk_cache_lookup(dd, cyl, rotoffset,
+						      &delay);
+		if (dd->dd_cachestate == CACHE_HIT) {
+			HWTRACE(DOTRACE_DISK,
+				"disk: slot %d: cache hit, track %d: %u ns",
+				dd->dd_slot, cyl, delay);
+			if (delay > 0) {
+				dd->dd_timedop = 1;
+				schedule_event(delay, dd, 2, disk_waitdone,
+					       "disk readahead");
+				return;
+			}
+			dd->dd_iostatus = 2;
+		}
+	}
+
+	if (dd->dd_current_track != cyl &&
+	    dd->dd_cachestate != CACHE_HIT) {
 		/*
 		 * Need to seek.
 		 */
@@ -972,12 +2300,30 @@ disk_work(struct disk_data *dd)
 	if (dd->dd_stat & DISKBIT_ISWRITE) {
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: write sector %u", 
 			dd->dd_slot, dd->dd_sect);
-		err = disk_writesector(dd);
+		flight_hwevent(FLIGHT_DISK, dd->dd_slot, 1, dd->dd_sect);
+		g_stats.s_wsects++;
+		if (dd->dd_aio != NULL) {
+			err = disk_aio_finish(dd);
+		}
+		else {
+			err = disk_writesector(dd, dd->dd_sect, dd->dd_buf);
+		}
 	}
 	else {
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: read sector %u", 
 			dd->dd_slot, dd->dd_sect);
-		err = disk_readsector(dd);
+		flight_hwevent(FLIGHT_DISK, dd->dd_slot, 0, dd->dd_sect);
+		g_stats.s_rsects++;
+		if (dd->dd_aio != NULL) {
+			err = disk_aio_finish(dd);
+		}
+		else {
+			err = disk_readsector(dd, dd->dd_sect, dd->dd_buf);
+		}
+		if (!err && dd->dd_cache != NULL) {
+			locate_sector(dd, dd->dd_sect, &cyl, &rotoffset);
+			disk_cache_fill(dd, cyl);
+		}
 	}
 
 	if (err) {
@@ -1032,12 +2378,27 @@ disk_setstatus(struct disk_data *dd, uint32_t val)
 		}
 		dd->dd_iostatus = 0;
 		break;
+	    case DISKSTAT_DISCARDING:
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: discard starts", 
+			dd->dd_slot);
+		if (dd->dd_usedoom) {
+			doom_tick();
+		}
+		dd->dd_iostatus = 0;
+		break;
 	    default:
 		hang("disk: Invalid write %u to status register", val);
 		return;
 	}
 
 	dd->dd_stat = val;
+	dd->dd_cachestate = CACHE_UNCHECKED;
+
+	if (dd->dd_aio != NULL && (val & DISKBIT_INPROGRESS) &&
+	    (val & DISKBIT_DISCARD) == 0 &&
+	    dd->dd_sect < dd->dd_totsectors) {
+		disk_aio_start(dd);
+	}
 
 	disk_update(dd);
 }
@@ -1063,6 +2424,7 @@ disk_fetch(unsigned cpunum, void *data, uint32_t offset, uint32_t *ret)
 	    case DISKREG_RPM: *ret = dd->dd_rpm; return 0;
 	    case DISKREG_STAT: *ret = dd->dd_stat; return 0;
 	    case DISKREG_SECT: *ret = dd->dd_sect; return 0;
+	    case DISKREG_COUNT: *ret = dd->dd_count; return 0;
 	}
 	return -1;
 }
@@ -1086,6 +2448,7 @@ disk_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 	switch (offset) {
 	    case DISKREG_STAT: disk_setstatus(dd, val); return 0;
 	    case DISKREG_SECT: dd->dd_sect = val; return 0;
+	    case DISKREG_COUNT: dd->dd_count = val; return 0;
 	}
 
 	return -1;
@@ -1099,6 +2462,35 @@ disk_dumpstate(void *data)
 
 	msg("System/161 disk rev %d", DISK_REVISION);
 	msg("    Paranoid flag: %s", dd->dd_paranoid ? "ON" : "off");
+	msg("    Async host I/O: %s", dd->dd_aio ? "ON" : "off");
+	if (dd->dd_aio != NULL) {
+		/* keep the I/O thread off the metadata while we look */
+		pthread_mutex_lock(&dd->dd_aio->da_lock);
+		disk_aio_drain(dd->dd_aio);
+	}
+	if (dd->dd_overlay != NULL) {
+		msg("    Overlay: %lu of %lu sectors written",
+		    (unsigned long) dd->dd_overlay->do_dirtysectors,
+		    (unsigned long) dd->dd_overlay->do_nsectors);
+	}
+	if (dd->dd_sparse != NULL) {
+		msg("    Sparse: %lu of %lu clusters allocated, %lu compressed",
+		    (unsigned long) dd->dd_sparse->ds_allocated,
+		    (unsigned long) dd->dd_sparse->ds_nclusters,
+		    (unsigned long) dd->dd_sparse->ds_compressed);
+	}
+	if (dd->dd_aio != NULL) {
+		pthread_mutex_unlock(&dd->dd_aio->da_lock);
+	}
+	if (dd->dd_cache != NULL) {
+		msg("    Cache: %lu of %lu sectors used, readahead %u; "
+		    "%lu hits, %lu misses",
+		    (unsigned long) dd->dd_cache->dc_used,
+		    (unsigned long) dd->dd_cache->dc_capacity,
+		    dd->dd_cache->dc_readahead,
+		    (unsigned long) dd->dd_cache->dc_hits,
+		    (unsigned long) dd->dd_cache->dc_misses);
+	}
 	msg("    Tracks: %lu  Total sectors: %lu  RPM: %lu",
 	    (unsigned long) dd->dd_tracks,
 	    (unsigned long) dd->dd_totsectors,
@@ -1111,9 +2503,10 @@ disk_dumpstate(void *data)
 	    dd->dd_worktries,
 	    dd->dd_iostatus,
 	    dd->dd_timedop ? "event in progress" : "idle");
-	msg("    Registers: status 0x%08lx  sector 0x%08lx", 
+	msg("    Registers: status 0x%08lx  sector 0x%08lx  count 0x%08lx",
 	    (unsigned long) dd->dd_stat,
-	    (unsigned long) dd->dd_sect);
+	    (unsigned long) dd->dd_sect,
+	    (unsigned long) dd->dd_count);
 
 	msg("    Transfer buffer:");
 	dohexdump(dd->dd_buf, SECTSIZE);
@@ -93,6 +93,35 @@
  *           The file is truncated to the requested length.
  *
  *           RRES: result code
+ *
+ * Revision 2 adds a descriptor ring in guest physical memory, so the
+ * guest can have many operations outstanding at once and move data
+ * straight to and from its own memory:
+ *    4 bytes: RBASE ring physical address (32-byte aligned)
+ *    4 bytes: RSIZE number of descriptors (power of 2, at most 4096;
+ *                   0 = no ring). Writing it resets RHEAD and RTAIL.
+ *    4 bytes: RTAIL count of descriptors posted (write rings doorbell)
+ *    4 bytes: RHEAD count of descriptors completed (read-only)
+ *    4 bytes: RSTAT 1 when descriptors have completed (write 0 to ack)
+ *
+ * RHEAD and RTAIL count up forever; descriptor N is at index N mod
+ * RSIZE. Each descriptor is eight 32-bit words:
+ *    OP, HANDLE, OFFSET, LENGTH, BUFFER, RESULT, and two unused
+ * where OP, HANDLE, OFFSET, and LENGTH are as for the registers above
+ * and BUFFER is the physical address of the data (or pathname). When
+ * a descriptor completes, HANDLE, OFFSET, LENGTH, and RESULT are
+ * written back as the registers would be.
+ *
+ * Ringing the doorbell starts everything posted. The whole batch
+ * completes together and raises the interrupt once; anything posted
+ * while a batch is in progress is started when it finishes. Within a
+ * batch descriptors may be carried out in any order, or at the same
+ * time. The register interface still works and is independent of the
+ * ring.
+ *
+ * The host side of operations is done by a pool of worker threads
+ * (see below), so a slow host filesystem doesn't stop the simulation
+ * unless it's slower than the modeled device.
  */
 
 #include <sys/types.h>
@@ -104,9 +133,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "config.h"
 
 #include "util.h"
+#include "thread.h"
 #include "console.h"
 #include "speed.h"
 #include "clock.h"
@@ -114,10 +145,12 @@
 
 #include "lamebus.h"
 #include "busids.h"
+#include "memdefs.h"
 
 
-#define MAXHANDLES     64
+#define INITHANDLES    64	/* initial size of handle table; power of 2 */
 #define EMU_ROOTHANDLE  0
+#define NOHANDLE       (-1)
 
 #define EMU_BUF_START  32768
 #define EMU_BUF_SIZE   16384
@@ -128,6 +161,34 @@
 #define EMUREG_IOLEN   8
 #define EMUREG_OPER    12
 #define EMUREG_RESULT  16
+#define EMUREG_RINGBASE 20
+#define EMUREG_RINGSIZE 24
+#define EMUREG_RINGTAIL 28
+#define EMUREG_RINGHEAD 32
+#define EMUREG_RINGSTAT 36
+
+#define EMU_DESC_SIZE    32
+#define EMU_DESC_OP      0
+#define EMU_DESC_HANDLE  4
+#define EMU_DESC_OFFSET  8
+#define EMU_DESC_IOLEN   12
+#define EMU_DESC_BUFFER  16
+#define EMU_DESC_RESULT  20
+
+#define EMU_MAXRING      4096
+
+#define MAXWORKERS       64
+
+/*
+ * Worker threads need the *at functions and fdopendir, so that
+ * nothing depends on the current directory.
+ */
+#if defined(HAS_OPENAT) && defined(HAS_FDOPENDIR)
+#define USE_WORKERS
+#define DEFAULT_WORKERS  4
+#else
+#define DEFAULT_WORKERS  0
+#endif
 
 #define EMU_OP_OPEN          1
 #define EMU_OP_CREATE        2
@@ -152,11 +213,49 @@
 #define EMU_RES_NOTDIR       11
 #define EMU_RES_UNKNOWN      12
 #define EMU_RES_UNSUPP       13
+#define EMU_RES_BADADDR      14
 
+/*
+ * Open handles. eh_fd is -1 if the handle is free. Open handles are
+ * also hashed on (dev, ino) so reopening a file finds its handle;
+ * eh_next links the hash chain, or for free handles the free list.
+ *
+ * Directories get a directory stream the first time they're read;
+ * eh_dirpos is the number of the entry it will return next, so
+ * reading a directory in order doesn't need to rescan it.
+ *
+ * eh_busy counts requests using eh_fd; closing waits for it to be 0.
+ */
 struct emufs_handleinfo {
 	int eh_fd;
 	dev_t eh_dev;
 	ino_t eh_ino;
+	int eh_next;
+	DIR *eh_dir;
+	uint32_t eh_dirpos;
+	unsigned eh_busy;
+};
+
+/*
+ * One operation, from the registers or from a ring descriptor.
+ * er_buf is the I/O buffer, or the descriptor's buffer in guest RAM,
+ * with er_bufsize bytes available. Once submitted, everything but
+ * er_next belongs to the worker doing it until er_done is set;
+ * er_next and er_done are protected by ed_lock.
+ */
+struct emufs_req {
+	uint32_t er_op;
+	uint32_t er_handle;
+	uint32_t er_offset;
+	uint32_t er_iolen;
+	char *er_buf;
+	uint32_t er_bufsize;
+	uint32_t er_busyhandle;		/* handle as submitted */
+	uint32_t er_xferbytes;		/* bytes moved, for timing */
+	uint32_t er_result;
+	int er_err;			/* host errno, for tracing */
+	int er_done;
+	struct emufs_req *er_next;	/* work queue */
 };
 
 struct emufs_data {
@@ -169,14 +268,62 @@ struct emufs_data {
 	uint32_t ed_iolen;		/* iolen register */
 	uint32_t ed_result;		/* result register */
 
-	/* Handles from ed_handle are indexes into here */
-	struct emufs_handleinfo ed_handles[MAXHANDLES];
+	/*
+	 * Handles from ed_handle are indexes into ed_handles, which has
+	 * ed_numhandles entries and doubles when full. ed_hash has the
+	 * same number of buckets. The table is shared with the worker
+	 * threads and protected by ed_lock.
+	 */
+	struct emufs_handleinfo *ed_handles;
+	unsigned ed_numhandles;
+	unsigned ed_openhandles;
+	int *ed_hash;
+	int ed_freehandles;
+
+	/* Worker threads and their work queue */
+	pthread_mutex_t ed_lock;
+	pthread_cond_t ed_workcv;	/* queue nonempty or exiting */
+	pthread_cond_t ed_donecv;	/* some request finished */
+	pthread_cond_t ed_handlecv;	/* some eh_busy went to 0 */
+	pthread_t *ed_workers;
+	unsigned ed_nworkers;		/* 0 to do everything here */
+	struct emufs_req *ed_queue;
+	struct emufs_req **ed_queuetail;
+	int ed_exiting;
 
 	/* Timing stuff */
 	int ed_busy;			/* true if operation in progress */
 	uint32_t ed_busyresult;		/* result for ed_result when done */
+	struct emufs_req ed_regreq;	/* register operation */
+
+	/*
+	 * Timing model: each operation takes the base latency for its
+	 * kind, plus the time to move its data at ed_bandwidth bytes per
+	 * second (0 for unlimited).
+	 */
+	uint64_t ed_openlatency;	/* open/create */
+	uint64_t ed_iolatency;		/* read/readdir/write */
+	uint64_t ed_metalatency;	/* close/getsize/truncate */
+	uint64_t ed_bandwidth;
+
+	/*
+	 * Descriptor ring. ed_ringbusy is the number of descriptors
+	 * in the batch in progress; their results wait in ed_ringreqs
+	 * until it completes.
+	 */
+	uint32_t ed_ringbase;
+	uint32_t ed_ringsize;
+	uint32_t ed_ringhead;
+	uint32_t ed_ringtail;
+	uint32_t ed_ringstat;
+	uint32_t ed_ringbusy;
+	struct emufs_req *ed_ringreqs;
+	uint32_t ed_ringalloc;		/* size of ed_ringreqs */
+	uint32_t ed_ringbatches;	/* for dumpstate */
+	uint32_t ed_ringdescs;
 };
 
+#if !defined(HAS_OPENAT) || !defined(HAS_FDOPENDIR)
 static
 int
 pushdir(int fd, int h)
@@ -205,14 +352,18 @@ popdir(int oldfd)
 	}
 	close(oldfd);
 }
+#endif
 
 
+/*
+ * The interrupt is on if there's a register-interface result or a
+ * ring completion that hasn't been acknowledged.
+ */
 static
 void
-emufs_setresult(struct emufs_data *ed, uint32_t result)
+emufs_updateirq(struct emufs_data *ed)
 {
-	ed->ed_result = result;
-	if (ed->ed_result>0) {
+	if (ed->ed_result > 0 || ed->ed_ringstat) {
 		raise_irq(ed->ed_slot);
 	}
 	else {
@@ -220,6 +371,22 @@ emufs_setresult(struct emufs_data *ed, uint32_t result)
 	}
 }
 
+static
+void
+emufs_setresult(struct emufs_data *ed, uint32_t result)
+{
+	ed->ed_result = result;
+	emufs_updateirq(ed);
+}
+
+static
+void
+emufs_setringstat(struct emufs_data *ed, uint32_t val)
+{
+	ed->ed_ringstat = val;
+	emufs_updateirq(ed);
+}
+
 static
 uint32_t
 errno_to_code(int err)
@@ -234,40 +401,172 @@ errno_to_code(int err)
 	    case EISDIR: return EMU_RES_ISDIR;
 	    case EEXIST: return EMU_RES_EXISTS;
 	    case ENOSPC: return EMU_RES_NOSPACE;
+	    case EMFILE: return EMU_RES_NOHANDLES;
+	    case ENFILE: return EMU_RES_NOHANDLES;
 	}
 	return EMU_RES_UNKNOWN;
 }
 
+////////////////////////////////////////////////////////////
+// handle table
+
+static
+unsigned
+handlehash(struct emufs_data *ed, dev_t dev, ino_t ino)
+{
+	uint64_t h;
+
+	h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h & (ed->ed_numhandles - 1);
+}
+
 /*
- * Find an existing handle for this file (if any); otherwise allocate
- * a new one. XXX: this table should really use some kind of lookup
- * scheme and not linear search, although since MAXHANDLES is
- * currently only 64 it doesn't matter that much.
+ * Make handles FIRST through ed_numhandles-1 free, so that the lowest
+ * comes off the free list first.
  */
 static
-int
-pickhandle(struct emufs_data *ed, dev_t dev, ino_t ino)
+void
+inithandles(struct emufs_data *ed, unsigned first)
 {
-	int i;
-	int empty = -1;
+	unsigned i;
 
-	for (i=0; i<MAXHANDLES; i++) {
-		if (ed->ed_handles[i].eh_fd < 0) {
-			/* remember first unused handle */
-			if (empty < 0) {
-				empty = i;
-			}
+	for (i = ed->ed_numhandles; i-- > first; ) {
+		ed->ed_handles[i].eh_fd = -1;
+		ed->ed_handles[i].eh_dev = 0;
+		ed->ed_handles[i].eh_ino = 0;
+		ed->ed_handles[i].eh_dir = NULL;
+		ed->ed_handles[i].eh_dirpos = 0;
+		ed->ed_handles[i].eh_busy = 0;
+		ed->ed_handles[i].eh_next = ed->ed_freehandles;
+		ed->ed_freehandles = i;
+	}
+}
+
+static
+void
+rehash(struct emufs_data *ed)
+{
+	unsigned i, b;
+
+	for (i=0; i<ed->ed_numhandles; i++) {
+		ed->ed_hash[i] = NOHANDLE;
+	}
+	for (i=0; i<ed->ed_numhandles; i++) {
+		if (ed->ed_handles[i].eh_fd >= 0) {
+			b = handlehash(ed, ed->ed_handles[i].eh_dev,
+				       ed->ed_handles[i].eh_ino);
+			ed->ed_handles[i].eh_next = ed->ed_hash[b];
+			ed->ed_hash[b] = i;
 		}
-		else if (ed->ed_handles[i].eh_dev == dev &&
-			 ed->ed_handles[i].eh_ino == ino) {
-			return i;
+	}
+}
+
+static
+void
+growhandles(struct emufs_data *ed)
+{
+	unsigned oldnum = ed->ed_numhandles;
+
+	ed->ed_numhandles *= 2;
+	ed->ed_handles = dorealloc(ed->ed_handles, ed->ed_numhandles *
+				   sizeof(ed->ed_handles[0]));
+	free(ed->ed_hash);
+	ed->ed_hash = domalloc(ed->ed_numhandles * sizeof(ed->ed_hash[0]));
+	Assert(ed->ed_freehandles == NOHANDLE);
+	inithandles(ed, oldnum);
+	rehash(ed);
+}
+
+/*
+ * Find an existing handle for this file, or NOHANDLE.
+ */
+static
+int
+findhandle(struct emufs_data *ed, dev_t dev, ino_t ino)
+{
+	int h;
+
+	for (h = ed->ed_hash[handlehash(ed, dev, ino)];
+	     h != NOHANDLE;
+	     h = ed->ed_handles[h].eh_next) {
+		if (ed->ed_handles[h].eh_dev == dev &&
+		    ed->ed_handles[h].eh_ino == ino) {
+			return h;
 		}
 	}
-	ed->ed_handles[empty].eh_dev = dev;
-	ed->ed_handles[empty].eh_ino = ino;
-	return empty;
+	return NOHANDLE;
+}
+
+/*
+ * Allocate a handle for FD, which is open on (DEV, INO).
+ */
+static
+int
+addhandle(struct emufs_data *ed, int fd, dev_t dev, ino_t ino)
+{
+	struct emufs_handleinfo *eh;
+	unsigned b;
+	int h;
+
+	if (ed->ed_freehandles == NOHANDLE) {
+		growhandles(ed);
+	}
+	h = ed->ed_freehandles;
+	eh = &ed->ed_handles[h];
+	ed->ed_freehandles = eh->eh_next;
+
+	eh->eh_fd = fd;
+	eh->eh_dev = dev;
+	eh->eh_ino = ino;
+	eh->eh_dir = NULL;
+	eh->eh_dirpos = 0;
+	eh->eh_busy = 0;
+
+	b = handlehash(ed, dev, ino);
+	eh->eh_next = ed->ed_hash[b];
+	ed->ed_hash[b] = h;
+	ed->ed_openhandles++;
+	return h;
 }
 
+static
+void
+removehandle(struct emufs_data *ed, int h)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[h];
+	int *p;
+
+	for (p = &ed->ed_hash[handlehash(ed, eh->eh_dev, eh->eh_ino)];
+	     *p != h;
+	     p = &ed->ed_handles[*p].eh_next) {
+		Assert(*p != NOHANDLE);
+	}
+	*p = eh->eh_next;
+
+	if (eh->eh_dir != NULL) {
+		/* this closes the dup'd fd, not eh_fd */
+		closedir(eh->eh_dir);
+		eh->eh_dir = NULL;
+	}
+	close(eh->eh_fd);
+	eh->eh_fd = -1;
+	eh->eh_next = ed->ed_freehandles;
+	ed->ed_freehandles = h;
+	ed->ed_openhandles--;
+}
+
+////////////////////////////////////////////////////////////
+// operations
+//
+// Except for emufs_openfirst these run on the worker threads (or on
+// the main thread if there are none), so they touch only the request,
+// the host filesystem, and the handle table, which is protected by
+// ed_lock. They don't trace or update statistics; emufs_report does
+// that on the main thread when the request completes.
+
 static
 void
 emufs_openfirst(struct emufs_data *ed, const char *dir)
@@ -275,7 +574,7 @@ emufs_openfirst(struct emufs_data *ed, const char *dir)
 	struct stat sbuf;
 	int fd;
 
-	Assert(ed->ed_handles[EMU_ROOTHANDLE].eh_fd < 0);
+	Assert(ed->ed_openhandles == 0);
 
 	fd = open(dir, O_RDONLY);
 	if (fd<0) {
@@ -289,57 +588,92 @@ emufs_openfirst(struct emufs_data *ed, const char *dir)
 		die();
 	}
 
-	ed->ed_handles[EMU_ROOTHANDLE].eh_fd = fd;
-	ed->ed_handles[EMU_ROOTHANDLE].eh_dev = sbuf.st_dev;
-	ed->ed_handles[EMU_ROOTHANDLE].eh_ino = sbuf.st_ino;
+	if (addhandle(ed, fd, sbuf.st_dev, sbuf.st_ino) != EMU_ROOTHANDLE) {
+		smoke("emufs: slot %d: root handle misallocated", ed->ed_slot);
+	}
 
 	g_stats.s_memu++;
 }
 
+/*
+ * Look up PATH relative to the directory DIRFD. Without openat and
+ * friends we're already in that directory (see emufs_open).
+ */
+static
+int
+emufs_stat(int dirfd, const char *path, struct stat *sbuf)
+{
+#ifdef HAS_OPENAT
+	return fstatat(dirfd, path, sbuf, 0);
+#else
+	(void)dirfd;
+	return stat(path, sbuf);
+#endif
+}
+
 static
 unsigned
-emufs_open_and_stat(struct emufs_data *ed, int flags, struct stat *sbuf,
-		    int *fd_ret)
+emufs_open_and_stat(struct emufs_req *er, int dirfd, const char *path,
+		    int flags, struct stat *sbuf, int *fd_ret)
 {
-	int fd, err;
+	int fd;
 
-	fd = open(ed->ed_buf, flags, 0664);
+#ifdef HAS_OPENAT
+	fd = openat(dirfd, path, flags, 0664);
+#else
+	(void)dirfd;
+	fd = open(path, flags, 0664);
+#endif
 	if (fd < 0) {
-		err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 	if (fstat(fd, sbuf) < 0) {
-		err = errno;
+		er->er_err = errno;
 		close(fd);
-		HWTRACE(DOTRACE_EMUFS, "fstat: %s", strerror(err));
-		return errno_to_code(err);
+		return errno_to_code(er->er_err);
 	}
 
 	*fd_ret = fd;
 	return EMU_RES_SUCCESS;
 }
 
+/*
+ * Enter a newly opened file in the handle table. If another request
+ * got there first, use its handle and close FD.
+ */
+static
+int
+emufs_install(struct emufs_data *ed, int fd, struct stat *sbuf)
+{
+	int handle;
+
+	pthread_mutex_lock(&ed->ed_lock);
+	handle = findhandle(ed, sbuf->st_dev, sbuf->st_ino);
+	if (handle != NOHANDLE) {
+		close(fd);
+	}
+	else {
+		handle = addhandle(ed, fd, sbuf->st_dev, sbuf->st_ino);
+	}
+	pthread_mutex_unlock(&ed->ed_lock);
+	return handle;
+}
+
 static
 unsigned
-emufs_open_create(struct emufs_data *ed, int flags, int *handle_ret)
+emufs_open_create(struct emufs_data *ed, struct emufs_req *er, int dirfd,
+		  const char *path, int flags, int *handle_ret)
 {
 	struct stat sbuf;
 	unsigned status;
-	int handle, fd = -1;
+	int fd = -1;
 
-	status = emufs_open_and_stat(ed, flags, &sbuf, &fd);
+	status = emufs_open_and_stat(er, dirfd, path, flags, &sbuf, &fd);
 	if (status != EMU_RES_SUCCESS) {
 		return status;
 	}
 
-	handle = pickhandle(ed, sbuf.st_dev, sbuf.st_ino);
-	if (handle < 0) {
-		close(fd);
-		HWTRACE(DOTRACE_EMUFS, "out of handles");
-		return EMU_RES_NOHANDLES;
-	}
-
 	/*
 	 * If we created a new file and got back a file we already
 	 * have open, it means someone renamed the file under us
@@ -352,19 +686,14 @@ emufs_open_create(struct emufs_data *ed, int flags, int *handle_ret)
 	 * so if this happens just reuse the existing handle for the
 	 * file and close the new fd.
 	 */
-	if (ed->ed_handles[handle].eh_fd >= 0) {
-		close(fd);
-	}
-	else {
-		ed->ed_handles[handle].eh_fd = fd;
-	}
-	*handle_ret = handle;
+	*handle_ret = emufs_install(ed, fd, &sbuf);
 	return EMU_RES_SUCCESS;
 }
 
 static
 unsigned
-emufs_open_existing(struct emufs_data *ed, int flags,
+emufs_open_existing(struct emufs_data *ed, struct emufs_req *er, int dirfd,
+		    const char *path, int flags,
 		    dev_t expected_dev, ino_t expected_ino,
 		    int *handle_ret)
 {
@@ -377,19 +706,18 @@ emufs_open_existing(struct emufs_data *ed, int flags,
 		 * We might already have this file open, so look for
 		 * it first.
 		 */
-		handle = pickhandle(ed, expected_dev, expected_ino);
-		if (handle < 0) {
-			HWTRACE(DOTRACE_EMUFS, "out of handles");
-			return EMU_RES_NOHANDLES;
-		}
+		pthread_mutex_lock(&ed->ed_lock);
+		handle = findhandle(ed, expected_dev, expected_ino);
+		pthread_mutex_unlock(&ed->ed_lock);
 
 		/* If so, just return it. */
-		if (ed->ed_handles[handle].eh_fd >= 0) {
+		if (handle != NOHANDLE) {
 			*handle_ret = handle;
 			return EMU_RES_SUCCESS;
 		}
 
-		status = emufs_open_and_stat(ed, flags, &sbuf, &fd);
+		status = emufs_open_and_stat(er, dirfd, path, flags,
+					     &sbuf, &fd);
 		if (status != EMU_RES_SUCCESS) {
 			return status;
 		}
@@ -417,47 +745,33 @@ emufs_open_existing(struct emufs_data *ed, int flags,
 		expected_ino = sbuf.st_ino;
 	}
 
-	ed->ed_handles[handle].eh_fd = fd;
-	*handle_ret = handle;
+	/* another request may have opened it meanwhile */
+	*handle_ret = emufs_install(ed, fd, &sbuf);
 	return EMU_RES_SUCCESS;
 }
 
-
 static
 uint32_t
-emufs_open(struct emufs_data *ed, int flags)
+emufs_doopen(struct emufs_data *ed, struct emufs_req *er, int dirfd,
+	     const char *path, int flags)
 {
 	int handle = -1;
-	int curdir;
 	struct stat sbuf;
 	unsigned status;
 	int isdir;
 
-	if (ed->ed_iolen >= EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
-	}
-
-	/* ensure null termination */
-	ed->ed_buf[ed->ed_iolen] = 0;
-
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: open %s: ", ed->ed_slot,
-			       ed->ed_buf);
-
-	curdir = pushdir(ed->ed_handles[ed->ed_handle].eh_fd, ed->ed_handle);
-
-	if (stat(ed->ed_buf, &sbuf)) {
+	if (emufs_stat(dirfd, path, &sbuf)) {
 		if (flags==0) {
 			/* not creating; doesn't exist -> fail */
-			int err = errno;
-			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-			popdir(curdir);
-			return errno_to_code(err);
+			er->er_err = errno;
+			return errno_to_code(er->er_err);
 		}
 		/* creating; ok if it doesn't exist, and it's not a dir */
 		flags |= O_RDWR;
 		isdir = 0;
 
-		status = emufs_open_create(ed, flags, &handle);
+		status = emufs_open_create(ed, er, dirfd, path, flags,
+					   &handle);
 	}
 	else {
 		isdir = S_ISDIR(sbuf.st_mode)!=0;
@@ -467,282 +781,535 @@ emufs_open(struct emufs_data *ed, int flags)
 		else {
 			flags |= O_RDWR;
 		}
-		status = emufs_open_existing(ed, flags,
+		status = emufs_open_existing(ed, er, dirfd, path, flags,
 					     sbuf.st_dev, sbuf.st_ino,
 					     &handle);
 	}
 
 	if (status != EMU_RES_SUCCESS) {
-		popdir(curdir);
 		return status;
 	}
 	Assert(handle >= 0);
 
-	popdir(curdir);
-
-	ed->ed_handle = handle;
-	ed->ed_iolen = isdir;
-
-	HWTRACE(DOTRACE_EMUFS, "succeeded, handle %d%s", handle,
-		isdir ? " (directory)" : "");
-	g_stats.s_memu++;
+	er->er_handle = handle;
+	er->er_iolen = isdir;
 
 	return EMU_RES_SUCCESS;
 }
 
 static
 uint32_t
-emufs_close(struct emufs_data *ed)
+emufs_open(struct emufs_data *ed, struct emufs_req *er, int dirfd, int flags)
 {
-	close(ed->ed_handles[ed->ed_handle].eh_fd);
-	ed->ed_handles[ed->ed_handle].eh_fd = -1;
-	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: close handle %d",
-		ed->ed_slot, ed->ed_handle);
-	g_stats.s_memu++;
-	return EMU_RES_SUCCESS;
+	char path[EMU_BUF_SIZE];
+	uint32_t status;
+#ifndef HAS_OPENAT
+	int curdir;
+#endif
+
+	if (er->er_iolen >= EMU_BUF_SIZE || er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
+	}
+
+	/* copy out so we can null-terminate it */
+	memcpy(path, er->er_buf, er->er_iolen);
+	path[er->er_iolen] = 0;
+
+#ifdef HAS_OPENAT
+	status = emufs_doopen(ed, er, dirfd, path, flags);
+#else
+	curdir = pushdir(dirfd, er->er_handle);
+	status = emufs_doopen(ed, er, dirfd, path, flags);
+	popdir(curdir);
+#endif
+	return status;
 }
 
+/*
+ * Close a handle, once any other requests using it are finished.
+ */
 static
 uint32_t
-emufs_read(struct emufs_data *ed)
+emufs_close(struct emufs_data *ed, struct emufs_req *er)
 {
-	int len;
-	int fd;
+	uint32_t result = EMU_RES_SUCCESS;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	pthread_mutex_lock(&ed->ed_lock);
+	while (ed->ed_handles[er->er_handle].eh_busy > 0) {
+		pthread_cond_wait(&ed->ed_handlecv, &ed->ed_lock);
 	}
+	/* it might have been closed by someone else while we waited */
+	if (ed->ed_handles[er->er_handle].eh_fd < 0) {
+		result = EMU_RES_BADHANDLE;
+	}
+	else {
+		removehandle(ed, er->er_handle);
+	}
+	pthread_mutex_unlock(&ed->ed_lock);
+	return result;
+}
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: read %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
-
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
+static
+uint32_t
+emufs_read(struct emufs_req *er, int fd)
+{
+	ssize_t len;
 
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = read(fd, ed->ed_buf, ed->ed_iolen);
+	if (er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
+	}
 
+	len = pread(fd, er->er_buf, er->er_iolen, er->er_offset);
 	if (len < 0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
-
-	HWTRACE(DOTRACE_EMUFS, "success");
-	g_stats.s_remu++;
+	er->er_offset += len;
+	er->er_iolen = len;
+	er->er_xferbytes = len;
 
 	return EMU_RES_SUCCESS;
 }
 
+/*
+ * Set up the directory stream for a handle. It gets its own file
+ * descriptor so closing it doesn't close the handle.
+ */
 static
-uint32_t
-emufs_readdir(struct emufs_data *ed)
+int
+emufs_opendir(struct emufs_handleinfo *eh, uint32_t handle)
 {
-	struct dirent *dp;
-	DIR *d;
-
-	uint32_t ct, len;
-	int herefd, fd;
+#ifdef HAS_FDOPENDIR
+	int fd;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	fd = dup(eh->eh_fd);
+	if (fd < 0) {
+		return -1;
+	}
+	eh->eh_dir = fdopendir(fd);
+	if (eh->eh_dir == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
 	}
+#else
+	int curdir;
 
-	HWTRACEL(DOTRACE_EMUFS,
-		 "emufs: slot %d: readdir %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
+	curdir = pushdir(eh->eh_fd, handle);
+	eh->eh_dir = opendir(".");
+	popdir(curdir);
+	if (eh->eh_dir == NULL) {
+		return -1;
+	}
+#endif
+	(void)handle;
+	eh->eh_dirpos = 0;
+	return 0;
+}
 
-	herefd = open(".", O_RDONLY);
-	if (herefd<0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+/*
+ * Position the directory stream for a handle at entry number POS.
+ * Reading forward from where it is costs nothing extra; going
+ * backwards means starting over, which also picks up any changes
+ * to the directory since it was last read from the start.
+ */
+static
+void
+emufs_seekdir(struct emufs_handleinfo *eh, uint32_t pos)
+{
+	if (pos < eh->eh_dirpos) {
+		rewinddir(eh->eh_dir);
+		eh->eh_dirpos = 0;
 	}
+	while (eh->eh_dirpos < pos) {
+		if (readdir(eh->eh_dir) == NULL) {
+			break;
+		}
+		eh->eh_dirpos++;
+	}
+}
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
+/*
+ * The directory stream belongs to the handle table entry, which can
+ * move if the table grows, so this holds ed_lock throughout.
+ */
+static
+uint32_t
+emufs_readdir(struct emufs_data *ed, struct emufs_req *er)
+{
+	struct emufs_handleinfo *eh;
+	struct dirent *dp;
+	uint32_t len;
 
-	if (fchdir(fd)<0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		close(herefd);
-		return errno_to_code(err);
+	if (er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
 	}
 
-	d = opendir(".");
-	if (d==NULL) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		fchdir(herefd);
-		close(herefd);
-		return errno_to_code(err);
+	pthread_mutex_lock(&ed->ed_lock);
+	eh = &ed->ed_handles[er->er_handle];
+	if (eh->eh_dir == NULL && emufs_opendir(eh, er->er_handle) < 0) {
+		er->er_err = errno;
+		pthread_mutex_unlock(&ed->ed_lock);
+		return errno_to_code(er->er_err);
 	}
 
+	emufs_seekdir(eh, er->er_offset);
 	dp = NULL;
-	for (ct = 0; ct <= ed->ed_offset; ct++) {
-		dp = readdir(d);
-		if (dp == NULL) {
-			break;
-		}
+	if (eh->eh_dirpos == er->er_offset) {
+		dp = readdir(eh->eh_dir);
 	}
 	if (dp != NULL) {
-		HWTRACE(DOTRACE_EMUFS, "got %s", dp->d_name);
+		eh->eh_dirpos++;
 		len = strlen(dp->d_name);
-		if (len > ed->ed_iolen) {
-			len = ed->ed_iolen;
+		if (len > er->er_iolen) {
+			len = er->er_iolen;
 		}
-		memcpy(ed->ed_buf, dp->d_name, len);
-		ed->ed_iolen = len;
-		ed->ed_offset++;
-		g_stats.s_remu++;
+		memcpy(er->er_buf, dp->d_name, len);
+		er->er_iolen = len;
+		er->er_xferbytes = len;
+		er->er_offset++;
 	}
 	else {
-		HWTRACE(DOTRACE_EMUFS, "EOF");
-		ed->ed_iolen = 0;
+		er->er_iolen = 0;
 	}
-
-	closedir(d);
-	fchdir(herefd);
-	close(herefd);
+	pthread_mutex_unlock(&ed->ed_lock);
 
 	return EMU_RES_SUCCESS;
-#if 0
-	/*
-	 * without fchdir, can't do it - there's no fdopendir() or equivalent.
-	 */
-	(void) ed;
-	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: readdir unsupported",
-		ed->ed_slot);
-
-	return EMU_RES_UNSUPP;
-#endif
 }
 
 static
 uint32_t
-emufs_write(struct emufs_data *ed)
+emufs_write(struct emufs_req *er, int fd)
 {
-	int len;
-	int fd;
+	ssize_t len;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
+	if (er->er_iolen > er->er_bufsize) {
 		return EMU_RES_BADSIZE;
 	}
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: write %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
-
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
-
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = write(fd, ed->ed_buf, ed->ed_iolen);
-
+	len = pwrite(fd, er->er_buf, er->er_iolen, er->er_offset);
 	if (len < 0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
-
-	HWTRACE(DOTRACE_EMUFS, "success");
-	g_stats.s_wemu++;
+	er->er_offset += len;
+	er->er_iolen = len;
+	er->er_xferbytes = len;
 
 	return EMU_RES_SUCCESS;
 }
 
 static
 uint32_t
-emufs_getsize(struct emufs_data *ed)
+emufs_getsize(struct emufs_req *er, int fd)
 {
 	struct stat sb;
-	int fd;
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: handle %d length: ",
-		 ed->ed_slot, ed->ed_handle);
-
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
 	if (fstat(fd, &sb)) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 
-	ed->ed_iolen = sb.st_size;
-
-	HWTRACE(DOTRACE_EMUFS, "%u", ed->ed_iolen);
-	g_stats.s_memu++;
+	er->er_iolen = sb.st_size;
+	return EMU_RES_SUCCESS;
+}
 
+static
+uint32_t
+emufs_trunc(struct emufs_req *er, int fd)
+{
+	if (ftruncate(fd, er->er_iolen)) {
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
+	}
 	return EMU_RES_SUCCESS;
 }
 
+/*
+ * Carry out a request. The handle is marked busy while we use its
+ * file descriptor so that a concurrent close waits for us.
+ */
 static
 uint32_t
-emufs_trunc(struct emufs_data *ed)
+emufs_op(struct emufs_data *ed, struct emufs_req *er)
 {
+	uint32_t result;
 	int fd;
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: truncate handle %d to %u: ",
-		 ed->ed_slot, ed->ed_handle, ed->ed_iolen);
+	er->er_xferbytes = 0;
+	er->er_err = 0;
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
-	if (ftruncate(fd, ed->ed_iolen)) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+	/* for the open operations this is the directory to look in */
+	pthread_mutex_lock(&ed->ed_lock);
+	if (er->er_handle >= ed->ed_numhandles ||
+	    ed->ed_handles[er->er_handle].eh_fd < 0) {
+		pthread_mutex_unlock(&ed->ed_lock);
+		return EMU_RES_BADHANDLE;
+	}
+	if (er->er_op == EMU_OP_CLOSE) {
+		pthread_mutex_unlock(&ed->ed_lock);
+		return emufs_close(ed, er);
+	}
+	fd = ed->ed_handles[er->er_handle].eh_fd;
+	ed->ed_handles[er->er_handle].eh_busy++;
+	pthread_mutex_unlock(&ed->ed_lock);
+
+	switch (er->er_op) {
+	    case EMU_OP_OPEN:
+		result = emufs_open(ed, er, fd, 0);
+		break;
+	    case EMU_OP_CREATE:
+		result = emufs_open(ed, er, fd, O_CREAT);
+		break;
+	    case EMU_OP_EXCLCREATE:
+		result = emufs_open(ed, er, fd, O_CREAT|O_EXCL);
+		break;
+	    case EMU_OP_READ:       result = emufs_read(er, fd); break;
+	    case EMU_OP_READDIR:    result = emufs_readdir(ed, er); break;
+	    case EMU_OP_WRITE:      result = emufs_write(er, fd); break;
+	    case EMU_OP_GETSIZE:    result = emufs_getsize(er, fd); break;
+	    case EMU_OP_TRUNC:      result = emufs_trunc(er, fd); break;
+	    default:                result = EMU_RES_BADOP; break;
 	}
 
-	HWTRACE(DOTRACE_EMUFS, "success");
-	g_stats.s_wemu++;
+	pthread_mutex_lock(&ed->ed_lock);
+	if (--ed->ed_handles[er->er_busyhandle].eh_busy == 0) {
+		pthread_cond_broadcast(&ed->ed_handlecv);
+	}
+	pthread_mutex_unlock(&ed->ed_lock);
 
-	return EMU_RES_SUCCESS;
+	return result;
 }
 
+/*
+ * Account for and trace a completed request, on the main thread.
+ */
 static
-uint32_t
-emufs_op(struct emufs_data *ed, uint32_t op)
+void
+emufs_report(struct emufs_data *ed, struct emufs_req *er)
 {
-	switch (op) {
-	    case EMU_OP_OPEN:       return emufs_open(ed, 0);
-	    case EMU_OP_CREATE:     return emufs_open(ed, O_CREAT);
-	    case EMU_OP_EXCLCREATE: return emufs_open(ed, O_CREAT|O_EXCL);
-	    default: break;
+	static const char *const opnames[] = {
+		"?", "open", "create", "exclcreate", "close", "read",
+		"readdir", "write", "getsize", "truncate",
+	};
+	const char *opname;
+
+	if (er->er_result == EMU_RES_SUCCESS) {
+		switch (er->er_op) {
+		    case EMU_OP_READ:
+		    case EMU_OP_READDIR:
+			if (er->er_xferbytes > 0) {
+				g_stats.s_remu++;
+			}
+			break;
+		    case EMU_OP_WRITE:
+		    case EMU_OP_TRUNC:
+			g_stats.s_wemu++;
+			break;
+		    default:
+			g_stats.s_memu++;
+			break;
+		}
 	}
 
-	if (ed->ed_handle >= MAXHANDLES ||
-	    ed->ed_handles[ed->ed_handle].eh_fd < 0) {
-		return EMU_RES_BADHANDLE;
+	opname = er->er_op < sizeof(opnames)/sizeof(opnames[0]) ?
+		opnames[er->er_op] : opnames[0];
+	if (er->er_result != EMU_RES_SUCCESS) {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: %s handle %u: "
+			"result %u%s%s", ed->ed_slot, opname,
+			er->er_busyhandle, er->er_result,
+			er->er_err ? ", " : "",
+			er->er_err ? strerror(er->er_err) : "");
+	}
+	else if (er->er_op >= EMU_OP_OPEN && er->er_op <= EMU_OP_EXCLCREATE) {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: %s in handle %u: "
+			"succeeded, handle %u%s", ed->ed_slot, opname,
+			er->er_busyhandle, er->er_handle,
+			er->er_iolen ? " (directory)" : "");
+	}
+	else {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: %s handle %u: "
+			"success, offset %u length %u", ed->ed_slot, opname,
+			er->er_handle, er->er_offset, er->er_iolen);
 	}
+	(void)ed;
+	(void)opname;
+}
 
+/*
+ * Timing: the base latency for an operation of kind OP, and the time
+ * to move BYTES of data.
+ */
+static
+uint64_t
+emufs_oplatency(struct emufs_data *ed, uint32_t op)
+{
 	switch (op) {
 	    case EMU_OP_OPEN:
 	    case EMU_OP_CREATE:
 	    case EMU_OP_EXCLCREATE:
-		/* ? */
-		break;
-	    case EMU_OP_CLOSE:      return emufs_close(ed);
-	    case EMU_OP_READ:       return emufs_read(ed);
-	    case EMU_OP_READDIR:    return emufs_readdir(ed);
-	    case EMU_OP_WRITE:      return emufs_write(ed);
-	    case EMU_OP_GETSIZE:    return emufs_getsize(ed);
-	    case EMU_OP_TRUNC:      return emufs_trunc(ed);
+		return ed->ed_openlatency;
+	    case EMU_OP_READ:
+	    case EMU_OP_READDIR:
+	    case EMU_OP_WRITE:
+		return ed->ed_iolatency;
+	}
+	return ed->ed_metalatency;
+}
+
+static
+uint64_t
+emufs_xfertime(struct emufs_data *ed, uint32_t bytes)
+{
+	if (ed->ed_bandwidth == 0) {
+		return 0;
+	}
+	return (uint64_t)bytes * 1000000000ULL / ed->ed_bandwidth;
+}
+
+////////////////////////////////////////////////////////////
+// worker threads
+//
+// Requests are handed to the workers when the simulated operation
+// starts and collected when its base latency has elapsed, so the host
+// work overlaps with simulation; the main thread only waits if the
+// host hasn't finished by then. The transfer time is charged after
+// that, once we know how much data actually moved. With no workers
+// requests are carried out on the spot.
+
+static
+void *
+emufs_worker(void *data)
+{
+	struct emufs_data *ed = data;
+	struct emufs_req *er;
+	uint32_t result;
+
+	pthread_mutex_lock(&ed->ed_lock);
+	while (1) {
+		while (ed->ed_queue == NULL && !ed->ed_exiting) {
+			pthread_cond_wait(&ed->ed_workcv, &ed->ed_lock);
+		}
+		if (ed->ed_queue == NULL) {
+			break;
+		}
+		er = ed->ed_queue;
+		ed->ed_queue = er->er_next;
+		if (ed->ed_queue == NULL) {
+			ed->ed_queuetail = &ed->ed_queue;
+		}
+		pthread_mutex_unlock(&ed->ed_lock);
+
+		result = emufs_op(ed, er);
+
+		pthread_mutex_lock(&ed->ed_lock);
+		er->er_result = result;
+		er->er_done = 1;
+		pthread_cond_broadcast(&ed->ed_donecv);
+	}
+	pthread_mutex_unlock(&ed->ed_lock);
+	return NULL;
+}
+
+static
+void
+emufs_submit(struct emufs_data *ed, struct emufs_req *er)
+{
+	if (ed->ed_nworkers == 0) {
+		er->er_result = emufs_op(ed, er);
+		er->er_done = 1;
+		return;
 	}
 
-	return EMU_RES_BADOP;
+	pthread_mutex_lock(&ed->ed_lock);
+	er->er_done = 0;
+	er->er_next = NULL;
+	*ed->ed_queuetail = er;
+	ed->ed_queuetail = &er->er_next;
+	pthread_cond_signal(&ed->ed_workcv);
+	pthread_mutex_unlock(&ed->ed_lock);
+}
+
+static
+void
+emufs_wait(struct emufs_data *ed, struct emufs_req *er)
+{
+	pthread_mutex_lock(&ed->ed_lock);
+	while (!er->er_done) {
+		pthread_cond_wait(&ed->ed_donecv, &ed->ed_lock);
+	}
+	pthread_mutex_unlock(&ed->ed_lock);
 }
 
 static
 void
-emufs_done(void *d, uint32_t gen)
+emufs_startworkers(struct emufs_data *ed)
+{
+	unsigned i;
+
+	ed->ed_workers = domalloc(ed->ed_nworkers * sizeof(pthread_t));
+	for (i=0; i<ed->ed_nworkers; i++) {
+		dothread(&ed->ed_workers[i], emufs_worker, ed);
+	}
+}
+
+static
+void
+emufs_stopworkers(struct emufs_data *ed)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&ed->ed_lock);
+	ed->ed_exiting = 1;
+	pthread_cond_broadcast(&ed->ed_workcv);
+	pthread_mutex_unlock(&ed->ed_lock);
+
+	for (i=0; i<ed->ed_nworkers; i++) {
+		pthread_join(ed->ed_workers[i], NULL);
+	}
+	free(ed->ed_workers);
+	ed->ed_workers = NULL;
+	ed->ed_nworkers = 0;
+}
+
+////////////////////////////////////////////////////////////
+// register interface
+
+/*
+ * Event function: with code 0 the base latency is up and we collect
+ * the result; with code 1 the data transfer is done too.
+ */
+static
+void
+emufs_done(void *d, uint32_t code)
 {
 	struct emufs_data *ed = d;
-	(void)gen;
+	struct emufs_req *er = &ed->ed_regreq;
+	uint64_t nsecs;
 
 	if (ed->ed_busy != 1) {
 		smoke("Spurious call of emufs_done");
 	}
+
+	if (code == 0) {
+		emufs_wait(ed, er);
+		emufs_report(ed, er);
+		ed->ed_handle = er->er_handle;
+		ed->ed_offset = er->er_offset;
+		ed->ed_iolen = er->er_iolen;
+		ed->ed_busyresult = er->er_result;
+
+		nsecs = emufs_xfertime(ed, er->er_xferbytes);
+		if (nsecs > 0) {
+			schedule_event(nsecs, ed, 1, emufs_done,
+				       "emufs transfer");
+			return;
+		}
+	}
+
 	emufs_setresult(ed, ed->ed_busyresult);
 	ed->ed_busy = 0;
 	ed->ed_busyresult = 0;
@@ -754,7 +1321,7 @@ static
 void
 emufs_do_op(struct emufs_data *ed, uint32_t op)
 {
-	uint32_t res;
+	struct emufs_req *er = &ed->ed_regreq;
 
 	if (ed->ed_busy != 0) {
 		hang("emufs operation started while an operation "
@@ -762,12 +1329,233 @@ emufs_do_op(struct emufs_data *ed, uint32_t op)
 		return;
 	}
 
-	res = emufs_op(ed, op);
+	er->er_op = op;
+	er->er_handle = ed->ed_handle;
+	er->er_offset = ed->ed_offset;
+	er->er_iolen = ed->ed_iolen;
+	er->er_buf = ed->ed_buf;
+	er->er_bufsize = EMU_BUF_SIZE;
+	er->er_busyhandle = ed->ed_handle;
 
 	ed->ed_busy = 1;
-	ed->ed_busyresult = res;
+	emufs_submit(ed, er);
 
-	schedule_event(EMUFS_NSECS, ed, 0, emufs_done, "emufs");
+	schedule_event(emufs_oplatency(ed, op), ed, 0, emufs_done, "emufs");
+}
+
+////////////////////////////////////////////////////////////
+// descriptor ring
+
+/*
+ * Read and write descriptor words in guest RAM. The ring has already
+ * been checked to lie within RAM.
+ */
+static
+uint32_t
+ring_fetch(struct emufs_data *ed, uint32_t index, uint32_t word)
+{
+	uint32_t addr;
+
+	addr = ed->ed_ringbase + (index & (ed->ed_ringsize - 1)) * EMU_DESC_SIZE;
+	return ntohl(*(uint32_t *)(ram + addr + word));
+}
+
+static
+void
+ring_store(struct emufs_data *ed, uint32_t index, uint32_t word,
+	   uint32_t val)
+{
+	uint32_t addr;
+
+	addr = ed->ed_ringbase + (index & (ed->ed_ringsize - 1)) * EMU_DESC_SIZE;
+	*(uint32_t *)(ram + addr + word) = htonl(val);
+}
+
+/*
+ * Start one descriptor. The buffer is used in place in guest RAM.
+ */
+static
+void
+emufs_ring_op(struct emufs_data *ed, uint32_t index, struct emufs_req *er)
+{
+	uint32_t bufaddr;
+
+	er->er_op = ring_fetch(ed, index, EMU_DESC_OP);
+	er->er_handle = ring_fetch(ed, index, EMU_DESC_HANDLE);
+	er->er_offset = ring_fetch(ed, index, EMU_DESC_OFFSET);
+	er->er_iolen = ring_fetch(ed, index, EMU_DESC_IOLEN);
+	bufaddr = ring_fetch(ed, index, EMU_DESC_BUFFER);
+	er->er_busyhandle = er->er_handle;
+	er->er_xferbytes = 0;
+	er->er_err = 0;
+
+	if (bufaddr >= bus_ramsize) {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: descriptor %u: "
+			"bad buffer address 0x%x", ed->ed_slot, index,
+			bufaddr);
+		er->er_result = EMU_RES_BADADDR;
+		er->er_done = 1;
+		return;
+	}
+	er->er_buf = ram + bufaddr;
+	er->er_bufsize = bus_ramsize - bufaddr;
+	emufs_submit(ed, er);
+}
+
+static void emufs_ring_done(void *d, uint32_t code);
+
+/*
+ * Start on everything the guest has posted. The descriptors all go
+ * to the workers at once and may be carried out in any order. The
+ * device's latency overlaps across the batch but the data transfers
+ * don't, so the batch takes the longest base latency plus the time
+ * to move all its data. The results are written back, and the
+ * interrupt raised, when it finishes.
+ */
+static
+void
+emufs_ring_start(struct emufs_data *ed)
+{
+	uint32_t i, n;
+	uint64_t latency, nsecs;
+	struct emufs_req *er;
+
+	Assert(ed->ed_ringbusy == 0);
+
+	n = ed->ed_ringtail - ed->ed_ringhead;
+	if (n == 0) {
+		return;
+	}
+	if (n > ed->ed_ringsize) {
+		hang("emufs: ring tail %u is more than %u past head %u",
+		     ed->ed_ringtail, ed->ed_ringsize, ed->ed_ringhead);
+		return;
+	}
+
+	latency = 0;
+	for (i=0; i<n; i++) {
+		er = &ed->ed_ringreqs[i];
+		emufs_ring_op(ed, ed->ed_ringhead + i, er);
+		nsecs = emufs_oplatency(ed, er->er_op);
+		if (nsecs > latency) {
+			latency = nsecs;
+		}
+	}
+
+	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: ring batch of %u started",
+		ed->ed_slot, n);
+
+	ed->ed_ringbusy = n;
+	ed->ed_ringbatches++;
+	schedule_event(latency, ed, 0, emufs_ring_done, "emufs ring");
+}
+
+/*
+ * Event function; the codes are as for emufs_done.
+ */
+static
+void
+emufs_ring_done(void *d, uint32_t code)
+{
+	struct emufs_data *ed = d;
+	struct emufs_req *er;
+	uint32_t i, index;
+	uint64_t bytes;
+
+	if (ed->ed_ringbusy == 0) {
+		smoke("Spurious call of emufs_ring_done");
+	}
+
+	if (code == 0) {
+		bytes = 0;
+		for (i=0; i<ed->ed_ringbusy; i++) {
+			er = &ed->ed_ringreqs[i];
+			emufs_wait(ed, er);
+			emufs_report(ed, er);
+			bytes += er->er_xferbytes;
+		}
+		if (emufs_xfertime(ed, bytes) > 0) {
+			schedule_event(emufs_xfertime(ed, bytes), ed, 1,
+				       emufs_ring_done, "emufs ring transfer");
+			return;
+		}
+	}
+
+	for (i=0; i<ed->ed_ringbusy; i++) {
+		er = &ed->ed_ringreqs[i];
+		index = ed->ed_ringhead + i;
+		ring_store(ed, index, EMU_DESC_HANDLE, er->er_handle);
+		ring_store(ed, index, EMU_DESC_OFFSET, er->er_offset);
+		ring_store(ed, index, EMU_DESC_IOLEN, er->er_iolen);
+		ring_store(ed, index, EMU_DESC_RESULT, er->er_result);
+	}
+	ed->ed_ringhead += ed->ed_ringbusy;
+	ed->ed_ringdescs += ed->ed_ringbusy;
+	ed->ed_ringbusy = 0;
+
+	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: ring batch complete, "
+		"head now %u", ed->ed_slot, ed->ed_ringhead);
+
+	emufs_setringstat(ed, 1);
+
+	/* go on to anything posted meanwhile */
+	emufs_ring_start(ed);
+}
+
+static
+void
+emufs_ring_setbase(struct emufs_data *ed, uint32_t val)
+{
+	if (ed->ed_ringbusy) {
+		hang("emufs: ring base changed while ring is busy");
+		return;
+	}
+	if (val % EMU_DESC_SIZE != 0) {
+		hang("emufs: ring base 0x%x not aligned", val);
+		return;
+	}
+	ed->ed_ringbase = val;
+}
+
+static
+void
+emufs_ring_setsize(struct emufs_data *ed, uint32_t val)
+{
+	if (ed->ed_ringbusy) {
+		hang("emufs: ring size changed while ring is busy");
+		return;
+	}
+	if (val > EMU_MAXRING || (val & (val - 1)) != 0) {
+		hang("emufs: invalid ring size %u", val);
+		return;
+	}
+	if (val > ed->ed_ringalloc) {
+		free(ed->ed_ringreqs);
+		ed->ed_ringreqs = domalloc(val * sizeof(ed->ed_ringreqs[0]));
+		ed->ed_ringalloc = val;
+	}
+	ed->ed_ringsize = val;
+	ed->ed_ringhead = ed->ed_ringtail = 0;
+}
+
+static
+void
+emufs_ring_settail(struct emufs_data *ed, uint32_t val)
+{
+	if (ed->ed_ringsize == 0) {
+		hang("emufs: ring doorbell rung with no ring set up");
+		return;
+	}
+	if ((uint64_t)ed->ed_ringbase + (uint64_t)ed->ed_ringsize * EMU_DESC_SIZE
+	    > bus_ramsize) {
+		hang("emufs: ring at 0x%x size %u extends past end of RAM",
+		     ed->ed_ringbase, ed->ed_ringsize);
+		return;
+	}
+	ed->ed_ringtail = val;
+	if (!ed->ed_ringbusy) {
+		emufs_ring_start(ed);
+	}
 }
 
 static
@@ -776,12 +1564,34 @@ emufs_init(int slot, int argc, char *argv[])
 {
 	struct emufs_data *ed = domalloc(sizeof(struct emufs_data));
 	const char *dir = ".";
+	int64_t latency = EMUFS_NSECS;
+	int64_t openlatency = -1, iolatency = -1, metalatency = -1;
+	off_t bandwidth = 0;
+	long workers = DEFAULT_WORKERS;
 	int i;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "dir=", 4)) {
 			dir = argv[i]+4;
 		}
+		else if (!strncmp(argv[i], "latency=", 8)) {
+			latency = strtoll(argv[i]+8, NULL, 0);
+		}
+		else if (!strncmp(argv[i], "openlatency=", 12)) {
+			openlatency = strtoll(argv[i]+12, NULL, 0);
+		}
+		else if (!strncmp(argv[i], "iolatency=", 10)) {
+			iolatency = strtoll(argv[i]+10, NULL, 0);
+		}
+		else if (!strncmp(argv[i], "metalatency=", 12)) {
+			metalatency = strtoll(argv[i]+12, NULL, 0);
+		}
+		else if (!strncmp(argv[i], "bandwidth=", 10)) {
+			bandwidth = getsize(argv[i]+10);
+		}
+		else if (!strncmp(argv[i], "workers=", 8)) {
+			workers = strtol(argv[i]+8, NULL, 0);
+		}
 		else {
 			msg("emufs: slot %d: invalid option %s",slot, argv[i]);
 			die();
@@ -796,17 +1606,65 @@ emufs_init(int slot, int argc, char *argv[])
 	ed->ed_iolen = 0;
 	ed->ed_result = 0;
 
-	for (i=0; i<MAXHANDLES; i++) {
-		ed->ed_handles[i].eh_fd = -1;
-		ed->ed_handles[i].eh_dev = 0;
-		ed->ed_handles[i].eh_ino = 0;
+	ed->ed_numhandles = INITHANDLES;
+	ed->ed_openhandles = 0;
+	ed->ed_handles = domalloc(INITHANDLES * sizeof(ed->ed_handles[0]));
+	ed->ed_hash = domalloc(INITHANDLES * sizeof(ed->ed_hash[0]));
+	ed->ed_freehandles = NOHANDLE;
+	inithandles(ed, 0);
+	rehash(ed);
+
+	if (latency < 0 || bandwidth < 0) {
+		msg("emufs: slot %d: Invalid timing options", slot);
+		die();
+	}
+	if (workers < 0 || workers > MAXWORKERS) {
+		msg("emufs: slot %d: workers must be between 0 and %d",
+		    slot, MAXWORKERS);
+		die();
 	}
+#ifndef USE_WORKERS
+	if (workers > 0) {
+		msg("emufs: slot %d: worker threads not supported on this host",
+		    slot);
+		die();
+	}
+#endif
+
+	pthread_mutex_init(&ed->ed_lock, NULL);
+	pthread_cond_init(&ed->ed_workcv, NULL);
+	pthread_cond_init(&ed->ed_donecv, NULL);
+	pthread_cond_init(&ed->ed_handlecv, NULL);
+	ed->ed_workers = NULL;
+	ed->ed_nworkers = workers;
+	ed->ed_queue = NULL;
+	ed->ed_queuetail = &ed->ed_queue;
+	ed->ed_exiting = 0;
 
 	ed->ed_busy = 0;
 	ed->ed_busyresult = 0;
+	ed->ed_openlatency = openlatency >= 0 ? openlatency : latency;
+	ed->ed_iolatency = iolatency >= 0 ? iolatency : latency;
+	ed->ed_metalatency = metalatency >= 0 ? metalatency : latency;
+	ed->ed_bandwidth = bandwidth;
+
+	ed->ed_ringbase = 0;
+	ed->ed_ringsize = 0;
+	ed->ed_ringhead = 0;
+	ed->ed_ringtail = 0;
+	ed->ed_ringstat = 0;
+	ed->ed_ringbusy = 0;
+	ed->ed_ringreqs = NULL;
+	ed->ed_ringalloc = 0;
+	ed->ed_ringbatches = 0;
+	ed->ed_ringdescs = 0;
 
 	emufs_openfirst(ed, dir);
 
+	if (ed->ed_nworkers > 0) {
+		emufs_startworkers(ed);
+	}
+
 	return ed;
 }
 
@@ -832,6 +1690,11 @@ emufs_fetch(unsigned cpunum, void *data, uint32_t offset, uint32_t *ret)
 	    case EMUREG_IOLEN: *ret = ed->ed_iolen; return 0;
 	    case EMUREG_OPER: *ret = 0; return 0;
 	    case EMUREG_RESULT: *ret = ed->ed_result; return 0;
+	    case EMUREG_RINGBASE: *ret = ed->ed_ringbase; return 0;
+	    case EMUREG_RINGSIZE: *ret = ed->ed_ringsize; return 0;
+	    case EMUREG_RINGTAIL: *ret = ed->ed_ringtail; return 0;
+	    case EMUREG_RINGHEAD: *ret = ed->ed_ringhead; return 0;
+	    case EMUREG_RINGSTAT: *ret = ed->ed_ringstat; return 0;
 	}
 	return -1;
 }
@@ -858,6 +1721,10 @@ emufs_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 	    case EMUREG_IOLEN: ed->ed_iolen = val; return 0;
 	    case EMUREG_OPER: emufs_do_op(ed, val); return 0;
 	    case EMUREG_RESULT: emufs_setresult(ed, val); return 0;
+	    case EMUREG_RINGBASE: emufs_ring_setbase(ed, val); return 0;
+	    case EMUREG_RINGSIZE: emufs_ring_setsize(ed, val); return 0;
+	    case EMUREG_RINGTAIL: emufs_ring_settail(ed, val); return 0;
+	    case EMUREG_RINGSTAT: emufs_setringstat(ed, val); return 0;
 	}
 	return -1;
 }
@@ -883,6 +1750,34 @@ emufs_dumpstate(void *data)
 	else {
 		msg("    Presently idle");
 	}
+	msg("    Latency: open %llu ns, i/o %llu ns, other %llu ns; "
+	    "bandwidth %llu bytes/sec%s",
+	    (unsigned long long) ed->ed_openlatency,
+	    (unsigned long long) ed->ed_iolatency,
+	    (unsigned long long) ed->ed_metalatency,
+	    (unsigned long long) ed->ed_bandwidth,
+	    ed->ed_bandwidth == 0 ? " (unlimited)" : "");
+	pthread_mutex_lock(&ed->ed_lock);
+	msg("    Handles: %u open, table size %u",
+	    ed->ed_openhandles, ed->ed_numhandles);
+	pthread_mutex_unlock(&ed->ed_lock);
+	msg("    Worker threads: %u", ed->ed_nworkers);
+	if (ed->ed_ringsize > 0) {
+		msg("    Ring: base 0x%lx size %lu head %lu tail %lu stat %lu",
+		    (unsigned long) ed->ed_ringbase,
+		    (unsigned long) ed->ed_ringsize,
+		    (unsigned long) ed->ed_ringhead,
+		    (unsigned long) ed->ed_ringtail,
+		    (unsigned long) ed->ed_ringstat);
+		msg("    Ring: %lu in progress; %lu descriptors in %lu batches"
+		    " so far",
+		    (unsigned long) ed->ed_ringbusy,
+		    (unsigned long) ed->ed_ringdescs,
+		    (unsigned long) ed->ed_ringbatches);
+	}
+	else {
+		msg("    Ring: not in use");
+	}
 	msg("    Buffer:");
 	dohexdump(ed->ed_buf, EMU_BUF_SIZE);
 }
@@ -892,7 +1787,24 @@ void
 emufs_cleanup(void *data)
 {
 	struct emufs_data *ed = data;
-	emufs_close(ed);
+	unsigned i;
+
+	if (ed->ed_nworkers > 0) {
+		emufs_stopworkers(ed);
+	}
+	pthread_cond_destroy(&ed->ed_handlecv);
+	pthread_cond_destroy(&ed->ed_donecv);
+	pthread_cond_destroy(&ed->ed_workcv);
+	pthread_mutex_destroy(&ed->ed_lock);
+
+	for (i=0; i<ed->ed_numhandles; i++) {
+		if (ed->ed_handles[i].eh_fd >= 0) {
+			removehandle(ed, i);
+		}
+	}
+	free(ed->ed_handles);
+	free(ed->ed_hash);
+	free(ed->ed_ringreqs);
 	free(ed->ed_buf);
 	free(ed);
 }
@@ -14,16 +14,28 @@
 #include "clock.h"
 #include "onsel.h"
 #include "main.h"
+#include "flight.h"
 #include "util.h"
 
 #include "busids.h"
 #include "lamebus.h"
+#include "memdefs.h"
+#include "pcapfmt.h"
 
 
 #define NETREG_READINTR    0
 #define NETREG_WRITEINTR   4
 #define NETREG_CONTROL     8
 #define NETREG_STATUS      12
+#define NETREG_RXBASE      16
+#define NETREG_RXSIZE      20
+#define NETREG_RXTAIL      24
+#define NETREG_RXHEAD      28
+#define NETREG_TXBASE      32
+#define NETREG_TXSIZE      36
+#define NETREG_TXTAIL      40
+#define NETREG_TXHEAD      44
+#define NETREG_COALESCE    48
 
 #define NET_READBUF     32768
 #define NET_WRITEBUF    (NET_READBUF+NET_BUFSIZE)
@@ -34,7 +46,43 @@
 
 #define FRAME_MAGIC     0xa4b3
 
-#define NETWORK_LATENCY		2000000  /* ns: 2ms for every packet */
+#define NETWORK_LATENCY		2000000  /* ns: default; 2ms for every packet */
+
+/*
+ * Descriptor rings (revision 2). A ring is an array of descriptors in
+ * guest physical memory; the guest advances the tail to hand
+ * descriptors to the card and the card advances the head as it
+ * finishes with them. Both count up forever and are taken modulo
+ * the ring size to index the ring. Descriptors are four words:
+ */
+#define NETDESC_SIZE       16
+#define NETDESC_BUFFER     0	/* physical address of packet buffer */
+#define NETDESC_BUFLEN     4	/* size of buffer */
+#define NETDESC_LENGTH     8	/* (out) length of packet */
+#define NETDESC_STATUS     12	/* (out) completion status */
+
+#define NETDS_PENDING      0
+#define NETDS_DONE         1
+#define NETDS_ERROR        2	/* bad buffer, or packet didn't fit */
+
+#define NET_MAXRING        1024
+
+struct net_ring {
+	uint32_t nr_base;
+	uint32_t nr_size;	/* 0 if not in use */
+	uint32_t nr_head;
+	uint32_t nr_tail;
+};
+
+/*
+ * Interrupt coalescing register: completions on the rings are held
+ * back until NDCO_COUNT(val) of them have happened in one direction,
+ * or NDCO_USECS(val) microseconds after the first, whichever is
+ * first. 0 for either means no limit of that kind; the register
+ * resets to 0, which interrupts for every packet.
+ */
+#define NDCO_COUNT(v)      ((v) & 0xffff)
+#define NDCO_USECS(v)      ((v) >> 16)
 
 struct net_data {
 	int nd_slot;
@@ -53,6 +101,45 @@ struct net_data {
 	/* These used to be nd_{r,w}buf[NET_BUFSIZE]; see dev_disk.c */
 	char *nd_rbuf;
 	char *nd_wbuf;
+
+	/*
+	 * Rings. When the receive ring is in use incoming packets go
+	 * there instead of nd_rbuf, and are only dropped if it's full.
+	 * nd_scratch holds a packet on its way in.
+	 */
+	struct net_ring nd_rx;
+	struct net_ring nd_tx;
+	char *nd_scratch;
+
+	/* Interrupt coalescing */
+	uint32_t nd_coalesce;		/* coalescing register */
+	uint32_t nd_rpending;		/* completions not yet signaled */
+	uint32_t nd_wpending;
+	uint32_t nd_coalgen;		/* to ignore stale timeouts */
+	int nd_coaltimer;		/* timeout scheduled */
+
+	/*
+	 * Transmit timing: a packet goes onto the wire when the one
+	 * before it is finished, takes its length over nd_bandwidth
+	 * bytes per second (0 for unlimited) to send, and arrives
+	 * nd_latency after that. nd_wirefree is when the wire is next
+	 * free.
+	 *
+	 * Only the packet at the head of the transmit ring has a send
+	 * event pending (nd_txbusy); each one schedules the next when
+	 * it completes, so a full ring costs one event, not one per
+	 * packet. nd_txposted is when packets were last posted, so the
+	 * next packet doesn't go on the wire before it existed.
+	 */
+	uint64_t nd_latency;
+	uint64_t nd_bandwidth;
+	uint64_t nd_wirefree;
+	int nd_txbusy;
+	uint64_t nd_txposted;
+
+	/* Capture file for pcap= option, or NULL */
+	FILE *nd_pcap;
+	const char *nd_pcapname;
 };
 
 /* Fields in interrupt registers */
@@ -77,6 +164,68 @@ struct linkheader {
 	uint16_t lh_to;
 };
 
+////////////////////////////////////////////////////////////
+// packet capture
+
+static
+void
+pcap_open(struct net_data *nd, const char *path)
+{
+	struct pcapfmt_filehdr pf;
+
+	nd->nd_pcap = fopen(path, "wb");
+	if (nd->nd_pcap == NULL) {
+		msg("nic: slot %d: %s: %s", nd->nd_slot, path,
+		    strerror(errno));
+		die();
+	}
+	/* packets are small; buffer many of them */
+	setvbuf(nd->nd_pcap, NULL, _IOFBF, 65536);
+	nd->nd_pcapname = path;
+
+	pf.pf_magic = PCAPFMT_MAGIC_NSEC;
+	pf.pf_major = PCAPFMT_VERSION_MAJOR;
+	pf.pf_minor = PCAPFMT_VERSION_MINOR;
+	pf.pf_thiszone = 0;
+	pf.pf_sigfigs = 0;
+	pf.pf_snaplen = NET_BUFSIZE;
+	pf.pf_linktype = PCAPFMT_LINKTYPE_SYS161;
+	if (fwrite(&pf, sizeof(pf), 1, nd->nd_pcap) != 1) {
+		msg("nic: slot %d: %s: write error", nd->nd_slot, path);
+		die();
+	}
+}
+
+/*
+ * Record a frame going by. CAPLEN bytes of it are in BUF; LEN is
+ * its full length. Timestamps are virtual time.
+ */
+static
+void
+pcap_frame(struct net_data *nd, const char *buf, uint32_t caplen,
+	   uint32_t len)
+{
+	struct pcapfmt_rechdr pr;
+	uint64_t now;
+
+	if (nd->nd_pcap == NULL) {
+		return;
+	}
+
+	now = clock_monotime();
+	pr.pr_sec = now / 1000000000;
+	pr.pr_nsec = now % 1000000000;
+	pr.pr_caplen = caplen;
+	pr.pr_len = len;
+	if (fwrite(&pr, sizeof(pr), 1, nd->nd_pcap) != 1 ||
+	    fwrite(buf, caplen, 1, nd->nd_pcap) != 1) {
+		msg("nic: slot %d: %s: write error; capture stopped",
+		    nd->nd_slot, nd->nd_pcapname);
+		fclose(nd->nd_pcap);
+		nd->nd_pcap = NULL;
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -109,6 +258,103 @@ writedone(struct net_data *nd)
 	chkint(nd);
 }
 
+/*
+ * Deliver the ring completions that have been held back.
+ */
+static
+void
+coalesce_flush(struct net_data *nd)
+{
+	if (nd->nd_rpending > 0) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: %u packets received",
+			nd->nd_slot, nd->nd_rpending);
+		nd->nd_rirq = NDI_DONE;
+	}
+	if (nd->nd_wpending > 0) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: %u packets sent",
+			nd->nd_slot, nd->nd_wpending);
+		nd->nd_wirq = NDI_DONE;
+	}
+	nd->nd_rpending = nd->nd_wpending = 0;
+	nd->nd_coaltimer = 0;
+	nd->nd_coalgen++;
+	chkint(nd);
+}
+
+static
+void
+coalesce_timeout(void *data, uint32_t gen)
+{
+	struct net_data *nd = data;
+
+	if (gen == nd->nd_coalgen && nd->nd_coaltimer) {
+		coalesce_flush(nd);
+	}
+}
+
+/*
+ * A descriptor on one of the rings has completed.
+ */
+static
+void
+ringdone(struct net_data *nd, int isread)
+{
+	uint32_t count = NDCO_COUNT(nd->nd_coalesce);
+	uint32_t usecs = NDCO_USECS(nd->nd_coalesce);
+
+	if (isread) {
+		nd->nd_rpending++;
+	}
+	else {
+		nd->nd_wpending++;
+	}
+
+	if (count <= 1 ||
+	    nd->nd_rpending >= count || nd->nd_wpending >= count) {
+		coalesce_flush(nd);
+	}
+	else if (usecs > 0 && !nd->nd_coaltimer) {
+		nd->nd_coaltimer = 1;
+		schedule_event((uint64_t)usecs * 1000, nd, nd->nd_coalgen,
+			       coalesce_timeout, "nic coalescing");
+	}
+}
+
+static
+void
+setcoalesce(struct net_data *nd, uint32_t val)
+{
+	nd->nd_coalesce = val;
+	/* don't leave anything held back under the old setting */
+	if (nd->nd_rpending > 0 || nd->nd_wpending > 0) {
+		coalesce_flush(nd);
+	}
+}
+
+/*
+ * How long from now until a packet of LEN bytes that was ready to go
+ * at time READY (no later than now) has been sent and delivered.
+ * Packets are sent one at a time.
+ */
+static
+uint64_t
+txdelay(struct net_data *nd, uint32_t len, uint64_t ready)
+{
+	uint64_t now, start;
+
+	now = clock_monotime();
+	start = nd->nd_wirefree > ready ? nd->nd_wirefree : ready;
+	nd->nd_wirefree = start;
+	if (nd->nd_bandwidth > 0) {
+		nd->nd_wirefree += (uint64_t)len * 1000000000ULL /
+			nd->nd_bandwidth;
+	}
+	if (nd->nd_wirefree + nd->nd_latency < now) {
+		return 0;
+	}
+	return nd->nd_wirefree + nd->nd_latency - now;
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -164,23 +410,27 @@ keepalive(void *data, uint32_t junk)
 	schedule_event(1000000000, nd, 0, keepalive, "net keepalive");
 }
 
+/*
+ * Send the packet in BUF, which has room for BUFLEN bytes. Returns -1
+ * if the length in the header doesn't fit.
+ */
 static
-void
-dosend(struct net_data *nd)
+int
+transmit(struct net_data *nd, char *buf, uint32_t buflen)
 {
-	struct linkheader *lh = (struct linkheader *)nd->nd_wbuf;
+	struct linkheader *lh = (struct linkheader *)buf;
 	uint32_t len;
 	int r;
 
 	len = ntohs(lh->lh_packetlen);
 
-	if (len > NET_BUFSIZE) {
-		hang("Packet size too long");
-		return;
+	if (len > NET_BUFSIZE || len > buflen) {
+		return -1;
 	}
 
 	HWTRACE(DOTRACE_NET, "nic: slot %d: starting send (%u bytes)", 
 		nd->nd_slot, len);
+	flight_hwevent(FLIGHT_NET, nd->nd_slot, 1, len);
 
 	/*
 	 * Force the link-level header to the right values
@@ -188,17 +438,249 @@ dosend(struct net_data *nd)
 	lh->lh_frame = htons(FRAME_MAGIC);
 	lh->lh_from = htons(nd->nd_status & NDS_HWADDR);
 
-	r = sendto(nd->nd_socket, nd->nd_wbuf, len, 0, 
+	pcap_frame(nd, buf, len, len);
+
+	r = sendto(nd->nd_socket, buf, len, 0, 
 	       (struct sockaddr *)&nd->nd_hubaddr, nd->nd_hubaddrlen);
 	if (r<0) {
 		msg("nic: slot %d: sendto: %s", nd->nd_slot, strerror(errno));
 	}
 
 	g_stats.s_wpkts++;
+	return 0;
+}
 
+static
+void
+dosend(struct net_data *nd)
+{
+	if (transmit(nd, nd->nd_wbuf, NET_BUFSIZE) < 0) {
+		hang("Packet size too long");
+		return;
+	}
 	writedone(nd);
 }
 
+////////////////////////////////////////////////////////////
+// rings
+
+/*
+ * Access descriptor words in guest RAM. ring_setsize/ring_settail
+ * have already checked that the ring lies within RAM.
+ */
+static
+uint32_t
+desc_fetch(struct net_ring *nr, uint32_t index, uint32_t word)
+{
+	uint32_t addr;
+
+	addr = nr->nr_base + (index & (nr->nr_size - 1)) * NETDESC_SIZE;
+	return ntohl(*(uint32_t *)(ram + addr + word));
+}
+
+static
+void
+desc_store(struct net_ring *nr, uint32_t index, uint32_t word, uint32_t val)
+{
+	uint32_t addr;
+
+	addr = nr->nr_base + (index & (nr->nr_size - 1)) * NETDESC_SIZE;
+	*(uint32_t *)(ram + addr + word) = htonl(val);
+}
+
+/*
+ * Get the buffer for a descriptor, or NULL if it isn't within RAM.
+ */
+static
+char *
+desc_buffer(struct net_ring *nr, uint32_t index, uint32_t *len_ret)
+{
+	uint32_t addr, len;
+
+	addr = desc_fetch(nr, index, NETDESC_BUFFER);
+	len = desc_fetch(nr, index, NETDESC_BUFLEN);
+	if (addr >= bus_ramsize || len > bus_ramsize - addr) {
+		return NULL;
+	}
+	*len_ret = len;
+	return ram + addr;
+}
+
+static
+void
+desc_finish(struct net_ring *nr, uint32_t index, uint32_t len,
+	    uint32_t status)
+{
+	desc_store(nr, index, NETDESC_LENGTH, len);
+	desc_store(nr, index, NETDESC_STATUS, status);
+}
+
+static
+int
+ring_inram(struct net_ring *nr)
+{
+	return (uint64_t)nr->nr_base + (uint64_t)nr->nr_size * NETDESC_SIZE
+		<= bus_ramsize;
+}
+
+static
+void
+ring_setbase(struct net_ring *nr, uint32_t val)
+{
+	if (val % NETDESC_SIZE != 0) {
+		hang("nic: ring base 0x%x not aligned", val);
+		return;
+	}
+	nr->nr_base = val;
+}
+
+static
+void
+ring_setsize(struct net_ring *nr, uint32_t val)
+{
+	if (val > NET_MAXRING || (val & (val - 1)) != 0) {
+		hang("nic: invalid ring size %u", val);
+		return;
+	}
+	nr->nr_size = val;
+	nr->nr_head = nr->nr_tail = 0;
+	if (!ring_inram(nr)) {
+		hang("nic: ring at 0x%x size %u extends past end of RAM",
+		     nr->nr_base, nr->nr_size);
+	}
+}
+
+static
+int
+ring_settail(struct net_ring *nr, uint32_t val)
+{
+	if (nr->nr_size == 0) {
+		hang("nic: ring tail written with no ring set up");
+		return -1;
+	}
+	if (!ring_inram(nr)) {
+		hang("nic: ring at 0x%x size %u extends past end of RAM",
+		     nr->nr_base, nr->nr_size);
+		return -1;
+	}
+	if (val - nr->nr_head > nr->nr_size) {
+		hang("nic: ring tail %u is more than %u past head %u",
+		     val, nr->nr_size, nr->nr_head);
+		return -1;
+	}
+	nr->nr_tail = val;
+	return 0;
+}
+
+static void tx_ringdone(void *n, uint32_t code);
+
+/*
+ * Schedule the send of the packet at the head of the transmit ring,
+ * timed by the length in its header (it had better not change), if
+ * there is one and nothing is being sent already.
+ */
+static
+void
+tx_schedule(struct net_data *nd, uint64_t ready)
+{
+	struct net_ring *nr = &nd->nd_tx;
+	struct linkheader *lh;
+	uint32_t len, buflen;
+	char *buf;
+
+	if (nd->nd_txbusy || nr->nr_head == nr->nr_tail) {
+		return;
+	}
+	len = 0;
+	buf = desc_buffer(nr, nr->nr_head, &buflen);
+	if (buf != NULL && buflen >= sizeof(*lh)) {
+		lh = (struct linkheader *)buf;
+		len = ntohs(lh->lh_packetlen);
+	}
+	nd->nd_txbusy = 1;
+	schedule_event(txdelay(nd, len, ready), nd, 0, tx_ringdone,
+		       "packet send");
+}
+
+/*
+ * New packets were posted on the transmit ring.
+ */
+static
+void
+tx_start(struct net_data *nd)
+{
+	nd->nd_txposted = clock_monotime();
+	tx_schedule(nd, nd->nd_txposted);
+}
+
+/*
+ * Send the packet at the head of the transmit ring, and start the
+ * next one. It has been waiting since it was posted, so it can go on
+ * the wire as soon as this one left it.
+ */
+static
+void
+tx_ringdone(void *n, uint32_t code)
+{
+	struct net_data *nd = n;
+	struct net_ring *nr = &nd->nd_tx;
+	uint32_t len;
+	char *buf;
+
+	(void)code;
+
+	nd->nd_txbusy = 0;
+	if (nr->nr_head == nr->nr_tail) {
+		/* ring was reset under us; hang() already happened */
+		return;
+	}
+
+	buf = desc_buffer(nr, nr->nr_head, &len);
+	if (buf == NULL || transmit(nd, buf, len) < 0) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: bad transmit "
+			"descriptor %u", nd->nd_slot, nr->nr_head);
+		g_stats.s_epkts++;
+		desc_finish(nr, nr->nr_head, 0, NETDS_ERROR);
+	}
+	else {
+		len = ntohs(((struct linkheader *)buf)->lh_packetlen);
+		desc_finish(nr, nr->nr_head, len, NETDS_DONE);
+	}
+	nr->nr_head++;
+	ringdone(nd, 0);
+	tx_schedule(nd, nd->nd_txposted);
+}
+
+/*
+ * Put a received packet of length LEN into the next receive
+ * descriptor. The caller has checked there is one.
+ */
+static
+void
+rx_deliver(struct net_data *nd, const char *pkt, uint32_t len)
+{
+	struct net_ring *nr = &nd->nd_rx;
+	uint32_t buflen;
+	char *buf;
+
+	buf = desc_buffer(nr, nr->nr_head, &buflen);
+	if (buf == NULL || len > buflen) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: packet doesn't fit "
+			"receive descriptor %u", nd->nd_slot, nr->nr_head);
+		g_stats.s_epkts++;
+		desc_finish(nr, nr->nr_head, len, NETDS_ERROR);
+	}
+	else {
+		memcpy(buf, pkt, len);
+		desc_finish(nr, nr->nr_head, len, NETDS_DONE);
+		g_stats.s_rpkts++;
+	}
+	nr->nr_head++;
+	ringdone(nd, 1);
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 dorecv(void *data)
@@ -213,7 +695,16 @@ dorecv(void *data)
 
 	int overrun=0, r;
 
-	if (nd->nd_rirq != 0) {
+	if (nd->nd_rx.nr_size > 0) {
+		/*
+		 * Receive into the ring; the packet is dropped if
+		 * there's no free descriptor for it.
+		 */
+		overrun = nd->nd_rx.nr_head == nd->nd_rx.nr_tail;
+		readbuf = nd->nd_scratch;
+		readbuflen = NET_BUFSIZE;
+	}
+	else if (nd->nd_rirq != 0) {
 		/*
 		 * The last packet we got hasn't cleared yet.
 		 * Drop this one.
@@ -257,6 +748,11 @@ dorecv(void *data)
 		return 0;
 	}
 
+	/* capture what the card accepts, even if it's then dropped */
+	pcap_frame(nd, readbuf,
+		   r < ntohs(lh->lh_packetlen) ? r : ntohs(lh->lh_packetlen),
+		   ntohs(lh->lh_packetlen));
+
 	if (ntohs(lh->lh_packetlen) > r) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: truncated packet", 
 			nd->nd_slot);
@@ -271,6 +767,8 @@ dorecv(void *data)
 		return 0;
 	}
 
+	flight_hwevent(FLIGHT_NET, nd->nd_slot, 0, r);
+
 	if (overrun) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: overrun",
 			nd->nd_slot);
@@ -278,6 +776,11 @@ dorecv(void *data)
 		return 0;
 	}
 
+	if (nd->nd_rx.nr_size > 0) {
+		rx_deliver(nd, readbuf, r);
+		return 0;
+	}
+
 	g_stats.s_rpkts++;
 
 	readdone(nd);
@@ -331,7 +834,13 @@ setctl(struct net_data *nd, uint32_t val)
 				     "send already in progress");
 			}
 			else {
-				schedule_event(NETWORK_LATENCY,
+				struct linkheader *lh;
+				uint32_t len;
+
+				lh = (struct linkheader *)nd->nd_wbuf;
+				len = ntohs(lh->lh_packetlen);
+				schedule_event(txdelay(nd, len,
+						       clock_monotime()),
 					       nd, 0,
 					       triggersend,
 					       "packet send");
@@ -370,6 +879,15 @@ net_fetch(unsigned cpunum, void *d, uint32_t offset, uint32_t *val)
 	    case NETREG_WRITEINTR: *val = nd->nd_wirq; return 0;
 	    case NETREG_CONTROL: *val = nd->nd_control; return 0;
 	    case NETREG_STATUS: *val = nd->nd_status; return 0;
+	    case NETREG_RXBASE: *val = nd->nd_rx.nr_base; return 0;
+	    case NETREG_RXSIZE: *val = nd->nd_rx.nr_size; return 0;
+	    case NETREG_RXTAIL: *val = nd->nd_rx.nr_tail; return 0;
+	    case NETREG_RXHEAD: *val = nd->nd_rx.nr_head; return 0;
+	    case NETREG_TXBASE: *val = nd->nd_tx.nr_base; return 0;
+	    case NETREG_TXSIZE: *val = nd->nd_tx.nr_size; return 0;
+	    case NETREG_TXTAIL: *val = nd->nd_tx.nr_tail; return 0;
+	    case NETREG_TXHEAD: *val = nd->nd_tx.nr_head; return 0;
+	    case NETREG_COALESCE: *val = nd->nd_coalesce; return 0;
 	}
 	return -1;
 }
@@ -397,6 +915,29 @@ net_store(unsigned cpunum, void *d, uint32_t offset, uint32_t val)
 	    case NETREG_WRITEINTR: setirq(nd, val, 0); break;
 	    case NETREG_CONTROL: setctl(nd, val); break;
 	    case NETREG_STATUS: return -1;
+	    case NETREG_RXBASE: ring_setbase(&nd->nd_rx, val); break;
+	    case NETREG_RXSIZE: ring_setsize(&nd->nd_rx, val); break;
+	    case NETREG_RXTAIL: ring_settail(&nd->nd_rx, val); break;
+	    case NETREG_TXBASE:
+	    case NETREG_TXSIZE:
+		if (nd->nd_txbusy) {
+			hang("nic: transmit ring changed while sending");
+		}
+		else if (offset == NETREG_TXBASE) {
+			ring_setbase(&nd->nd_tx, val);
+		}
+		else {
+			ring_setsize(&nd->nd_tx, val);
+		}
+		break;
+	    case NETREG_TXTAIL:
+		if (ring_settail(&nd->nd_tx, val) == 0) {
+			tx_start(nd);
+		}
+		break;
+	    case NETREG_COALESCE: setcoalesce(nd, val); break;
+	    case NETREG_RXHEAD: return -1;
+	    case NETREG_TXHEAD: return -1;
 	    default: return -1;
 	}
 	return 0;
@@ -412,9 +953,17 @@ net_cleanup(void *d)
 		close(nd->nd_socket);
 		nd->nd_socket = -1;
 	}
+	if (nd->nd_pcap != NULL) {
+		if (fclose(nd->nd_pcap)) {
+			msg("nic: slot %d: %s: write error", nd->nd_slot,
+			    nd->nd_pcapname);
+		}
+		nd->nd_pcap = NULL;
+	}
 
 	free(nd->nd_rbuf);
 	free(nd->nd_wbuf);
+	free(nd->nd_scratch);
 	free(nd);
 }
 
@@ -425,6 +974,9 @@ net_init(int slot, int argc, char *argv[])
 	struct net_data *nd = domalloc(sizeof(struct net_data));
 	const char *hubname = ".sockets/hub";
 	uint16_t hwaddr = HUB_ADDR;
+	int64_t latency = NETWORK_LATENCY;
+	off_t bandwidth = 0;
+	const char *pcapname = NULL;
 	char cwd[PATH_MAX];
 	int len;
 
@@ -440,6 +992,15 @@ net_init(int slot, int argc, char *argv[])
 		else if (!strncmp(argv[i], "hwaddr=", 7)) {
 			hwaddr = atoi(argv[i]+7);
 		}
+		else if (!strncmp(argv[i], "latency=", 8)) {
+			latency = strtoll(argv[i]+8, NULL, 0);
+		}
+		else if (!strncmp(argv[i], "bandwidth=", 10)) {
+			bandwidth = getsize(argv[i]+10);
+		}
+		else if (!strncmp(argv[i], "pcap=", 5)) {
+			pcapname = argv[i]+5;
+		}
 		else {
 			msg("nic: slot %d: invalid option %s", slot, argv[i]);
 			die();
@@ -451,6 +1012,11 @@ net_init(int slot, int argc, char *argv[])
 		die();
 	}
 
+	if (latency < 0 || bandwidth < 0) {
+		msg("nic: slot %d: Invalid timing options", slot);
+		die();
+	}
+
 	if (getcwd(cwd, sizeof(cwd))==NULL) {
 		msg("nic: slot %d: getcwd: %s", slot, strerror(errno));
 		die();
@@ -470,6 +1036,27 @@ net_init(int slot, int argc, char *argv[])
 
 	nd->nd_rbuf = domalloc(NET_BUFSIZE);
 	nd->nd_wbuf = domalloc(NET_BUFSIZE);
+	nd->nd_scratch = domalloc(NET_BUFSIZE);
+
+	memset(&nd->nd_rx, 0, sizeof(nd->nd_rx));
+	memset(&nd->nd_tx, 0, sizeof(nd->nd_tx));
+
+	nd->nd_coalesce = 0;
+	nd->nd_rpending = nd->nd_wpending = 0;
+	nd->nd_coalgen = 0;
+	nd->nd_coaltimer = 0;
+
+	nd->nd_latency = latency;
+	nd->nd_bandwidth = bandwidth;
+	nd->nd_wirefree = 0;
+	nd->nd_txbusy = 0;
+	nd->nd_txposted = 0;
+
+	nd->nd_pcap = NULL;
+	nd->nd_pcapname = NULL;
+	if (pcapname != NULL) {
+		pcap_open(nd, pcapname);
+	}
 
 	memset(&mysun, 0, sizeof(mysun));
 	mysun.sun_family = AF_UNIX;
@@ -515,12 +1102,38 @@ net_dumpstate(void *data)
 	struct net_data *nd = data;
 	msg("System/161 network interface rev %d", NET_REVISION);
 	msg("    Hub: %s", nd->nd_hubaddr.sun_path);
+	if (nd->nd_pcap != NULL) {
+		msg("    Capturing to: %s", nd->nd_pcapname);
+	}
 	msg("    Carrier: %s", nd->nd_lostcarrier ? "none" : "detected");
 	msg("    rirq: %lu  wirq: %lu  control: %lu  status: 0x%04lx",
 	    (unsigned long) nd->nd_rirq,
 	    (unsigned long) nd->nd_wirq,
 	    (unsigned long) nd->nd_control,
 	    (unsigned long) nd->nd_status);
+	if (nd->nd_rx.nr_size > 0) {
+		msg("    rx ring: base 0x%lx size %lu head %lu tail %lu",
+		    (unsigned long) nd->nd_rx.nr_base,
+		    (unsigned long) nd->nd_rx.nr_size,
+		    (unsigned long) nd->nd_rx.nr_head,
+		    (unsigned long) nd->nd_rx.nr_tail);
+	}
+	if (nd->nd_tx.nr_size > 0) {
+		msg("    tx ring: base 0x%lx size %lu head %lu tail %lu%s",
+		    (unsigned long) nd->nd_tx.nr_base,
+		    (unsigned long) nd->nd_tx.nr_size,
+		    (unsigned long) nd->nd_tx.nr_head,
+		    (unsigned long) nd->nd_tx.nr_tail,
+		    nd->nd_txbusy ? " (sending)" : "");
+	}
+	msg("    coalescing: 0x%lx; %lu rx and %lu tx held back",
+	    (unsigned long) nd->nd_coalesce,
+	    (unsigned long) nd->nd_rpending,
+	    (unsigned long) nd->nd_wpending);
+	msg("    latency %llu ns, bandwidth %llu bytes/sec%s",
+	    (unsigned long long) nd->nd_latency,
+	    (unsigned long long) nd->nd_bandwidth,
+	    nd->nd_bandwidth == 0 ? " (unlimited)" : "");
 	msg("    rx buffer:");
 	dohexdump(nd->nd_rbuf, NET_BUFSIZE);
 	msg("    tx buffer:");
@@ -4,8 +4,11 @@
 #include "config.h"
 
 #include "main.h"
+#include "clock.h"
 #include "cpu.h"
 #include "prof.h"
+#include "trace.h"
+#include "flight.h"
 
 #include "lamebus.h"
 #include "busids.h"
@@ -18,6 +21,12 @@
 #define TRACEREG_STOP	16
 #define TRACEREG_PROFEN	20
 #define TRACEREG_PROFCL	24
+#define TRACEREG_FCLEAR	28
+#define TRACEREG_FCPUS	32
+#define TRACEREG_FASID	36
+#define TRACEREG_FPCLO	40
+#define TRACEREG_FPCHI	44
+#define TRACEREG_FTIME	48
 
 
 static
@@ -89,6 +98,7 @@ trace_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 		    (unsigned long)val, (unsigned long)val);
 
 		main_dumpstate();
+		flight_dump("software request");
 
 		msg("trace: dump complete");
 		msg("----------------------------------------"
@@ -113,6 +123,45 @@ trace_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 	    case TRACEREG_PROFCL:
 #ifdef USE_TRACE
 		prof_clear();
+#endif
+		break;
+	    case TRACEREG_FCLEAR:
+#ifdef USE_TRACE
+		trace_clearfilters();
+#endif
+		break;
+	    case TRACEREG_FCPUS:
+#ifdef USE_TRACE
+		trace_filtercpus(val);
+#endif
+		break;
+	    case TRACEREG_FASID:
+#ifdef USE_TRACE
+		trace_filterasid(val);
+#endif
+		break;
+	    case TRACEREG_FPCLO:
+#ifdef USE_TRACE
+		trace_filterpclo(val);
+#endif
+		break;
+	    case TRACEREG_FPCHI:
+#ifdef USE_TRACE
+		if (trace_filterpchi(val)) {
+			hang("Too many trace filter address ranges");
+		}
+#endif
+		break;
+	    case TRACEREG_FTIME:
+#ifdef USE_TRACE
+		/* trace for the next VAL ns; 0 removes the time window */
+		if (val == 0) {
+			trace_filtertime(0, UINT64_MAX);
+		}
+		else {
+			trace_filtertime(clock_monotime(),
+					 clock_monotime() + val);
+		}
 #endif
 		break;
 	    default:
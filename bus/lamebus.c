@@ -14,6 +14,7 @@
 #include "onsel.h"
 #include "clock.h"
 #include "main.h"
+#include "flight.h"
 #include "memdefs.h"
 
 #include "lamebus.h"
@@ -183,6 +184,9 @@ irqupdate(void)
 void
 raise_irq(int slot)
 {
+	if ((bus_raised_interrupts & ((uint32_t)1 << slot)) == 0) {
+		flight_hwevent(FLIGHT_SLOTIRQ, slot, 1, 0);
+	}
 	bus_raised_interrupts |= ((uint32_t)1 << slot);
 	irqupdate();
 	HWTRACE(DOTRACE_IRQ, "Slot %2d: irq ON", (slot));
@@ -191,6 +195,9 @@ raise_irq(int slot)
 void
 lower_irq(int slot)
 {
+	if (bus_raised_interrupts & ((uint32_t)1 << slot)) {
+		flight_hwevent(FLIGHT_SLOTIRQ, slot, 0, 0);
+	}
 	bus_raised_interrupts &= ~((uint32_t)1 << slot);
 	irqupdate();
 	HWTRACE(DOTRACE_IRQ, "Slot %2d: irq OFF", (slot));
@@ -555,6 +562,9 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 	int i;
 	unsigned long j, tmp_ncpus, ncores;
 	const char *myname = isold ? "oldmainboard" : "mainboard";
+	int cache, cacherandom;
+	uint32_t cachesize;
+	unsigned cacheways, cacheline, cachemiss;
 
 	Assert(slot==LAMEBUS_CONTROLLER_SLOT);
 
@@ -564,6 +574,13 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 	bus_ramsize = 0; /* for now require configuration */
 	tmp_ncpus = 1;
 	ncores = 1;
+	/* the cache model is off; these match what CONFIG1 says anyway */
+	cache = 0;
+	cachesize = 4096;
+	cacheways = 4;
+	cacheline = 16;
+	cacherandom = 0;
+	cachemiss = 0;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "ramsize=", 8)) {
@@ -575,6 +592,33 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 		else if (!isold && !strncmp(argv[i], "cores=", 6)) {
 			ncores = strtoul(argv[i]+6, NULL, 0);
 		}
+		else if (!strcmp(argv[i], "cache")) {
+			cache = 1;
+		}
+		else if (!strncmp(argv[i], "cachesize=", 10)) {
+			cachesize = getsize(argv[i]+10);
+			cache = 1;
+		}
+		else if (!strncmp(argv[i], "cacheways=", 10)) {
+			cacheways = strtoul(argv[i]+10, NULL, 0);
+			cache = 1;
+		}
+		else if (!strncmp(argv[i], "cacheline=", 10)) {
+			cacheline = strtoul(argv[i]+10, NULL, 0);
+			cache = 1;
+		}
+		else if (!strcmp(argv[i], "cachepolicy=lru")) {
+			cacherandom = 0;
+			cache = 1;
+		}
+		else if (!strcmp(argv[i], "cachepolicy=random")) {
+			cacherandom = 1;
+			cache = 1;
+		}
+		else if (!strncmp(argv[i], "cachemiss=", 10)) {
+			cachemiss = strtoul(argv[i]+10, NULL, 0);
+			cache = 1;
+		}
 		else {
 			msg("%s: invalid option `%s'", myname, argv[i]);
 			die();
@@ -596,6 +640,11 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 	/* avoid overflow from unsigned long to unsigned */
 	ncpus = tmp_ncpus;
 
+	if (cache) {
+		cpu_setcache(cachesize, cacheways, cacheline,
+			     cacherandom, cachemiss);
+	}
+
 	for (j=0; j<ncpus; j++) {
 		cpus[j].cpu_enabled = 0;
 		cpus[j].cpu_enabled_interrupts = 0xffffffff;
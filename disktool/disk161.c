@@ -6,6 +6,8 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +15,12 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include "config.h"
+
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
 /*
  * On Linux, or at least in some glibc versions, fcntl.h defines the
  * constants for flock(), but not the function, which is in sys/file.h
@@ -22,12 +30,22 @@
 #include <sys/file.h>
 #endif
 
-#define SECTORSIZE 512
+#include "diskfmt.h"
+
+#define SECTORSIZE DISKFMT_SECTSIZE
 #define MINSIZE (128 * SECTORSIZE)
 #define MAXSIZE 0x100000000LL
 
-#define HEADERSIZE   SECTORSIZE
-#define HEADERSTRING "System/161 Disk Image"
+#define HEADERSIZE   DISKFMT_HEADERSIZE
+#define HEADERSTRING DISKFMT_RAW_MAGIC
+
+/* Kinds of image (see diskfmt.h) */
+#define IMG_RAW      0
+#define IMG_OVERLAY  1
+#define IMG_SPARSE   2
+
+/* Default cluster size for sparse images */
+#define DEFAULT_CLUSTER (8 * SECTORSIZE)
 
 ////////////////////////////////////////////////////////////
 // Compat
@@ -41,7 +59,7 @@
  */
 #ifndef LOCK_EX
 
-/*      LOCK_SH F_RDLCK - we don't use this */
+#define LOCK_SH F_RDLCK
 #define LOCK_EX F_WRLCK
 #define LOCK_UN F_UNLCK
 #define LOCK_NB 0  /* assume we always want this */
@@ -239,23 +257,101 @@ checksize(off_t size)
 	}
 }
 
+/*
+ * Read the header into BUF and return what kind of image it is.
+ */
 static
-void
-checkheader(const char *file, int fd)
+int
+readheader(const char *file, int fd, char *buf)
 {
-	char buf[SECTORSIZE];
-
-	doread(file, fd, buf, sizeof(buf));
-	buf[sizeof(buf) - 1] = 0;
+	dolseek(file, fd, 0, SEEK_SET);
+	doread(file, fd, buf, SECTORSIZE);
+	buf[SECTORSIZE - 1] = 0;
 
 	if (!strcmp(buf, HEADERSTRING)) {
-		/* ok */
-		return;
+		return IMG_RAW;
+	}
+	if (!strcmp(buf, DISKFMT_OVERLAY_MAGIC)) {
+		return IMG_OVERLAY;
+	}
+	if (!strcmp(buf, DISKFMT_SPARSE_MAGIC)) {
+		return IMG_SPARSE;
 	}
 	fprintf(stderr, "disk161: %s: Not a System/161 disk image\n", file);
 	exit(1);
 }
 
+/*
+ * Decode an overlay header read with readheader.
+ */
+static
+void
+getoverlayheader(const char *file, const char *buf,
+		 struct diskfmt_overlay_header *oh)
+{
+	memcpy(oh, buf, sizeof(*oh));
+	oh->oh_version = ntohl(oh->oh_version);
+	oh->oh_sectors = ntohl(oh->oh_sectors);
+	oh->oh_bitmapstart = ntohl(oh->oh_bitmapstart);
+	oh->oh_bitmapsectors = ntohl(oh->oh_bitmapsectors);
+	oh->oh_datastart = ntohl(oh->oh_datastart);
+	oh->oh_base[DISKFMT_PATHLEN - 1] = 0;
+	if (oh->oh_version != DISKFMT_OVERLAY_VERSION) {
+		fprintf(stderr, "disk161: %s: Unsupported overlay "
+			"version %u\n", file, oh->oh_version);
+		exit(1);
+	}
+	if (oh->oh_bitmapstart < 1 ||
+	    oh->oh_bitmapsectors < DISKFMT_BITMAPSECTORS(oh->oh_sectors) ||
+	    oh->oh_datastart < oh->oh_bitmapstart + oh->oh_bitmapsectors) {
+		fprintf(stderr, "disk161: %s: Corrupt overlay header\n",
+			file);
+		exit(1);
+	}
+}
+
+/*
+ * Decode a sparse image header read with readheader.
+ */
+static
+void
+getsparseheader(const char *file, const char *buf,
+		struct diskfmt_sparse_header *sh)
+{
+	memcpy(sh, buf, sizeof(*sh));
+	sh->sh_version = ntohl(sh->sh_version);
+	sh->sh_sectors = ntohl(sh->sh_sectors);
+	sh->sh_clustersectors = ntohl(sh->sh_clustersectors);
+	sh->sh_tablestart = ntohl(sh->sh_tablestart);
+	sh->sh_tablesectors = ntohl(sh->sh_tablesectors);
+	if (sh->sh_version != DISKFMT_SPARSE_VERSION) {
+		fprintf(stderr, "disk161: %s: Unsupported sparse image "
+			"version %u\n", file, sh->sh_version);
+		exit(1);
+	}
+	if (sh->sh_clustersectors < 1 ||
+	    sh->sh_clustersectors > DISKFMT_SPARSE_MAXCLUSTER ||
+	    sh->sh_tablestart < 1 ||
+	    sh->sh_tablesectors < DISKFMT_TABLESECTORS(
+		    DISKFMT_NCLUSTERS(sh->sh_sectors, sh->sh_clustersectors))) {
+		fprintf(stderr, "disk161: %s: Corrupt sparse image header\n",
+			file);
+		exit(1);
+	}
+}
+
+static
+void
+checkheader(const char *file, int fd)
+{
+	char buf[SECTORSIZE];
+
+	if (readheader(file, fd, buf) != IMG_RAW) {
+		fprintf(stderr, "disk161: %s: Not a raw disk image\n", file);
+		exit(1);
+	}
+}
+
 static
 void
 writeheader(const char *file, int fd)
@@ -269,6 +365,560 @@ writeheader(const char *file, int fd)
 	dowrite(file, fd, buf, sizeof(buf));
 }
 
+static
+void
+writeoverlayheader(const char *file, int fd,
+		   const struct diskfmt_overlay_header *oh)
+{
+	struct diskfmt_overlay_header noh;
+	char buf[SECTORSIZE];
+
+	noh = *oh;
+	noh.oh_version = htonl(noh.oh_version);
+	noh.oh_sectors = htonl(noh.oh_sectors);
+	noh.oh_bitmapstart = htonl(noh.oh_bitmapstart);
+	noh.oh_bitmapsectors = htonl(noh.oh_bitmapsectors);
+	noh.oh_datastart = htonl(noh.oh_datastart);
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &noh, sizeof(noh));
+
+	dolseek(file, fd, 0, SEEK_SET);
+	dowrite(file, fd, buf, sizeof(buf));
+}
+
+static
+unsigned char *
+readbitmap(const char *file, int fd, const struct diskfmt_overlay_header *oh)
+{
+	unsigned char *bitmap;
+	size_t len;
+
+	len = (size_t)oh->oh_bitmapsectors * SECTORSIZE;
+	bitmap = malloc(len);
+	if (bitmap == NULL) {
+		fprintf(stderr, "disk161: Out of memory\n");
+		exit(1);
+	}
+	dolseek(file, fd, (off_t)oh->oh_bitmapstart * SECTORSIZE, SEEK_SET);
+	doread(file, fd, bitmap, len);
+	return bitmap;
+}
+
+static
+uint32_t
+countbits(const unsigned char *bitmap, uint32_t nsectors)
+{
+	uint32_t i, n = 0;
+
+	for (i=0; i<nsectors; i++) {
+		if (bitmap[i/8] & (1 << (i%8))) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static
+void *
+domalloc(size_t len)
+{
+	void *p;
+
+	p = malloc(len);
+	if (p == NULL) {
+		fprintf(stderr, "disk161: Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static
+struct diskfmt_sparse_entry *
+readtable(const char *file, int fd, const struct diskfmt_sparse_header *sh)
+{
+	struct diskfmt_sparse_entry *table;
+	uint32_t i, n;
+
+	n = DISKFMT_NCLUSTERS(sh->sh_sectors, sh->sh_clustersectors);
+	table = domalloc((size_t)sh->sh_tablesectors * SECTORSIZE);
+	dolseek(file, fd, (off_t)sh->sh_tablestart * SECTORSIZE, SEEK_SET);
+	doread(file, fd, table, (size_t)sh->sh_tablesectors * SECTORSIZE);
+	for (i=0; i<n; i++) {
+		table[i].se_start = ntohl(table[i].se_start);
+		table[i].se_length = ntohl(table[i].se_length);
+		if ((table[i].se_length & DISKFMT_SPARSE_LENGTH) >
+		    sh->sh_clustersectors * SECTORSIZE) {
+			fprintf(stderr, "disk161: %s: Corrupt cluster "
+				"table\n", file);
+			exit(1);
+		}
+	}
+	return table;
+}
+
+////////////////////////////////////////////////////////////
+// reading images of any kind
+
+struct image {
+	const char *im_file;
+	int im_fd;
+	int im_kind;
+	uint32_t im_sectors;
+
+	/* overlays */
+	struct diskfmt_overlay_header im_oh;
+	unsigned char *im_bitmap;
+	struct image *im_base;
+
+	/* sparse images */
+	struct diskfmt_sparse_header im_sh;
+	struct diskfmt_sparse_entry *im_table;
+	char *im_cluster;
+	char *im_cbuf;
+	uint32_t im_cached;
+};
+
+static struct image *image_open(const char *file);
+
+/*
+ * Read an image from FD, which the caller has already locked. The
+ * image owns FD from then on; image_close unlocks and closes it.
+ */
+static
+struct image *
+image_openfd(const char *file, int fd)
+{
+	struct image *im;
+	char buf[SECTORSIZE];
+
+	im = domalloc(sizeof(*im));
+	im->im_file = file;
+	im->im_fd = fd;
+	im->im_bitmap = NULL;
+	im->im_base = NULL;
+	im->im_table = NULL;
+	im->im_cluster = NULL;
+	im->im_cbuf = NULL;
+	im->im_cached = 0xffffffff;
+
+	im->im_kind = readheader(file, im->im_fd, buf);
+	switch (im->im_kind) {
+	    case IMG_RAW:
+		im->im_sectors =
+			(filesize(file, im->im_fd) - HEADERSIZE) / SECTORSIZE;
+		break;
+	    case IMG_OVERLAY:
+		getoverlayheader(file, buf, &im->im_oh);
+		im->im_sectors = im->im_oh.oh_sectors;
+		im->im_bitmap = readbitmap(file, im->im_fd, &im->im_oh);
+		im->im_base = image_open(im->im_oh.oh_base);
+		if (im->im_base->im_kind != IMG_RAW ||
+		    im->im_base->im_sectors != im->im_sectors) {
+			fprintf(stderr, "disk161: %s: Base image %s does not "
+				"match\n", file, im->im_oh.oh_base);
+			exit(1);
+		}
+		break;
+	    case IMG_SPARSE:
+		getsparseheader(file, buf, &im->im_sh);
+		im->im_sectors = im->im_sh.sh_sectors;
+		im->im_table = readtable(file, im->im_fd, &im->im_sh);
+		im->im_cluster = domalloc(im->im_sh.sh_clustersectors *
+					  SECTORSIZE);
+		im->im_cbuf = domalloc(im->im_sh.sh_clustersectors *
+				       SECTORSIZE);
+		break;
+	}
+	return im;
+}
+
+static
+struct image *
+image_open(const char *file)
+{
+	int fd;
+
+	fd = doopen(file, O_RDONLY, 0);
+	doflock(file, fd, LOCK_SH);
+	return image_openfd(file, fd);
+}
+
+static
+void
+image_close(struct image *im)
+{
+	if (im->im_base != NULL) {
+		image_close(im->im_base);
+	}
+	doflock(im->im_file, im->im_fd, LOCK_UN);
+	close(im->im_fd);
+	free(im->im_bitmap);
+	free(im->im_table);
+	free(im->im_cluster);
+	free(im->im_cbuf);
+	free(im);
+}
+
+static
+void
+image_readsector(struct image *im, uint32_t sect, char *buf)
+{
+	struct diskfmt_sparse_entry *se;
+	uint32_t cl, within;
+	size_t len;
+	off_t pos;
+
+	switch (im->im_kind) {
+	    case IMG_RAW:
+		pos = HEADERSIZE + (off_t)sect * SECTORSIZE;
+		break;
+	    case IMG_OVERLAY:
+		if ((im->im_bitmap[sect/8] & (1 << (sect%8))) == 0) {
+			image_readsector(im->im_base, sect, buf);
+			return;
+		}
+		pos = ((off_t)im->im_oh.oh_datastart + sect) * SECTORSIZE;
+		break;
+	    case IMG_SPARSE:
+	    default:
+		cl = sect / im->im_sh.sh_clustersectors;
+		within = sect % im->im_sh.sh_clustersectors;
+		se = &im->im_table[cl];
+		if (se->se_start == 0) {
+			memset(buf, 0, SECTORSIZE);
+			return;
+		}
+		if ((se->se_length & DISKFMT_SPARSE_COMPRESSED) == 0) {
+			pos = ((off_t)se->se_start + within) * SECTORSIZE;
+			break;
+		}
+		if (im->im_cached != cl) {
+#ifdef HAS_ZLIB
+			uLongf outlen;
+
+			len = se->se_length & DISKFMT_SPARSE_LENGTH;
+			dolseek(im->im_file, im->im_fd,
+				(off_t)se->se_start * SECTORSIZE, SEEK_SET);
+			doread(im->im_file, im->im_fd, im->im_cbuf, len);
+			outlen = im->im_sh.sh_clustersectors * SECTORSIZE;
+			if (uncompress((Bytef *)im->im_cluster, &outlen,
+				       (const Bytef *)im->im_cbuf, len)
+			    != Z_OK ||
+			    outlen != im->im_sh.sh_clustersectors *
+			    SECTORSIZE) {
+				fprintf(stderr, "disk161: %s: Cluster %u: "
+					"Decompression failed\n",
+					im->im_file, cl);
+				exit(1);
+			}
+			im->im_cached = cl;
+#else
+			(void)len;
+			fprintf(stderr, "disk161: %s: Compressed images "
+				"are not supported in this build\n",
+				im->im_file);
+			exit(1);
+#endif
+		}
+		memcpy(buf, im->im_cluster + within * SECTORSIZE, SECTORSIZE);
+		return;
+	}
+
+	dolseek(im->im_file, im->im_fd, pos, SEEK_SET);
+	doread(im->im_file, im->im_fd, buf, SECTORSIZE);
+}
+
+static
+int
+iszero(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (buf[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+// writing images
+
+/*
+ * Write a raw image, leaving sectors of zeros as holes.
+ */
+static
+void
+writeraw(const char *file, int fd, struct image *im)
+{
+	char buf[SECTORSIZE];
+	uint32_t i;
+
+	dotruncate(file, fd, 0);
+	dotruncate(file, fd, HEADERSIZE + (off_t)im->im_sectors * SECTORSIZE);
+	writeheader(file, fd);
+	for (i=0; i<im->im_sectors; i++) {
+		image_readsector(im, i, buf);
+		if (iszero(buf, sizeof(buf))) {
+			continue;
+		}
+		dolseek(file, fd, HEADERSIZE + (off_t)i * SECTORSIZE,
+			SEEK_SET);
+		dowrite(file, fd, buf, sizeof(buf));
+	}
+}
+
+/*
+ * Write a sparse image. Clusters of zeros are left unallocated. If
+ * COMPRESS is set, clusters that shrink by at least a sector when
+ * compressed are stored compressed.
+ */
+static
+void
+writesparse(const char *file, int fd, struct image *im,
+	    uint32_t clustersectors, int compress)
+{
+	struct diskfmt_sparse_header sh;
+	struct diskfmt_sparse_entry *table;
+	char buf[SECTORSIZE];
+	char *cluster, *cbuf;
+	size_t clustersize, len;
+	uint32_t ncl, cl, i, end;
+
+	clustersize = (size_t)clustersectors * SECTORSIZE;
+	ncl = DISKFMT_NCLUSTERS(im->im_sectors, clustersectors);
+
+	memset(&sh, 0, sizeof(sh));
+	strcpy(sh.sh_magic, DISKFMT_SPARSE_MAGIC);
+	sh.sh_version = htonl(DISKFMT_SPARSE_VERSION);
+	sh.sh_sectors = htonl(im->im_sectors);
+	sh.sh_clustersectors = htonl(clustersectors);
+	sh.sh_tablestart = htonl(1);
+	sh.sh_tablesectors = htonl(DISKFMT_TABLESECTORS(ncl));
+
+	table = domalloc(DISKFMT_TABLESECTORS(ncl) * SECTORSIZE);
+	memset(table, 0, DISKFMT_TABLESECTORS(ncl) * SECTORSIZE);
+	cluster = domalloc(clustersize);
+#ifdef HAS_ZLIB
+	cbuf = domalloc(compressBound(clustersize));
+#else
+	cbuf = NULL;
+	if (compress) {
+		fprintf(stderr, "disk161: Compression is not supported in "
+			"this build\n");
+		exit(1);
+	}
+#endif
+
+	dotruncate(file, fd, 0);
+	end = 1 + DISKFMT_TABLESECTORS(ncl);
+
+	for (cl=0; cl<ncl; cl++) {
+		memset(cluster, 0, clustersize);
+		for (i=0; i<clustersectors; i++) {
+			if (cl * clustersectors + i >= im->im_sectors) {
+				break;
+			}
+			image_readsector(im, cl * clustersectors + i, buf);
+			memcpy(cluster + i * SECTORSIZE, buf, SECTORSIZE);
+		}
+		if (iszero(cluster, clustersize)) {
+			continue;
+		}
+
+		len = clustersize;
+#ifdef HAS_ZLIB
+		if (compress) {
+			uLongf clen = compressBound(clustersize);
+
+			if (compress2((Bytef *)cbuf, &clen,
+				      (const Bytef *)cluster, clustersize,
+				      Z_BEST_COMPRESSION) == Z_OK &&
+			    clen + SECTORSIZE <= clustersize) {
+				len = clen;
+			}
+		}
+#endif
+		dolseek(file, fd, (off_t)end * SECTORSIZE, SEEK_SET);
+		if (len < clustersize) {
+			dowrite(file, fd, cbuf, len);
+			table[cl].se_length =
+				htonl(len | DISKFMT_SPARSE_COMPRESSED);
+		}
+		else {
+			dowrite(file, fd, cluster, clustersize);
+			table[cl].se_length = htonl(clustersize);
+		}
+		table[cl].se_start = htonl(end);
+		end += (len + SECTORSIZE - 1) / SECTORSIZE;
+	}
+
+	/* make the file a whole number of sectors */
+	dotruncate(file, fd, (off_t)end * SECTORSIZE);
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &sh, sizeof(sh));
+	dolseek(file, fd, 0, SEEK_SET);
+	dowrite(file, fd, buf, sizeof(buf));
+	dowrite(file, fd, table, DISKFMT_TABLESECTORS(ncl) * SECTORSIZE);
+
+	free(table);
+	free(cluster);
+	free(cbuf);
+}
+
+static
+uint32_t
+getclustersize(const char *clusterspec)
+{
+	off_t size;
+
+	if (clusterspec == NULL) {
+		return DEFAULT_CLUSTER / SECTORSIZE;
+	}
+	size = getsize(clusterspec);
+	if (size < SECTORSIZE || size % SECTORSIZE ||
+	    size > DISKFMT_SPARSE_MAXCLUSTER * SECTORSIZE) {
+		fprintf(stderr, "disk161: Invalid cluster size %s\n",
+			clusterspec);
+		exit(1);
+	}
+	return size / SECTORSIZE;
+}
+
+////////////////////////////////////////////////////////////
+// convert
+
+static
+void
+doconvert(const char *infile, const char *outfile, int doforce,
+	  int toraw, int compress, const char *clusterspec)
+{
+	struct image *im;
+	uint32_t clustersectors;
+	int fd;
+
+	clustersectors = getclustersize(clusterspec);
+	if (toraw && (compress || clusterspec != NULL)) {
+		fprintf(stderr, "disk161: Raw images cannot be compressed\n");
+		exit(1);
+	}
+
+	im = image_open(infile);
+
+	if (!doforce) {
+		fd = open(outfile, O_RDONLY);
+		if (fd >= 0) {
+			fprintf(stderr, "disk161: %s: %s\n", outfile,
+				strerror(EEXIST));
+			exit(1);
+		}
+	}
+
+	fd = doopen(outfile, O_RDWR|O_CREAT, 0664);
+	doflock(outfile, fd, LOCK_EX);
+	if (toraw) {
+		writeraw(outfile, fd, im);
+	}
+	else {
+		writesparse(outfile, fd, im, clustersectors, compress);
+	}
+	doflock(outfile, fd, LOCK_UN);
+	close(fd);
+
+	image_close(im);
+}
+
+////////////////////////////////////////////////////////////
+// compact
+
+/*
+ * Rewrite an image in place (via a temporary file) in the same
+ * format, dropping all-zero data and, for sparse images, space left
+ * behind by rewritten clusters. Overlays aren't handled; merge them
+ * or convert them instead. COMPRESS is 1 or 0 to force compression on
+ * or off, or -1 to keep a sparse image compressed if any of it is.
+ */
+static
+void
+docompact(const char *file, int compress, const char *clusterspec)
+{
+	struct image *im;
+	char *tmpfile;
+	uint32_t clustersectors, ncl, i;
+	int fd, lockfd;
+
+	/*
+	 * Hold an exclusive lock on the old file until the new one has
+	 * replaced it, so nobody can write to it in between.
+	 */
+	lockfd = doopen(file, O_RDWR, 0);
+	doflock(file, lockfd, LOCK_EX);
+	im = image_openfd(file, lockfd);
+	if (im->im_kind == IMG_OVERLAY) {
+		fprintf(stderr, "disk161: %s: Cannot compact an overlay\n",
+			file);
+		exit(1);
+	}
+	if (im->im_kind == IMG_RAW && (compress > 0 || clusterspec != NULL)) {
+		fprintf(stderr, "disk161: %s: Raw images cannot be "
+			"compressed; use convert\n", file);
+		exit(1);
+	}
+	if (im->im_kind == IMG_SPARSE && clusterspec == NULL) {
+		clustersectors = im->im_sh.sh_clustersectors;
+	}
+	else {
+		clustersectors = getclustersize(clusterspec);
+	}
+	if (compress < 0) {
+		/* neither -z nor -u: stay compressed if it was */
+		compress = 0;
+		if (im->im_kind == IMG_SPARSE) {
+			ncl = DISKFMT_NCLUSTERS(im->im_sectors,
+						im->im_sh.sh_clustersectors);
+			for (i=0; i<ncl; i++) {
+				if (im->im_table[i].se_length &
+				    DISKFMT_SPARSE_COMPRESSED) {
+					compress = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	tmpfile = domalloc(strlen(file) + 8);
+	strcpy(tmpfile, file);
+	strcat(tmpfile, ".tmp161");
+
+	fd = doopen(tmpfile, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	doflock(tmpfile, fd, LOCK_EX);
+	if (im->im_kind == IMG_RAW) {
+		writeraw(tmpfile, fd, im);
+	}
+	else {
+		writesparse(tmpfile, fd, im, clustersectors, compress);
+	}
+	if (fsync(fd) == -1) {
+		fprintf(stderr, "disk161: %s: fsync: %s\n", tmpfile,
+			strerror(errno));
+		exit(1);
+	}
+	if (rename(tmpfile, file) == -1) {
+		fprintf(stderr, "disk161: %s: rename: %s\n", tmpfile,
+			strerror(errno));
+		unlink(tmpfile);
+		exit(1);
+	}
+	doflock(tmpfile, fd, LOCK_UN);
+	close(fd);
+
+	image_close(im);
+	free(tmpfile);
+}
+
 ////////////////////////////////////////////////////////////
 // create
 
@@ -298,29 +948,199 @@ docreate(const char *file, const char *sizespec, int doforce)
 	close(fd);
 }
 
+////////////////////////////////////////////////////////////
+// overlay
+
+static
+void
+dooverlay(const char *file, const char *base, int doforce)
+{
+	struct diskfmt_overlay_header oh;
+	int fd, basefd;
+	off_t size;
+
+	if (strlen(base) >= DISKFMT_PATHLEN) {
+		fprintf(stderr, "disk161: %s: Path too long\n", base);
+		exit(1);
+	}
+
+	basefd = doopen(base, O_RDONLY, 0);
+	doflock(base, basefd, LOCK_SH);
+	checkheader(base, basefd);
+	size = filesize(base, basefd) - HEADERSIZE;
+	checksize(size);
+
+	if (!doforce) {
+		fd = open(file, O_RDONLY);
+		if (fd >= 0) {
+			fprintf(stderr, "disk161: %s: %s\n", file,
+				strerror(EEXIST));
+			exit(1);
+		}
+	}
+
+	memset(&oh, 0, sizeof(oh));
+	strcpy(oh.oh_magic, DISKFMT_OVERLAY_MAGIC);
+	oh.oh_version = DISKFMT_OVERLAY_VERSION;
+	oh.oh_sectors = size / SECTORSIZE;
+	oh.oh_bitmapstart = 1;
+	oh.oh_bitmapsectors = DISKFMT_BITMAPSECTORS(oh.oh_sectors);
+	oh.oh_datastart = oh.oh_bitmapstart + oh.oh_bitmapsectors;
+	strcpy(oh.oh_base, base);
+
+	fd = doopen(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	doflock(file, fd, LOCK_EX);
+	/* Leaves the bitmap and data area as a hole, i.e. all zeros */
+	dotruncate(file, fd, (off_t)oh.oh_datastart * SECTORSIZE + size);
+	writeoverlayheader(file, fd, &oh);
+	doflock(file, fd, LOCK_UN);
+	close(fd);
+
+	doflock(base, basefd, LOCK_UN);
+	close(basefd);
+}
+
+////////////////////////////////////////////////////////////
+// merge
+
+/*
+ * Copy the sectors written in an overlay back into its base image,
+ * then empty the overlay.
+ */
+static
+void
+domerge(const char *file, const char *base)
+{
+	struct diskfmt_overlay_header oh;
+	unsigned char *bitmap;
+	char buf[SECTORSIZE];
+	int fd, basefd;
+	off_t size;
+	uint32_t i, n;
+
+	fd = doopen(file, O_RDWR, 0);
+	doflock(file, fd, LOCK_EX);
+	if (readheader(file, fd, buf) != IMG_OVERLAY) {
+		fprintf(stderr, "disk161: %s: Not an overlay\n", file);
+		exit(1);
+	}
+	getoverlayheader(file, buf, &oh);
+	if (base == NULL) {
+		base = oh.oh_base;
+	}
+
+	basefd = doopen(base, O_RDWR, 0);
+	doflock(base, basefd, LOCK_EX);
+	checkheader(base, basefd);
+	size = filesize(base, basefd) - HEADERSIZE;
+	if (size != (off_t)oh.oh_sectors * SECTORSIZE) {
+		fprintf(stderr, "disk161: %s: Size does not match overlay "
+			"%s\n", base, file);
+		exit(1);
+	}
+
+	bitmap = readbitmap(file, fd, &oh);
+	n = 0;
+	for (i=0; i<oh.oh_sectors; i++) {
+		if ((bitmap[i/8] & (1 << (i%8))) == 0) {
+			continue;
+		}
+		dolseek(file, fd,
+			((off_t)oh.oh_datastart + i) * SECTORSIZE, SEEK_SET);
+		doread(file, fd, buf, sizeof(buf));
+		dolseek(base, basefd, HEADERSIZE + (off_t)i * SECTORSIZE,
+			SEEK_SET);
+		dowrite(base, basefd, buf, sizeof(buf));
+		n++;
+	}
+	if (fsync(basefd) == -1) {
+		fprintf(stderr, "disk161: %s: fsync: %s\n", base,
+			strerror(errno));
+		exit(1);
+	}
+	doflock(base, basefd, LOCK_UN);
+	close(basefd);
+
+	/*
+	 * Now empty the overlay: truncating away the bitmap and data
+	 * and then extending again leaves them as a zero-filled hole.
+	 */
+	dotruncate(file, fd, (off_t)oh.oh_bitmapstart * SECTORSIZE);
+	dotruncate(file, fd, (off_t)oh.oh_datastart * SECTORSIZE + size);
+	doflock(file, fd, LOCK_UN);
+	close(fd);
+	free(bitmap);
+
+	printf("%s: merged %lu sectors into %s\n", file, (unsigned long)n,
+	       base);
+}
+
 ////////////////////////////////////////////////////////////
 // info
 
+static
+void
+printamount(const char *file, const char *what, long long amt)
+{
+	printf("%s %s %lld bytes (%lld sectors; %lldK; %lldM)\n", file, what,
+	       amt, amt / SECTORSIZE, amt / 1024, amt / (1024*1024));
+}
+
 static
 void
 doinfo(const char *file)
 {
+	struct diskfmt_overlay_header oh;
+	struct diskfmt_sparse_header sh;
+	struct diskfmt_sparse_entry *table;
+	unsigned char *bitmap;
+	char buf[SECTORSIZE];
+	uint32_t ncl, i, nalloc, ncomp;
+	long long stored;
 	int fd;
 	struct stat st;
-	long long amt;
 
 	fd = doopen(file, O_RDWR, 0);
-	checkheader(file, fd);
 	dofstat(file, fd, &st);
+	switch (readheader(file, fd, buf)) {
+	    case IMG_RAW:
+		printamount(file, "size", st.st_size - HEADERSIZE);
+		break;
+	    case IMG_OVERLAY:
+		getoverlayheader(file, buf, &oh);
+		bitmap = readbitmap(file, fd, &oh);
+		printf("%s overlay on %s\n", file, oh.oh_base);
+		printamount(file, "size", oh.oh_sectors * (long long)SECTORSIZE);
+		printamount(file, "written", countbits(bitmap, oh.oh_sectors)
+			    * (long long)SECTORSIZE);
+		free(bitmap);
+		break;
+	    case IMG_SPARSE:
+		getsparseheader(file, buf, &sh);
+		table = readtable(file, fd, &sh);
+		ncl = DISKFMT_NCLUSTERS(sh.sh_sectors, sh.sh_clustersectors);
+		nalloc = ncomp = 0;
+		stored = 0;
+		for (i=0; i<ncl; i++) {
+			if (table[i].se_start == 0) {
+				continue;
+			}
+			nalloc++;
+			if (table[i].se_length & DISKFMT_SPARSE_COMPRESSED) {
+				ncomp++;
+			}
+			stored += table[i].se_length & DISKFMT_SPARSE_LENGTH;
+		}
+		printf("%s sparse, %u-sector clusters, %u of %u allocated, "
+		       "%u compressed\n", file, sh.sh_clustersectors,
+		       nalloc, ncl, ncomp);
+		printamount(file, "size", sh.sh_sectors * (long long)SECTORSIZE);
+		printamount(file, "stored", stored);
+		free(table);
+		break;
+	}
 
-	amt = st.st_size - HEADERSIZE;
-	printf("%s size %lld bytes (%lld sectors; %lldK; %lldM)\n", file,
-	       amt, amt / SECTORSIZE, amt / 1024, amt / (1024*1024));
-	
-
-	amt = st.st_blocks * 512LL;
-	printf("%s spaceused %lld bytes (%lld sectors; %lldK; %lldM)\n", file,
-	       amt, amt / SECTORSIZE, amt / 1024, amt / (1024*1024));
+	printamount(file, "spaceused", st.st_blocks * 512LL);
 
 	close(fd);
 }
@@ -392,6 +1212,12 @@ usage(void)
 	fprintf(stderr, "   disk161 create [-f] filename size\n"); 
 	fprintf(stderr, "   disk161 info filename...\n");
 	fprintf(stderr, "   disk161 resize filename [+-]size\n");
+	fprintf(stderr, "   disk161 overlay [-f] filename basefile\n");
+	fprintf(stderr, "   disk161 merge filename [basefile]\n");
+	fprintf(stderr, "   disk161 convert [-f] [-r | -z] [-c clustersize] "
+		"infile outfile\n");
+	fprintf(stderr, "   disk161 compact [-u | -z] [-c clustersize] "
+		"filename...\n");
 	exit(3);
 }
 
@@ -399,7 +1225,8 @@ int
 main(int argc, char *argv[])
 {
 	const char *command;
-	int doforce = 0;
+	const char *clusterspec = NULL;
+	int doforce = 0, toraw = 0, compress = 0, nocompress = 0;
 	int ch;
 	int i;
 
@@ -411,13 +1238,26 @@ main(int argc, char *argv[])
 	argv++;
 	argc--;
 
-	while ((ch = getopt(argc, argv, "f"))!=-1) {
+	while ((ch = getopt(argc, argv, "c:fruz"))!=-1) {
 		switch (ch) {
+		    case 'c': clusterspec = optarg; break;
 		    case 'f': doforce = 1; break;
+		    case 'r': toraw = 1; break;
+		    case 'u': nocompress = 1; break;
+		    case 'z': compress = 1; break;
 		    default: usage();
 		}
 	}
 
+	if (nocompress && (compress || strcmp(command, "compact") != 0)) {
+		usage();
+	}
+	if ((toraw || compress || clusterspec != NULL) &&
+	    strcmp(command, "convert") != 0 &&
+	    strcmp(command, "compact") != 0) {
+		usage();
+	}
+
 	if (!strcmp(command, "create")) {
 		if (optind + 2 != argc) {
 			usage();
@@ -442,6 +1282,38 @@ main(int argc, char *argv[])
 		}
 		doresize(argv[optind], argv[optind+1]);
 	}
+	else if (!strcmp(command, "overlay")) {
+		if (optind + 2 != argc) {
+			usage();
+		}
+		dooverlay(argv[optind], argv[optind+1], doforce);
+	}
+	else if (!strcmp(command, "merge")) {
+		if (optind + 1 != argc && optind + 2 != argc) {
+			usage();
+		}
+		if (doforce) {
+			usage();
+		}
+		domerge(argv[optind], optind + 2 == argc ? argv[optind+1] : NULL);
+	}
+	else if (!strcmp(command, "convert")) {
+		if (optind + 2 != argc) {
+			usage();
+		}
+		doconvert(argv[optind], argv[optind+1], doforce,
+			  toraw, compress, clusterspec);
+	}
+	else if (!strcmp(command, "compact")) {
+		if (optind >= argc || doforce || toraw) {
+			usage();
+		}
+		for (i=optind; i<argc; i++) {
+			docompact(argv[i],
+				  compress ? 1 : nocompress ? 0 : -1,
+				  clusterspec);
+		}
+	}
 	else if (!strcmp(command, "help")) {
 		usage();
 	}
@@ -7,6 +7,15 @@ extern uint32_t cpu_running_mask;
 /* number of cycles into cpu_cycles() */
 extern uint64_t cpu_cycles_count;
 
+/*
+ * Turn on the L1 cache model: SIZE bytes each of icache and dcache,
+ * WAYS-way set associative with LINESIZE-byte lines, replacing lines
+ * LRU or at random, with MISSCYCLES cycles of stall per miss. Call
+ * before cpu_init. Dies if the geometry can't be reported in CONFIG1.
+ */
+void cpu_setcache(uint32_t size, unsigned ways, unsigned linesize,
+		  int randomrepl, unsigned misscycles);
+
 void cpu_init(unsigned numcpus);
 uint64_t cpu_cycles(uint64_t maxcycles); /* returns cycles spent */
 void cpu_stopcycling(void); /* stops cpu_cycles() */
@@ -44,7 +53,12 @@ void cpudebug_get_bp_region(uint32_t *start, uint32_t *end);
 void cpudebug_getregs(unsigned cpunum, uint32_t *regs, int maxregs,
 		      int *nregs);
 
-/* Functions used by the profiling code */
-uint32_t cpuprof_sample(void);
+/*
+ * Functions used by the profiling code: get the pc and current address
+ * space id of a cpu (fails if the cpu hasn't been started), and its
+ * stack pointer and return address registers (for unwinding).
+ */
+int cpuprof_sample(unsigned cpunum, uint32_t *pc, uint32_t *asid);
+void cpuprof_stackregs(unsigned cpunum, uint32_t *sp, uint32_t *ra);
 
 #endif /* CPU_H */
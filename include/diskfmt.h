@@ -0,0 +1,99 @@
+#ifndef DISKFMT_H
+#define DISKFMT_H
+
+/*
+ * On-disk formats of System/161 disk image files. Shared between the
+ * disk device (bus/dev_disk.c) and disk161 (disktool/disk161.c).
+ *
+ * Every image file begins with a one-sector header whose first bytes
+ * are a null-terminated signature string saying what kind of image
+ * it is. Multibyte fields in headers are stored big-endian (network
+ * byte order) regardless of the host.
+ *
+ * You must have uint32_t defined before including this file.
+ */
+
+#define DISKFMT_SECTSIZE	512
+#define DISKFMT_HEADERSIZE	DISKFMT_SECTSIZE
+
+/*
+ * Plain raw image: the header sector followed by the sectors of the
+ * disk in order.
+ */
+#define DISKFMT_RAW_MAGIC	"System/161 Disk Image"
+
+/*
+ * Copy-on-write overlay on top of a raw base image. The overlay holds
+ * only the sectors written since it was created; everything else is
+ * read from the base image, which is not modified. After the header
+ * comes a bitmap with one bit per sector (set if the overlay has its
+ * own copy of the sector; bit 0 of byte 0 is sector 0), padded to a
+ * whole number of sectors, and then a data area laid out like a raw
+ * image. The file is created sparse, so unwritten sectors of the data
+ * area take no space.
+ *
+ * oh_base is the path of the base image as given when the overlay
+ * was created; it is used if no other base image is specified.
+ */
+#define DISKFMT_OVERLAY_MAGIC	"System/161 Disk Overlay"
+#define DISKFMT_OVERLAY_VERSION	1
+#define DISKFMT_MAGICLEN	64
+#define DISKFMT_PATHLEN		256
+
+struct diskfmt_overlay_header {
+	char oh_magic[DISKFMT_MAGICLEN];
+	uint32_t oh_version;
+	uint32_t oh_sectors;		/* size of virtual disk in sectors */
+	uint32_t oh_bitmapstart;	/* first sector of bitmap */
+	uint32_t oh_bitmapsectors;	/* length of bitmap in sectors */
+	uint32_t oh_datastart;		/* sector where data area begins */
+	char oh_base[DISKFMT_PATHLEN];	/* path to base image */
+};
+
+/* Number of sectors needed for the bitmap of a disk of N sectors */
+#define DISKFMT_BITMAPSECTORS(n) \
+	(((n) + DISKFMT_SECTSIZE*8 - 1) / (DISKFMT_SECTSIZE*8))
+
+/*
+ * Sparse image: the disk is divided into clusters of sh_clustersectors
+ * sectors, and a table (sh_tablestart, sh_tablesectors long) gives for
+ * each cluster in order where its data is stored in the file. An
+ * entry with se_start 0 is an unallocated cluster, which reads as
+ * zeros. Otherwise the cluster's data begins at sector se_start of
+ * the file and is se_length bytes long; if DISKFMT_SPARSE_COMPRESSED
+ * is set it is zlib-compressed, otherwise it is the full cluster.
+ *
+ * Clusters are only ever appended; rewriting a compressed cluster
+ * moves it to the end of the file uncompressed, leaving the old copy
+ * as garbage until "disk161 compact" is run.
+ */
+#define DISKFMT_SPARSE_MAGIC	"System/161 Sparse Disk Image"
+#define DISKFMT_SPARSE_VERSION	1
+#define DISKFMT_SPARSE_MAXCLUSTER 128	/* sectors */
+
+struct diskfmt_sparse_header {
+	char sh_magic[DISKFMT_MAGICLEN];
+	uint32_t sh_version;
+	uint32_t sh_sectors;		/* size of virtual disk in sectors */
+	uint32_t sh_clustersectors;	/* sectors per cluster */
+	uint32_t sh_tablestart;		/* first sector of cluster table */
+	uint32_t sh_tablesectors;	/* length of table in sectors */
+};
+
+struct diskfmt_sparse_entry {
+	uint32_t se_start;		/* sector in file; 0 if none */
+	uint32_t se_length;		/* length in bytes, plus flag */
+};
+
+#define DISKFMT_SPARSE_COMPRESSED	0x80000000
+#define DISKFMT_SPARSE_LENGTH		0x7fffffff
+
+/* Number of clusters in a disk of N sectors with C sectors per cluster */
+#define DISKFMT_NCLUSTERS(n, c)	(((n) + (c) - 1) / (c))
+
+/* Number of sectors needed for the table of a disk with N clusters */
+#define DISKFMT_TABLESECTORS(n) \
+	(((n) * sizeof(struct diskfmt_sparse_entry) + DISKFMT_SECTSIZE - 1) \
+	 / DISKFMT_SECTSIZE)
+
+#endif /* DISKFMT_H */
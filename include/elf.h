@@ -161,9 +161,60 @@ typedef struct {
 #define	PF_W		0x2	/* Segment is writable */
 #define	PF_X		0x1	/* Segment is executable */
 
+/*
+ * Section header. Only used to find the symbol table, for profiling.
+ * There are Ehdr.e_shnum of these, starting at Ehdr.e_shoff.
+ */
+typedef struct {
+	uint32_t	sh_name;     /* Section name (string table offset) */
+	uint32_t	sh_type;     /* Type of section */
+	uint32_t	sh_flags;    /* Flags */
+	uint32_t	sh_addr;     /* Address in memory, if loaded */
+	uint32_t	sh_offset;   /* Location of data within file */
+	uint32_t	sh_size;     /* Size of data */
+	uint32_t	sh_link;     /* For symbol tables, the string table */
+	uint32_t	sh_info;     /* Ignore */
+	uint32_t	sh_addralign; /* Ignore */
+	uint32_t	sh_entsize;  /* Size of entries, for tables */
+} Elf32_Shdr;
+
+/* values for sh_type (incomplete) */
+#define	SHT_NULL	0
+#define	SHT_PROGBITS	1
+#define	SHT_SYMTAB	2
+#define	SHT_STRTAB	3
+
+/*
+ * Symbol table entry.
+ */
+typedef struct {
+	uint32_t	st_name;     /* Name (string table offset) */
+	uint32_t	st_value;    /* Value (address) */
+	uint32_t	st_size;     /* Size of object, or 0 */
+	unsigned char	st_info;     /* Binding and type */
+	unsigned char	st_other;    /* Ignore */
+	uint16_t	st_shndx;    /* Section it's in */
+} Elf32_Sym;
+
+#define	ELF_ST_BIND(info)	((info) >> 4)
+#define	ELF_ST_TYPE(info)	((info) & 0xf)
+
+/* values for ELF_ST_TYPE (incomplete) */
+#define	STT_NOTYPE	0
+#define	STT_OBJECT	1
+#define	STT_FUNC	2
+#define	STT_SECTION	3
+#define	STT_FILE	4
+
+/* special values for st_shndx (incomplete) */
+#define	SHN_UNDEF	0
+#define	SHN_ABS		0xfff1
+
 
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
 
 
 #endif /* _ELF_H_ */
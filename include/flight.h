@@ -0,0 +1,55 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+/*
+ * Flight recorder. Always on, in sys161 as well as trace161: each cpu
+ * keeps the addresses of the last FLIGHT_NPCS instructions it ran and
+ * its last FLIGHT_NEVENTS exceptions, TLB writes, and interrupt
+ * changes, and there's a ring of the same size for device events.
+ * flight_dump writes all of it to flight.out.
+ */
+
+#define FLIGHT_NPCS	4096	/* must be a power of 2 */
+#define FLIGHT_NEVENTS	512	/* must be a power of 2 */
+
+/* cpu events */
+#define FLIGHT_EXN	1	/* a = code, b = epc, c = vaddr; name */
+#define FLIGHT_RFE	2	/* a = user mode, b = irqs on */
+#define FLIGHT_TLBW	3	/* a = index, b = entryhi, c = entrylo */
+#define FLIGHT_IRQ	4	/* a = lamebus, b = ipi, c = timer */
+/* device events */
+#define FLIGHT_SLOTIRQ	5	/* a = slot, b = on */
+#define FLIGHT_DISK	6	/* a = slot, b = write, c = sector */
+#define FLIGHT_NET	7	/* a = slot, b = send, c = length */
+
+struct flightevent {
+	uint64_t fe_time;		/* virtual time */
+	const char *fe_name;		/* static string, or NULL */
+	unsigned fe_kind;
+	uint32_t fe_a, fe_b, fe_c;
+};
+
+struct flightring {
+	uint32_t fr_pcs[FLIGHT_NPCS];
+	unsigned fr_pcpos;
+	struct flightevent fr_events[FLIGHT_NEVENTS];
+	unsigned fr_eventpos;
+};
+
+/* call after bus_config and before cpu_init */
+void flight_init(unsigned ncpus);
+void flight_cleanup(void);
+
+/* the cpu code keeps a pointer to its ring and records pcs directly */
+struct flightring *flight_cpuring(unsigned cpunum);
+#define FLIGHT_PC(fr, pc) \
+	((fr)->fr_pcs[(fr)->fr_pcpos++ & (FLIGHT_NPCS - 1)] = (pc))
+
+void flight_cpuevent(struct flightring *fr, unsigned kind, const char *name,
+		     uint32_t a, uint32_t b, uint32_t c);
+void flight_hwevent(unsigned kind, uint32_t a, uint32_t b, uint32_t c);
+
+/* write everything out, saying why */
+void flight_dump(const char *why);
+
+#endif /* FLIGHT_H */
@@ -46,6 +46,15 @@ struct stats_percpu {
 	uint64_t sp_okscs;    // successful SC instructions
 	uint64_t sp_badscs;   // failed SC instructions
 	uint64_t sp_syncs;    // SYNC instructions
+	/* L1 cache model; all 0 unless it's turned on */
+	uint64_t sp_ichits;   // icache hits
+	uint64_t sp_icmisses; // icache misses
+	uint64_t sp_dchits;   // dcache hits
+	uint64_t sp_dcmisses; // dcache misses
+	uint64_t sp_dcwbacks; // dcache lines written back
+	uint64_t sp_dcinvals; // dcache lines invalidated by other cpus
+	uint64_t sp_uncached; // uncached accesses
+	uint64_t sp_cstalls;  // cycles stalled for cache misses
 };
 
 struct stats {
@@ -57,6 +66,8 @@ struct stats {
 	uint32_t s_exns;     // total exceptions
 	uint32_t s_rsects;   // disk sectors read
 	uint32_t s_wsects;   // disk sectors written
+	uint32_t s_dchits;   // disk cache hits
+	uint32_t s_dcmisses; // disk cache misses
 	uint32_t s_rchars;   // console chars read
 	uint32_t s_wchars;   // console chars written
 	uint32_t s_remu;     // emufs reads
@@ -0,0 +1,45 @@
+#ifndef PCAPFMT_H
+#define PCAPFMT_H
+
+/*
+ * libpcap capture file format, as written by the network card's
+ * pcap= option (bus/dev_net.c) and hub161 -w (nethub/nethub.c).
+ *
+ * The file is a header followed by one record per frame; each record
+ * is a record header followed by the captured bytes. Unlike the disk
+ * formats, headers are in the byte order of the host that wrote them;
+ * readers tell which from the magic number. We use the nanosecond
+ * variant of the format, since that's the resolution of System/161's
+ * clock.
+ *
+ * Frames are stored whole, link-level header (struct linkheader, all
+ * fields big-endian) included. There's no registered link type for
+ * that, so we use the first of the ones reserved for private use.
+ *
+ * You must have uint16_t and uint32_t defined before including this
+ * file.
+ */
+
+#define PCAPFMT_MAGIC_NSEC	0xa1b23c4d
+#define PCAPFMT_VERSION_MAJOR	2
+#define PCAPFMT_VERSION_MINOR	4
+#define PCAPFMT_LINKTYPE_SYS161	147	/* LINKTYPE_USER0 */
+
+struct pcapfmt_filehdr {
+	uint32_t pf_magic;
+	uint16_t pf_major;
+	uint16_t pf_minor;
+	int32_t pf_thiszone;		/* always 0 (UTC) */
+	uint32_t pf_sigfigs;		/* always 0 */
+	uint32_t pf_snaplen;		/* max bytes captured per frame */
+	uint32_t pf_linktype;
+};
+
+struct pcapfmt_rechdr {
+	uint32_t pr_sec;
+	uint32_t pr_nsec;
+	uint32_t pr_caplen;		/* bytes stored in the file */
+	uint32_t pr_len;		/* length of the frame on the wire */
+};
+
+#endif /* PCAPFMT_H */
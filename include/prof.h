@@ -4,15 +4,34 @@
 /* call while loading the kernel image */
 void prof_addtext(uint32_t textbase, uint32_t textsize);
 
-/* call after loading the kernel image to turn on profiling */
-void prof_setup(void);
+/* likewise, for each function symbol in the image, and its path */
+void prof_addsym(uint32_t addr, uint32_t size, const char *name);
+void prof_setimage(const char *path);
 
-/* call on exit (or whenever, actually) to write gmon.out */
+/*
+ * call after loading the kernel image to turn on profiling; if EXACT,
+ * also count every cycle (see prof_cycle)
+ */
+void prof_setup(int exact);
+
+/* call on exit (or whenever, actually) to write gmon.out et al. */
 void prof_write(void);
 
 /* call from cpu code when a function-call instruction is reached */
 void prof_call(uint32_t frompc, uint32_t topc);
 
+/*
+ * call from cpu code on every cycle of every running cpu while
+ * prof_exact is set, with the pc being executed and what happened
+ */
+#define PROF_RETIRED	0	/* retired an instruction */
+#define PROF_TLBMISS	1	/* took a TLB miss exception */
+#define PROF_EXCEPTION	2	/* took some other exception */
+#define PROF_STALL	3	/* stalled (waiting for hi/lo) */
+extern int prof_exact;
+void prof_cycle(unsigned cpunum, uint32_t pc, uint32_t asid,
+		unsigned kind, int irqoff);
+
 /* call from ltrace to manipulate profiling state */
 void prof_enable(void);
 void prof_disable(void);
@@ -23,7 +23,8 @@
 #define SERIAL_FUDGE   25
 #define SERIAL_NSECS   (1000000000/((19200*(SERIAL_FUDGE))/10))
 
-// All emufs ops take 5ms.
+// By default all emufs ops take 5ms, regardless of size. This can be
+// changed with the latency= and bandwidth= options.
 #define EMUFS_NSECS    (5000000)
 
 // Profile at 1000 Hz for increased accuracy.
@@ -0,0 +1,16 @@
+/*
+ * Host-side helper threads.
+ *
+ * The simulated machine itself runs entirely on the main thread.
+ * Helper threads are only used to overlap host I/O with simulation;
+ * they must not call into the cpu, bus, clock, or console code.
+ *
+ * You must include <pthread.h> before this file.
+ */
+
+/*
+ * Start a helper thread with all signals blocked, so that they
+ * continue to be delivered to the main loop. Calls smoke() if it
+ * fails.
+ */
+void dothread(pthread_t *ret, void *(*func)(void *), void *data);
@@ -24,6 +24,34 @@ void set_traceflags(const char *letters);
 void print_traceflags(void);
 void print_traceflags_usage(void);
 
+/*
+ * Trace filters, also in trace.c. While g_tracefilter is set, the cpu
+ * code must call trace_filtercpu() at the start of each cycle; that
+ * sets or clears the cpu's bit in g_tracecpuok, which gates all its
+ * trace output. Device trace output is subject only to the time
+ * window, which trace_filterhw() checks.
+ */
+extern int g_tracefilter;
+extern uint32_t g_tracecpuok;
+
+void trace_filtercpu(unsigned cpunum, uint32_t pc, uint32_t asid,
+		     uint64_t ninsns);
+int trace_filterhw(void);
+
+void trace_addfilter(const char *spec);	/* command line; dies on error */
+void print_tracefilters(void);
+
+/* for dev_trace */
+void trace_clearfilters(void);
+void trace_filtercpus(uint32_t mask);
+void trace_filterasid(uint32_t asid);
+int trace_filterpc(uint32_t lo, uint32_t hi);	/* -1 if too many */
+void trace_filterpclo(uint32_t lo);
+int trace_filterpchi(uint32_t hi);		/* -1 if too many */
+void trace_filtertime(uint64_t from, uint64_t to);
+
+#define TRACE_CPUOK(cn)	((g_tracecpuok >> (cn)) & 1)
+
 
 /*
  * These five functions are actually in console.c.
@@ -32,22 +60,30 @@ void print_traceflags_usage(void);
  * hwtrace: issue a trace message from a hardware device (not per-cpu)
  * cputrace: issue a trace message from a CPU
  * hwtracel/cputracel: same but without an implicit newline added
+ *
+ * K is the DOTRACE_* category, which is recorded in binary traces.
  */
 
 void set_tracefile(const char *filename);
-void hwtrace(const char *fmt, ...) PF(1,2);
-void hwtracel(const char *fmt, ...) PF(1,2);
-void cputrace(unsigned cpunum, const char *fmt, ...) PF(2,3);
-void cputracel(unsigned cpunum, const char *fmt, ...) PF(2,3);
+void hwtrace(int k, const char *fmt, ...) PF(2,3);
+void hwtracel(int k, const char *fmt, ...) PF(2,3);
+void cputrace(int k, unsigned cpunum, const char *fmt, ...) PF(3,4);
+void cputracel(int k, unsigned cpunum, const char *fmt, ...) PF(3,4);
 
 
 #define CPUTRACEL(k, cn, ...) \
-	(g_traceflags[(k)] ? cputracel(cn, __VA_ARGS__) : (void)0)
+	((g_traceflags[(k)] && TRACE_CPUOK(cn)) ? \
+	 cputracel((k), cn, __VA_ARGS__) : (void)0)
 #define CPUTRACE(k, cn, ...)  \
-	(g_traceflags[(k)] ? cputrace(cn, __VA_ARGS__) : (void)0)
-
-#define HWTRACEL(k, ...)   (g_traceflags[(k)] ? hwtracel(__VA_ARGS__): (void)0)
-#define HWTRACE(k, ...)    (g_traceflags[(k)] ? hwtrace(__VA_ARGS__) : (void)0)
+	((g_traceflags[(k)] && TRACE_CPUOK(cn)) ? \
+	 cputrace((k), cn, __VA_ARGS__) : (void)0)
+
+#define HWTRACEL(k, ...) \
+	((g_traceflags[(k)] && (!g_tracefilter || trace_filterhw())) ? \
+	 hwtracel((k), __VA_ARGS__) : (void)0)
+#define HWTRACE(k, ...) \
+	((g_traceflags[(k)] && (!g_tracefilter || trace_filterhw())) ? \
+	 hwtrace((k), __VA_ARGS__) : (void)0)
 
 
 
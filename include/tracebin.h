@@ -0,0 +1,31 @@
+#ifndef TRACEBIN_H
+#define TRACEBIN_H
+
+/*
+ * Binary trace output (trace161 -B), in main/tracebin.c. When
+ * g_tracebinary is set, the trace output functions in console.c write
+ * text records to the binary trace instead of formatting to the trace
+ * file, and the cpu writes instruction records with tracebin_insn()
+ * in place of its usual trace text.
+ *
+ * You must have uint32_t and va_list defined before including this
+ * file.
+ */
+
+#ifdef USE_TRACE
+
+extern int g_tracebinary;
+
+void tracebin_open(const char *filename);
+void tracebin_insn(unsigned cpunum, int k, uint32_t pc, uint32_t insn,
+		   uint32_t rsval, uint32_t rtval, uint32_t result,
+		   unsigned status);
+void tracebin_vtext(int hw, unsigned cpunum, int k, int eol,
+		    const char *fmt, va_list ap);
+void tracebin_console(int ch);
+void tracebin_flush(void);
+void tracebin_close(void);
+
+#endif /* USE_TRACE */
+
+#endif /* TRACEBIN_H */
@@ -0,0 +1,78 @@
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+/*
+ * Binary trace file format, as written by trace161 -B (main/tracebin.c)
+ * and read by trace161-decode (tracetool/trace161-decode.c).
+ *
+ * The file is a header followed by records. Every record starts with
+ * the same fixed-size structure; text records are followed by the
+ * text itself (tr_a bytes, not null-terminated). Multibyte fields are
+ * big-endian (network byte order) regardless of the host. The file
+ * may be gzip-compressed as a whole; readers should use gzread or
+ * equivalent, which handles both.
+ *
+ * You must have uint8_t and uint32_t defined before including this
+ * file.
+ */
+
+#define TRACEFMT_MAGIC		"System/161 Binary Trace"
+#define TRACEFMT_MAGICLEN	32
+#define TRACEFMT_VERSION	1
+
+struct tracefmt_header {
+	char th_magic[TRACEFMT_MAGICLEN];
+	uint32_t th_version;
+	uint32_t th_recsize;		/* sizeof(struct tracefmt_rec) */
+};
+
+/*
+ * Record kinds.
+ *
+ * TRACEFMT_INSN is an instruction executed (or at least started) by
+ * cpu tr_cpu: tr_pc and tr_insn are the address and the instruction,
+ * tr_a and tr_b the values of its rs and rt registers beforehand, and
+ * tr_c the value afterwards of the register it writes (rd for SPECIAL
+ * instructions, ra for jal and friends, otherwise rt). For stores
+ * and branches tr_c is meaningless. There is one record per cycle,
+ * so tr_status says whether the instruction completed; if it didn't,
+ * tr_c is also meaningless.
+ *
+ * TRACEFMT_CPUTEXT and TRACEFMT_HWTEXT are lines of trace text, from
+ * a cpu or from a device. TRACEFMT_CONSOLE is a character written to
+ * the system console, in tr_a.
+ */
+#define TRACEFMT_INSN		1
+#define TRACEFMT_CPUTEXT	2
+#define TRACEFMT_HWTEXT		3
+#define TRACEFMT_CONSOLE	4
+
+struct tracefmt_rec {
+	uint8_t tr_kind;
+	uint8_t tr_cpu;
+	uint8_t tr_flag;		/* DOTRACE_* category */
+	uint8_t tr_status;		/* TRACEFMT_RETIRED etc., for INSN */
+	uint32_t tr_timehi;		/* virtual time in ns, high word */
+	uint32_t tr_timelo;		/* virtual time in ns, low word */
+	uint32_t tr_pc;
+	uint32_t tr_insn;
+	uint32_t tr_a;
+	uint32_t tr_b;
+	uint32_t tr_c;
+};
+
+/*
+ * The trace161 -t letter for each DOTRACE_* category, in order. Must
+ * match trace.h and main/trace.c.
+ */
+#define TRACEFMT_FLAGLETTERS	"kujtxidne"
+
+/* tr_status for TRACEFMT_INSN */
+#define TRACEFMT_RETIRED	0	/* completed */
+#define TRACEFMT_STALLED	1	/* waited for hi/lo; will be retried */
+#define TRACEFMT_TRAPPED	2	/* took an exception */
+
+/* tr_flag for notes from trace161 itself, which are never filtered out */
+#define TRACEFMT_NOTE		0xff
+
+#endif /* TRACEFMT_H */
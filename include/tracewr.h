@@ -0,0 +1,56 @@
+#ifndef TRACEWR_H
+#define TRACEWR_H
+
+#ifdef USE_TRACE
+
+/*
+ * Trace writer. Trace output to a file (-f or -B) is collected in
+ * large chunks and written out by a helper thread, so the simulation
+ * doesn't wait for the disk. What to do when the writer falls behind
+ * is set with trace161 -O.
+ *
+ * Output is a sequence of records (a line of text trace, or a binary
+ * trace record); call tracewr_record at the start of each one. Records
+ * are only ever dropped or sampled out whole.
+ *
+ * You must include <stdarg.h> before this file.
+ */
+
+/* parse the -O argument; dies on error */
+void tracewr_setpolicy(const char *spec);
+
+/*
+ * Start writing. WRITEFN is called on the writer thread and must not
+ * call anything else in System/161; it returns 0 or an errno value.
+ * FLUSHFN, if not NULL, is called on the main thread by tracewr_sync
+ * once everything has been handed to WRITEFN.
+ */
+void tracewr_open(const char *name,
+		  int (*writefn)(void *data, const void *buf, size_t len),
+		  void (*flushfn)(void *data), void *data);
+
+/*
+ * Begin a record. Records with ALWAYS set (console output and the
+ * like) are never sampled out. Returns 0 if this record is being
+ * skipped; output until the next call is then discarded.
+ */
+int tracewr_record(int always);
+
+void tracewr_put(const void *buf, size_t len);
+void tracewr_vprintf(const char *fmt, va_list ap);
+
+/* number of records dropped since last asked, for writing a notice */
+unsigned long tracewr_takedrops(void);
+
+/* write out everything so far and wait for it */
+void tracewr_sync(void);
+
+/* best-effort tracewr_sync for fatal signal handlers */
+void tracewr_sigflush(void);
+
+/* sync, stop the writer thread, and report anything lost */
+void tracewr_close(void);
+
+#endif /* USE_TRACE */
+
+#endif /* TRACEWR_H */
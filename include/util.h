@@ -2,9 +2,10 @@
 /*
  * Utility functions.
  *
- * domalloc calls smoke() if it fails.
+ * domalloc and dorealloc call smoke() if they fail.
  */
 
 void *domalloc(size_t);
+void *dorealloc(void *, size_t);
 void dohexdump(const char *buf, size_t len);
 off_t getsize(const char *str);
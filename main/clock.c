@@ -321,16 +321,21 @@ schedule_event(uint64_t nsecs, void *data, uint32_t code,
 	(*p) = n;
 
 	/*
-	 * If the event we're scheduling before is the next event and
-	 * we told the cpu it can run until that time, stop the cpu.
-	 * Then the main loop logic will recalculate things.
+	 * If the new event is now the next event, the cpu may have been
+	 * told it can run past it (either until the old next event or,
+	 * if there was none close by, for a whole MAXRUN), so stop the
+	 * cpu. Then the main loop logic will recalculate things.
+	 * Otherwise short device delays get stretched to the end of the
+	 * cpu's time slice.
 	 *
 	 * XXX: it would be more efficient to tell the cpu when to stop,
 	 * but currently that'd be difficult.
 	 */
-	if (n->ta_next != NULL && n->ta_next->ta_runningto) {
+	if (n == queuehead) {
 		cpu_stopcycling();
-		n->ta_next->ta_runningto = 0;
+		if (n->ta_next != NULL) {
+			n->ta_next->ta_runningto = 0;
+		}
 	}
 }
 
@@ -17,6 +17,8 @@
 #include "cpu.h"
 #include "main.h"
 #include "trace.h"
+#include "tracebin.h"
+#include "tracewr.h"
 #include "prof.h"
 
 
@@ -41,7 +43,8 @@
  * Since tracing can be voluminous, it is possible to send trace
  * messages to a file, or even (FUTURE) through a pipe to gzip. For
  * maximum utility of such logs, messages are also repeated there, and
- * console output is presented in a schematic format.
+ * console output is presented in a schematic format. A trace file is
+ * written through the trace writer (tracewr.c), in the background.
  */
 
 ////////////////////////////////////////////////////////////
@@ -57,6 +60,7 @@ typedef enum {
 struct output {
 #ifdef USE_TRACE
 	FILE *f;
+	int async;		/* goes through tracewr */
 #endif
 	int fd;
 	int needs_close;
@@ -285,6 +289,7 @@ output_create(FILE *f, int needs_close)
 	}
 #ifdef USE_TRACE
 	o->f = f;
+	o->async = 0;
 #endif
 	o->fd = fileno(f);
 	o->needs_close = needs_close;
@@ -300,6 +305,10 @@ void
 output_destroy(struct output *o)
 {
 #ifdef USE_TRACE
+	if (o->async) {
+		tracewr_close();
+		o->async = 0;
+	}
 	if (o->f) {
 		fflush(o->f);
 	}
@@ -328,7 +337,13 @@ void
 output_putc(struct output *o, int c)
 {
 #ifdef USE_TRACE
-	fputc(c, o->f);
+	if (o->async) {
+		char ch = c;
+		tracewr_put(&ch, 1);
+	}
+	else {
+		fputc(c, o->f);
+	}
 #else
 	char ch = c;
 	writestr(o->fd, &ch, 1);
@@ -350,7 +365,12 @@ void
 output_vsay(struct output *o, const char *fmt, va_list ap)
 {
 #ifdef USE_TRACE
-	vfprintf(o->f, fmt, ap);
+	if (o->async) {
+		tracewr_vprintf(fmt, ap);
+	}
+	else {
+		vfprintf(o->f, fmt, ap);
+	}
 #else
 	char buf[4096];
 	vsnprintf(buf, sizeof(buf), fmt, ap);
@@ -377,12 +397,37 @@ output_flush(struct output *o)
 		o->at_bol = 1;
 	}
 #ifdef USE_TRACE
-	if (o->f != NULL) {
+	if (o->async) {
+		tracewr_sync();
+	}
+	else if (o->f != NULL) {
 		fflush(o->f);
 	}
 #endif
 }
 
+#ifdef USE_TRACE
+/*
+ * Begin a line of output on an async output, which is a record as far
+ * as the trace writer is concerned. Only trace lines get sampled out.
+ * If the writer has been dropping lines, say so first.
+ */
+static
+void
+output_startline(struct output *o, msgtypes mt)
+{
+	unsigned long drops;
+
+	drops = tracewr_takedrops();
+	if (drops > 0) {
+		tracewr_record(1);
+		output_say(o, "sys161: [%lu trace lines dropped]", drops);
+		output_eol(o);
+	}
+	tracewr_record(mt == MT_MSG || mt == MT_CONSOLE);
+}
+#endif
+
 /*
  * Output a character. Use message type MT. If MT is not MT_CPUTRACE,
  * cpunum should always be 0.
@@ -398,6 +443,11 @@ output_char(struct output *o, msgtypes mt, unsigned cpunum, int c)
 		output_eol(o);
 		o->at_bol = 1;
 	}
+#ifdef USE_TRACE
+	if (o->async && o->at_bol) {
+		output_startline(o, mt);
+	}
+#endif
 	if (c == '\n') {
 		if (o->needs_crs) {
 			output_putc(o, '\r');
@@ -430,6 +480,11 @@ output_vmsgl(msgtypes mt, unsigned cpunum,
 		o->at_bol = 1;
 	}
 	if (o->at_bol) {
+#ifdef USE_TRACE
+		if (o->async) {
+			output_startline(o, mt);
+		}
+#endif
 		switch (mt) {
 		    case MT_CONSOLE:
 			output_say(o, "console: ");
@@ -578,6 +633,9 @@ console_putc(int c)
 		output_msg(MT_CONSOLE, 0, o_tracefile, 
 			   "`%s' (%d / 0x%x)", tmp, c, c);
 	}
+	if (g_tracebinary) {
+		tracebin_console(c);
+	}
 	fflush(o_stdout->f);
 #endif
 }
@@ -685,6 +743,7 @@ hang(const char *fmt, ...)  // was crash()
 	if (o_tracefile != NULL) {
 		output_flush(o_tracefile);
 	}
+	tracebin_flush();
 #endif
 
 	// wait for debugger connection
@@ -700,6 +759,32 @@ hang(const char *fmt, ...)  // was crash()
 
 #ifdef USE_TRACE
 
+/*
+ * Write function for the trace writer. This runs on the writer
+ * thread, so it must not call anything, including msg().
+ */
+static
+int
+output_write(void *data, const void *buf, size_t len)
+{
+	struct output *o = data;
+	size_t tot;
+	ssize_t r;
+
+	tot = 0;
+	while (tot < len) {
+		r = write(o->fd, (const char *)buf + tot, len - tot);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return r < 0 ? errno : EIO;
+		}
+		tot += r;
+	}
+	return 0;
+}
+
 void
 set_tracefile(const char *filename)
 {
@@ -722,6 +807,8 @@ set_tracefile(const char *filename)
 		}
 		o_tracefile = output_create(f, 1);
 		o_tracefile->last_msgtype = MT_HWTRACE;
+		tracewr_open(filename, output_write, NULL, o_tracefile);
+		o_tracefile->async = 1;
 		trace_to = o_tracefile;
 	}
 	else {
@@ -730,38 +817,58 @@ set_tracefile(const char *filename)
 }
 
 void
-cputrace(unsigned cpunum, const char *fmt, ...)
+cputrace(int k, unsigned cpunum, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	output_vmsg(MT_CPUTRACE, cpunum, trace_to, fmt, ap);
+	if (g_tracebinary) {
+		tracebin_vtext(0, cpunum, k, 1, fmt, ap);
+	}
+	else {
+		output_vmsg(MT_CPUTRACE, cpunum, trace_to, fmt, ap);
+	}
 	va_end(ap);
 }
 
 void
-cputracel(unsigned cpunum, const char *fmt, ...)
+cputracel(int k, unsigned cpunum, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	output_vmsgl(MT_CPUTRACE, cpunum, trace_to, fmt, ap);
+	if (g_tracebinary) {
+		tracebin_vtext(0, cpunum, k, 0, fmt, ap);
+	}
+	else {
+		output_vmsgl(MT_CPUTRACE, cpunum, trace_to, fmt, ap);
+	}
 	va_end(ap);
 }
 
 void
-hwtrace(const char *fmt, ...)
+hwtrace(int k, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	output_vmsg(MT_HWTRACE, 0, trace_to, fmt, ap);
+	if (g_tracebinary) {
+		tracebin_vtext(1, 0, k, 1, fmt, ap);
+	}
+	else {
+		output_vmsg(MT_HWTRACE, 0, trace_to, fmt, ap);
+	}
 	va_end(ap);
 }
 
 void
-hwtracel(const char *fmt, ...)
+hwtracel(int k, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	output_vmsgl(MT_HWTRACE, 0, trace_to, fmt, ap);
+	if (g_tracebinary) {
+		tracebin_vtext(1, 0, k, 0, fmt, ap);
+	}
+	else {
+		output_vmsgl(MT_HWTRACE, 0, trace_to, fmt, ap);
+	}
 	va_end(ap);
 }
 
@@ -776,9 +883,7 @@ console_sig(int sig)
 	static int evil=0;
 	if (evil==0) {
 		evil = 1;	// protect against recursive invocation
-		if (o_tracefile && o_tracefile->f) {
-			fflush(o_tracefile->f);
-		}
+		tracewr_sigflush();
 	}
 	signal(sig, SIG_DFL);
 	raise(sig);
@@ -984,6 +1089,7 @@ console_cleanup(void)
 		o_tracefile = NULL;
 		trace_to = o_stderr ? o_stderr : o_stdout;
 	}
+	tracebin_close();
 #endif
 	if (o_stderr != NULL) {
 		output_destroy(o_stderr);
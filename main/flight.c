@@ -0,0 +1,213 @@
+/*
+ * Flight recorder.
+ *
+ * Turning on tracing after a crash means running again, and tracing
+ * from the start is too slow and too big. So we always keep a little
+ * history around: the cpu code stores the pc of every instruction in
+ * a per-cpu ring (one store per cycle), and exceptions, TLB writes,
+ * and interrupt changes, which are much rarer, go in a per-cpu ring
+ * of events along with the time. Devices share one more ring.
+ *
+ * It's written out to flight.out when the machine stops for good
+ * (including hang()), and when software asks for a state dump through
+ * the trace device. The first dump of a run replaces the file; later
+ * ones are appended.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+
+#include "clock.h"
+#include "console.h"
+#include "util.h"
+#include "flight.h"
+
+#define FLIGHT_FILE "flight.out"
+
+/* one ring per cpu, and the last one for devices */
+static struct flightring *flight_rings;
+static unsigned flight_ncpus;
+static int flight_dumped;
+
+void
+flight_init(unsigned ncpus)
+{
+	flight_ncpus = ncpus;
+	flight_rings = domalloc((ncpus + 1) * sizeof(*flight_rings));
+	memset(flight_rings, 0, (ncpus + 1) * sizeof(*flight_rings));
+}
+
+void
+flight_cleanup(void)
+{
+	free(flight_rings);
+	flight_rings = NULL;
+}
+
+struct flightring *
+flight_cpuring(unsigned cpunum)
+{
+	Assert(cpunum < flight_ncpus);
+	return &flight_rings[cpunum];
+}
+
+void
+flight_cpuevent(struct flightring *fr, unsigned kind, const char *name,
+		uint32_t a, uint32_t b, uint32_t c)
+{
+	struct flightevent *fe;
+
+	fe = &fr->fr_events[fr->fr_eventpos++ & (FLIGHT_NEVENTS - 1)];
+	fe->fe_time = clock_monotime();
+	fe->fe_name = name;
+	fe->fe_kind = kind;
+	fe->fe_a = a;
+	fe->fe_b = b;
+	fe->fe_c = c;
+}
+
+void
+flight_hwevent(unsigned kind, uint32_t a, uint32_t b, uint32_t c)
+{
+	/* devices may do things while being configured */
+	if (flight_rings == NULL) {
+		return;
+	}
+	flight_cpuevent(&flight_rings[flight_ncpus], kind, NULL, a, b, c);
+}
+
+////////////////////////////////////////////////////////////
+// dumping
+
+static
+void
+flight_printtime(FILE *f, uint64_t t)
+{
+	fprintf(f, "[%llu.%09llu]",
+		(unsigned long long)(t / 1000000000),
+		(unsigned long long)(t % 1000000000));
+}
+
+static
+void
+flight_printevent(FILE *f, const struct flightevent *fe)
+{
+	fprintf(f, "  ");
+	flight_printtime(f, fe->fe_time);
+	switch (fe->fe_kind) {
+	    case FLIGHT_EXN:
+		fprintf(f, " exception %u (%s), epc %08x, vaddr %08x\n",
+			fe->fe_a, fe->fe_name ? fe->fe_name : "?",
+			fe->fe_b, fe->fe_c);
+		break;
+	    case FLIGHT_RFE:
+		fprintf(f, " rfe: %s mode, interrupts %s\n",
+			fe->fe_a ? "user" : "kernel",
+			fe->fe_b ? "on" : "off");
+		break;
+	    case FLIGHT_TLBW:
+		fprintf(f, " tlb write: [%2u] hi %08x lo %08x\n",
+			fe->fe_a, fe->fe_b, fe->fe_c);
+		break;
+	    case FLIGHT_IRQ:
+		fprintf(f, " irq lines: LAMEbus %s, IPI %s, timer %s\n",
+			fe->fe_a ? "ON" : "off",
+			fe->fe_b ? "ON" : "off",
+			fe->fe_c ? "ON" : "off");
+		break;
+	    case FLIGHT_SLOTIRQ:
+		fprintf(f, " slot %2u: irq %s\n", fe->fe_a,
+			fe->fe_b ? "ON" : "off");
+		break;
+	    case FLIGHT_DISK:
+		fprintf(f, " disk: slot %u: %s sector %u\n", fe->fe_a,
+			fe->fe_b ? "write" : "read", fe->fe_c);
+		break;
+	    case FLIGHT_NET:
+		fprintf(f, " nic: slot %u: %s %u bytes\n", fe->fe_a,
+			fe->fe_b ? "sent" : "received", fe->fe_c);
+		break;
+	    default:
+		fprintf(f, " event %u: %u %u %u\n", fe->fe_kind,
+			fe->fe_a, fe->fe_b, fe->fe_c);
+		break;
+	}
+}
+
+static
+void
+flight_printevents(FILE *f, const struct flightring *fr, const char *who)
+{
+	unsigned n, i;
+
+	n = fr->fr_eventpos < FLIGHT_NEVENTS ? fr->fr_eventpos : FLIGHT_NEVENTS;
+	fprintf(f, "%s: last %u events:\n", who, n);
+	for (i = fr->fr_eventpos - n; i != fr->fr_eventpos; i++) {
+		flight_printevent(f, &fr->fr_events[i & (FLIGHT_NEVENTS - 1)]);
+	}
+}
+
+static
+void
+flight_printpcs(FILE *f, const struct flightring *fr, const char *who)
+{
+	unsigned n, i, col;
+
+	n = fr->fr_pcpos < FLIGHT_NPCS ? fr->fr_pcpos : FLIGHT_NPCS;
+	fprintf(f, "%s: last %u instructions, oldest first:\n", who, n);
+	col = 0;
+	for (i = fr->fr_pcpos - n; i != fr->fr_pcpos; i++) {
+		fprintf(f, "%s%08x", col == 0 ? "  " : " ",
+			fr->fr_pcs[i & (FLIGHT_NPCS - 1)]);
+		if (++col == 8) {
+			fprintf(f, "\n");
+			col = 0;
+		}
+	}
+	if (col > 0) {
+		fprintf(f, "\n");
+	}
+}
+
+void
+flight_dump(const char *why)
+{
+	char who[32];
+	FILE *f;
+	unsigned i;
+
+	if (flight_rings == NULL) {
+		return;
+	}
+
+	f = fopen(FLIGHT_FILE, flight_dumped ? "a" : "w");
+	if (f == NULL) {
+		msg("Could not open %s (skipping flight recorder dump)",
+		    FLIGHT_FILE);
+		return;
+	}
+	flight_dumped = 1;
+
+	fprintf(f, "==== Flight recorder dump: %s, at ", why);
+	flight_printtime(f, clock_monotime());
+	fprintf(f, "\n");
+	for (i=0; i<flight_ncpus; i++) {
+		snprintf(who, sizeof(who), "cpu %u", i);
+		flight_printevents(f, &flight_rings[i], who);
+		flight_printpcs(f, &flight_rings[i], who);
+	}
+	flight_printevents(f, &flight_rings[flight_ncpus], "devices");
+
+	fflush(f);
+	if (ferror(f)) {
+		msg("Warning: error writing %s", FLIGHT_FILE);
+	}
+	else {
+		msg("Flight recorder dumped to %s", FLIGHT_FILE);
+	}
+	fclose(f);
+}
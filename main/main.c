@@ -2,6 +2,7 @@
 #include <sys/time.h>
 #include <sys/stat.h> // for mkdir()
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -11,8 +12,11 @@
 #include "util.h"
 #include "console.h"
 #include "trace.h"
+#include "tracebin.h"
+#include "tracewr.h"
 #include "doom.h"
 #include "prof.h"
+#include "flight.h"
 #include "meter.h"
 #include "gdb.h"
 #include "cpu.h"
@@ -104,6 +108,9 @@ main_enter_debugger(int lethal)
 {
 	stopped_in_debugger = 1;
 	stop_is_lethal = lethal;
+	if (lethal) {
+		flight_dump("lethal stop");
+	}
 }
 
 void
@@ -193,6 +200,14 @@ initstats(unsigned ncpus)
 		g_stats.s_percpu[i].sp_okscs = 0;
 		g_stats.s_percpu[i].sp_badscs = 0;
 		g_stats.s_percpu[i].sp_syncs = 0;
+		g_stats.s_percpu[i].sp_ichits = 0;
+		g_stats.s_percpu[i].sp_icmisses = 0;
+		g_stats.s_percpu[i].sp_dchits = 0;
+		g_stats.s_percpu[i].sp_dcmisses = 0;
+		g_stats.s_percpu[i].sp_dcwbacks = 0;
+		g_stats.s_percpu[i].sp_dcinvals = 0;
+		g_stats.s_percpu[i].sp_uncached = 0;
+		g_stats.s_percpu[i].sp_cstalls = 0;
 	}
 }
 
@@ -200,6 +215,7 @@ static
 uint64_t
 showstats(void)
 {
+	const struct stats_percpu *sp;
 	uint64_t totcycles;
 	unsigned i;
 
@@ -219,6 +235,22 @@ showstats(void)
 		    (unsigned long long) g_stats.s_percpu[i].sp_okscs,
 		    (unsigned long long) g_stats.s_percpu[i].sp_badscs,
 		    (unsigned long long) g_stats.s_percpu[i].sp_syncs);
+
+		/* with the cache model on, every instruction counts */
+		sp = &g_stats.s_percpu[i];
+		if (sp->sp_ichits + sp->sp_icmisses + sp->sp_uncached > 0) {
+			msg("  cpu%u: icache %llu/%llu hit/miss; "
+			    "dcache %llu/%llu hit/miss, %llu wb, %llu inval; "
+			    "%llu uncached, %llu stall", i,
+			    (unsigned long long) sp->sp_ichits,
+			    (unsigned long long) sp->sp_icmisses,
+			    (unsigned long long) sp->sp_dchits,
+			    (unsigned long long) sp->sp_dcmisses,
+			    (unsigned long long) sp->sp_dcwbacks,
+			    (unsigned long long) sp->sp_dcinvals,
+			    (unsigned long long) sp->sp_uncached,
+			    (unsigned long long) sp->sp_cstalls);
+		}
 	}
 
 	msg("%u irqs %u exns %ur/%uw disk %ur/%uw console %ur/%uw/%um emufs"
@@ -234,6 +266,10 @@ showstats(void)
 	    g_stats.s_memu,
 	    g_stats.s_rpkts,
 	    g_stats.s_wpkts);
+	if (g_stats.s_dchits > 0 || g_stats.s_dcmisses > 0) {
+		msg("%u hits %u misses disk cache",
+		    g_stats.s_dchits, g_stats.s_dcmisses);
+	}
 
 	return totcycles;
 }
@@ -245,6 +281,7 @@ main_dumpstate(void)
 	    shutoff_flag, stopped_in_debugger);
 #ifdef USE_TRACE
 	print_traceflags();
+	print_tracefilters();
 #endif
 	gdb_dumpstate();
 	showstats();
@@ -360,14 +397,25 @@ usage(void)
 	msg("System/161 %s, compiled %s %s", VERSION, __DATE__, __TIME__);
 	msg("Usage: sys161 [sys161 options] kernel [kernel args...]");
 	msg("   sys161 options:");
+#ifdef USE_TRACE
+	msg("     -B file        Trace to specified file, in binary");
+#else
+	msg("     -B file        (trace161 only)");
+#endif
 	msg("     -c config      Use alternate config file");
 	msg("     -C slot:arg    Override config file argument");
 	msg("     -D count       Set disk I/O doom counter");
 #ifdef USE_TRACE
+	msg("     -E             Profile, counting every cycle exactly");
 	msg("     -f file        Trace to specified file");
+	msg("     -F filter      Limit tracing (cpu=, asid=, pc=, time=, insns=)");
+	msg("     -O policy      If trace output falls behind: block, drop, sample[:N]");
 	msg("     -P             Collect kernel execution profile");
 #else
+	msg("     -E             (trace161 only)");
 	msg("     -f file        (trace161 only)");
+	msg("     -F filter      (trace161 only)");
+	msg("     -O policy      (trace161 only)");
 	msg("     -P             (trace161 only)");
 #endif
 	msg("     -p port        Listen for gdb over TCP on specified port");
@@ -403,6 +451,9 @@ main(int argc, char *argv[])
 	int timeout;
 #ifdef USE_TRACE
 	int profiling=0;
+	int exactprof=0;
+	const char *tracebinfile = NULL;
+	int tracetextfile = 0;
 #endif
 	int doom = 0;
 	unsigned ncpus;
@@ -418,8 +469,13 @@ main(int argc, char *argv[])
 		die();
 	}
 
-	while ((opt = mygetopt(argc, argv, "c:C:D:f:p:Pst:wXZ:"))!=-1) {
+	while ((opt = mygetopt(argc, argv, "B:c:C:D:Ef:F:O:p:Pst:wXZ:"))!=-1) {
 		switch (opt) {
+		    case 'B':
+#ifdef USE_TRACE
+			tracebinfile = myoptarg;
+#endif
+			break;
 		    case 'c': config = myoptarg; break;
 		    case 'C':
 			if (numconfigextra >= MAXCONFIGEXTRA) {
@@ -433,9 +489,26 @@ main(int argc, char *argv[])
 			configextra[numconfigextra++] = myoptarg;
 			break;
 		    case 'D': doom = atoi(myoptarg); break;
+		    case 'E':
+#ifdef USE_TRACE
+			profiling = 1;
+			exactprof = 1;
+#endif
+			break;
 		    case 'f':
 #ifdef USE_TRACE
 			set_tracefile(myoptarg);
+			tracetextfile = 1;
+#endif
+			break;
+		    case 'F':
+#ifdef USE_TRACE
+			trace_addfilter(myoptarg);
+#endif
+			break;
+		    case 'O':
+#ifdef USE_TRACE
+			tracewr_setpolicy(myoptarg);
 #endif
 			break;
 		    case 'p': port = atoi(myoptarg); usetcp=1; break;
@@ -466,6 +539,15 @@ main(int argc, char *argv[])
 	if (myoptind==argc) {
 		usage();
 	}
+#ifdef USE_TRACE
+	if (tracebinfile != NULL) {
+		if (tracetextfile) {
+			msg("-B and -f cannot be used together");
+			die();
+		}
+		tracebin_open(tracebinfile);
+	}
+#endif
 	kernel = argv[myoptind++];
 	
 	for (j=myoptind; j<argc; j++) {
@@ -493,6 +575,7 @@ main(int argc, char *argv[])
 	}
 
 	initstats(ncpus);
+	flight_init(ncpus);
 	cpu_init(ncpus);
 
 	if (usetcp) {
@@ -511,8 +594,9 @@ main(int argc, char *argv[])
 	msg("System/161 %s, compiled %s %s", VERSION, __DATE__, __TIME__);
 #ifdef USE_TRACE
 	print_traceflags();
+	print_tracefilters();
 	if (profiling) {
-		prof_setup();
+		prof_setup(exactprof);
 	}
 #endif
 
@@ -532,6 +616,7 @@ main(int argc, char *argv[])
 #endif
 
 	bus_cleanup();
+	flight_cleanup();
 	clock_cleanup();
 	console_cleanup();
 	
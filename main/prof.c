@@ -14,12 +14,19 @@
 #include "clock.h"
 #include "console.h"
 #include "cpu.h"
+#include "util.h"
 #include "prof.h"
+#include "version.h"
 
 
 #ifdef USE_TRACE
 
 #define PROFILE_FILE "gmon.out"
+#define PROFILE_USERFILE "gmon.out.asid%u"
+#define PROFILE_CGFILE "callgrind.out"
+#define PROFILE_PPROFFILE "profile.pb"
+#define PROFILE_EXACTFILE "callgrind.out.cycles"
+#define PROFILE_FOLDEDFILE "profile.folded"
 #define PROFILE_HZ (1000000000/PROFILE_NSECS)
 
 /*
@@ -28,268 +35,1796 @@
  * should give us perfectly acceptable results.
  */
 #define PROF_BINSIZE  16
-#define PROF_ADDR2BIN(addr) (((addr)-prof_textbase)/PROF_BINSIZE)
 
-struct cgentry {
-	struct cgentry *next;
-	struct gmon_callgraph_entry gce;
+/*
+ * Kernel text is profiled in regions, one per executable segment of
+ * the kernel image (merged if they overlap or touch, so no address is
+ * in two regions; past PROF_MAXREGIONS, the closest ones are merged
+ * along with the gap between them). Bins are 32 bits wide;
+ * gmon.out only has room for 16, so prof_write() writes as many
+ * copies of a histogram record as it takes, which gprof adds up.
+ */
+#define PROF_MAXREGIONS 16
+
+struct profregion {
+	uint32_t pr_base;		/* rounded down to a bin */
+	uint32_t pr_end;		/* rounded up to a bin */
+	unsigned pr_nbins;
+	uint32_t *pr_samples;
+};
+
+/*
+ * Call graph arcs. These are counted on every call instruction, so
+ * they need to be cheap: arcs live in an open-addressed hash table
+ * keyed on (from, to), with linear probing, and are allocated out of
+ * big chunks that are only freed by prof_clear(). The table is
+ * doubled when it gets half full, so lookups stay short no matter
+ * how many arcs there are. There's also a one-entry cache in front,
+ * since the same call is often made many times in a row.
+ */
+#define PROF_ARCCHUNK	4096	/* arcs per chunk */
+#define PROF_ARCHASH	4096	/* initial table size; power of 2 */
+
+struct profarc {
+	uint32_t pa_from;
+	uint32_t pa_to;
+	uint64_t pa_count;
+};
+
+struct arcchunk {
+	struct arcchunk *ac_next;
+	unsigned ac_used;
+	struct profarc ac_arcs[PROF_ARCCHUNK];
 };
 
-struct cgbin {
-	struct cgentry *list;
+/*
+ * Kernel function symbols, from the image's symbol table, sorted by
+ * address. Used to label the callgrind and pprof output. Symbols
+ * without a size are taken to extend to the next symbol.
+ */
+struct profsym {
+	uint32_t ps_addr;
+	uint32_t ps_end;
+	char *ps_name;
+};
+
+/*
+ * User text isn't known in advance, so samples from user addresses
+ * are kept per address space id and page, allocated on first use,
+ * and written to a separate file for each address space id.
+ */
+#define PROF_PAGESIZE   4096
+#define PROF_PAGEBINS   (PROF_PAGESIZE/PROF_BINSIZE)
+#define PROF_USERHASH   1024
+
+struct profpage {
+	struct profpage *pp_next;
+	uint32_t pp_asid;
+	uint32_t pp_vpage;
+	uint32_t pp_samples[PROF_PAGEBINS];
+};
+
+/*
+ * Exact mode charges every cycle of every running CPU to the
+ * instruction it was spent on, by what happened (see prof.h), and
+ * separately counts the cycles spent with interrupts off. Counters
+ * are kept per instruction in pages allocated on first use, kernel
+ * and user alike (user pages by ASID, as above), and each CPU caches
+ * the last page it used.
+ */
+#define PROF_IRQOFF	(PROF_STALL+1)
+#define PROF_NCOUNTS	(PROF_STALL+2)
+#define PROF_PAGEINSNS	(PROF_PAGESIZE/4)
+#define PROF_KASID	0xffffffff	/* kernel pages ignore the ASID */
+
+struct exactpage {
+	struct exactpage *ep_next;
+	uint32_t ep_asid;
+	uint32_t ep_vpage;
+	uint64_t ep_counts[PROF_PAGEINSNS][PROF_NCOUNTS];
+};
+
+/*
+ * Stack samples. At each sample the kernel stack of each CPU is
+ * unwound (see prof_unwind) and the resulting chain of functions is
+ * counted in a hash table, for writing out as folded stacks for
+ * flamegraph.pl. Frames are function entry points, or the pc itself
+ * where there's no symbol, innermost first. Samples from user mode
+ * have no frames and just record the ASID.
+ */
+#define PROF_MAXDEPTH	64
+#define PROF_STACKHASH	4096
+
+struct profstack {
+	struct profstack *st_next;
+	uint64_t st_count;
+	uint32_t st_asid;		/* PROF_KASID for kernel stacks */
+	unsigned st_depth;
+	uint32_t st_frames[PROF_MAXDEPTH];
+};
+
+static struct profregion prof_regions[PROF_MAXREGIONS];
+static unsigned prof_nregions;
+static struct profregion *prof_lastregion;	/* lookup cache */
+static struct profpage *prof_userpages[PROF_USERHASH];
+static struct arcchunk *prof_arcchunks;	/* newest first */
+static struct profarc **prof_arctable;
+static unsigned prof_arcsize;		/* power of 2 */
+static unsigned prof_narcs;
+static struct profarc *prof_lastarc;	/* lookup cache */
+static struct profsym *prof_syms;
+static unsigned prof_nsyms, prof_maxsyms;
+static char *prof_image;
+static struct exactpage *prof_exactpages[PROF_USERHASH];
+static struct exactpage **prof_exactlast;	/* per cpu */
+static int prof_wantexact = 0;
+static struct profstack *prof_stacks[PROF_STACKHASH];
+int prof_exact = 0;
+static int prof_on = 0;
+static int prof_active = 0;
+
+void
+prof_enable(void)
+{
+	if (prof_on) {
+		prof_active = 1;
+		prof_exact = prof_wantexact;
+	}
+}
+
+void
+prof_disable(void)
+{
+	prof_active = 0;
+	prof_exact = 0;
+}
+
+int
+prof_isenabled(void)
+{
+	return prof_active;
+}
+
+/*
+ * Find the kernel text region containing PC, or NULL.
+ */
+static
+struct profregion *
+prof_findregion(uint32_t pc)
+{
+	struct profregion *pr;
+	unsigned i;
+
+	pr = prof_lastregion;
+	if (pr != NULL && pc >= pr->pr_base && pc < pr->pr_end) {
+		return pr;
+	}
+	for (i=0; i<prof_nregions; i++) {
+		pr = &prof_regions[i];
+		if (pc >= pr->pr_base && pc < pr->pr_end) {
+			prof_lastregion = pr;
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+static
+unsigned
+prof_userhash(uint32_t asid, uint32_t vpage)
+{
+	return (vpage / PROF_PAGESIZE + asid * 31) % PROF_USERHASH;
+}
+
+static
+void
+prof_usersample(uint32_t asid, uint32_t pc)
+{
+	struct profpage *pp;
+	uint32_t vpage;
+	unsigned h;
+
+	vpage = pc & ~(uint32_t)(PROF_PAGESIZE-1);
+	h = prof_userhash(asid, vpage);
+	for (pp = prof_userpages[h]; pp; pp = pp->pp_next) {
+		if (pp->pp_asid == asid && pp->pp_vpage == vpage) {
+			break;
+		}
+	}
+	if (pp == NULL) {
+		pp = domalloc(sizeof(struct profpage));
+		memset(pp, 0, sizeof(*pp));
+		pp->pp_asid = asid;
+		pp->pp_vpage = vpage;
+		pp->pp_next = prof_userpages[h];
+		prof_userpages[h] = pp;
+	}
+	pp->pp_samples[(pc - vpage) / PROF_BINSIZE]++;
+}
+
+static
+struct exactpage *
+prof_exactpage(uint32_t asid, uint32_t vpage)
+{
+	struct exactpage *ep;
+	unsigned h;
+
+	h = prof_userhash(asid, vpage);
+	for (ep = prof_exactpages[h]; ep; ep = ep->ep_next) {
+		if (ep->ep_asid == asid && ep->ep_vpage == vpage) {
+			return ep;
+		}
+	}
+	ep = domalloc(sizeof(struct exactpage));
+	memset(ep, 0, sizeof(*ep));
+	ep->ep_asid = asid;
+	ep->ep_vpage = vpage;
+	ep->ep_next = prof_exactpages[h];
+	prof_exactpages[h] = ep;
+	return ep;
+}
+
+void
+prof_cycle(unsigned cpunum, uint32_t pc, uint32_t asid,
+	   unsigned kind, int irqoff)
+{
+	struct exactpage *ep;
+	uint64_t *counts;
+	uint32_t vpage;
+
+	vpage = pc & ~(uint32_t)(PROF_PAGESIZE-1);
+	if (pc >= 0x80000000) {
+		asid = PROF_KASID;
+	}
+
+	ep = prof_exactlast[cpunum];
+	if (ep == NULL || ep->ep_vpage != vpage || ep->ep_asid != asid) {
+		ep = prof_exactpage(asid, vpage);
+		prof_exactlast[cpunum] = ep;
+	}
+
+	counts = ep->ep_counts[(pc - vpage) / 4];
+	counts[kind]++;
+	if (irqoff) {
+		counts[PROF_IRQOFF]++;
+	}
+}
+
+/*
+ * Symbol lookup, for stack unwinding and the symbolized output.
+ */
+
+static
+int
+prof_symcmp(const void *av, const void *bv)
+{
+	const struct profsym *a = av;
+	const struct profsym *b = bv;
+
+	if (a->ps_addr != b->ps_addr) {
+		return a->ps_addr < b->ps_addr ? -1 : 1;
+	}
+	/* prefer the one with a size, then the bigger one */
+	if (a->ps_end != b->ps_end) {
+		return a->ps_end > b->ps_end ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Return the index of the symbol containing PC, or -1.
+ */
+static
+int
+prof_findsym(uint32_t pc)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = prof_nsyms;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (prof_syms[mid].ps_addr <= pc) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	/* lo is now the first symbol above pc */
+	if (lo == 0 || pc >= prof_syms[lo-1].ps_end) {
+		return -1;
+	}
+	return lo - 1;
+}
+
+/*
+ * Stack unwinding. There's no frame pointer to follow, and rather
+ * than interpret DWARF call frame information we look at function
+ * prologues, like gdb's fallback MIPS unwinder: gcc's prologues
+ * allocate the frame with "addiu sp, sp, -N" and save the return
+ * address with "sw ra, M(sp)", so from the function's entry point
+ * (from the symbol table) we can find the caller's sp and ra.
+ *
+ * This is a heuristic. Hand-written assembly (exception entry, thread
+ * switch) generally defeats it, and the chain just stops there, or
+ * occasionally picks up a stale frame. The memory reads go through
+ * the debugger's path, so they can't fault or have side effects.
+ */
+#define PROF_MAXPROLOGUE	64	/* instructions to scan */
+
+#define INSN_ADDIU_SP	0x27bd0000	/* addiu sp, sp, imm */
+#define INSN_ADDI_SP	0x23bd0000	/* addi sp, sp, imm */
+#define INSN_SW_RA	0xafbf0000	/* sw ra, imm(sp) */
+#define INSN_JR_RA	0x03e00008	/* jr ra */
+#define INSN_HI(insn)	((insn) & 0xffff0000)
+#define INSN_IMM(insn)	((int32_t)(int16_t)((insn) & 0xffff))
+
+/*
+ * Scan the prologue of the function starting at ENTRY, stopping at PC
+ * (which hasn't been executed), for the frame size and the offset of
+ * the saved return address, if any.
+ */
+static
+void
+prof_prologue(unsigned cpunum, uint32_t entry, uint32_t pc,
+	      uint32_t *framesize, int32_t *raoff)
+{
+	uint32_t addr, insn;
+
+	*framesize = 0;
+	*raoff = -1;
+	for (addr = entry; addr < pc; addr += 4) {
+		if (addr >= entry + 4*PROF_MAXPROLOGUE ||
+		    cpudebug_fetch_word(cpunum, addr, &insn)) {
+			break;
+		}
+		if (INSN_HI(insn) == INSN_ADDIU_SP ||
+		    INSN_HI(insn) == INSN_ADDI_SP) {
+			if (INSN_IMM(insn) > 0) {
+				/* epilogue */
+				break;
+			}
+			if (*framesize == 0) {
+				*framesize = -INSN_IMM(insn);
+			}
+		}
+		else if (INSN_HI(insn) == INSN_SW_RA && *raoff < 0) {
+			*raoff = INSN_IMM(insn);
+		}
+		else if (insn == INSN_JR_RA) {
+			break;
+		}
+		if (*framesize > 0 && *raoff >= 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * If the innermost frame is returning (at "jr ra" or in its delay
+ * slot), the return address is already back in ra; say whether that's
+ * so and how much of the frame is yet to be popped.
+ */
+static
+int
+prof_returning(unsigned cpunum, uint32_t pc, uint32_t *framesize)
+{
+	uint32_t insn, prev, delay;
+
+	if (cpudebug_fetch_word(cpunum, pc, &insn) ||
+	    cpudebug_fetch_word(cpunum, pc - 4, &prev)) {
+		return 0;
+	}
+	if (insn == INSN_JR_RA) {
+		if (cpudebug_fetch_word(cpunum, pc + 4, &delay)) {
+			return 0;
+		}
+	}
+	else if (prev == INSN_JR_RA) {
+		delay = insn;
+	}
+	else {
+		return 0;
+	}
+	*framesize = 0;
+	if (INSN_HI(delay) == INSN_ADDIU_SP && INSN_IMM(delay) > 0) {
+		*framesize = INSN_IMM(delay);
+	}
+	return 1;
+}
+
+/*
+ * Check that the instruction at CALLPC is a call. If it's a direct
+ * call, also check that it calls ENTRY; a function that never returns
+ * (like the startup code) can leave a stale value in ra, and this
+ * catches it. Tail calls fail the check too, which stops the chain
+ * early but doesn't make anything up.
+ */
+static
+int
+prof_iscall(unsigned cpunum, uint32_t callpc, uint32_t entry)
+{
+	uint32_t insn, target;
+
+	if (cpudebug_fetch_word(cpunum, callpc, &insn)) {
+		return 0;
+	}
+	switch (insn >> 26) {
+	    case 3: /* jal */
+		target = ((callpc + 4) & 0xf0000000) |
+			((insn & 0x03ffffff) << 2);
+		return entry == 0 || target == entry;
+	    case 0: /* jalr */
+		return (insn & 0x3f) == 9;
+	    case 1: /* bltzal, bgezal */
+		return ((insn >> 16) & 0x1f) == 16 ||
+			((insn >> 16) & 0x1f) == 17;
+	}
+	return 0;
+}
+
+/*
+ * Unwind the kernel stack of cpu CPUNUM, which is at PC. Returns the
+ * number of frames put in FRAMES.
+ */
+static
+unsigned
+prof_unwind(unsigned cpunum, uint32_t pc, uint32_t *frames)
+{
+	uint32_t sp, ra, newsp, framesize, entry;
+	int32_t raoff;
+	unsigned depth;
+	int sym;
+
+	cpuprof_stackregs(cpunum, &sp, &ra);
+
+	depth = 0;
+	while (1) {
+		sym = prof_findsym(pc);
+		frames[depth++] = sym < 0 ? pc : prof_syms[sym].ps_addr;
+		if (sym < 0 || depth == PROF_MAXDEPTH) {
+			break;
+		}
+
+		/* entry is 0 if ra came from memory and needn't match */
+		entry = prof_syms[sym].ps_addr;
+		if (depth == 1 && prof_returning(cpunum, pc, &framesize)) {
+			/* ra is live */
+		}
+		else {
+			prof_prologue(cpunum, entry, pc, &framesize, &raoff);
+			if (raoff >= 0) {
+				if (cpudebug_fetch_word(cpunum, sp + raoff,
+							&ra)) {
+					break;
+				}
+				entry = 0;
+			}
+			else if (depth > 1) {
+				/* only the innermost frame can be a leaf */
+				break;
+			}
+		}
+
+		/* the caller is at the call, before its delay slot */
+		newsp = sp + framesize;
+		if (newsp < sp || ra < 8 || prof_findregion(ra - 8) == NULL ||
+		    !prof_iscall(cpunum, ra - 8, entry)) {
+			break;
+		}
+		sp = newsp;
+		pc = ra - 8;
+	}
+	return depth;
+}
+
+static
+unsigned
+prof_stackhash(uint32_t asid, const uint32_t *frames, unsigned depth)
+{
+	uint32_t h;
+	unsigned i;
+
+	h = asid;
+	for (i=0; i<depth; i++) {
+		h = h * 31 + frames[i];
+	}
+	return h % PROF_STACKHASH;
+}
+
+static
+void
+prof_stacksample(unsigned cpunum, uint32_t pc, uint32_t asid)
+{
+	struct profstack *st;
+	uint32_t frames[PROF_MAXDEPTH];
+	unsigned depth, h;
+
+	if (pc < 0x80000000) {
+		depth = 0;
+	}
+	else {
+		asid = PROF_KASID;
+		depth = prof_unwind(cpunum, pc, frames);
+	}
+
+	h = prof_stackhash(asid, frames, depth);
+	for (st = prof_stacks[h]; st; st = st->st_next) {
+		if (st->st_asid == asid && st->st_depth == depth &&
+		    !memcmp(st->st_frames, frames, depth*sizeof(uint32_t))) {
+			st->st_count++;
+			return;
+		}
+	}
+	st = domalloc(sizeof(struct profstack));
+	st->st_count = 1;
+	st->st_asid = asid;
+	st->st_depth = depth;
+	memcpy(st->st_frames, frames, depth*sizeof(uint32_t));
+	st->st_next = prof_stacks[h];
+	prof_stacks[h] = st;
+}
+
+static
+void
+prof_sample(void *junk1, uint32_t junk2)
+{
+	struct profregion *pr;
+	uint32_t pc, asid;
+	unsigned i, n;
+
+	(void)junk1;
+	(void)junk2;
+
+	if (prof_active) {
+		n = cpu_numcpus();
+		for (i=0; i<n; i++) {
+			if (cpuprof_sample(i, &pc, &asid)) {
+				/* not started */
+				continue;
+			}
+			pr = prof_findregion(pc);
+			if (pr != NULL) {
+				pr->pr_samples[(pc - pr->pr_base) /
+					       PROF_BINSIZE]++;
+			}
+			else if (pc < 0x80000000) {
+				prof_usersample(asid, pc);
+			}
+			prof_stacksample(i, pc, asid);
+		}
+	}
+
+	schedule_event(PROFILE_NSECS, NULL, 0, prof_sample, 
+		       "profiling sampler");
+}
+
+static
+unsigned
+prof_archash(uint32_t frompc, uint32_t topc)
+{
+	uint32_t h;
+
+	h = frompc ^ (topc * 0x9e3779b1);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h & (prof_arcsize - 1);
+}
+
+static
+void
+prof_arcinsert(struct profarc *pa)
+{
+	unsigned h;
+
+	h = prof_archash(pa->pa_from, pa->pa_to);
+	while (prof_arctable[h] != NULL) {
+		h = (h + 1) & (prof_arcsize - 1);
+	}
+	prof_arctable[h] = pa;
+}
+
+static
+void
+prof_arcgrow(void)
+{
+	struct arcchunk *ac;
+	unsigned i;
+
+	free(prof_arctable);
+	prof_arcsize *= 2;
+	prof_arctable = domalloc(prof_arcsize * sizeof(struct profarc *));
+	memset(prof_arctable, 0, prof_arcsize * sizeof(struct profarc *));
+
+	for (ac = prof_arcchunks; ac; ac = ac->ac_next) {
+		for (i=0; i<ac->ac_used; i++) {
+			prof_arcinsert(&ac->ac_arcs[i]);
+		}
+	}
+}
+
+void
+prof_call(uint32_t frompc, uint32_t topc)
+{
+	struct profarc *pa;
+	struct arcchunk *ac;
+	unsigned h;
+
+	if (prof_active==0) {
+		return;
+	}
+
+	pa = prof_lastarc;
+	if (pa != NULL && pa->pa_from == frompc && pa->pa_to == topc) {
+		pa->pa_count++;
+		return;
+	}
+
+	h = prof_archash(frompc, topc);
+	while ((pa = prof_arctable[h]) != NULL) {
+		if (pa->pa_from == frompc && pa->pa_to == topc) {
+			pa->pa_count++;
+			prof_lastarc = pa;
+			return;
+		}
+		h = (h + 1) & (prof_arcsize - 1);
+	}
+
+	if (prof_findregion(frompc) == NULL) {
+		/* out of range; skip */
+		return;
+	}
+
+	/* need to add a new entry */
+	ac = prof_arcchunks;
+	if (ac == NULL || ac->ac_used == PROF_ARCCHUNK) {
+		ac = domalloc(sizeof(struct arcchunk));
+		ac->ac_used = 0;
+		ac->ac_next = prof_arcchunks;
+		prof_arcchunks = ac;
+	}
+	pa = &ac->ac_arcs[ac->ac_used++];
+	pa->pa_from = frompc;
+	pa->pa_to = topc;
+	pa->pa_count = 1;
+	prof_arctable[h] = pa;
+	prof_lastarc = pa;
+
+	if (++prof_narcs > prof_arcsize / 2) {
+		prof_arcgrow();
+	}
+}
+
+void
+prof_clear(void)
+{
+	struct profregion *pr;
+	struct profpage *pp;
+	struct exactpage *ep;
+	struct profstack *st;
+	struct arcchunk *ac;
+	unsigned i, j;
+
+	if (prof_on == 0) {
+		return;
+	}
+
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		for (i=0; i<pr->pr_nbins; i++) {
+			pr->pr_samples[i] = 0;
+		}
+	}
+
+	while (prof_arcchunks != NULL) {
+		ac = prof_arcchunks;
+		prof_arcchunks = ac->ac_next;
+		free(ac);
+	}
+	memset(prof_arctable, 0, prof_arcsize * sizeof(struct profarc *));
+	prof_narcs = 0;
+	prof_lastarc = NULL;
+
+	for (i=0; i<PROF_USERHASH; i++) {
+		while (prof_userpages[i] != NULL) {
+			pp = prof_userpages[i];
+			prof_userpages[i] = pp->pp_next;
+			free(pp);
+		}
+		while (prof_exactpages[i] != NULL) {
+			ep = prof_exactpages[i];
+			prof_exactpages[i] = ep->ep_next;
+			free(ep);
+		}
+	}
+	for (i=0; i<PROF_STACKHASH; i++) {
+		while (prof_stacks[i] != NULL) {
+			st = prof_stacks[i];
+			prof_stacks[i] = st->st_next;
+			free(st);
+		}
+	}
+	if (prof_exactlast != NULL) {
+		memset(prof_exactlast, 0,
+		       cpu_numcpus() * sizeof(struct exactpage *));
+	}
+}
+
+static
+void
+writebyte(int val, FILE *f)
+{
+	uint8_t byte = val;
+	fwrite(&byte, 1, sizeof(uint8_t), f);
+}
+
+static
+void
+write_header(FILE *f)
+{
+	struct gmon_file_header gfh;
+
+	memset(&gfh, 0, sizeof(gfh));
+	memcpy(gfh.gfh_magic, "gmon", 4);
+	gfh.gfh_version = htonl(GMON_VERSION);
+	fwrite(&gfh, 1, sizeof(gfh), f);
+}
+
+/*
+ * Write the histogram for NBINS bins starting at LOWPC. Each record
+ * can only count to 65535 per bin, so write as many records for the
+ * same range as the fullest bin needs.
+ */
+static
+void
+write_histogram(FILE *f, uint32_t lowpc, unsigned nbins,
+		const uint32_t *samples)
+{
+	struct gmon_histogram_header ghh;
+	uint32_t max, done, n;
+	uint16_t tmp;
+	unsigned i;
+
+	max = 0;
+	for (i=0; i<nbins; i++) {
+		if (samples[i] > max) {
+			max = samples[i];
+		}
+	}
+
+	memset(&ghh, 0, sizeof(ghh));
+	ghh.ghh_lowpc = htonl(lowpc);
+	ghh.ghh_highpc = htonl(lowpc + nbins * PROF_BINSIZE);
+	ghh.ghh_size = htonl(nbins);
+	ghh.ghh_hz = htonl(PROFILE_HZ);
+	strcpy(ghh.ghh_name, "seconds");
+	ghh.ghh_abbrev = 's';
+
+	done = 0;
+	do {
+		writebyte(GMON_RT_HISTOGRAM, f);
+		fwrite(&ghh, 1, sizeof(ghh), f);
+		for (i=0; i<nbins; i++) {
+			n = samples[i] > done ? samples[i] - done : 0;
+			tmp = htons(n > 0xffff ? 0xffff : n);
+			fwrite(&tmp, 1, sizeof(tmp), f);
+		}
+		done += 0xffff;
+	} while (done < max);
+}
+
+static
+void
+finish_file(FILE *f, const char *name)
+{
+	unsigned long len;
+
+	fflush(f);
+	if (ferror(f)) {
+		msg("Warning: error writing %s", name);
+	}
+	else {
+		len = ftell(f);
+		msg("%lu bytes written to %s", len, name);
+	}
+	fclose(f);
+}
+
+static
+int
+prof_pagecmp(const void *av, const void *bv)
+{
+	const struct profpage *a = *(const struct profpage *const *)av;
+	const struct profpage *b = *(const struct profpage *const *)bv;
+
+	if (a->pp_asid != b->pp_asid) {
+		return a->pp_asid < b->pp_asid ? -1 : 1;
+	}
+	if (a->pp_vpage != b->pp_vpage) {
+		return a->pp_vpage < b->pp_vpage ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Write the user samples: one file per address space id, with one
+ * histogram for each run of adjacent pages.
+ */
+static
+void
+prof_writeuser(void)
+{
+	struct profpage **pages, *pp;
+	uint32_t *samples;
+	unsigned npages, i, j, k, run;
+	char name[64];
+	FILE *f;
+
+	npages = 0;
+	for (i=0; i<PROF_USERHASH; i++) {
+		for (pp = prof_userpages[i]; pp; pp = pp->pp_next) {
+			npages++;
+		}
+	}
+	if (npages == 0) {
+		return;
+	}
+
+	pages = domalloc(npages * sizeof(*pages));
+	samples = domalloc(npages * sizeof(uint32_t) * PROF_PAGEBINS);
+	npages = 0;
+	for (i=0; i<PROF_USERHASH; i++) {
+		for (pp = prof_userpages[i]; pp; pp = pp->pp_next) {
+			pages[npages++] = pp;
+		}
+	}
+	qsort(pages, npages, sizeof(*pages), prof_pagecmp);
+
+	f = NULL;
+	for (i=0; i<npages; i = j) {
+		if (i == 0 || pages[i]->pp_asid != pages[i-1]->pp_asid) {
+			if (f != NULL) {
+				finish_file(f, name);
+			}
+			snprintf(name, sizeof(name), PROFILE_USERFILE,
+				 pages[i]->pp_asid);
+			f = fopen(name, "w");
+			if (!f) {
+				msg("Could not open %s (skipping)", name);
+			}
+			else {
+				write_header(f);
+			}
+		}
+
+		/* find the run of adjacent pages starting at i */
+		for (j = i+1; j < npages; j++) {
+			if (pages[j]->pp_asid != pages[i]->pp_asid ||
+			    pages[j]->pp_vpage != pages[j-1]->pp_vpage +
+			    PROF_PAGESIZE) {
+				break;
+			}
+		}
+		if (f == NULL) {
+			continue;
+		}
+		run = j - i;
+		for (k=0; k<run; k++) {
+			memcpy(samples + k * PROF_PAGEBINS,
+			       pages[i+k]->pp_samples,
+			       sizeof(pages[i+k]->pp_samples));
+		}
+		write_histogram(f, pages[i]->pp_vpage, run * PROF_PAGEBINS,
+				samples);
+	}
+	if (f != NULL) {
+		finish_file(f, name);
+	}
+
+	free(samples);
+	free(pages);
+}
+
+/*
+ * Collect the arcs into an array sorted by call site.
+ */
+static
+int
+prof_arccmp(const void *av, const void *bv)
+{
+	const struct profarc *a = *(const struct profarc *const *)av;
+	const struct profarc *b = *(const struct profarc *const *)bv;
+
+	if (a->pa_from != b->pa_from) {
+		return a->pa_from < b->pa_from ? -1 : 1;
+	}
+	if (a->pa_to != b->pa_to) {
+		return a->pa_to < b->pa_to ? -1 : 1;
+	}
+	return 0;
+}
+
+static
+struct profarc **
+prof_sortarcs(void)
+{
+	struct profarc **arcs;
+	struct arcchunk *ac;
+	unsigned i, n;
+
+	arcs = domalloc((prof_narcs + 1) * sizeof(*arcs));
+	n = 0;
+	for (ac = prof_arcchunks; ac; ac = ac->ac_next) {
+		for (i=0; i<ac->ac_used; i++) {
+			arcs[n++] = &ac->ac_arcs[i];
+		}
+	}
+	qsort(arcs, n, sizeof(*arcs), prof_arccmp);
+	return arcs;
+}
+
+/*
+ * Callgrind format, for kcachegrind, callgrind_annotate, and friends.
+ *
+ * Costs are given per bin, at the bin's address, under the function
+ * containing it. Callgrind wants an inclusive cost for each call;
+ * we don't have one (no stacks), so like gprof we charge each call
+ * its share of the callee's own samples, in proportion to the number
+ * of calls made to it.
+ */
+
+static
+void
+cg_fn(FILE *f, int sym, uint32_t addr, int *cur)
+{
+	if (sym == *cur && sym >= 0) {
+		return;
+	}
+	*cur = sym;
+	if (sym >= 0) {
+		fprintf(f, "fn=%s\n", prof_syms[sym].ps_name);
+	}
+	else {
+		fprintf(f, "fn=0x%08x\n", addr);
+	}
+}
+
+static
+void
+prof_writecallgrind(struct profarc **arcs)
+{
+	struct profregion *pr;
+	struct profarc *pa;
+	uint64_t *self, *callsin, total, cost;
+	uint32_t addr;
+	unsigned i, j;
+	int sym, cur;
+	FILE *f;
+
+	f = fopen(PROFILE_CGFILE, "w");
+	if (!f) {
+		msg("Could not open %s (skipping)", PROFILE_CGFILE);
+		return;
+	}
+
+	/* one extra slot, for addresses with no symbol */
+	self = domalloc((prof_nsyms + 1) * sizeof(uint64_t));
+	callsin = domalloc((prof_nsyms + 1) * sizeof(uint64_t));
+	memset(self, 0, (prof_nsyms + 1) * sizeof(uint64_t));
+	memset(callsin, 0, (prof_nsyms + 1) * sizeof(uint64_t));
+
+	total = 0;
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		for (i=0; i<pr->pr_nbins; i++) {
+			if (pr->pr_samples[i] > 0) {
+				addr = pr->pr_base + i * PROF_BINSIZE;
+				sym = prof_findsym(addr);
+				self[sym < 0 ? prof_nsyms : (unsigned)sym] +=
+					pr->pr_samples[i];
+				total += pr->pr_samples[i];
+			}
+		}
+	}
+	for (i=0; i<prof_narcs; i++) {
+		sym = prof_findsym(arcs[i]->pa_to);
+		callsin[sym < 0 ? prof_nsyms : (unsigned)sym] +=
+			arcs[i]->pa_count;
+	}
+
+	fprintf(f, "version: 1\n");
+	fprintf(f, "creator: System/161 %s\n", VERSION);
+	fprintf(f, "cmd: %s\n", prof_image ? prof_image : "kernel");
+	fprintf(f, "positions: instr\n");
+	fprintf(f, "events: Samples\n");
+	fprintf(f, "summary: %llu\n", (unsigned long long)total);
+	fprintf(f, "\nob=%s\n", prof_image ? prof_image : "kernel");
+
+	/* self cost */
+	cur = -2;
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		for (i=0; i<pr->pr_nbins; i++) {
+			if (pr->pr_samples[i] == 0) {
+				continue;
+			}
+			addr = pr->pr_base + i * PROF_BINSIZE;
+			cg_fn(f, prof_findsym(addr), addr, &cur);
+			fprintf(f, "0x%08x %u\n", addr, pr->pr_samples[i]);
+		}
+	}
+
+	/* calls; a function may appear again, which adds up */
+	cur = -2;
+	for (i=0; i<prof_narcs; i++) {
+		pa = arcs[i];
+		cg_fn(f, prof_findsym(pa->pa_from), pa->pa_from, &cur);
+		sym = prof_findsym(pa->pa_to);
+		if (sym >= 0) {
+			fprintf(f, "cfn=%s\n", prof_syms[sym].ps_name);
+			cost = callsin[sym] == 0 ? 0 :
+				(uint64_t)((double)self[sym] * pa->pa_count /
+					   callsin[sym]);
+		}
+		else {
+			fprintf(f, "cfn=0x%08x\n", pa->pa_to);
+			cost = 0;
+		}
+		fprintf(f, "calls=%llu 0x%08x\n",
+			(unsigned long long)pa->pa_count, pa->pa_to);
+		fprintf(f, "0x%08x %llu\n", pa->pa_from,
+			(unsigned long long)cost);
+	}
+
+	free(callsin);
+	free(self);
+	finish_file(f, PROFILE_CGFILE);
+}
+
+/*
+ * pprof format: a perftools.profiles.Profile protocol buffer (see
+ * profile.proto in the pprof sources). pprof accepts it uncompressed,
+ * so we don't bother with gzip. We write it by hand; it's just nested
+ * length-prefixed records of varints.
+ *
+ * There are three sample types: samples, cpu time, and calls. Each
+ * histogram bin with samples is one sample whose only location is the
+ * bin. Each call graph arc is a sample with two locations, the callee
+ * entry point and the call site, carrying only the call count. So
+ * pprof's flat and cumulative views of the first two types are the
+ * same as gprof's self times, and the calls type gives the call graph.
+ */
+
+struct pbuf {
+	unsigned char *pb_data;
+	size_t pb_len;
+	size_t pb_max;
 };
 
-static uint32_t prof_textbase = 0;
-static uint32_t prof_textend = 0;
-static uint32_t prof_samplenum;
-static uint16_t *prof_sampledata;
-static struct cgbin *prof_cg;
-static int prof_on = 0;
-static int prof_active = 0;
+static
+void
+pb_byte(struct pbuf *pb, unsigned char c)
+{
+	if (pb->pb_len == pb->pb_max) {
+		pb->pb_max = pb->pb_max ? pb->pb_max * 2 : 256;
+		pb->pb_data = dorealloc(pb->pb_data, pb->pb_max);
+	}
+	pb->pb_data[pb->pb_len++] = c;
+}
 
+static
 void
-prof_enable(void)
+pb_varint(struct pbuf *pb, uint64_t val)
 {
-	if (prof_on) {
-		prof_active = 1;
+	while (val >= 0x80) {
+		pb_byte(pb, (val & 0x7f) | 0x80);
+		val >>= 7;
 	}
+	pb_byte(pb, val);
 }
 
+/* wire types */
+#define PB_VARINT	0
+#define PB_BYTES	2
+
+static
 void
-prof_disable(void)
+pb_uint(struct pbuf *pb, unsigned field, uint64_t val)
 {
-	prof_active = 0;
+	pb_varint(pb, (field << 3) | PB_VARINT);
+	pb_varint(pb, val);
 }
 
-int
-prof_isenabled(void)
+static
+void
+pb_bytes(struct pbuf *pb, unsigned field, const void *data, size_t len)
 {
-	return prof_active;
+	const unsigned char *p = data;
+	size_t i;
+
+	pb_varint(pb, (field << 3) | PB_BYTES);
+	pb_varint(pb, len);
+	for (i=0; i<len; i++) {
+		pb_byte(pb, p[i]);
+	}
 }
 
+/* append SUB to PB as field FIELD, and empty SUB for reuse */
 static
 void
-prof_sample(void *junk1, uint32_t junk2)
+pb_message(struct pbuf *pb, unsigned field, struct pbuf *sub)
 {
-	uint32_t pc;
-	unsigned bin;
+	pb_bytes(pb, field, sub->pb_data, sub->pb_len);
+	sub->pb_len = 0;
+}
 
-	(void)junk1;
-	(void)junk2;
+/* Profile fields */
+#define PPROF_SAMPLE_TYPE	1
+#define PPROF_SAMPLE		2
+#define PPROF_MAPPING		3
+#define PPROF_LOCATION		4
+#define PPROF_FUNCTION		5
+#define PPROF_STRING_TABLE	6
+#define PPROF_PERIOD_TYPE	11
+#define PPROF_PERIOD		12
 
-	if (prof_active) {
-		pc = cpuprof_sample();
-		bin = PROF_ADDR2BIN(pc);
+/* fixed string table entries; symbol names follow */
+#define PPROF_S_SAMPLES		1
+#define PPROF_S_COUNT		2
+#define PPROF_S_CPU		3
+#define PPROF_S_NANOSECONDS	4
+#define PPROF_S_CALLS		5
+#define PPROF_S_IMAGE		6
+#define PPROF_S_UNKNOWN		7
+#define PPROF_S_SYMS		8
 
-		if (bin < prof_samplenum) {
-			prof_sampledata[bin]++;
-		}
+static
+int
+prof_addrcmp(const void *av, const void *bv)
+{
+	uint32_t a = *(const uint32_t *)av;
+	uint32_t b = *(const uint32_t *)bv;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* location ids are indexes into the sorted address list, plus 1 */
+static
+uint64_t
+pprof_locid(const uint32_t *addrs, unsigned naddrs, uint32_t addr)
+{
+	const uint32_t *p;
+
+	p = bsearch(&addr, addrs, naddrs, sizeof(uint32_t), prof_addrcmp);
+	if (p == NULL) {
+		smoke("pprof: lost track of address 0x%08x", addr);
 	}
+	return (p - addrs) + 1;
+}
 
-	schedule_event(PROFILE_NSECS, NULL, 0, prof_sample, 
-		       "profiling sampler");
+static
+void
+pprof_valuetype(struct pbuf *pb, unsigned field, unsigned type,
+		unsigned unit, struct pbuf *tmp)
+{
+	pb_uint(tmp, 1, type);
+	pb_uint(tmp, 2, unit);
+	pb_message(pb, field, tmp);
 }
 
+static
 void
-prof_call(uint32_t frompc, uint32_t topc)
+prof_writepprof(struct profarc **arcs)
 {
-	unsigned bin;
-	struct cgbin *cb;
-	struct cgentry *ce;
+	struct pbuf pb, sub, vals;
+	struct profregion *pr;
+	uint32_t *addrs, lowpc, highpc, n;
+	unsigned naddrs, i, j, k;
+	const char *str;
+	int sym;
+	FILE *f;
 
-	if (prof_active==0) {
-		return;
+	memset(&pb, 0, sizeof(pb));
+	memset(&sub, 0, sizeof(sub));
+	memset(&vals, 0, sizeof(vals));
+
+	/* collect the addresses we need locations for */
+	naddrs = 2 * prof_narcs;
+	for (j=0; j<prof_nregions; j++) {
+		naddrs += prof_regions[j].pr_nbins;
+	}
+	addrs = domalloc((naddrs + 1) * sizeof(uint32_t));
+	naddrs = 0;
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		for (i=0; i<pr->pr_nbins; i++) {
+			if (pr->pr_samples[i] > 0) {
+				addrs[naddrs++] = pr->pr_base + i*PROF_BINSIZE;
+			}
+		}
+	}
+	for (i=0; i<prof_narcs; i++) {
+		addrs[naddrs++] = arcs[i]->pa_from;
+		addrs[naddrs++] = arcs[i]->pa_to;
 	}
+	qsort(addrs, naddrs, sizeof(uint32_t), prof_addrcmp);
+	for (i=j=0; i<naddrs; i++) {
+		if (j == 0 || addrs[i] != addrs[j-1]) {
+			addrs[j++] = addrs[i];
+		}
+	}
+	naddrs = j;
 
-	bin = PROF_ADDR2BIN(frompc);
-	if (bin >= prof_samplenum) {
-		/* out of range; skip */
-		return;
+	pprof_valuetype(&pb, PPROF_SAMPLE_TYPE,
+			PPROF_S_SAMPLES, PPROF_S_COUNT, &sub);
+	pprof_valuetype(&pb, PPROF_SAMPLE_TYPE,
+			PPROF_S_CPU, PPROF_S_NANOSECONDS, &sub);
+	pprof_valuetype(&pb, PPROF_SAMPLE_TYPE,
+			PPROF_S_CALLS, PPROF_S_COUNT, &sub);
+
+	/* samples: histogram bins */
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		for (i=0; i<pr->pr_nbins; i++) {
+			n = pr->pr_samples[i];
+			if (n == 0) {
+				continue;
+			}
+			pb_varint(&vals, pprof_locid(addrs, naddrs,
+					     pr->pr_base + i*PROF_BINSIZE));
+			pb_message(&sub, 1, &vals);
+			pb_varint(&vals, n);
+			pb_varint(&vals, (uint64_t)n * PROFILE_NSECS);
+			pb_varint(&vals, 0);
+			pb_message(&sub, 2, &vals);
+			pb_message(&pb, PPROF_SAMPLE, &sub);
+		}
 	}
 
-	cb = &prof_cg[bin];
+	/* samples: call graph arcs, callee first */
+	for (i=0; i<prof_narcs; i++) {
+		pb_varint(&vals, pprof_locid(addrs, naddrs, arcs[i]->pa_to));
+		pb_varint(&vals, pprof_locid(addrs, naddrs,
+					     arcs[i]->pa_from));
+		pb_message(&sub, 1, &vals);
+		pb_varint(&vals, 0);
+		pb_varint(&vals, 0);
+		pb_varint(&vals, arcs[i]->pa_count);
+		pb_message(&sub, 2, &vals);
+		pb_message(&pb, PPROF_SAMPLE, &sub);
+	}
 
-	for (ce = cb->list; ce; ce = ce->next) {
-		if (ce->gce.gce_from == frompc &&
-		    ce->gce.gce_to == topc) {
-			ce->gce.gce_count++;
-			return;
+	/* one mapping, covering all the kernel text */
+	lowpc = 0xffffffff;
+	highpc = 0;
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		if (pr->pr_base < lowpc) {
+			lowpc = pr->pr_base;
+		}
+		if (pr->pr_end > highpc) {
+			highpc = pr->pr_end;
 		}
 	}
+	pb_uint(&sub, 1, 1);			/* id */
+	pb_uint(&sub, 2, lowpc);		/* memory_start */
+	pb_uint(&sub, 3, highpc);		/* memory_limit */
+	pb_uint(&sub, 5, PPROF_S_IMAGE);	/* filename */
+	pb_uint(&sub, 7, 1);			/* has_functions */
+	pb_message(&pb, PPROF_MAPPING, &sub);
 
-	/* need to add a new entry */
-	ce = malloc(sizeof(struct cgentry));
-	if (ce==NULL) {
-		msg("malloc failed updating profiling data");
-		die();
+	/* locations */
+	for (i=0; i<naddrs; i++) {
+		sym = prof_findsym(addrs[i]);
+		pb_uint(&sub, 1, i + 1);		/* id */
+		pb_uint(&sub, 2, 1);			/* mapping_id */
+		pb_uint(&sub, 3, addrs[i]);		/* address */
+		/* line: function_id */
+		pb_uint(&vals, 1, sym < 0 ? prof_nsyms + 1 : (unsigned)sym + 1);
+		pb_message(&sub, 4, &vals);
+		pb_message(&pb, PPROF_LOCATION, &sub);
+	}
+
+	/* functions: one per symbol, plus one for unknown addresses */
+	for (k=0; k<=prof_nsyms; k++) {
+		pb_uint(&sub, 1, k + 1);			/* id */
+		pb_uint(&sub, 2, k < prof_nsyms ?		/* name */
+			PPROF_S_SYMS + k : PPROF_S_UNKNOWN);
+		pb_uint(&sub, 3, k < prof_nsyms ?		/* system_name */
+			PPROF_S_SYMS + k : PPROF_S_UNKNOWN);
+		pb_message(&pb, PPROF_FUNCTION, &sub);
 	}
-	ce->gce.gce_from = frompc;
-	ce->gce.gce_to = topc;
-	ce->gce.gce_count = 1;
 
-	/* add to head of list */
-	ce->next = cb->list;
-	cb->list = ce;
+	/* string table, which must be in order */
+	for (k=0; k<PPROF_S_SYMS + prof_nsyms; k++) {
+		switch (k) {
+		    case 0: str = ""; break;
+		    case PPROF_S_SAMPLES: str = "samples"; break;
+		    case PPROF_S_COUNT: str = "count"; break;
+		    case PPROF_S_CPU: str = "cpu"; break;
+		    case PPROF_S_NANOSECONDS: str = "nanoseconds"; break;
+		    case PPROF_S_CALLS: str = "calls"; break;
+		    case PPROF_S_IMAGE:
+			str = prof_image ? prof_image : "kernel";
+			break;
+		    case PPROF_S_UNKNOWN: str = "[unknown]"; break;
+		    default: str = prof_syms[k - PPROF_S_SYMS].ps_name; break;
+		}
+		pb_bytes(&pb, PPROF_STRING_TABLE, str, strlen(str));
+	}
+
+	pprof_valuetype(&pb, PPROF_PERIOD_TYPE,
+			PPROF_S_CPU, PPROF_S_NANOSECONDS, &sub);
+	pb_uint(&pb, PPROF_PERIOD, PROFILE_NSECS);
+
+	f = fopen(PROFILE_PPROFFILE, "w");
+	if (!f) {
+		msg("Could not open %s (skipping)", PROFILE_PPROFFILE);
+	}
+	else {
+		fwrite(pb.pb_data, 1, pb.pb_len, f);
+		finish_file(f, PROFILE_PPROFFILE);
+	}
+
+	free(vals.pb_data);
+	free(sub.pb_data);
+	free(pb.pb_data);
+	free(addrs);
+}
+
+/*
+ * Exact mode output. This is also in callgrind format, with one
+ * event per kind of cycle, and a line for every instruction that
+ * was charged anything. User code goes under a separate object for
+ * each ASID, with a function per page since we have no symbols for
+ * it.
+ */
+
+static
+int
+prof_exactcmp(const void *av, const void *bv)
+{
+	const struct exactpage *a = *(const struct exactpage *const *)av;
+	const struct exactpage *b = *(const struct exactpage *const *)bv;
+
+	if (a->ep_asid != b->ep_asid) {
+		/* kernel (PROF_KASID) last */
+		return a->ep_asid < b->ep_asid ? -1 : 1;
+	}
+	if (a->ep_vpage != b->ep_vpage) {
+		return a->ep_vpage < b->ep_vpage ? -1 : 1;
+	}
+	return 0;
 }
 
+static
 void
-prof_clear(void)
+prof_writeexact(void)
 {
-	struct cgentry *ce;
-	unsigned i;
+	struct exactpage **pages, *ep;
+	uint64_t total[PROF_NCOUNTS], *counts, cycles;
+	unsigned npages, i, j, k;
+	uint32_t addr, curasid, curpage;
+	int sym, cursym;
+	FILE *f;
 
-	if (prof_on == 0) {
+	npages = 0;
+	for (i=0; i<PROF_USERHASH; i++) {
+		for (ep = prof_exactpages[i]; ep; ep = ep->ep_next) {
+			npages++;
+		}
+	}
+	pages = domalloc((npages + 1) * sizeof(*pages));
+	npages = 0;
+	memset(total, 0, sizeof(total));
+	for (i=0; i<PROF_USERHASH; i++) {
+		for (ep = prof_exactpages[i]; ep; ep = ep->ep_next) {
+			pages[npages++] = ep;
+			for (j=0; j<PROF_PAGEINSNS; j++) {
+				for (k=0; k<PROF_NCOUNTS; k++) {
+					total[k] += ep->ep_counts[j][k];
+				}
+			}
+		}
+	}
+	qsort(pages, npages, sizeof(*pages), prof_exactcmp);
+
+	f = fopen(PROFILE_EXACTFILE, "w");
+	if (!f) {
+		msg("Could not open %s (skipping)", PROFILE_EXACTFILE);
+		free(pages);
 		return;
 	}
 
-	for (i=0; i<prof_samplenum; i++) {
-		prof_sampledata[i] = 0;
-		while (prof_cg[i].list != NULL) {
-			ce = prof_cg[i].list;
-			prof_cg[i].list = prof_cg[i].list->next;
-			free(ce);
+	fprintf(f, "version: 1\n");
+	fprintf(f, "creator: System/161 %s\n", VERSION);
+	fprintf(f, "cmd: %s\n", prof_image ? prof_image : "kernel");
+	fprintf(f, "positions: instr\n");
+	fprintf(f, "event: Cycles : Cycles\n");
+	fprintf(f, "event: Instr : Instructions retired\n");
+	fprintf(f, "event: TLB : TLB miss cycles\n");
+	fprintf(f, "event: Exn : Other exception cycles\n");
+	fprintf(f, "event: Stall : Stall cycles (hi/lo)\n");
+	fprintf(f, "event: IrqOff : Cycles with interrupts off\n");
+	fprintf(f, "events: Cycles Instr TLB Exn Stall IrqOff\n");
+	fprintf(f, "summary: %llu %llu %llu %llu %llu %llu\n",
+		(unsigned long long)(total[PROF_RETIRED] +
+				     total[PROF_TLBMISS] +
+				     total[PROF_EXCEPTION] +
+				     total[PROF_STALL]),
+		(unsigned long long)total[PROF_RETIRED],
+		(unsigned long long)total[PROF_TLBMISS],
+		(unsigned long long)total[PROF_EXCEPTION],
+		(unsigned long long)total[PROF_STALL],
+		(unsigned long long)total[PROF_IRQOFF]);
+
+	curasid = 0;
+	curpage = 0;
+	cursym = -2;
+	for (i=0; i<npages; i++) {
+		ep = pages[i];
+		if (i == 0 || ep->ep_asid != curasid) {
+			curasid = ep->ep_asid;
+			if (curasid == PROF_KASID) {
+				fprintf(f, "\nob=%s\n",
+					prof_image ? prof_image : "kernel");
+			}
+			else {
+				fprintf(f, "\nob=asid%u\n", curasid);
+			}
+			cursym = -2;
+		}
+		if (curasid != PROF_KASID) {
+			fprintf(f, "fn=0x%08x\n", ep->ep_vpage);
+		}
+		for (j=0; j<PROF_PAGEINSNS; j++) {
+			counts = ep->ep_counts[j];
+			cycles = counts[PROF_RETIRED] + counts[PROF_TLBMISS] +
+				counts[PROF_EXCEPTION] + counts[PROF_STALL];
+			if (cycles == 0) {
+				continue;
+			}
+			addr = ep->ep_vpage + j*4;
+			if (curasid == PROF_KASID) {
+				/* unknown kernel code gets a fn per page */
+				sym = prof_findsym(addr);
+				if (sym < 0 && (cursym != -1 ||
+						curpage != ep->ep_vpage)) {
+					cursym = -1;
+					curpage = ep->ep_vpage;
+					fprintf(f, "fn=0x%08x\n", curpage);
+				}
+				else if (sym >= 0 && sym != cursym) {
+					cursym = sym;
+					fprintf(f, "fn=%s\n",
+						prof_syms[sym].ps_name);
+				}
+			}
+			fprintf(f, "0x%08x %llu %llu %llu %llu %llu %llu\n",
+				addr, (unsigned long long)cycles,
+				(unsigned long long)counts[PROF_RETIRED],
+				(unsigned long long)counts[PROF_TLBMISS],
+				(unsigned long long)counts[PROF_EXCEPTION],
+				(unsigned long long)counts[PROF_STALL],
+				(unsigned long long)counts[PROF_IRQOFF]);
 		}
 	}
+
+	finish_file(f, PROFILE_EXACTFILE);
+	free(pages);
 }
 
+/*
+ * Folded stacks, one line per distinct stack, outermost frame first,
+ * as expected by flamegraph.pl:
+ *	trace161 -P kernel
+ *	flamegraph.pl profile.folded > kernel.svg
+ */
+
 static
 void
-writebyte(int val, FILE *f)
+prof_writefolded(void)
 {
-	uint8_t byte = val;
-	fwrite(&byte, 1, sizeof(uint8_t), f);
+	struct profstack *st;
+	unsigned i, j;
+	uint32_t frame;
+	int sym;
+	FILE *f;
+
+	f = fopen(PROFILE_FOLDEDFILE, "w");
+	if (!f) {
+		msg("Could not open %s (skipping)", PROFILE_FOLDEDFILE);
+		return;
+	}
+
+	for (i=0; i<PROF_STACKHASH; i++) {
+		for (st = prof_stacks[i]; st; st = st->st_next) {
+			if (st->st_asid != PROF_KASID) {
+				fprintf(f, "[user asid%u]", st->st_asid);
+			}
+			for (j=st->st_depth; j-- > 0; ) {
+				frame = st->st_frames[j];
+				sym = prof_findsym(frame);
+				if (sym >= 0 &&
+				    prof_syms[sym].ps_addr == frame) {
+					fprintf(f, "%s", prof_syms[sym].ps_name);
+				}
+				else {
+					fprintf(f, "0x%08x", frame);
+				}
+				fprintf(f, "%s", j > 0 ? ";" : "");
+			}
+			fprintf(f, " %llu\n", (unsigned long long)st->st_count);
+		}
+	}
+
+	finish_file(f, PROFILE_FOLDEDFILE);
 }
 
 void
 prof_write(void)
 {
 	FILE *f;
-	struct gmon_file_header gfh;
-	struct gmon_histogram_header ghh;
 	struct gmon_callgraph_entry gcetmp;
-	struct cgbin *cb;
-	struct cgentry *ce;
-	unsigned i;
-	unsigned long len;
+	struct profregion *pr;
+	struct profarc **arcs, *pa;
+	unsigned i, j;
 
 	if (prof_on == 0) {
 		return;
 	}
 
+	arcs = prof_sortarcs();
+
 	f = fopen(PROFILE_FILE, "w");
 	if (!f) {
 		msg("Could not open %s (skipping)", PROFILE_FILE);
-		return;
+		goto others;
 	}
 
 	/* file header */
-	memset(&gfh, 0, sizeof(gfh));
-	memcpy(gfh.gfh_magic, "gmon", 4);
-	gfh.gfh_version = htonl(GMON_VERSION);
-	fwrite(&gfh, 1, sizeof(gfh), f);
+	write_header(f);
 
-	/* histogram */
-	writebyte(GMON_RT_HISTOGRAM, f);
-	memset(&ghh, 0, sizeof(ghh));
-	ghh.ghh_lowpc = htonl(prof_textbase);
-	ghh.ghh_highpc = htonl(prof_textend);
-	ghh.ghh_size = htonl(prof_samplenum);
-	ghh.ghh_hz = htonl(PROFILE_HZ);
-	strcpy(ghh.ghh_name, "seconds");
-	ghh.ghh_abbrev = 's';
-	fwrite(&ghh, 1, sizeof(ghh), f);
-	for (i=0; i<prof_samplenum; i++) {
-		uint16_t tmp = htons(prof_sampledata[i]);
-		fwrite(&tmp, 1, sizeof(tmp), f);
+	/* histograms */
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		write_histogram(f, pr->pr_base, pr->pr_nbins, pr->pr_samples);
 	}
 
-	/* call graph */
-	for (i=0; i<prof_samplenum; i++) {
-		cb = &prof_cg[i];
-		for (ce = cb->list; ce; ce = ce->next) {
-			writebyte(GMON_RT_CALLGRAPH, f);
-			gcetmp.gce_from = htonl(ce->gce.gce_from);
-			gcetmp.gce_to = htonl(ce->gce.gce_to);
-			gcetmp.gce_count = htonl(ce->gce.gce_count);
-			fwrite(&gcetmp, 1, sizeof(gcetmp), f);
-		}
+	/* call graph; gmon.out counts are only 32 bits */
+	for (i=0; i<prof_narcs; i++) {
+		pa = arcs[i];
+		writebyte(GMON_RT_CALLGRAPH, f);
+		gcetmp.gce_from = htonl(pa->pa_from);
+		gcetmp.gce_to = htonl(pa->pa_to);
+		gcetmp.gce_count = htonl(pa->pa_count > 0xffffffff ?
+					 0xffffffff : pa->pa_count);
+		fwrite(&gcetmp, 1, sizeof(gcetmp), f);
 	}
 
-	fflush(f);
-	if (ferror(f)) {
-		msg("Warning: error writing %s", PROFILE_FILE);
+	finish_file(f, PROFILE_FILE);
+
+ others:
+	prof_writecallgrind(arcs);
+	prof_writepprof(arcs);
+	free(arcs);
+
+	if (prof_wantexact) {
+		prof_writeexact();
 	}
-	else {
-		len = ftell(f);
-		msg("%lu bytes written to %s", len, PROFILE_FILE);
+	prof_writefolded();
+
+	prof_writeuser();
+}
+
+/*
+ * Merge region J into region I and close up the slot it leaves.
+ */
+static
+void
+prof_mergeregion(unsigned i, unsigned j)
+{
+	if (prof_regions[j].pr_base < prof_regions[i].pr_base) {
+		prof_regions[i].pr_base = prof_regions[j].pr_base;
+	}
+	if (prof_regions[j].pr_end > prof_regions[i].pr_end) {
+		prof_regions[i].pr_end = prof_regions[j].pr_end;
+	}
+	prof_nregions--;
+	for (; j<prof_nregions; j++) {
+		prof_regions[j] = prof_regions[j+1];
 	}
-	fclose(f);
 }
 
 void
 prof_addtext(uint32_t textbase, uint32_t textsize)
 {
-	uint32_t textend;
-
-	/* Round size up to a multiple of PROF_BINSIZE, which is a power of 2*/
-	textsize = (textsize+PROF_BINSIZE+1) & ~(uint32_t)PROF_BINSIZE;
+	struct profregion *pr;
+	uint32_t textend, gap, bestgap;
+	unsigned i, j;
 
 	if (textsize==0) {
 		/* just in case */
 		return;
 	}
 
+	/* Round out to whole bins; PROF_BINSIZE is a power of 2 */
 	textend = textbase + textsize;
+	textbase &= ~(uint32_t)(PROF_BINSIZE-1);
+	textend = (textend + PROF_BINSIZE-1) & ~(uint32_t)(PROF_BINSIZE-1);
+	if (textend <= textbase) {
+		smoke("Profiling text region corrupt");
+	}
 
-	if (prof_textbase==0 && prof_textend==0) {
-		prof_textbase = textbase;
-		prof_textend = textend;
+	/* Merge with an existing region if it overlaps or touches */
+	for (i=0; i<prof_nregions; i++) {
+		pr = &prof_regions[i];
+		if (textbase <= pr->pr_end && textend >= pr->pr_base) {
+			break;
+		}
 	}
-	else {
-		if (textbase < prof_textbase) {
-			prof_textbase = textbase;
+	if (i == prof_nregions) {
+		if (prof_nregions < PROF_MAXREGIONS) {
+			pr = &prof_regions[prof_nregions++];
+			pr->pr_base = textbase;
+			pr->pr_end = textend;
+			return;
 		}
-		if (textend > prof_textend) {
-			prof_textend = textend;
+		/*
+		 * Out of slots; grow whichever region is closest to
+		 * cover this one too, and the gap in between.
+		 */
+		bestgap = 0xffffffff;
+		for (j=0; j<prof_nregions; j++) {
+			pr = &prof_regions[j];
+			gap = textbase >= pr->pr_end ?
+				textbase - pr->pr_end : pr->pr_base - textend;
+			if (gap < bestgap) {
+				bestgap = gap;
+				i = j;
+			}
 		}
 	}
-	if (prof_textend <= prof_textbase) {
-		smoke("Profiling text region corrupt");
+	pr = &prof_regions[i];
+	if (textbase < pr->pr_base) {
+		pr->pr_base = textbase;
+	}
+	if (textend > pr->pr_end) {
+		pr->pr_end = textend;
+	}
+
+	/*
+	 * The bigger region may now overlap or touch others; fold them
+	 * in too, so no address is in more than one region. Start over
+	 * after each merge, since the region has grown again.
+	 */
+	j = 0;
+	while (j < prof_nregions) {
+		pr = &prof_regions[i];
+		if (j != i && prof_regions[j].pr_base <= pr->pr_end &&
+		    prof_regions[j].pr_end >= pr->pr_base) {
+			prof_mergeregion(i, j);
+			if (j < i) {
+				i--;
+			}
+			j = 0;
+		}
+		else {
+			j++;
+		}
 	}
+	prof_lastregion = NULL;
 }
 
 void
-prof_setup(void)
+prof_addsym(uint32_t addr, uint32_t size, const char *name)
 {
-	unsigned i;
+	struct profsym *ps;
 
-	if (prof_textbase==0 && prof_textend==0) {
-		/* no text to profile? */
+	/* only functions in kernel text are interesting */
+	if (prof_findregion(addr) == NULL) {
 		return;
 	}
 
-	if (prof_textend <= prof_textbase) {
-		smoke("Profiling text region corrupt");
+	if (prof_nsyms == prof_maxsyms) {
+		prof_maxsyms = prof_maxsyms ? prof_maxsyms * 2 : 256;
+		prof_syms = dorealloc(prof_syms,
+				      prof_maxsyms * sizeof(struct profsym));
+	}
+	ps = &prof_syms[prof_nsyms++];
+	ps->ps_addr = addr;
+	ps->ps_end = size > 0 ? addr + size : 0;
+	ps->ps_name = domalloc(strlen(name) + 1);
+	strcpy(ps->ps_name, name);
+}
+
+void
+prof_setimage(const char *path)
+{
+	prof_image = domalloc(strlen(path) + 1);
+	strcpy(prof_image, path);
+}
+
+/*
+ * Sort the symbols, drop duplicates, and fill in the ends of ones
+ * that didn't come with a size.
+ */
+static
+void
+prof_sortsyms(void)
+{
+	struct profregion *pr;
+	unsigned i, j;
+
+	qsort(prof_syms, prof_nsyms, sizeof(struct profsym), prof_symcmp);
+	for (i=j=0; i<prof_nsyms; i++) {
+		if (j > 0 && prof_syms[i].ps_addr == prof_syms[j-1].ps_addr) {
+			free(prof_syms[i].ps_name);
+			continue;
+		}
+		prof_syms[j++] = prof_syms[i];
+	}
+	prof_nsyms = j;
+
+	for (i=0; i<prof_nsyms; i++) {
+		if (prof_syms[i].ps_end != 0) {
+			continue;
+		}
+		pr = prof_findregion(prof_syms[i].ps_addr);
+		prof_syms[i].ps_end = pr->pr_end;
+		if (i+1 < prof_nsyms &&
+		    prof_syms[i+1].ps_addr < prof_syms[i].ps_end) {
+			prof_syms[i].ps_end = prof_syms[i+1].ps_addr;
+		}
 	}
+}
 
-	/* note: prof_textend has already been rounded up appropriately */
-	prof_samplenum = (prof_textend - prof_textbase) / PROF_BINSIZE;
+void
+prof_setup(int exact)
+{
+	struct profregion *pr;
+	unsigned i, j;
 
-	prof_sampledata = malloc(sizeof(uint16_t)*prof_samplenum);
-	if (prof_sampledata==NULL) {
-		msg("malloc failed");
-		die();
+	if (prof_nregions == 0) {
+		/* no text to profile? */
+		return;
 	}
 
-	prof_cg = malloc(sizeof(struct cgbin)*prof_samplenum);
-	if (prof_cg==NULL) {
-		msg("malloc failed");
-		die();
+	for (j=0; j<prof_nregions; j++) {
+		pr = &prof_regions[j];
+		if (pr->pr_end <= pr->pr_base) {
+			smoke("Profiling text region corrupt");
+		}
+
+		/* note: pr_end has already been rounded up appropriately */
+		pr->pr_nbins = (pr->pr_end - pr->pr_base) / PROF_BINSIZE;
+
+		pr->pr_samples = malloc(sizeof(uint32_t)*pr->pr_nbins);
+		if (pr->pr_samples==NULL) {
+			msg("malloc failed");
+			die();
+		}
+
+		for (i=0; i<pr->pr_nbins; i++) {
+			pr->pr_samples[i] = 0;
+		}
 	}
 
-	for (i=0; i<prof_samplenum; i++) {
-		prof_sampledata[i] = 0;
-		prof_cg[i].list = NULL;
+	prof_arcsize = PROF_ARCHASH;
+	prof_arctable = domalloc(prof_arcsize * sizeof(struct profarc *));
+	memset(prof_arctable, 0, prof_arcsize * sizeof(struct profarc *));
+
+	prof_sortsyms();
+
+	if (exact) {
+		prof_exactlast = domalloc(cpu_numcpus() *
+					  sizeof(struct exactpage *));
+		memset(prof_exactlast, 0,
+		       cpu_numcpus() * sizeof(struct exactpage *));
+		prof_wantexact = 1;
+		prof_exact = 1;
 	}
 
 	prof_on = 1;
@@ -1,8 +1,12 @@
+#include <sys/types.h>
+#include <stdint.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include "config.h"
 
 #include "console.h"
+#include "clock.h"
 #include "trace.h"
 
 
@@ -109,4 +113,323 @@ print_traceflags_usage(void)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// filters
+
+/*
+ * The trace flags say what to trace; the filters say when. Devices
+ * are only subject to the time window. For cpus, the cpu code calls
+ * trace_filtercpu() at the start of every cycle while any filter is
+ * set, and that decides whether the cpu's trace output for the cycle
+ * goes out, by way of its bit in g_tracecpuok. So with filters set,
+ * tracing something narrow costs one call per cycle instead of
+ * formatting everything and throwing most of it away.
+ */
+
+#define MAXPCRANGES 16
+
+int g_tracefilter;
+uint32_t g_tracecpuok = 0xffffffff;
+
+static uint32_t tf_cpus = 0xffffffff;
+static int tf_useasids;
+static uint64_t tf_asids;
+static unsigned tf_npcranges;
+static struct {
+	uint32_t lo, hi;
+} tf_pcranges[MAXPCRANGES];
+static uint32_t tf_pclo;		/* from TRACEREG_FPCLO */
+static uint64_t tf_timefrom, tf_timeto = UINT64_MAX;
+static uint64_t tf_insnfrom, tf_insnto = UINT64_MAX;
+
+static
+void
+trace_filterupdate(void)
+{
+	g_tracefilter = tf_cpus != 0xffffffff || tf_useasids ||
+		tf_npcranges > 0 ||
+		tf_timefrom > 0 || tf_timeto != UINT64_MAX ||
+		tf_insnfrom > 0 || tf_insnto != UINT64_MAX;
+	if (!g_tracefilter) {
+		g_tracecpuok = 0xffffffff;
+	}
+}
+
+void
+trace_filtercpu(unsigned cpunum, uint32_t pc, uint32_t asid, uint64_t ninsns)
+{
+	int ok;
+	uint64_t now;
+	unsigned i;
+
+	ok = (tf_cpus >> cpunum) & 1;
+	if (ok && tf_useasids) {
+		ok = (tf_asids >> (asid & 63)) & 1;
+	}
+	if (ok && tf_npcranges > 0) {
+		ok = 0;
+		for (i=0; i<tf_npcranges; i++) {
+			if (pc >= tf_pcranges[i].lo && pc < tf_pcranges[i].hi) {
+				ok = 1;
+				break;
+			}
+		}
+	}
+	if (ok) {
+		ok = ninsns >= tf_insnfrom && ninsns < tf_insnto;
+	}
+	if (ok && (tf_timefrom > 0 || tf_timeto != UINT64_MAX)) {
+		now = clock_monotime();
+		ok = now >= tf_timefrom && now < tf_timeto;
+	}
+
+	if (ok) {
+		g_tracecpuok |= (uint32_t)1 << cpunum;
+	}
+	else {
+		g_tracecpuok &= ~((uint32_t)1 << cpunum);
+	}
+}
+
+int
+trace_filterhw(void)
+{
+	uint64_t now;
+
+	if (tf_timefrom == 0 && tf_timeto == UINT64_MAX) {
+		return 1;
+	}
+	now = clock_monotime();
+	return now >= tf_timefrom && now < tf_timeto;
+}
+
+void
+trace_clearfilters(void)
+{
+	tf_cpus = 0xffffffff;
+	tf_useasids = 0;
+	tf_asids = 0;
+	tf_npcranges = 0;
+	tf_timefrom = 0;
+	tf_timeto = UINT64_MAX;
+	tf_insnfrom = 0;
+	tf_insnto = UINT64_MAX;
+	trace_filterupdate();
+}
+
+void
+trace_filtercpus(uint32_t mask)
+{
+	tf_cpus = mask;
+	trace_filterupdate();
+}
+
+void
+trace_filterasid(uint32_t asid)
+{
+	tf_useasids = 1;
+	tf_asids |= (uint64_t)1 << (asid & 63);
+	trace_filterupdate();
+}
+
+/* returns -1 if there are too many ranges */
+int
+trace_filterpc(uint32_t lo, uint32_t hi)
+{
+	if (tf_npcranges >= MAXPCRANGES) {
+		return -1;
+	}
+	tf_pcranges[tf_npcranges].lo = lo;
+	tf_pcranges[tf_npcranges].hi = hi;
+	tf_npcranges++;
+	trace_filterupdate();
+	return 0;
+}
+
+void
+trace_filterpclo(uint32_t lo)
+{
+	tf_pclo = lo;
+}
+
+int
+trace_filterpchi(uint32_t hi)
+{
+	return trace_filterpc(tf_pclo, hi);
+}
+
+void
+trace_filtertime(uint64_t from, uint64_t to)
+{
+	tf_timefrom = from;
+	tf_timeto = to;
+	trace_filterupdate();
+}
+
+/*
+ * Parse FROM-TO, where either may be omitted, using GETNUM for each
+ * number. Returns -1 if it's malformed.
+ */
+static
+int
+trace_parserange(const char *spec, uint64_t (*getnum)(const char *, char **),
+		 uint64_t *from, uint64_t *to)
+{
+	char *end;
+
+	*from = 0;
+	*to = UINT64_MAX;
+	if (*spec != '-') {
+		*from = getnum(spec, &end);
+		if (end == spec || *end != '-') {
+			return -1;
+		}
+		spec = end;
+	}
+	spec++;
+	if (*spec != 0) {
+		*to = getnum(spec, &end);
+		if (end == spec || *end != 0 || *to <= *from) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+uint64_t
+trace_getsecs(const char *s, char **end)
+{
+	return (uint64_t)(strtod(s, end) * 1000000000.0 + 0.5);
+}
+
+static
+uint64_t
+trace_getcount(const char *s, char **end)
+{
+	return strtoull(s, end, 0);
+}
+
+static
+uint64_t
+trace_gethex(const char *s, char **end)
+{
+	return strtoul(s, end, 16);
+}
+
+/*
+ * Command-line filter spec: comma-separated list of
+ *    cpu=N        only this cpu (may be repeated)
+ *    asid=N       only this address space (may be repeated)
+ *    pc=LO-HI     only these addresses, in hex (may be repeated)
+ *    time=T1-T2   only between these virtual times, in seconds
+ *    insns=N1-N2  only between these instruction counts (per cpu)
+ */
+void
+trace_addfilter(const char *spec)
+{
+	char buf[128], *s, *next, *val, *end;
+	unsigned long n;
+	uint64_t from, to;
+	int bad;
+
+	if (strlen(spec) >= sizeof(buf)) {
+		msg("Trace filter too long");
+		die();
+	}
+	strcpy(buf, spec);
+
+	for (s = buf; s != NULL; s = next) {
+		next = strchr(s, ',');
+		if (next != NULL) {
+			*next++ = 0;
+		}
+		val = strchr(s, '=');
+		if (val == NULL) {
+			msg("Invalid trace filter %s", s);
+			die();
+		}
+		*val++ = 0;
+		bad = 0;
+		if (!strcmp(s, "cpu")) {
+			n = strtoul(val, &end, 0);
+			bad = *val == 0 || *end != 0 || n >= 32;
+			if (!bad) {
+				if (tf_cpus == 0xffffffff) {
+					tf_cpus = 0;
+				}
+				tf_cpus |= (uint32_t)1 << n;
+			}
+		}
+		else if (!strcmp(s, "asid")) {
+			n = strtoul(val, &end, 0);
+			bad = *val == 0 || *end != 0 || n >= 64;
+			if (!bad) {
+				trace_filterasid(n);
+			}
+		}
+		else if (!strcmp(s, "pc")) {
+			bad = trace_parserange(val, trace_gethex, &from, &to);
+			if (!bad && to == UINT64_MAX) {
+				to = 0xffffffff;
+			}
+			bad = bad || to > 0xffffffff ||
+				trace_filterpc(from, to);
+		}
+		else if (!strcmp(s, "time")) {
+			bad = trace_parserange(val, trace_getsecs, &from, &to);
+			if (!bad) {
+				trace_filtertime(from, to);
+			}
+		}
+		else if (!strcmp(s, "insns")) {
+			bad = trace_parserange(val, trace_getcount,
+					       &tf_insnfrom, &tf_insnto);
+		}
+		else {
+			msg("Unknown trace filter %s", s);
+			die();
+		}
+		if (bad) {
+			msg("Invalid trace filter %s=%s", s, val);
+			die();
+		}
+	}
+	trace_filterupdate();
+}
+
+void
+print_tracefilters(void)
+{
+	unsigned i;
+
+	if (!g_tracefilter) {
+		return;
+	}
+	msgl("Trace filters:");
+	if (tf_cpus != 0xffffffff) {
+		msgl(" cpus 0x%x", tf_cpus);
+	}
+	if (tf_useasids) {
+		msgl(" asids 0x%llx", (unsigned long long)tf_asids);
+	}
+	for (i=0; i<tf_npcranges; i++) {
+		msgl(" pc %x-%x", tf_pcranges[i].lo, tf_pcranges[i].hi);
+	}
+	if (tf_timefrom > 0 || tf_timeto != UINT64_MAX) {
+		msgl(" time %llu-", (unsigned long long)tf_timefrom);
+		if (tf_timeto != UINT64_MAX) {
+			msgl("%llu", (unsigned long long)tf_timeto);
+		}
+		msgl(" ns");
+	}
+	if (tf_insnfrom > 0 || tf_insnto != UINT64_MAX) {
+		msgl(" insns %llu-", (unsigned long long)tf_insnfrom);
+		if (tf_insnto != UINT64_MAX) {
+			msgl("%llu", (unsigned long long)tf_insnto);
+		}
+	}
+	msg(" ");
+}
+
 #endif /* USE_TRACE */
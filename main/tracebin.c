@@ -0,0 +1,292 @@
+/*
+ * Binary trace output (trace161 -B).
+ *
+ * Formatting every instruction as text is what makes instruction
+ * traces slow and huge. In binary mode, instructions are written as
+ * fixed-size records with no formatting at all; everything else that
+ * would have been trace text (exceptions, TLB operations, devices) is
+ * still formatted, since there isn't much of it, but is written as
+ * text records. See tracefmt.h for the file format, and
+ * trace161-decode for turning it back into text.
+ *
+ * The file is written by the trace writer (tracewr.c), which also
+ * does the compression, on its own thread.
+ */
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#include "console.h"
+#include "clock.h"
+#include "util.h"
+#include "trace.h"
+#include "tracebin.h"
+#include "tracefmt.h"
+#include "tracewr.h"
+
+
+#ifdef USE_TRACE
+
+#define TRACEBIN_MAXLINE	1024
+
+int g_tracebinary;
+
+static const char *tracebin_name;
+static FILE *tracebin_f;
+#ifdef HAS_ZLIB
+static gzFile tracebin_gz;
+#endif
+
+/* line of text in progress, as from cputracel() */
+static char tracebin_line[TRACEBIN_MAXLINE];
+static size_t tracebin_linelen;
+static unsigned tracebin_linekind, tracebin_linecpu, tracebin_lineflag;
+
+/*
+ * Trace writer callbacks. tracebin_write runs on the writer thread.
+ */
+static
+int
+tracebin_write(void *data, const void *buf, size_t len)
+{
+	size_t r;
+
+	(void)data;
+#ifdef HAS_ZLIB
+	if (tracebin_gz != NULL) {
+		r = gzwrite(tracebin_gz, buf, len);
+	}
+	else
+#endif
+	{
+		r = fwrite(buf, 1, len, tracebin_f);
+	}
+	if (r != len) {
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+static
+void
+tracebin_flushfile(void *data)
+{
+	(void)data;
+#ifdef HAS_ZLIB
+	if (tracebin_gz != NULL) {
+		gzflush(tracebin_gz, Z_SYNC_FLUSH);
+		return;
+	}
+#endif
+	fflush(tracebin_f);
+}
+
+static
+void
+tracebin_rawrec(unsigned kind, unsigned cpunum, unsigned flag,
+		unsigned status, uint32_t pc, uint32_t insn,
+		uint32_t a, uint32_t b, uint32_t c)
+{
+	struct tracefmt_rec tr;
+	uint64_t now;
+
+	now = clock_monotime();
+	tr.tr_kind = kind;
+	tr.tr_cpu = cpunum;
+	tr.tr_flag = flag;
+	tr.tr_status = status;
+	tr.tr_timehi = htonl((uint32_t)(now >> 32));
+	tr.tr_timelo = htonl((uint32_t)now);
+	tr.tr_pc = htonl(pc);
+	tr.tr_insn = htonl(insn);
+	tr.tr_a = htonl(a);
+	tr.tr_b = htonl(b);
+	tr.tr_c = htonl(c);
+	tracewr_put(&tr, sizeof(tr));
+}
+
+/*
+ * Start a record. If the trace writer has been dropping records, put
+ * in a note saying so first.
+ */
+static
+void
+tracebin_rec(unsigned kind, unsigned cpunum, unsigned flag,
+	     unsigned status, uint32_t pc, uint32_t insn,
+	     uint32_t a, uint32_t b, uint32_t c)
+{
+	char note[64];
+	unsigned long drops;
+	int len;
+
+	drops = tracewr_takedrops();
+	if (drops > 0) {
+		len = snprintf(note, sizeof(note),
+			       "[%lu trace records dropped]", drops);
+		tracewr_record(1);
+		tracebin_rawrec(TRACEFMT_HWTEXT, 0, TRACEFMT_NOTE, 0,
+				0, 0, len, 0, 0);
+		tracewr_put(note, len);
+	}
+	tracewr_record(kind == TRACEFMT_CONSOLE);
+	tracebin_rawrec(kind, cpunum, flag, status, pc, insn, a, b, c);
+}
+
+static
+void
+tracebin_endline(void)
+{
+	tracebin_rec(tracebin_linekind, tracebin_linecpu, tracebin_lineflag,
+		     0, 0, 0, tracebin_linelen, 0, 0);
+	tracewr_put(tracebin_line, tracebin_linelen);
+	tracebin_linelen = 0;
+}
+
+void
+tracebin_insn(unsigned cpunum, int k, uint32_t pc, uint32_t insn,
+	      uint32_t rsval, uint32_t rtval, uint32_t result,
+	      unsigned status)
+{
+	tracebin_rec(TRACEFMT_INSN, cpunum, k, status, pc, insn,
+		     rsval, rtval, result);
+}
+
+/*
+ * Trace text. A line may be built up over several calls; it's written
+ * when it's finished (EOL is set), or when a different cpu or device
+ * starts one, the same way the text trace breaks lines.
+ */
+void
+tracebin_vtext(int hw, unsigned cpunum, int k, int eol,
+	       const char *fmt, va_list ap)
+{
+	unsigned kind;
+	size_t room;
+	int r;
+
+	kind = hw ? TRACEFMT_HWTEXT : TRACEFMT_CPUTEXT;
+	if (tracebin_linelen > 0 &&
+	    (tracebin_linekind != kind || tracebin_linecpu != cpunum)) {
+		tracebin_endline();
+	}
+	if (tracebin_linelen == 0) {
+		tracebin_linekind = kind;
+		tracebin_linecpu = cpunum;
+		tracebin_lineflag = k;
+	}
+
+	room = sizeof(tracebin_line) - tracebin_linelen;
+	r = vsnprintf(tracebin_line + tracebin_linelen, room, fmt, ap);
+	if (r > 0) {
+		/* if it didn't fit, it's truncated */
+		tracebin_linelen += (size_t)r < room ? (size_t)r : room - 1;
+	}
+
+	if (eol) {
+		tracebin_endline();
+	}
+}
+
+void
+tracebin_console(int ch)
+{
+	tracebin_rec(TRACEFMT_CONSOLE, 0, 0, 0, 0, 0, (unsigned char)ch, 0, 0);
+}
+
+void
+tracebin_open(const char *filename)
+{
+	struct tracefmt_header th;
+	size_t len;
+
+	if (g_tracebinary) {
+		smoke("Multiple calls to tracebin_open");
+	}
+
+	len = strlen(filename);
+	if (len > 3 && !strcmp(filename + len - 3, ".gz")) {
+#ifdef HAS_ZLIB
+		/* fastest compression; it's still a big win on traces */
+		tracebin_gz = gzopen(filename, "wb1");
+		if (tracebin_gz == NULL) {
+			msg("Cannot open tracefile %s: %s",
+			    filename, strerror(errno));
+			die();
+		}
+#else
+		msg("Cannot write %s: no zlib support", filename);
+		die();
+#endif
+	}
+	else {
+		tracebin_f = fopen(filename, "wb");
+		if (tracebin_f == NULL) {
+			msg("Cannot open tracefile %s: %s",
+			    filename, strerror(errno));
+			die();
+		}
+	}
+	tracebin_name = filename;
+	tracewr_open(filename, tracebin_write, tracebin_flushfile, NULL);
+
+	memset(&th, 0, sizeof(th));
+	strcpy(th.th_magic, TRACEFMT_MAGIC);
+	th.th_version = htonl(TRACEFMT_VERSION);
+	th.th_recsize = htonl(sizeof(struct tracefmt_rec));
+	tracewr_record(1);
+	tracewr_put(&th, sizeof(th));
+
+	g_tracebinary = 1;
+}
+
+/*
+ * Push everything out to the file, e.g. before crashing.
+ */
+void
+tracebin_flush(void)
+{
+	if (!g_tracebinary) {
+		return;
+	}
+	tracewr_sync();
+}
+
+void
+tracebin_close(void)
+{
+	if (!g_tracebinary) {
+		return;
+	}
+	if (tracebin_linelen > 0) {
+		tracebin_endline();
+	}
+	tracewr_close();
+	g_tracebinary = 0;
+#ifdef HAS_ZLIB
+	if (tracebin_gz != NULL) {
+		if (gzclose(tracebin_gz) != Z_OK) {
+			msg("Error closing %s", tracebin_name);
+		}
+		tracebin_gz = NULL;
+	}
+	else
+#endif
+	{
+		if (fclose(tracebin_f) != 0) {
+			msg("Error closing %s: %s", tracebin_name,
+			    strerror(errno));
+		}
+		tracebin_f = NULL;
+	}
+}
+
+#endif /* USE_TRACE */
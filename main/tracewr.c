@@ -0,0 +1,631 @@
+/*
+ * Trace writer.
+ *
+ * Traces are written far faster than a disk will take them, and
+ * writing them synchronously leaves the simulator waiting on I/O
+ * much of the time. Instead, trace output goes into a chunk of
+ * memory, and full chunks are handed to a helper thread that writes
+ * them out while the simulation carries on.
+ *
+ * The whole machine is simulated on the main thread, so there is only
+ * one producer; there's no point in per-cpu buffers, which would only
+ * have to be merged back in order. Appending to the current chunk
+ * touches nothing the writer thread looks at and takes no lock; the
+ * lock is taken only to hand off a full chunk and pick up an empty one.
+ *
+ * If all the chunks are full when the simulator needs an empty one,
+ * the policy (trace161 -O) decides:
+ *    block    wait for the writer (the default; nothing is lost)
+ *    drop     throw away the records in the current chunk, counting
+ *             them and leaving a notice in the trace
+ *    sample   once the writer is more than half a buffer behind, keep
+ *             only one trace record in N (default 16) until it catches
+ *             up; if it gets all the way behind, wait
+ */
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+
+#include "console.h"
+#include "util.h"
+#include "thread.h"
+#include "tracewr.h"
+
+
+#ifdef USE_TRACE
+
+#define TRACEWR_NCHUNKS		16
+#define TRACEWR_CHUNKSIZE	(1024*1024)
+#define TRACEWR_DEFSAMPLE	16
+
+#define TRACEWR_BLOCK		0
+#define TRACEWR_DROP		1
+#define TRACEWR_SAMPLE		2
+
+struct twchunk {
+	char *tc_buf;
+	size_t tc_len;
+	size_t tc_recstart;	/* offset of the record in progress */
+	unsigned long tc_nrecs;	/* records begun in this chunk */
+};
+
+static unsigned tw_policy = TRACEWR_BLOCK;
+static unsigned tw_samplerate = TRACEWR_DEFSAMPLE;
+
+static int tw_open;
+static const char *tw_name;
+static int (*tw_writefn)(void *data, const void *buf, size_t len);
+static void (*tw_flushfn)(void *data);
+static void *tw_data;
+
+/*
+ * Chunks tw_tail through tw_head-1 (mod TRACEWR_NCHUNKS) are waiting
+ * for or being written by the writer thread; chunk tw_head is being
+ * filled. tw_head belongs to the main thread and tw_tail to the writer
+ * thread; both, and tw_error and tw_exiting, are protected by tw_lock.
+ */
+static struct twchunk tw_chunks[TRACEWR_NCHUNKS];
+static unsigned tw_head, tw_tail;
+static int tw_error;
+static int tw_exiting;
+static pthread_mutex_t tw_lock;
+static pthread_cond_t tw_workcv;	/* chunk queued, or exiting */
+static pthread_cond_t tw_donecv;	/* chunk written */
+static pthread_t tw_thread;
+
+/* main thread only */
+static struct twchunk *tw_cur;
+static int tw_skipping;		/* discarding the current record */
+static int tw_sampling;		/* the writer is behind */
+static unsigned tw_samplecount;
+static unsigned long tw_dropped, tw_newdrops, tw_sampledout;
+static int tw_errreported;
+
+void
+tracewr_setpolicy(const char *spec)
+{
+	char *end;
+	unsigned long n;
+
+	if (!strcmp(spec, "block")) {
+		tw_policy = TRACEWR_BLOCK;
+	}
+	else if (!strcmp(spec, "drop")) {
+		tw_policy = TRACEWR_DROP;
+	}
+	else if (!strcmp(spec, "sample")) {
+		tw_policy = TRACEWR_SAMPLE;
+		tw_samplerate = TRACEWR_DEFSAMPLE;
+	}
+	else if (!strncmp(spec, "sample:", 7)) {
+		n = strtoul(spec + 7, &end, 0);
+		if (*end != 0 || n < 1 || n > 1000000) {
+			msg("Invalid sampling rate %s", spec + 7);
+			die();
+		}
+		tw_policy = TRACEWR_SAMPLE;
+		tw_samplerate = n;
+	}
+	else {
+		msg("Invalid trace overflow policy %s", spec);
+		msg("(expected block, drop, sample, or sample:N)");
+		die();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// writer thread
+
+static
+void *
+tracewr_thread(void *unused)
+{
+	struct twchunk *tc;
+	int err;
+
+	(void)unused;
+
+	pthread_mutex_lock(&tw_lock);
+	while (1) {
+		while (tw_tail == tw_head && !tw_exiting) {
+			pthread_cond_wait(&tw_workcv, &tw_lock);
+		}
+		if (tw_tail == tw_head) {
+			break;
+		}
+		tc = &tw_chunks[tw_tail % TRACEWR_NCHUNKS];
+		err = tw_error;
+		pthread_mutex_unlock(&tw_lock);
+
+		/* after an error, just keep the queue moving */
+		if (err == 0) {
+			err = tw_writefn(tw_data, tc->tc_buf, tc->tc_len);
+		}
+
+		pthread_mutex_lock(&tw_lock);
+		if (err != 0 && tw_error == 0) {
+			tw_error = err;
+		}
+		tw_tail++;
+		pthread_cond_broadcast(&tw_donecv);
+	}
+	pthread_mutex_unlock(&tw_lock);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// handing off chunks
+
+static
+void
+tracewr_checkerror(int err)
+{
+	if (err != 0 && !tw_errreported) {
+		tw_errreported = 1;
+		msg("Error writing %s: %s", tw_name, strerror(err));
+		die();
+	}
+}
+
+/*
+ * Queue the current chunk, up to offset LEN, and start filling the
+ * next one with whatever comes after LEN. Call with tw_lock held.
+ */
+static
+void
+tracewr_queue(size_t len)
+{
+	struct twchunk *next;
+	size_t carry;
+
+	carry = tw_cur->tc_len - len;
+	tw_cur->tc_len = len;
+	tw_head++;
+	pthread_cond_signal(&tw_workcv);
+
+	while (tw_head - tw_tail >= TRACEWR_NCHUNKS) {
+		pthread_cond_wait(&tw_donecv, &tw_lock);
+	}
+	next = &tw_chunks[tw_head % TRACEWR_NCHUNKS];
+
+	/* the writer doesn't look past tc_len, so this is safe */
+	memcpy(next->tc_buf, tw_cur->tc_buf + len, carry);
+	next->tc_len = carry;
+	next->tc_recstart = 0;
+	next->tc_nrecs = carry > 0 ? 1 : 0;
+	tw_cur = next;
+}
+
+/*
+ * The current chunk has no room for NEED more bytes of the record in
+ * progress. Pass on the complete records in it, one way or another.
+ */
+static
+void
+tracewr_switch(size_t need)
+{
+	size_t len, carry;
+	unsigned long nrecs;
+	int err;
+
+	len = tw_cur->tc_recstart;
+	if (len == 0 || tw_cur->tc_len - len + need > TRACEWR_CHUNKSIZE) {
+		/* one huge record; split it */
+		len = tw_cur->tc_len;
+	}
+
+	pthread_mutex_lock(&tw_lock);
+	if (tw_policy == TRACEWR_DROP &&
+	    tw_head + 1 - tw_tail >= TRACEWR_NCHUNKS) {
+		/* no room; throw away the complete records instead */
+		carry = tw_cur->tc_len - len;
+		nrecs = tw_cur->tc_nrecs - (carry > 0 ? 1 : 0);
+		tw_dropped += nrecs;
+		tw_newdrops += nrecs;
+		memmove(tw_cur->tc_buf, tw_cur->tc_buf + len, carry);
+		tw_cur->tc_len = carry;
+		tw_cur->tc_recstart = 0;
+		tw_cur->tc_nrecs = carry > 0 ? 1 : 0;
+	}
+	else {
+		tracewr_queue(len);
+	}
+	tw_sampling = (tw_head - tw_tail) > TRACEWR_NCHUNKS / 2;
+	err = tw_error;
+	pthread_mutex_unlock(&tw_lock);
+
+	tracewr_checkerror(err);
+}
+
+////////////////////////////////////////////////////////////
+// producer interface
+
+int
+tracewr_record(int always)
+{
+	if (tw_sampling && tw_policy == TRACEWR_SAMPLE && !always) {
+		if (++tw_samplecount < tw_samplerate) {
+			tw_sampledout++;
+			tw_skipping = 1;
+			return 0;
+		}
+		tw_samplecount = 0;
+	}
+	tw_skipping = 0;
+	tw_cur->tc_recstart = tw_cur->tc_len;
+	tw_cur->tc_nrecs++;
+	return 1;
+}
+
+void
+tracewr_put(const void *buf, size_t len)
+{
+	if (tw_skipping) {
+		return;
+	}
+	if (tw_cur->tc_len + len > TRACEWR_CHUNKSIZE) {
+		tracewr_switch(len);
+		if (len > TRACEWR_CHUNKSIZE - tw_cur->tc_len) {
+			/* can only happen with absurd records */
+			len = TRACEWR_CHUNKSIZE - tw_cur->tc_len;
+		}
+	}
+	memcpy(tw_cur->tc_buf + tw_cur->tc_len, buf, len);
+	tw_cur->tc_len += len;
+}
+
+/*
+ * Format into BUF, handling only what trace messages use: %d, %i, %u,
+ * %x, %X, %c, %s, and %%, with an optional 0 flag, width, and l or ll.
+ * Returns -1 for anything else, or if it doesn't fit, and the caller
+ * falls back to vsnprintf.
+ *
+ * This is here because vsnprintf has to set up a string stream on
+ * every call, which costs noticeably more than vfprintf on a real
+ * stream; with many short calls per line of trace, it adds up.
+ */
+static
+int
+tracewr_quickfmt(char *buf, size_t room, const char *fmt, va_list ap)
+{
+	static const char lowerdigits[] = "0123456789abcdef";
+	static const char upperdigits[] = "0123456789ABCDEF";
+	char tmp[24];
+	char *p, *end;
+	const char *digits, *str;
+	unsigned long long val;
+	long long sval;
+	unsigned base, width, lng, ntmp, slen, neg, pad, i;
+	int zero;
+
+	p = buf;
+	end = buf + room;
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			if (p == end) {
+				return -1;
+			}
+			*p++ = *fmt;
+			continue;
+		}
+		fmt++;
+		zero = 0;
+		if (*fmt == '0') {
+			zero = 1;
+			fmt++;
+		}
+		width = 0;
+		while (*fmt >= '0' && *fmt <= '9') {
+			width = width*10 + (*fmt - '0');
+			if (width > 64) {
+				return -1;
+			}
+			fmt++;
+		}
+		lng = 0;
+		while (*fmt == 'l' && lng < 2) {
+			lng++;
+			fmt++;
+		}
+
+		neg = 0;
+		base = 10;
+		digits = lowerdigits;
+		str = NULL;
+		slen = 0;
+		switch (*fmt) {
+		    case 'd':
+		    case 'i':
+			sval = lng == 2 ? va_arg(ap, long long) :
+				lng == 1 ? va_arg(ap, long) : va_arg(ap, int);
+			neg = sval < 0;
+			val = neg ? -(unsigned long long)sval :
+				(unsigned long long)sval;
+			break;
+		    case 'X':
+			digits = upperdigits;
+			/* FALLTHROUGH */
+		    case 'x':
+			base = 16;
+			/* FALLTHROUGH */
+		    case 'u':
+			val = lng == 2 ? va_arg(ap, unsigned long long) :
+				lng == 1 ? va_arg(ap, unsigned long) :
+				va_arg(ap, unsigned);
+			break;
+		    case 'c':
+			tmp[0] = va_arg(ap, int);
+			str = tmp;
+			slen = 1;
+			break;
+		    case 's':
+			str = va_arg(ap, const char *);
+			if (str == NULL) {
+				return -1;
+			}
+			slen = strlen(str);
+			break;
+		    case '%':
+			if (zero || width > 0 || lng > 0) {
+				return -1;
+			}
+			str = "%";
+			slen = 1;
+			break;
+		    default:
+			return -1;
+		}
+
+		if (str != NULL) {
+			if (zero) {
+				return -1;
+			}
+			pad = width > slen ? width - slen : 0;
+			if ((size_t)(end - p) < pad + slen) {
+				return -1;
+			}
+			for (i=0; i<pad; i++) {
+				*p++ = ' ';
+			}
+			memcpy(p, str, slen);
+			p += slen;
+			continue;
+		}
+
+		ntmp = 0;
+		do {
+			tmp[ntmp++] = digits[val % base];
+			val /= base;
+		} while (val > 0);
+		pad = width > ntmp + neg ? width - ntmp - neg : 0;
+		if ((size_t)(end - p) < pad + neg + ntmp) {
+			return -1;
+		}
+		if (!zero) {
+			for (i=0; i<pad; i++) {
+				*p++ = ' ';
+			}
+		}
+		if (neg) {
+			*p++ = '-';
+		}
+		if (zero) {
+			for (i=0; i<pad; i++) {
+				*p++ = '0';
+			}
+		}
+		while (ntmp > 0) {
+			*p++ = tmp[--ntmp];
+		}
+	}
+	return p - buf;
+}
+
+void
+tracewr_vprintf(const char *fmt, va_list ap)
+{
+	va_list ap2;
+	size_t room;
+	int r;
+
+	if (tw_skipping) {
+		return;
+	}
+
+	/* format straight into the chunk if it fits, as it usually does */
+	room = TRACEWR_CHUNKSIZE - tw_cur->tc_len;
+	va_copy(ap2, ap);
+	r = tracewr_quickfmt(tw_cur->tc_buf + tw_cur->tc_len, room, fmt, ap2);
+	va_end(ap2);
+	if (r >= 0) {
+		tw_cur->tc_len += r;
+		return;
+	}
+	va_copy(ap2, ap);
+	r = vsnprintf(tw_cur->tc_buf + tw_cur->tc_len, room, fmt, ap2);
+	va_end(ap2);
+	if (r < 0) {
+		return;
+	}
+	if ((size_t)r >= room) {
+		tracewr_switch(r + 1);
+		room = TRACEWR_CHUNKSIZE - tw_cur->tc_len;
+		r = vsnprintf(tw_cur->tc_buf + tw_cur->tc_len, room, fmt, ap);
+		if (r < 0) {
+			return;
+		}
+		if ((size_t)r >= room) {
+			r = room - 1;
+		}
+	}
+	tw_cur->tc_len += r;
+}
+
+unsigned long
+tracewr_takedrops(void)
+{
+	unsigned long ret;
+
+	ret = tw_newdrops;
+	tw_newdrops = 0;
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// setup, sync, and shutdown
+
+void
+tracewr_open(const char *name,
+	     int (*writefn)(void *data, const void *buf, size_t len),
+	     void (*flushfn)(void *data), void *data)
+{
+	unsigned i;
+
+	if (tw_open) {
+		smoke("Multiple calls to tracewr_open");
+	}
+
+	tw_name = name;
+	tw_writefn = writefn;
+	tw_flushfn = flushfn;
+	tw_data = data;
+
+	for (i=0; i<TRACEWR_NCHUNKS; i++) {
+		tw_chunks[i].tc_buf = domalloc(TRACEWR_CHUNKSIZE);
+		tw_chunks[i].tc_len = 0;
+		tw_chunks[i].tc_recstart = 0;
+		tw_chunks[i].tc_nrecs = 0;
+	}
+	tw_head = tw_tail = 0;
+	tw_cur = &tw_chunks[0];
+	tw_error = 0;
+	tw_exiting = 0;
+	tw_skipping = 0;
+	tw_sampling = 0;
+	tw_samplecount = 0;
+	tw_dropped = tw_newdrops = tw_sampledout = 0;
+	tw_errreported = 0;
+
+	pthread_mutex_init(&tw_lock, NULL);
+	pthread_cond_init(&tw_workcv, NULL);
+	pthread_cond_init(&tw_donecv, NULL);
+	dothread(&tw_thread, tracewr_thread, NULL);
+	tw_open = 1;
+}
+
+void
+tracewr_sync(void)
+{
+	int err;
+
+	if (!tw_open) {
+		return;
+	}
+
+	pthread_mutex_lock(&tw_lock);
+	if (tw_cur->tc_len > 0) {
+		tracewr_queue(tw_cur->tc_len);
+	}
+	while (tw_tail != tw_head) {
+		pthread_cond_wait(&tw_donecv, &tw_lock);
+	}
+	err = tw_error;
+	pthread_mutex_unlock(&tw_lock);
+
+	if (tw_flushfn != NULL) {
+		tw_flushfn(tw_data);
+	}
+	tracewr_checkerror(err);
+}
+
+/*
+ * On a fatal signal, give the writer thread a few seconds to finish
+ * up. The main thread might have been interrupted holding the lock,
+ * so never wait for it.
+ */
+void
+tracewr_sigflush(void)
+{
+	struct timespec ts;
+	unsigned i;
+	int done;
+
+	if (!tw_open) {
+		return;
+	}
+	if (pthread_mutex_trylock(&tw_lock) != 0) {
+		return;
+	}
+	if (tw_cur->tc_len > 0 && tw_head + 1 - tw_tail < TRACEWR_NCHUNKS) {
+		tracewr_queue(tw_cur->tc_len);
+	}
+	pthread_mutex_unlock(&tw_lock);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10*1000*1000;
+	for (i=0; i<500; i++) {
+		if (pthread_mutex_trylock(&tw_lock) == 0) {
+			done = tw_tail == tw_head;
+			pthread_mutex_unlock(&tw_lock);
+			if (done) {
+				break;
+			}
+		}
+		nanosleep(&ts, NULL);
+	}
+	if (tw_flushfn != NULL) {
+		tw_flushfn(tw_data);
+	}
+}
+
+void
+tracewr_close(void)
+{
+	unsigned i;
+
+	if (!tw_open) {
+		return;
+	}
+
+	/* don't die from here; we're usually already on the way out */
+	tw_errreported = 1;
+	tracewr_sync();
+
+	pthread_mutex_lock(&tw_lock);
+	tw_exiting = 1;
+	pthread_cond_broadcast(&tw_workcv);
+	pthread_mutex_unlock(&tw_lock);
+	pthread_join(tw_thread, NULL);
+
+	if (tw_error != 0) {
+		msg("Error writing %s: %s", tw_name, strerror(tw_error));
+	}
+	if (tw_dropped > 0) {
+		msg("Trace writer fell behind: %lu records dropped",
+		    tw_dropped);
+	}
+	if (tw_sampledout > 0) {
+		msg("Trace writer fell behind: %lu records sampled out",
+		    tw_sampledout);
+	}
+
+	pthread_cond_destroy(&tw_donecv);
+	pthread_cond_destroy(&tw_workcv);
+	pthread_mutex_destroy(&tw_lock);
+	for (i=0; i<TRACEWR_NCHUNKS; i++) {
+		free(tw_chunks[i].tc_buf);
+		tw_chunks[i].tc_buf = NULL;
+	}
+	tw_cur = NULL;
+	tw_open = 0;
+}
+
+#endif /* USE_TRACE */
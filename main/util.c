@@ -3,9 +3,12 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "console.h"
 #include "util.h"
+#include "thread.h"
 
 
 void *
@@ -18,6 +21,31 @@ domalloc(size_t len)
 	return x;
 }
 
+void *
+dorealloc(void *x, size_t len)
+{
+	x = realloc(x, len);
+	if (!x) {
+		smoke("Out of memory");
+	}
+	return x;
+}
+
+void
+dothread(pthread_t *ret, void *(*func)(void *), void *data)
+{
+	sigset_t all, old;
+	int r;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(ret, NULL, func, data);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		smoke("pthread_create: %s", strerror(r));
+	}
+}
+
 void
 dohexdump(const char *buf, size_t len)
 {
@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <stdarg.h>
 #include <string.h>
 #include "config.h"
 
@@ -11,7 +12,10 @@
 #include "gdb.h"
 #include "main.h"
 #include "trace.h"
+#include "tracebin.h"
+#include "tracefmt.h"
 #include "prof.h"
+#include "flight.h"
 #include "memdefs.h"
 #include "inlinemem.h"
 
@@ -139,7 +143,9 @@
 #define CAUSE_BD		0x80000000	/* branch-delay flag */
 /*				0x40000000	   RESERVED set to 0 */
 #define CAUSE_CE		0x30000000	/* coprocessor # of exn */
-/*				0x0fff0000	   RESERVED set to 0 */
+/*				0x08000000	   RESERVED set to 0 */
+#define CAUSE_PCI		0x04000000	/* perf counter irq pending */
+/*				0x03ff0000	   RESERVED set to 0 */
 #define CAUSE_HARDIRQ_TIMER	0x00008000	/* on-chip timer bit */
 /*				0x00007000	   unused hardware irqs */
 #define CAUSE_HARDIRQ_IPI	0x00000800	/* lamebus IPI bit */
@@ -149,6 +155,40 @@
 #define CAUSE_EXCODE		0x0000003c	/* exception code */
 /*				0x00000003	   RESERVED Set to 0 */
 
+/* performance counter control register fields */
+#define PERFCTL_MORE		0x80000000	/* another counter follows */
+/*				0x7ffff800	   RESERVED set to 0 */
+#define PERFCTL_EVENT		0x000007e0	/* event to count */
+#define PERFCTL_IE		0x00000010	/* interrupt on overflow */
+#define PERFCTL_U		0x00000008	/* count in user mode */
+/*      PERFCTL_S		0x00000004	   supervisor mode (none) */
+#define PERFCTL_K		0x00000002	/* count in kernel mode */
+/*      PERFCTL_EXL		0x00000001	   exception level (none) */
+#define PERFCTL_WRITABLE	(PERFCTL_EVENT|PERFCTL_IE|PERFCTL_U|PERFCTL_K)
+#define PERFCTL_GETEVENT(ctl)	(((ctl) & PERFCTL_EVENT) >> 5)
+
+/* a counter with this bit set (and PERFCTL_IE) raises an interrupt */
+#define PERFCNT_OVERFLOW	0x80000000
+
+/* performance counter events (numbering is ours; mips32 leaves it open) */
+#define PERFEV_CYCLES		0	/* cycles (not counting WAIT) */
+#define PERFEV_INSNS		1	/* instructions retired */
+#define PERFEV_TLBMISS		2	/* TLB miss exceptions */
+#define PERFEV_EXNS		3	/* exceptions other than interrupts */
+#define PERFEV_IRQS		4	/* interrupts taken */
+#define PERFEV_SCOK		5	/* SC succeeded */
+#define PERFEV_SCFAIL		6	/* SC failed */
+#define PERFEV_LOADS		7	/* loads retired, including LL */
+#define PERFEV_STORES		8	/* stores retired, including SC */
+#define PERFEV_BRANCHES		9	/* branches and jumps taken */
+#define PERFEV_ICMISS		10	/* icache misses (cache model only) */
+#define PERFEV_DCMISS		11	/* dcache misses (cache model only) */
+#define PERFEV_DCWBACK		12	/* dcache writebacks (cache model only) */
+#define PERFEV_EXCODE(code)	(16 + (code))	/* exceptions by code */
+
+/* number of performance counters */
+#define NPERF			2
+
 /* tlb random register parameters (it ranges from 8 to 63) */
 #define RANDREG_MAX		56
 #define RANDREG_OFFSET		8
@@ -258,6 +298,10 @@
 #define C0_CONFIG5 REGSEL(16, 5)
 #define C0_CONFIG6 REGSEL(16, 6)
 #define C0_CONFIG7 REGSEL(16, 7)
+#define C0_PERFCTL0 REGSEL(25, 0)
+#define C0_PERFCNT0 REGSEL(25, 1)
+#define C0_PERFCTL1 REGSEL(25, 2)
+#define C0_PERFCNT1 REGSEL(25, 3)
 
 /* Version IDs for C0_PRID */
 #define PRID_VALUE_ANCIENT	0xbeef    /* sys161 <= 0.95 */
@@ -291,11 +335,35 @@ struct mipstlb {
 	uint32_t mt_pid;	// address space id
 };
 
+struct mipsperf {
+	uint32_t mp_ctl;	// PERFCTL_WRITABLE bits only
+	uint32_t mp_count;
+};
+
+/*
+ * L1 cache model (optional; see cpu_setcache). The caches only keep
+ * tags: memory is still read and written directly, and the model just
+ * works out what would have hit or missed.
+ */
+struct mipscacheline {
+	uint32_t ml_line;	// physical address >> cache_lineshift
+	int ml_valid;
+	int ml_dirty;		// dcache only
+	uint64_t ml_used;	// time of last use, for LRU
+};
+
+struct mipscache {
+	struct mipscacheline *mc_lines;	// all the sets, way by way
+	uint64_t mc_clock;	// counts uses, for LRU
+	uint32_t mc_rand;	// generator state, for random replacement
+};
+
 /* possible states for a cpu */
 enum cpustates {
 	CPU_DISABLED,
 	CPU_IDLE,
 	CPU_RUNNING,
+	CPU_STALLED,	// running, but waiting for a cache miss
 };
 
 struct mipscpu {
@@ -314,6 +382,12 @@ struct mipscpu {
 	// pipeline stall logic
 	int lowait, hiwait; // cycles to wait for lo/hi to become ready
 
+	// for exact profiling: exception taken this cycle, or -1
+	int prof_excode;
+
+	// flight recorder ring for this cpu
+	struct flightring *flight;
+
 	// "jumping" is set by the jump instruction.
 	// "in_jumpdelay" is set during decoding of the instruction in a jump 
 	// delay slot.
@@ -335,10 +409,13 @@ struct mipscpu {
 	uint32_t nextpcoff;	// page offset of nextpc
 	const uint32_t *pcpage;	// precomputed memory page of pc
 	const uint32_t *nextpcpage;	// precomputed memory page of nextpc
+	uint32_t pcphys;	// physical page of pc, | 1 if uncached
+	uint32_t nextpcphys;	// physical page of nextpc, | 1 if uncached
 
 	// mmu
 	struct mipstlb tlb[NTLB];
 	struct mipstlb tlbentry;	// cop0 register 2 (lo) and 10 (hi)
+	int uncached;		// last address translated was uncached
 #ifdef USE_TLBMAP
 	uint8_t tlbmap[1024*1024];	// vpn -> tlbentry map
 #endif
@@ -407,12 +484,26 @@ struct mipscpu {
 	uint32_t ex_compare;	// cop0 register 11
 	int ex_compare_used;	// timer irq disabled if not set
 
+	/*
+	 * performance counters (cop0 register 25, selects 0-3)
+	 */
+	struct mipsperf perf[NPERF];
+	int perf_on;		// nonzero if any counter is counting
+
 	/*
 	 * interrupt bits
 	 */
 	int irq_lamebus;
 	int irq_ipi;
 	int irq_timer;
+	int irq_perf;		// counter overflow; shares the timer line
+
+	/*
+	 * L1 cache model, if turned on
+	 */
+	struct mipscache icache;
+	struct mipscache dcache;
+	unsigned cachestall;	// cycles left to wait for memory
 
 	/*
 	 * LL/SC hooks
@@ -432,6 +523,29 @@ struct mipscpu {
 static struct mipscpu *mycpus;
 static unsigned ncpus;
 
+/*
+ * For the L1 cache model's entry points, so that when it's off, it
+ * stays out of the way of the main loop.
+ */
+#ifdef __GNUC__
+#define COLD __attribute__((__noinline__, __cold__))
+#else
+#define COLD
+#endif
+
+/*
+ * L1 cache geometry; the icache and dcache are the same, on all cpus.
+ * Unless cpu_setcache is called the caches aren't modeled, but this
+ * is still what CONFIG1 reports and what CACHE instructions decode.
+ */
+static int cache_on;
+static unsigned cache_setshift = 6;	// log2 of number of sets
+static unsigned cache_ways = 4;
+static unsigned cache_waybits = 2;	// log2 of ways, rounded up
+static unsigned cache_lineshift = 4;	// log2 of line size
+static int cache_random;		// random replacement, not LRU
+static unsigned cache_misscycles;	// stall cycles per miss
+
 /*
  * Hold cpu->state == CPU_RUNNING across all cpus, for rapid testing.
  */
@@ -481,6 +595,7 @@ exception_name(int code)
  */
 static int precompute_pc(struct mipscpu *cpu);
 static int precompute_nextpc(struct mipscpu *cpu);
+static void cache_init(struct mipscache *mc, unsigned cpunum);
 
 /*
  * The MIPS doesn't clear the TLB on reset, so it's perfectly correct
@@ -514,6 +629,20 @@ mips_init(struct mipscpu *cpu, unsigned cpunum)
 	}
 	cpu->lo = cpu->hi = 0;
 	cpu->lowait = cpu->hiwait = 0;
+	cpu->prof_excode = -1;
+	cpu->flight = flight_cpuring(cpunum);
+
+	if (cache_on) {
+		cache_init(&cpu->icache, cpunum);
+		cache_init(&cpu->dcache, cpunum);
+	}
+	else {
+		cpu->icache.mc_lines = NULL;
+		cpu->dcache.mc_lines = NULL;
+	}
+	cpu->cachestall = 0;
+	cpu->uncached = 0;
+	cpu->pcphys = cpu->nextpcphys = 0;
 
 	for (i=0; i<NTLB; i++) {
 		reset_tlbentry(&cpu->tlb[i], i);
@@ -555,13 +684,14 @@ mips_init(struct mipscpu *cpu, unsigned cpunum)
 		CONFIG0_KSEG0_COHERE_CACHED;
 
 	/* config register 1 - mostly L1 cache info */
-	/* for now report a 4K each 4-way 16-byte-line icache and dcache */
+	/* by default, a 4K each 4-way 16-byte-line icache and dcache */
 	cpu->ex_config1 =
 		CONFIG1_MK_TLBSIZE(NTLB) |
-		CONFIG1_MK_ICACHE(CONFIG1_SETS_64, CONFIG1_LINE_16,
-				  CONFIG1_MK_ASSOC(4)) |
-		CONFIG1_MK_DCACHE(CONFIG1_SETS_64, CONFIG1_LINE_16,
-				  CONFIG1_MK_ASSOC(4));
+		CONFIG1_MK_ICACHE(cache_setshift - 6, cache_lineshift - 1,
+				  CONFIG1_MK_ASSOC(cache_ways)) |
+		CONFIG1_MK_DCACHE(cache_setshift - 6, cache_lineshift - 1,
+				  CONFIG1_MK_ASSOC(cache_ways)) |
+		CONFIG1_PERFCTRS;
 
 	/* config register 2 - L2/L3 cache info */
 	cpu->ex_config2 = 0;
@@ -587,10 +717,16 @@ mips_init(struct mipscpu *cpu, unsigned cpunum)
 	cpu->ex_count = 1;
 	cpu->ex_compare = 0;
 	cpu->ex_compare_used = 0;
+	for (i=0; i<NPERF; i++) {
+		cpu->perf[i].mp_ctl = 0;
+		cpu->perf[i].mp_count = 0;
+	}
+	cpu->perf_on = 0;
 
 	cpu->irq_lamebus = 0;
 	cpu->irq_ipi = 0;
 	cpu->irq_timer = 0;
+	cpu->irq_perf = 0;
 
 	cpu->ll_active = 0;
 	cpu->ll_addr = 0;
@@ -811,6 +947,8 @@ writetlb(struct mipscpu *cpu, int ix, const char *how)
 #endif
 
 	cpu->tlb[ix] = cpu->tlbentry;
+	flight_cpuevent(cpu->flight, FLIGHT_TLBW, NULL, ix,
+			tlbgethi(&cpu->tlbentry), tlbgetlo(&cpu->tlbentry));
 
 #ifdef USE_TLBMAP
 	cpu->tlbmap[cpu->tlb[ix].mt_vpn >> 12] = ix;
@@ -827,12 +965,347 @@ writetlb(struct mipscpu *cpu, int ix, const char *how)
 	(void) precompute_nextpc(cpu);
 }
 
+/*
+ * Performance counters.
+ *
+ * While no counter is enabled this costs one test per cycle. The
+ * overflow interrupt is asserted while any counter with PERFCTL_IE
+ * set has its top bit set; as on real MIPS32 parts it shares the
+ * timer's interrupt line, and CAUSE_PCI tells them apart.
+ */
+static
+void
+perf_update(struct mipscpu *cpu)
+{
+	unsigned i;
+	int on = 0, irq = 0;
+
+	for (i=0; i<NPERF; i++) {
+		if (cpu->perf[i].mp_ctl & (PERFCTL_U | PERFCTL_K)) {
+			on = 1;
+		}
+		if ((cpu->perf[i].mp_ctl & PERFCTL_IE) &&
+		    (cpu->perf[i].mp_count & PERFCNT_OVERFLOW)) {
+			irq = 1;
+		}
+	}
+	cpu->perf_on = on;
+
+	if (irq != cpu->irq_perf) {
+		cpu->irq_perf = irq;
+		CPUTRACE(DOTRACE_IRQ, cpu->cpunum, "Perf counter irq %s",
+			 irq ? "ON" : "OFF");
+		flight_cpuevent(cpu->flight, FLIGHT_IRQ, NULL,
+				cpu->irq_lamebus, cpu->irq_ipi,
+				cpu->irq_timer || irq);
+	}
+}
+
+static
+void
+perf_count(struct mipscpu *cpu, unsigned event, int usermode)
+{
+	struct mipsperf *mp;
+	uint32_t modebit;
+	unsigned i;
+
+	modebit = usermode ? PERFCTL_U : PERFCTL_K;
+	for (i=0; i<NPERF; i++) {
+		mp = &cpu->perf[i];
+		if (PERFCTL_GETEVENT(mp->mp_ctl) != event ||
+		    (mp->mp_ctl & modebit) == 0) {
+			continue;
+		}
+		mp->mp_count++;
+		/* the top bit just changed */
+		if ((mp->mp_count & ~PERFCNT_OVERFLOW) == 0 &&
+		    (mp->mp_ctl & PERFCTL_IE)) {
+			perf_update(cpu);
+		}
+	}
+}
+
+#define PERF_COUNT(cpu, event, usermode) \
+	((cpu)->perf_on ? perf_count(cpu, event, usermode) : (void)0)
+
+/*
+ * Events counted once per cycle, at the end of the cycle.
+ */
+static
+void
+perf_cycle(struct mipscpu *cpu, uint32_t insn, int retired, int usermode)
+{
+	uint32_t op;
+
+	perf_count(cpu, PERFEV_CYCLES, usermode);
+	if (!retired) {
+		return;
+	}
+	perf_count(cpu, PERFEV_INSNS, usermode);
+
+	op = (insn & 0xfc000000) >> 26;
+	if ((op >= OPM_LB && op <= OPM_LWR) || op == OPM_LWC0) {
+		perf_count(cpu, PERFEV_LOADS, usermode);
+	}
+	else if ((op >= OPM_SB && op <= OPM_SWR) || op == OPM_SWC0) {
+		perf_count(cpu, PERFEV_STORES, usermode);
+	}
+}
+
+/*
+ * Exception events, counted in the mode the exception was taken from.
+ */
+static
+void
+perf_exception(struct mipscpu *cpu, int code)
+{
+	int usermode = IS_USERMODE(cpu);
+
+	perf_count(cpu, PERFEV_EXCODE(code), usermode);
+	if (code == EX_IRQ) {
+		perf_count(cpu, PERFEV_IRQS, usermode);
+		return;
+	}
+	perf_count(cpu, PERFEV_EXNS, usermode);
+	if (code == EX_TLBL || code == EX_TLBS) {
+		perf_count(cpu, PERFEV_TLBMISS, usermode);
+	}
+}
+
+/*
+ * L1 cache model.
+ *
+ * Both caches are physically indexed and physically tagged. The dcache
+ * is write-back and write-allocate, and is kept coherent between cpus:
+ * writing a line invalidates other cpus' copies, and reading a line
+ * another cpu has dirty makes it write the line back. As on real MIPS
+ * parts the icache isn't coherent with anything. Each miss, and each
+ * uncached access, stalls the cpu for cache_misscycles cycles once
+ * the instruction is done.
+ */
+static
+void
+cache_init(struct mipscache *mc, unsigned cpunum)
+{
+	unsigned n, i;
+
+	n = cache_ways << cache_setshift;
+	mc->mc_lines = domalloc(n * sizeof(*mc->mc_lines));
+	for (i=0; i<n; i++) {
+		mc->mc_lines[i].ml_line = 0;
+		mc->mc_lines[i].ml_valid = 0;
+		mc->mc_lines[i].ml_dirty = 0;
+		mc->mc_lines[i].ml_used = 0;
+	}
+	mc->mc_clock = 0;
+	/* reproducible, but different on each cpu; must not be 0 */
+	mc->mc_rand = 0x9e3779b9 + cpunum;
+}
+
+static
+inline
+struct mipscacheline *
+cache_set(struct mipscache *mc, uint32_t line)
+{
+	uint32_t set = line & ((1U << cache_setshift) - 1);
+
+	return &mc->mc_lines[set * cache_ways];
+}
+
+static
+struct mipscacheline *
+cache_lookup(struct mipscache *mc, uint32_t line)
+{
+	struct mipscacheline *set;
+	unsigned i;
+
+	set = cache_set(mc, line);
+	for (i=0; i<cache_ways; i++) {
+		if (set[i].ml_valid && set[i].ml_line == line) {
+			return &set[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Throw out a line, writing it back first if it's dirty.
+ */
+static
+void
+cache_evict(struct mipscpu *cpu, struct mipscacheline *ml)
+{
+	if (ml->ml_valid && ml->ml_dirty) {
+		g_stats.s_percpu[cpu->cpunum].sp_dcwbacks++;
+		PERF_COUNT(cpu, PERFEV_DCWBACK, IS_USERMODE(cpu));
+	}
+	ml->ml_valid = 0;
+	ml->ml_dirty = 0;
+}
+
+/*
+ * Wait for memory once this cycle is over.
+ */
+static
+void
+cache_stall(struct mipscpu *cpu)
+{
+	cpu->cachestall += cache_misscycles;
+	if (cpu->cachestall > 0 && cpu->state == CPU_RUNNING) {
+		cpu->state = CPU_STALLED;
+	}
+}
+
+/*
+ * Bring in a line that isn't there, replacing an empty way if there
+ * is one and otherwise the least recently used or a random one.
+ */
+static
+struct mipscacheline *
+cache_fill(struct mipscpu *cpu, struct mipscache *mc, uint32_t line)
+{
+	struct mipscacheline *set, *ml;
+	unsigned i;
+
+	set = cache_set(mc, line);
+	ml = NULL;
+	for (i=0; i<cache_ways; i++) {
+		if (!set[i].ml_valid) {
+			ml = &set[i];
+			break;
+		}
+	}
+	if (ml == NULL && cache_random) {
+		/* xorshift32 */
+		mc->mc_rand ^= mc->mc_rand << 13;
+		mc->mc_rand ^= mc->mc_rand >> 17;
+		mc->mc_rand ^= mc->mc_rand << 5;
+		ml = &set[mc->mc_rand % cache_ways];
+	}
+	else if (ml == NULL) {
+		ml = &set[0];
+		for (i=1; i<cache_ways; i++) {
+			if (set[i].ml_used < ml->ml_used) {
+				ml = &set[i];
+			}
+		}
+	}
+
+	cache_evict(cpu, ml);
+	ml->ml_line = line;
+	ml->ml_valid = 1;
+	cache_stall(cpu);
+	return ml;
+}
+
+/*
+ * Coherence: make other cpus write back their copies of LINE, and if
+ * FORWRITE, invalidate them too.
+ */
+static
+void
+cache_snoop(struct mipscpu *cpu, uint32_t line, int forwrite)
+{
+	struct mipscpu *other;
+	struct mipscacheline *ml;
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		other = &mycpus[i];
+		if (other == cpu) {
+			continue;
+		}
+		ml = cache_lookup(&other->dcache, line);
+		if (ml == NULL) {
+			continue;
+		}
+		if (ml->ml_dirty) {
+			g_stats.s_percpu[i].sp_dcwbacks++;
+			PERF_COUNT(other, PERFEV_DCWBACK, IS_USERMODE(other));
+			ml->ml_dirty = 0;
+		}
+		if (forwrite) {
+			ml->ml_valid = 0;
+			g_stats.s_percpu[i].sp_dcinvals++;
+		}
+	}
+}
+
+/*
+ * Instruction fetch from the current pc.
+ */
+static
+COLD
+void
+icache_fetch(struct mipscpu *cpu)
+{
+	struct mipscacheline *ml;
+	uint32_t line;
+
+	if (cpu->pcphys & 1) {
+		g_stats.s_percpu[cpu->cpunum].sp_uncached++;
+		cache_stall(cpu);
+		return;
+	}
+
+	line = (cpu->pcphys | cpu->pcoff) >> cache_lineshift;
+	ml = cache_lookup(&cpu->icache, line);
+	if (ml != NULL) {
+		g_stats.s_percpu[cpu->cpunum].sp_ichits++;
+	}
+	else {
+		g_stats.s_percpu[cpu->cpunum].sp_icmisses++;
+		PERF_COUNT(cpu, PERFEV_ICMISS, IS_USERMODE(cpu));
+		ml = cache_fill(cpu, &cpu->icache, line);
+	}
+	ml->ml_used = ++cpu->icache.mc_clock;
+}
+
+/*
+ * Data access to PADDR, which translatemem has just produced.
+ */
+static
+COLD
+void
+dcache_access(struct mipscpu *cpu, uint32_t paddr, int iswrite)
+{
+	struct mipscacheline *ml;
+	uint32_t line;
+
+	if (cpu->uncached) {
+		g_stats.s_percpu[cpu->cpunum].sp_uncached++;
+		cache_stall(cpu);
+		return;
+	}
+
+	line = paddr >> cache_lineshift;
+	ml = cache_lookup(&cpu->dcache, line);
+	if (ml != NULL) {
+		g_stats.s_percpu[cpu->cpunum].sp_dchits++;
+	}
+	else {
+		g_stats.s_percpu[cpu->cpunum].sp_dcmisses++;
+		PERF_COUNT(cpu, PERFEV_DCMISS, IS_USERMODE(cpu));
+		if (!iswrite) {
+			cache_snoop(cpu, line, 0);
+		}
+		ml = cache_fill(cpu, &cpu->dcache, line);
+	}
+	/* a dirty line is never in any other cache */
+	if (iswrite && !ml->ml_dirty) {
+		cache_snoop(cpu, line, 1);
+		ml->ml_dirty = 1;
+	}
+	ml->ml_used = ++cpu->dcache.mc_clock;
+}
+
 static
 void
 do_wait(struct mipscpu *cpu)
 {
 	/* Only wait if no interrupts are already pending */
-	if (!cpu->irq_lamebus && !cpu->irq_ipi && !cpu->irq_timer) {
+	if (!cpu->irq_lamebus && !cpu->irq_ipi && !cpu->irq_timer &&
+	    !cpu->irq_perf) {
 		cpu->state = CPU_IDLE;
 		RUNNING_MASK_OFF(cpu->cpunum);
 	}
@@ -857,6 +1330,8 @@ do_rfe(struct mipscpu *cpu)
 		 (cpu->current_usermode) ? "user" : "kernel",
 		 (cpu->current_irqon) ? "on" : "off",
 		 cpu->r[29]);
+	flight_cpuevent(cpu->flight, FLIGHT_RFE, NULL,
+			cpu->current_usermode, cpu->current_irqon, 0);
 
 	/*
 	 * Re-lookup the translations for the pc, because we might have
@@ -926,6 +1401,14 @@ exception(struct mipscpu *cpu, int code, int cn_or_user, uint32_t vaddr,
 	else {
 		g_stats.s_exns++;
 	}
+#ifdef USE_TRACE
+	cpu->prof_excode = code;
+#endif
+	flight_cpuevent(cpu->flight, FLIGHT_EXN, exception_name(code),
+			code, cpu->expc, vaddr);
+	if (cpu->perf_on) {
+		perf_exception(cpu, code);
+	}
 
 	cpu->cause_bd = cpu->in_jumpdelay;
 	if (code==EX_CPU) {
@@ -1014,6 +1497,7 @@ translatemem(struct mipscpu *cpu, uint32_t vaddr, int iswrite, uint32_t *ret)
 
 	if (seg==2) {
 		paddr = vaddr & 0x1fffffff;
+		cpu->uncached = vaddr >= KSEG1;
 	}
 	else {
 		uint32_t vpage;
@@ -1055,6 +1539,7 @@ translatemem(struct mipscpu *cpu, uint32_t vaddr, int iswrite, uint32_t *ret)
 		CPUTRACE(DOTRACE_TLB, cpu->cpunum, " - OK");
 		ppage = cpu->tlb[ix].mt_pfn;
 		paddr = ppage|off;
+		cpu->uncached = cpu->tlb[ix].mt_nocache != 0;
 	}
 
 	*ret = paddr;
@@ -1237,7 +1722,15 @@ domem(struct mipscpu *cpu, uint32_t vaddr, uint32_t *val,
 		return -1;
 	}
 
-	return accessmem(cpu, paddr, iswrite, val);
+	if (accessmem(cpu, paddr, iswrite, val)) {
+		return -1;
+	}
+
+	/* the read half of a sub-word store isn't a separate access */
+	if (cache_on && (iswrite || !willbewrite)) {
+		dcache_access(cpu, paddr, iswrite);
+	}
+	return 0;
 }
 
 static
@@ -1257,6 +1750,7 @@ precompute_pc(struct mipscpu *cpu)
 		return -1;
 	}
 	cpu->pcoff = physpc & 0xfff;
+	cpu->pcphys = (physpc & 0xfffff000) | (cpu->uncached != 0);
 	return 0;
 }
 
@@ -1277,6 +1771,7 @@ precompute_nextpc(struct mipscpu *cpu)
 		return -1;
 	}
 	cpu->nextpcoff = physnext & 0xfff;
+	cpu->nextpcphys = (physnext & 0xfffff000) | (cpu->uncached != 0);
 	return 0;
 }
 
@@ -1454,6 +1949,7 @@ abranch(struct mipscpu *cpu, uint32_t addr)
 		exception(cpu, EX_ADEL, 0, addr, ", branch");
 		return;
 	}
+	PERF_COUNT(cpu, PERFEV_BRANCHES, IS_USERMODE(cpu));
 
 	// Branches update nextpc (which points to the insn after 
 	// the delay slot).
@@ -1597,9 +2093,12 @@ getcause(struct mipscpu *cpu)
 	if (cpu->irq_ipi) {
 		val |= CAUSE_HARDIRQ_IPI;
 	}
-	if (cpu->irq_timer) {
+	if (cpu->irq_timer || cpu->irq_perf) {
 		val |= CAUSE_HARDIRQ_TIMER;
 	}
+	if (cpu->irq_perf) {
+		val |= CAUSE_PCI;
+	}
 
 	return val;
 }
@@ -1685,6 +2184,26 @@ regname(unsigned reg)
 }
 
 static int tracehow;		// how to trace the current instruction
+static int tracetext;		// nonzero to trace it as text
+static int tracebin;		// nonzero to trace it as a binary record
+
+/*
+ * The register an instruction writes, for binary traces. Doesn't need
+ * to be exact for instructions that don't write one.
+ */
+static
+unsigned
+tracebin_destreg(uint32_t insn)
+{
+	switch ((insn & 0xfc000000) >> 26) {
+	    case OPM_SPECIAL:
+		return (insn & 0x0000f800) >> 11;
+	    case OPM_BCOND:
+	    case OPM_JAL:
+		return 31;
+	}
+	return (insn & 0x001f0000) >> 16;
+}
 
 #endif
 
@@ -1727,8 +2246,15 @@ static int tracehow;		// how to trace the current instruction
 #define OVF	  { exception(cpu, EX_OVF, 0, 0, ""); }
 #define CHKOVF(v) {if (((int64_t)(int32_t)(v))!=(v)) { OVF; return; }}
 
-#define TRL(...)  CPUTRACEL(tracehow, cpu->cpunum, __VA_ARGS__)
-#define TR(...)   CPUTRACE(tracehow, cpu->cpunum, __VA_ARGS__)
+#ifdef USE_TRACE
+#define TRL(...) \
+	(tracetext ? cputracel(tracehow, cpu->cpunum, __VA_ARGS__) : (void)0)
+#define TR(...) \
+	(tracetext ? cputrace(tracehow, cpu->cpunum, __VA_ARGS__) : (void)0)
+#else
+#define TRL(...)
+#define TR(...)
+#endif
 
 #define NEEDRS	 uint32_t rs = (insn & 0x03e00000) >> 21	// register
 #define NEEDRT	 uint32_t rt = (insn & 0x001f0000) >> 16	// register
@@ -1773,6 +2299,10 @@ domf(struct mipscpu *cpu, int cn, unsigned reg, unsigned sel, int32_t *greg)
 	    case C0_IFEAT:   *greg = cpu->ex_ifeat; break;
 	    case C0_CONFIG0: *greg = cpu->ex_config0; break;
 	    case C0_CONFIG1: *greg = cpu->ex_config1; break;
+	    case C0_PERFCTL0: *greg = cpu->perf[0].mp_ctl | PERFCTL_MORE; break;
+	    case C0_PERFCNT0: *greg = cpu->perf[0].mp_count; break;
+	    case C0_PERFCTL1: *greg = cpu->perf[1].mp_ctl; break;
+	    case C0_PERFCNT1: *greg = cpu->perf[1].mp_count; break;
 #if 0 /* not yet */
 	    case C0_CONFIG2: *greg = cpu->ex_config2; break;
 	    case C0_CONFIG3: *greg = cpu->ex_config3; break;
@@ -1816,6 +2346,9 @@ domt(struct mipscpu *cpu, int cn, int reg, int sel, int32_t greg)
 		}
 		if (cpu->irq_timer) {
 			CPUTRACE(DOTRACE_IRQ, cpu->cpunum, "Timer irq OFF");
+			flight_cpuevent(cpu->flight, FLIGHT_IRQ, NULL,
+					cpu->irq_lamebus, cpu->irq_ipi,
+					cpu->irq_perf);
 		}
 		cpu->irq_timer = 0;
 		break;
@@ -1840,6 +2373,16 @@ domt(struct mipscpu *cpu, int cn, int reg, int sel, int32_t greg)
 	    case C0_CONFIG5: /* read-only register */ break;
 	    case C0_CONFIG6: /* read-only register */ break;
 	    case C0_CONFIG7: /* read-only register */ break;
+	    case C0_PERFCTL0:
+	    case C0_PERFCTL1:
+		cpu->perf[sel / 2].mp_ctl = greg & PERFCTL_WRITABLE;
+		perf_update(cpu);
+		break;
+	    case C0_PERFCNT0:
+	    case C0_PERFCNT1:
+		cpu->perf[sel / 2].mp_count = greg;
+		perf_update(cpu);
+		break;
 	    default:
 		exception(cpu, EX_RI, cn, 0, ", invalid cop0 register");
 		break;
@@ -2103,8 +2646,8 @@ mx_bne(struct mipscpu *cpu, uint32_t insn)
 }
 
 /*
- * Cache control. This actually does nothing, but that's adequate for
- * the time being.
+ * Cache control. Unless the cache model is on there's nothing to
+ * control, and this only checks its operands.
  */
 static
 inline
@@ -2114,9 +2657,11 @@ mx_cache(struct mipscpu *cpu, uint32_t insn)
 	NEEDADDR; NEEDRT;
 	unsigned cachecode, op;
 	enum { L1i, L1d, L2, L3 } cache;
-	unsigned cacheway, cacheindex, cacheoffset;
-	uint32_t waymask, indexmask, offsetmask;
+	unsigned cacheway, cacheindex;
+	uint32_t waymask, indexmask;
 	unsigned wayshift, indexshift;
+	struct mipscache *mc;
+	struct mipscacheline *ml;
 
 	/*
 	 * Some documentation says that this instruction is kernel-
@@ -2131,28 +2676,28 @@ mx_cache(struct mipscpu *cpu, uint32_t insn)
 	}
 
 	/*
-	 * The caches we reported in the config1 register are 4K,
-	 * 4-way, with 16-byte cache lines; that is, 64 sets.
-	 * Therefore, the index is 6 bits, the way when we need to
-	 * specify it explicitly is 2 bits, and the offset is 4 bits.
-	 *
-	 * XXX we should have the whole thing parameterized by
-	 * preprocessor macros, or even configured at runtime.
+	 * The L1 caches are as reported in the config1 register: by
+	 * default 4K, 4-way, with 16-byte cache lines, that is, 64
+	 * sets, so the offset is 4 bits, the index 6 bits, and the
+	 * way when we need to specify it explicitly 2 bits.
 	 *
-	 * XXX also this should come after we pick the cache, inasmuch
-	 * as the parameters ought to be different for L2 and L3. If
-	 * we have L2 and L3 - a mips of the vintage we're kinda still
+	 * XXX this should come after we pick the cache, inasmuch as
+	 * the parameters ought to be different for L2 and L3. If we
+	 * have L2 and L3 - a mips of the vintage we're kinda still
 	 * pretending to be wouldn't.
 	 */
-	waymask = 0x00000c00;
-	indexmask = 0x000003f0;
-	offsetmask = 0x0000000f;
-	wayshift = 10;
-	indexshift = 4;
+	indexshift = cache_lineshift;
+	wayshift = cache_lineshift + cache_setshift;
+	indexmask = ((1U << cache_setshift) - 1) << indexshift;
+	waymask = ((1U << cache_waybits) - 1) << wayshift;
 
-	/* the RT field here is a constant rather than a register number */
-	cachecode = rt >> 3;
-	op = rt & 7;
+	/*
+	 * The RT field here is a constant rather than a register
+	 * number: the low two bits pick the cache and the upper three
+	 * the operation.
+	 */
+	cachecode = rt & 3;
+	op = rt >> 2;
 
 	/* XXX should have symbolic constants for this */
 	switch (cachecode) {
@@ -2170,7 +2715,6 @@ mx_cache(struct mipscpu *cpu, uint32_t insn)
 		/* address the cache by index */
 		cacheway = (addr & waymask) >> wayshift;
 		cacheindex = (addr & indexmask) >> indexshift;
-		cacheoffset = (addr & offsetmask);
 		break;
 	    case 4:
 	    case 5:
@@ -2182,101 +2726,76 @@ mx_cache(struct mipscpu *cpu, uint32_t insn)
 		}
 		cacheway = 0; /* make compiler happy; need to check all ways */
 		cacheindex = (addr & indexmask) >> indexshift;
-		cacheoffset = (addr & offsetmask);
 		break;
 	}
 
+	if (!cache_on || (cache != L1i && cache != L1d)) {
+		/* no such cache in the model, so nothing to do */
+		return;
+	}
+	mc = cache == L1i ? &cpu->icache : &cpu->dcache;
+	addr >>= cache_lineshift;
+
 	switch (op) {
 	    case 0: /* index writeback & invalidate */
-		/*
-		 * Look at cache[cacheindex].ways[cacheway]; write it back
-		 * if needed, then invalidate it. (For the icache, just
-		 * invalidate it.)
-		 */
-		(void)cache;
-		(void)cacheway;
-		(void)cacheindex;
+		/* (the icache is never dirty) */
+		if (cacheway < cache_ways) {
+			ml = &mc->mc_lines[cacheindex * cache_ways + cacheway];
+			cache_evict(cpu, ml);
+		}
 		break;
 	    case 1: /* index load tag */
-		/*
-		 * Look at cache[cacheindex].ways[cacheway]; read the
-		 * tag into the TagLo and TagHi registers; use the
-		 * offset to read the data out of the cache line into
-		 * the DataLo and DataHi registers. Note: we don't
-		 * have any of these registers, and DataLo/DataHi are
-		 * optional.
-		 *
-		 * The sub-word bits of the offset, if any, should be
-		 * ignored rather than kvetched about.
-		 */
-		(void)cache;
-		(void)cacheindex;
-		(void)cacheway;
-		(void)cacheoffset;
-		break;
 	    case 2: /* index store tag */
 		/*
-		 * Look at cache[cacheindex].ways[cacheway]; write the
-		 * tag from the TagLo and TagHi registers.
+		 * These move tags to and from the TagLo and TagHi
+		 * registers, which we don't have.
 		 */
-		(void)cache;
-		(void)cacheindex;
-		(void)cacheway;
 		break;
 	    case 3: /* implementation-defined operation */
 		break;
 	    case 4: /* hit invalidate */
-		/*
-		 * Look at cache[cacheindex]; check all ways for a
-		 * matching tag, and if found invalidate it without
-		 * writing back.
-		 */
-		(void)cache;
-		(void)cacheindex;
+		/* without writing back, even if dirty */
+		ml = cache_lookup(mc, addr);
+		if (ml != NULL) {
+			ml->ml_valid = 0;
+			ml->ml_dirty = 0;
+		}
 		break;
 	    case 5: /* hit writeback & invalidate */
 		if (cache == L1i) {
-			/*
-			 * For the L1 cache this op is "fill" (!)
-			 * Load one of the ways at cache[cacheindex]
-			 * from memory using the specified address.
-			 */
-			(void)cache;
-			(void)cacheindex;
-			(void)addr;
+			/* For the L1 cache this op is "fill" (!) */
+			if (cache_lookup(mc, addr) == NULL) {
+				ml = cache_fill(cpu, mc, addr);
+				ml->ml_used = ++mc->mc_clock;
+			}
+			break;
 		}
-		else {
-			/*
-			 * Look at cache[cacheindex]; check all ways for
-			 * a matching tag, and if found, write it back if
-			 * necessary and then invalidate it.
-			 */
-			(void)cache;
-			(void)cacheindex;
+		ml = cache_lookup(mc, addr);
+		if (ml != NULL) {
+			cache_evict(cpu, ml);
 		}
 		break;
 	    case 6: /* hit writeback */
-		/*
-		 * Look at cache[cacheindex]; check all ways for a
-		 * matching tag, and if found, write it back if
-		 * necessary. Leave it valid. A nop for the icache, I
-		 * guess.
-		 */
-		(void)cache;
-		(void)cacheindex;
+		ml = cache_lookup(mc, addr);
+		if (ml != NULL && ml->ml_dirty) {
+			g_stats.s_percpu[cpu->cpunum].sp_dcwbacks++;
+			PERF_COUNT(cpu, PERFEV_DCWBACK, IS_USERMODE(cpu));
+			ml->ml_dirty = 0;
+		}
 		break;
 	    case 7: /* fetch and lock */
 		/*
-		 * Look at cache[cacheindex]; load one of the ways
-		 * from memory using the specified address, and lock
-		 * it in. It then won't be kicked out unless
-		 * explicitly invalidated, or revoked from another
-		 * processor. (Or if the lock bit is cleared by
-		 * mucking directly with the tag.)
+		 * Locking isn't modeled; this is just a fill. (It
+		 * doesn't take ownership, so a dcache line that some
+		 * other cpu has dirty gets written back.)
 		 */
-		(void)cache;
-		(void)cacheindex;
-		(void)addr;
+		if (cache_lookup(mc, addr) == NULL) {
+			if (cache == L1d) {
+				cache_snoop(cpu, addr, 0);
+			}
+			ml = cache_fill(cpu, mc, addr);
+			ml->ml_used = ++mc->mc_clock;
+		}
 		break;
 	}
 }
@@ -2546,12 +3065,14 @@ mx_sc(struct mipscpu *cpu, uint32_t insn)
 	/* success */
 	RTx = 1;
 	g_stats.s_percpu[cpu->cpunum].sp_okscs++;
+	PERF_COUNT(cpu, PERFEV_SCOK, IS_USERMODE(cpu));
 	return;
 
  fail:
 	/* failure */
 	RTx = 0;
 	g_stats.s_percpu[cpu->cpunum].sp_badscs++;
+	PERF_COUNT(cpu, PERFEV_SCFAIL, IS_USERMODE(cpu));
 }
 
 static
@@ -3208,6 +3729,91 @@ mx_copz(struct mipscpu *cpu, uint32_t insn)
 	}
 }
 
+/*
+ * Things that happen every cycle whether or not an instruction runs.
+ */
+static
+inline
+void
+cpu_tick(struct mipscpu *cpu)
+{
+	/* Timer. Take interrupt on next cycle; call it a pipeline effect. */
+	cpu->ex_count++;
+	if (cpu->ex_compare_used && cpu->ex_count == cpu->ex_compare) {
+		cpu->ex_count = 0; /* XXX is this right? */
+		cpu->irq_timer = 1;
+		CPUTRACE(DOTRACE_IRQ, cpu->cpunum, "Timer irq ON");
+		flight_cpuevent(cpu->flight, FLIGHT_IRQ, NULL,
+				cpu->irq_lamebus, cpu->irq_ipi, 1);
+	}
+
+	if (cpu->lowait > 0) {
+		cpu->lowait--;
+	}
+	if (cpu->hiwait > 0) {
+		cpu->hiwait--;
+	}
+
+	cpu->tlbrandom++;
+}
+
+/*
+ * A cycle spent waiting for memory after a cache miss. The instruction
+ * that missed has finished; the next one just doesn't start yet.
+ * Exact profiling charges the stall to the instruction that missed.
+ */
+static
+COLD
+void
+cache_stallcycle(struct mipscpu *cpu)
+{
+	int usermode = IS_USERMODE(cpu);
+
+	if (--cpu->cachestall == 0) {
+		cpu->state = CPU_RUNNING;
+	}
+	g_stats.s_percpu[cpu->cpunum].sp_cstalls++;
+	if (usermode) {
+		g_stats.s_percpu[cpu->cpunum].sp_ucycles++;
+	}
+	else {
+		g_stats.s_percpu[cpu->cpunum].sp_kcycles++;
+	}
+	cpu_tick(cpu);
+	if (cpu->perf_on) {
+		perf_cycle(cpu, 0, 0, usermode);
+	}
+#ifdef USE_TRACE
+	if (prof_exact) {
+		prof_cycle(cpu->cpunum, cpu->expc, cpu->tlbentry.mt_pid,
+			   PROF_STALL, !cpu->current_irqon);
+	}
+#endif
+}
+
+#ifdef USE_TRACE
+/*
+ * Classify a cycle for exact profiling: it retired an instruction,
+ * took an exception (TLB misses separately), or stalled.
+ */
+static
+inline
+unsigned
+prof_cyclekind(const struct mipscpu *cpu, int retired)
+{
+	if (retired) {
+		return PROF_RETIRED;
+	}
+	if (cpu->prof_excode == EX_TLBL || cpu->prof_excode == EX_TLBS) {
+		return PROF_TLBMISS;
+	}
+	if (cpu->prof_excode >= 0) {
+		return PROF_EXCEPTION;
+	}
+	return PROF_STALL;
+}
+#endif
+
 static
 int
 cpu_cycle(void)
@@ -3218,11 +3824,20 @@ cpu_cycle(void)
 	unsigned breakpoints = 0;
 	uint32_t retire_pc;
 	unsigned retire_usermode;
+#ifdef USE_TRACE
+	uint32_t insn_pc;
+	int prof_irqoff;
+	uint32_t tracebin_rs = 0, tracebin_rt = 0;
+#endif
 
 	for (whichcpu=0; whichcpu < ncpus; whichcpu++) {
 		struct mipscpu *cpu = &mycpus[whichcpu];
 
 		if (cpu->state != CPU_RUNNING) {
+			if (cpu->state == CPU_STALLED) {
+				cache_stallcycle(cpu);
+				continue;
+			}
 			// don't check this on the critical path
 			//Assert((cpu_running_mask & thiscpumask) == 0);
 			g_stats.s_percpu[cpu->cpunum].sp_icycles++;
@@ -3248,6 +3863,17 @@ cpu_cycle(void)
 		cpu->expc = cpu->pc;
 	}
 
+#ifdef USE_TRACE
+	/*
+	 * Decide whether this cycle passes the trace filters, if any.
+	 */
+	if (g_tracefilter) {
+		trace_filtercpu(cpu->cpunum, cpu->pc, cpu->tlbentry.mt_pid,
+			g_stats.s_percpu[cpu->cpunum].sp_kretired +
+			g_stats.s_percpu[cpu->cpunum].sp_uretired);
+	}
+#endif
+
 	/*
 	 * Check for interrupts.
 	 */
@@ -3255,7 +3881,8 @@ cpu_cycle(void)
 		uint32_t soft = cpu->status_softmask & cpu->cause_softirq;
 		int lb = cpu->irq_lamebus && cpu->status_hardmask_lb;
 		int ipi = cpu->irq_ipi && cpu->status_hardmask_ipi;
-		int timer = cpu->irq_timer && cpu->status_hardmask_timer;
+		int timer = (cpu->irq_timer || cpu->irq_perf) &&
+			cpu->status_hardmask_timer;
 
 		if (lb || ipi || timer || soft) {
 			CPUTRACE(DOTRACE_IRQ, cpu->cpunum,
@@ -3297,6 +3924,12 @@ cpu_cycle(void)
 		tracehow = DOTRACE_KINSN;
 #endif
 	}
+#ifdef USE_TRACE
+	tracetext = g_traceflags[tracehow] && TRACE_CPUOK(cpu->cpunum) &&
+		!g_tracebinary;
+	tracebin = g_traceflags[tracehow] && TRACE_CPUOK(cpu->cpunum) &&
+		g_tracebinary;
+#endif
 
 	/*
 	 * If at the end of all the following logic, the PC (which
@@ -3310,6 +3943,17 @@ cpu_cycle(void)
 	retire_pc = cpu->nextpc;
 	retire_usermode = IS_USERMODE(cpu);
 
+#ifdef USE_TRACE
+	/*
+	 * For exact profiling, remember where this cycle should be
+	 * charged. An interrupt taken above doesn't count; it costs
+	 * no cycles of its own.
+	 */
+	insn_pc = cpu->pc;
+	prof_irqoff = !cpu->current_irqon;
+	cpu->prof_excode = -1;
+#endif
+
 	/*
 	 * Fetch instruction.
 	 *
@@ -3324,11 +3968,16 @@ cpu_cycle(void)
 	 * behavior to exhibit.
 	 */
 	insn = bus_use_map(cpu->pcpage, cpu->pcoff);
+	FLIGHT_PC(cpu->flight, cpu->pc);
+	if (cache_on) {
+		icache_fetch(cpu);
+	}
 
 	// Update PC. 
 	cpu->pc = cpu->nextpc;
 	cpu->pcoff = cpu->nextpcoff;
 	cpu->pcpage = cpu->nextpcpage;
+	cpu->pcphys = cpu->nextpcphys;
 	cpu->nextpc += 4;
 	if ((cpu->nextpc & 0xfff)==0) {
 		/* crossed page boundary */
@@ -3339,6 +3988,14 @@ cpu_cycle(void)
 		}
 		else if (precompute_nextpc(cpu)) {
 			/* exception. on to next cpu. */
+#ifdef USE_TRACE
+			if (prof_exact) {
+				prof_cycle(cpu->cpunum, insn_pc,
+					   cpu->tlbentry.mt_pid,
+					   prof_cyclekind(cpu, 0),
+					   prof_irqoff);
+			}
+#endif
 			continue;
 		}
 	}
@@ -3347,6 +4004,12 @@ cpu_cycle(void)
 	}
 
 	TRL("at %08x: ", cpu->expc);
+#ifdef USE_TRACE
+	if (tracebin) {
+		tracebin_rs = cpu->r[(insn & 0x03e00000) >> 21];
+		tracebin_rt = cpu->r[(insn & 0x001f0000) >> 16];
+	}
+#endif
 	
 	/*
 	 * Decode instruction.
@@ -3463,24 +4126,21 @@ cpu_cycle(void)
 	    default: mx_ill(cpu, insn); break;
 	}
 
-	/* Timer. Take interrupt on next cycle; call it a pipeline effect. */
-	cpu->ex_count++;
-	if (cpu->ex_compare_used && cpu->ex_count == cpu->ex_compare) {
-		cpu->ex_count = 0; /* XXX is this right? */
-		cpu->irq_timer = 1;
-		CPUTRACE(DOTRACE_IRQ, cpu->cpunum, "Timer irq ON");
+#ifdef USE_TRACE
+	if (tracebin) {
+		/* same test as for retiring, below */
+		tracebin_insn(cpu->cpunum, tracehow, insn_pc, insn,
+			      tracebin_rs, tracebin_rt,
+			      cpu->r[tracebin_destreg(insn)],
+			      cpu->pc == retire_pc ? TRACEFMT_RETIRED :
+			      cpu->prof_excode >= 0 ? TRACEFMT_TRAPPED :
+			      TRACEFMT_STALLED);
 	}
+#endif
 
-	if (cpu->lowait > 0) {
-		cpu->lowait--;
-	}
-	if (cpu->hiwait > 0) {
-		cpu->hiwait--;
-	}
+	cpu_tick(cpu);
 
 	cpu->in_jumpdelay = 0;
-	
-	cpu->tlbrandom++;
 
 	/*
 	 * If the PC (which is the instruction we're going to execute
@@ -3504,6 +4164,17 @@ cpu_cycle(void)
 			g_stats.s_percpu[cpu->cpunum].sp_kretired++;
 		}
 	}
+	if (cpu->perf_on) {
+		perf_cycle(cpu, insn, cpu->pc == retire_pc, retire_usermode);
+	}
+
+#ifdef USE_TRACE
+	if (prof_exact) {
+		prof_cycle(cpu->cpunum, insn_pc, cpu->tlbentry.mt_pid,
+			   prof_cyclekind(cpu, cpu->pc == retire_pc),
+			   prof_irqoff);
+	}
+#endif
 
 	/* INDENT HORROR END */
 
@@ -3565,6 +4236,52 @@ cpu_stopcycling(void)
 
 /*************************************************************/
 
+void
+cpu_setcache(uint32_t size, unsigned ways, unsigned linesize,
+	     int randomrepl, unsigned misscycles)
+{
+	unsigned lineshift, setshift, waybits;
+	uint32_t waysize;
+
+	for (lineshift = 2; lineshift <= 7; lineshift++) {
+		if (linesize == 1U << lineshift) {
+			break;
+		}
+	}
+	if (lineshift > 7) {
+		msg("cache: line size must be a power of 2 from 4 to 128");
+		die();
+	}
+	if (ways < 1 || ways > 8) {
+		msg("cache: associativity must be from 1 to 8");
+		die();
+	}
+	waysize = size / ways;
+	for (setshift = 6; setshift <= 12; setshift++) {
+		if (waysize == linesize << setshift) {
+			break;
+		}
+	}
+	if (setshift > 12 || waysize * ways != size) {
+		msg("cache: %lu bytes %u-way with %u-byte lines is not a power "
+		    "of 2 from 64 to 4096 sets", (unsigned long)size, ways,
+		    linesize);
+		die();
+	}
+	waybits = 0;
+	while ((1U << waybits) < ways) {
+		waybits++;
+	}
+
+	cache_on = 1;
+	cache_setshift = setshift;
+	cache_ways = ways;
+	cache_waybits = waybits;
+	cache_lineshift = lineshift;
+	cache_random = randomrepl;
+	cache_misscycles = misscycles;
+}
+
 void
 cpu_init(unsigned numcpus)
 {
@@ -3660,7 +4377,7 @@ cpu_dumpstate(void)
 	msg("Cause register: %s %d %s---%s%s%s%s %d [%s]",
 	    cpu->cause_bd ? "B" : "-",
 	    cpu->cause_ce >> 28,
-	    cpu->irq_timer ? "H" : "-",
+	    cpu->irq_timer || cpu->irq_perf ? "H" : "-",
 	    cpu->irq_ipi ? "H" : "-",
 	    cpu->irq_lamebus ? "H" : "-",
 	    (cpu->cause_softirq & 0x200) ? "S" : "-",
@@ -3671,6 +4388,12 @@ cpu_dumpstate(void)
 	msg("VAddr register: 0x%08lx", (unsigned long)cpu->ex_vaddr);
 	msg("Context register: 0x%08lx", (unsigned long)cpu->ex_context);
 	msg("EPC register: 0x%08lx", (unsigned long)cpu->ex_epc);
+	msg("Perf counters: ctl0 0x%08lx count0 0x%08lx "
+	    "ctl1 0x%08lx count1 0x%08lx",
+	    (unsigned long)cpu->perf[0].mp_ctl,
+	    (unsigned long)cpu->perf[0].mp_count,
+	    (unsigned long)cpu->perf[1].mp_ctl,
+	    (unsigned long)cpu->perf[1].mp_count);
 
 	/* END INDENT HORROR */
 
@@ -3804,15 +4527,21 @@ cpu_set_irqs(unsigned cpunum, int lamebus, int ipi)
 	cpu = &mycpus[cpunum];
 	cpu->irq_lamebus = lamebus;
 	cpu->irq_ipi = ipi;
+	flight_cpuevent(cpu->flight, FLIGHT_IRQ, NULL,
+			lamebus, ipi, cpu->irq_timer || cpu->irq_perf);
 
-	/* cpu->irq_timer is on-chip, and cannot get set when CPU_IDLE */
+	/*
+	 * cpu->irq_timer and cpu->irq_perf are on-chip, and cannot get
+	 * set when CPU_IDLE
+	 */
 
 	CPUTRACE(DOTRACE_IRQ, cpunum,
 		 "cpu_set_irqs: LB %s IPI %s",
 		 lamebus ? "ON" : "off",
 		 ipi ? "ON" : "off");
 	if (cpu->state == CPU_IDLE && (lamebus || ipi)) {
-		cpu->state = CPU_RUNNING;
+		/* finish waiting for any cache miss from before the WAIT */
+		cpu->state = cpu->cachestall > 0 ? CPU_STALLED : CPU_RUNNING;
 		RUNNING_MASK_ON(cpunum);
 	}
 }
@@ -3983,9 +4712,30 @@ cpudebug_getregs(unsigned cpunum, uint32_t *regs, int maxregs, int *nregs)
 	*nregs = j;
 }
 
-uint32_t
-cpuprof_sample(void)
+int
+cpuprof_sample(unsigned cpunum, uint32_t *pc, uint32_t *asid)
 {
-	/* for now always use CPU 0 (XXX) */
-	return mycpus[0].pc;
+	struct mipscpu *cpu;
+
+	Assert(cpunum < ncpus);
+	cpu = &mycpus[cpunum];
+
+	if (cpu->state == CPU_DISABLED) {
+		return -1;
+	}
+	*pc = cpu->pc;
+	*asid = cpu->tlbentry.mt_pid;
+	return 0;
+}
+
+void
+cpuprof_stackregs(unsigned cpunum, uint32_t *sp, uint32_t *ra)
+{
+	struct mipscpu *cpu;
+
+	Assert(cpunum < ncpus);
+	cpu = &mycpus[cpunum];
+
+	*sp = cpu->r[29];
+	*ra = cpu->r[31];
 }
@@ -7,7 +7,7 @@ all: $(PROG)
 include rules.mk
 include depend.mk
 
-CFLAGS+=-I.
+CFLAGS+=-I$S/include -I.
 SRCFILES+=disktool  disk161.c
 
 distclean clean:
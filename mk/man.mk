@@ -2,7 +2,7 @@
 # Makefile fragment for installing the man pages
 #
 
-MAN=disk161.1 hub161.1 stat161.1 sys161.1
+MAN=disk161.1 hub161.1 stat161.1 sys161.1 trace161-decode.1
 
 
 include defs.mk
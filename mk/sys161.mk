@@ -13,7 +13,7 @@ SRCFILES+=bus     lamebus.c boot.c \
                   dev_screen.c dev_serial.c dev_timer.c dev_trace.c \
           gdb     gdb_fe.c gdb_be.c \
           main    main.c onsel.c clock.c console.c \
-                  prof.c meter.c trace.c util.c
+                  prof.c meter.c trace.c tracebin.c tracewr.c flight.c util.c
 
 tidy:
 	(find $S -name '*~' -print | xargs rm -f)
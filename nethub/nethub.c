@@ -5,23 +5,37 @@
  *
  * The hub listens on an AF_UNIX datagram socket and redistributes all
  * the packets it receives to all the senders it knows about.
+ *
+ * With -s it acts as a learning switch instead: it remembers which
+ * socket each hardware address was last seen on and sends unicast
+ * packets only there. Broadcasts, and packets for addresses not yet
+ * seen, are still sent to everyone.
+ *
+ * With -i it also makes the network worse on purpose: packets going
+ * out each port can be lost, duplicated, delayed, reordered, and
+ * rate limited. Delayed packets wait in a timer queue.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <assert.h>
 #include "config.h"
 
 #include "array.h"
+#include "pcapfmt.h"
 
 #define DEFAULT_SOCKET  ".sockets/hub"
 
@@ -30,6 +44,11 @@
 #define FRAME_MAGIC     0xa4b3
 #define MAXPACKET       4096
 
+#define NHASH           256	/* must be a power of 2 */
+#define BATCH           32	/* packets received per wakeup */
+#define OUTQ            256	/* packets sent per flush */
+#define DEFAULT_LIMIT   1000	/* packets waiting per port */
+
 struct linkheader {
 	uint16_t lh_frame;
 	uint16_t lh_from;
@@ -42,20 +61,208 @@ struct sender {
 	struct sockaddr_un sdr_sun;
 	socklen_t sdr_len;
 	int sdr_errors;
+	struct sender *sdr_next;	/* hash chain */
+
+	/* per-port counters */
+	unsigned long sdr_rpkts;	/* packets received from it */
+	unsigned long sdr_rbytes;
+	unsigned long sdr_wpkts;	/* packets sent to it */
+	unsigned long sdr_wbytes;
+	unsigned long sdr_sendfails;	/* sendto failures */
+	unsigned long sdr_lost;		/* dropped by impairment */
+	unsigned long sdr_duped;	/* duplicated by impairment */
+
+	/* impairment state */
+	struct impairment *sdr_imp;	/* or NULL */
+	int64_t sdr_tokens;		/* token bucket (may be in debt) */
+	uint64_t sdr_tbtime;		/* when sdr_tokens was computed */
+	unsigned sdr_waiting;		/* packets in the timer queue */
+};
+
+/*
+ * Impairment settings, applied to packets going out a port. The
+ * probabilities are between 0 and 1. Packets are delayed by im_delay
+ * plus or minus up to im_jitter, except that with probability
+ * im_reorder a packet isn't delayed and so overtakes those that are.
+ * If im_rate is set, a token bucket of im_burst bytes filling at
+ * im_rate bytes per second limits the rate; packets wait for tokens
+ * in order. At most im_limit packets per port may be waiting.
+ */
+struct impairment {
+	int im_hasaddr;			/* 0 for the default */
+	uint16_t im_addr;
+	double im_loss;
+	double im_dup;
+	double im_reorder;
+	uint64_t im_delay;		/* ns */
+	uint64_t im_jitter;		/* ns */
+	uint64_t im_rate;		/* bytes/sec; 0 if unlimited */
+	uint64_t im_burst;		/* bytes */
+	unsigned im_limit;
+};
+
+/*
+ * A packet waiting in the timer queue. The data follows the struct.
+ */
+struct delayed {
+	uint64_t d_when;		/* ns, CLOCK_MONOTONIC */
+	uint64_t d_seq;			/* to keep ties in order */
+	uint16_t d_to;			/* port it's going out */
+	size_t d_len;
+	struct delayed *d_next;		/* on firedlist */
+};
+
+/*
+ * Packets are received in batches and the copies to send out are
+ * queued, so that with recvmmsg/sendmmsg a burst takes only a few
+ * system calls. Queued packets point into the receive buffers.
+ */
+struct inpacket {
+	char ip_buf[MAXPACKET];
+	size_t ip_len;
+	struct sockaddr_un ip_sun;
+	socklen_t ip_sunlen;
+};
+
+struct outpacket {
+	struct sender *op_sdr;
+	const char *op_buf;
+	size_t op_len;
 };
 
 ////////////////////////////////////////////////////////////
 
 static struct array *senders;
+static struct sender *sendertable[NHASH];
 static int sock;
+static int switching;
+
+/* totals */
+static unsigned long npackets;		/* packets forwarded */
+static unsigned long nflooded;		/* unicasts to unknown addresses */
+static unsigned long nbadpackets;	/* runts, framing errors, etc. */
+
+static volatile sig_atomic_t wantstats;
+static volatile sig_atomic_t wantquit;
+
+/* capture file for -w, or NULL */
+static FILE *capfile;
+static const char *capname;
+
+static struct inpacket inpackets[BATCH];
+static struct outpacket outq[OUTQ];
+static unsigned nout;
+
+/* impairment settings (struct impairment) from -i */
+static struct array *impairments;
+
+/*
+ * Timer queue: a binary heap ordered by d_when and d_seq. Packets
+ * taken off it go on firedlist until they've been sent.
+ */
+static struct delayed **timerheap;
+static unsigned ntimers, maxtimers;
+static uint64_t timerseq;
+static struct delayed *firedlist;
 
 ////////////////////////////////////////////////////////////
 
+static
+unsigned
+addrhash(uint16_t addr)
+{
+	return (addr ^ (addr >> 8)) & (NHASH-1);
+}
+
+static
+struct sender *
+findsender(uint16_t addr)
+{
+	struct sender *sdr;
+
+	for (sdr = sendertable[addrhash(addr)]; sdr; sdr = sdr->sdr_next) {
+		if (sdr->sdr_addr == addr) {
+			return sdr;
+		}
+	}
+	return NULL;
+}
+
 static
 void
-checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
+unhashsender(struct sender *sdr)
+{
+	struct sender **p;
+
+	for (p = &sendertable[addrhash(sdr->sdr_addr)]; *p;
+	     p = &(*p)->sdr_next) {
+		if (*p == sdr) {
+			*p = sdr->sdr_next;
+			return;
+		}
+	}
+	assert(0);
+}
+
+static
+struct impairment *
+findimpairment(uint16_t addr)
+{
+	struct impairment *im, *dflt = NULL;
+	int n, i;
+
+	if (impairments == NULL) {
+		return NULL;
+	}
+	n = array_getnum(impairments);
+	for (i=0; i<n; i++) {
+		im = array_getguy(impairments, i);
+		if (!im->im_hasaddr) {
+			dflt = im;
+		}
+		else if (im->im_addr == addr) {
+			return im;
+		}
+	}
+	return dflt;
+}
+
+static
+void
+printsender(struct sender *sdr)
+{
+	printf("hub161: %04x: %lu packets (%lu bytes) in, "
+	       "%lu packets (%lu bytes) out, %lu send errors\n",
+	       sdr->sdr_addr, sdr->sdr_rpkts, sdr->sdr_rbytes,
+	       sdr->sdr_wpkts, sdr->sdr_wbytes, sdr->sdr_sendfails);
+	if (sdr->sdr_imp != NULL) {
+		printf("hub161: %04x: %lu lost, %lu duplicated, "
+		       "%u waiting\n", sdr->sdr_addr, sdr->sdr_lost,
+		       sdr->sdr_duped, sdr->sdr_waiting);
+	}
+}
+
+static
+void
+printstats(void)
 {
 	int n, i;
+
+	n = array_getnum(senders);
+	printf("hub161: %d senders, %lu packets forwarded, %lu flooded, "
+	       "%lu bad\n", n, npackets, nflooded, nbadpackets);
+	for (i=0; i<n; i++) {
+		printsender(array_getguy(senders, i));
+	}
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////
+
+static
+struct sender *
+checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
+{
 	struct sender *sdr;
 	int pathlen;
 
@@ -63,17 +270,13 @@ checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 	assert(rsun != NULL);
 	assert(addr != BROADCAST_ADDR);
 
-	n = array_getnum(senders);
-	for (i=0; i<n; i++) {
-		sdr = array_getguy(senders, i);
-		assert(sdr != NULL);
-		if (sdr->sdr_addr == addr) {
-			memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
-			sdr->sdr_len = rlen;
-			return;
-		}
+	sdr = findsender(addr);
+	if (sdr != NULL) {
+		memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
+		sdr->sdr_len = rlen;
+		return sdr;
 	}
-	
+
 	sdr = malloc(sizeof(struct sender));
 	if (!sdr) {
 		fprintf(stderr, "hub161: out of memory\n");
@@ -93,35 +296,567 @@ checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 	memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
 	sdr->sdr_len = rlen;
 	sdr->sdr_errors = 0;
+	sdr->sdr_rpkts = sdr->sdr_rbytes = 0;
+	sdr->sdr_wpkts = sdr->sdr_wbytes = 0;
+	sdr->sdr_sendfails = 0;
+	sdr->sdr_lost = sdr->sdr_duped = 0;
+	sdr->sdr_imp = findimpairment(addr);
+	sdr->sdr_tokens = sdr->sdr_imp ? (int64_t)sdr->sdr_imp->im_burst : 0;
+	sdr->sdr_tbtime = 0;
+	sdr->sdr_waiting = 0;
 
 	if (array_add(senders, sdr)) {
 		fprintf(stderr, "hub161: Out of memory\n");
 		exit(1);
 	}
+
+	sdr->sdr_next = sendertable[addrhash(addr)];
+	sendertable[addrhash(addr)] = sdr;
+
+	return sdr;
+}
+
+/*
+ * Account for a packet sent (or not, if ERR is nonzero).
+ */
+static
+void
+senddone(struct outpacket *op, int err)
+{
+	struct sender *sdr = op->op_sdr;
+
+	if (err) {
+		fprintf(stderr, "hub161: sendto %04x: %s\n",
+			sdr->sdr_addr, strerror(err));
+		sdr->sdr_errors++;
+		sdr->sdr_sendfails++;
+		return;
+	}
+	sdr->sdr_wpkts++;
+	sdr->sdr_wbytes += op->op_len;
 }
 
+/*
+ * Send everything queued by sendone(). This must be done before the
+ * receive buffers the packets point into are reused, and before any
+ * senders are freed.
+ */
 static
 void
-dosend(const char *pkt, size_t len)
+flushout(void)
 {
+	struct outpacket *op;
+	unsigned i;
+	int r;
+
+#ifdef HAS_MMSG
+	static struct mmsghdr mm[OUTQ];
+	static struct iovec iov[OUTQ];
+	unsigned j;
+
+	for (i=0; i<nout; i++) {
+		op = &outq[i];
+		iov[i].iov_base = (void *)op->op_buf;
+		iov[i].iov_len = op->op_len;
+		memset(&mm[i], 0, sizeof(mm[i]));
+		mm[i].msg_hdr.msg_name = &op->op_sdr->sdr_sun;
+		mm[i].msg_hdr.msg_namelen = op->op_sdr->sdr_len;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* sendmmsg stops at the first failure, which it then reports */
+	i = 0;
+	while (i < nout) {
+		r = sendmmsg(sock, mm+i, nout-i, 0);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			senddone(&outq[i], errno);
+			i++;
+			continue;
+		}
+		for (j=0; j<(unsigned)r; j++) {
+			senddone(&outq[i+j], 0);
+		}
+		i += r;
+	}
+#else
+	for (i=0; i<nout; i++) {
+		op = &outq[i];
+		r = sendto(sock, op->op_buf, op->op_len, 0, 
+			   (struct sockaddr *)&op->op_sdr->sdr_sun,
+			   op->op_sdr->sdr_len);
+		senddone(op, r < 0 ? errno : 0);
+	}
+#endif
+	nout = 0;
+}
+
+static
+void
+sendone(struct sender *sdr, const char *pkt, size_t len)
+{
+	struct outpacket *op;
+
+	if (nout == OUTQ) {
+		flushout();
+	}
+	op = &outq[nout++];
+	op->op_sdr = sdr;
+	op->op_buf = pkt;
+	op->op_len = len;
+}
+
+////////////////////////////////////////////////////////////
+// impairment
+
+static
+uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void
+timer_add(struct delayed *d)
+{
+	struct delayed *tmp;
+	unsigned i, parent;
+
+	if (ntimers == maxtimers) {
+		maxtimers = maxtimers ? maxtimers * 2 : 64;
+		timerheap = realloc(timerheap, maxtimers * sizeof(*timerheap));
+		if (timerheap == NULL) {
+			fprintf(stderr, "hub161: Out of memory\n");
+			exit(1);
+		}
+	}
+	d->d_seq = timerseq++;
+	i = ntimers++;
+	timerheap[i] = d;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (timerheap[parent]->d_when < d->d_when ||
+		    (timerheap[parent]->d_when == d->d_when &&
+		     timerheap[parent]->d_seq < d->d_seq)) {
+			break;
+		}
+		tmp = timerheap[parent];
+		timerheap[parent] = timerheap[i];
+		timerheap[i] = tmp;
+		i = parent;
+	}
+}
+
+static
+int
+timer_before(unsigned a, unsigned b)
+{
+	return timerheap[a]->d_when < timerheap[b]->d_when ||
+		(timerheap[a]->d_when == timerheap[b]->d_when &&
+		 timerheap[a]->d_seq < timerheap[b]->d_seq);
+}
+
+static
+struct delayed *
+timer_remove(void)
+{
+	struct delayed *ret, *tmp;
+	unsigned i, c, best;
+
+	assert(ntimers > 0);
+	ret = timerheap[0];
+	timerheap[0] = timerheap[--ntimers];
+	i = 0;
+	while (1) {
+		best = i;
+		c = 2*i + 1;
+		if (c < ntimers && timer_before(c, best)) {
+			best = c;
+		}
+		if (c+1 < ntimers && timer_before(c+1, best)) {
+			best = c+1;
+		}
+		if (best == i) {
+			break;
+		}
+		tmp = timerheap[best];
+		timerheap[best] = timerheap[i];
+		timerheap[i] = tmp;
+		i = best;
+	}
+	return ret;
+}
+
+/*
+ * Milliseconds until the next packet in the timer queue is due, for
+ * poll(); -1 if there's none.
+ */
+static
+int
+timer_wait(void)
+{
+	uint64_t now, when;
+
+	if (ntimers == 0) {
+		return -1;
+	}
+	now = now_ns();
+	when = timerheap[0]->d_when;
+	if (when <= now) {
+		return 0;
+	}
+	return (when - now + 999999) / 1000000;
+}
+
+/*
+ * Send the packets that are due. They stay allocated, on firedlist,
+ * until flushout() has sent them.
+ */
+static
+void
+timer_run(void)
+{
+	struct delayed *d;
 	struct sender *sdr;
-	int r, n, i;
+	uint64_t now;
+
+	now = now_ns();
+	while (ntimers > 0 && timerheap[0]->d_when <= now) {
+		d = timer_remove();
+		d->d_next = firedlist;
+		firedlist = d;
+
+		/* the port may have gone away in the meantime */
+		sdr = findsender(d->d_to);
+		if (sdr == NULL) {
+			continue;
+		}
+		if (sdr->sdr_waiting > 0) {
+			sdr->sdr_waiting--;
+		}
+		sendone(sdr, (const char *)(d+1), d->d_len);
+	}
+}
+
+static
+void
+timer_cleanup(void)
+{
+	struct delayed *d;
+
+	while (firedlist != NULL) {
+		d = firedlist;
+		firedlist = d->d_next;
+		free(d);
+	}
+}
+
+/*
+ * Send one copy of a packet out an impaired port.
+ */
+static
+void
+impaired_send(struct sender *sdr, const char *pkt, size_t len)
+{
+	struct impairment *im = sdr->sdr_imp;
+	struct delayed *d;
+	uint64_t now, when;
+	int64_t jitter;
+
+	now = when = now_ns();
+
+	if (im->im_rate > 0) {
+		if (sdr->sdr_tbtime > 0) {
+			sdr->sdr_tokens += (now - sdr->sdr_tbtime) *
+				im->im_rate / 1000000000ULL;
+		}
+		if (sdr->sdr_tokens > (int64_t)im->im_burst) {
+			sdr->sdr_tokens = im->im_burst;
+		}
+		sdr->sdr_tbtime = now;
+		sdr->sdr_tokens -= len;
+		if (sdr->sdr_tokens < 0) {
+			when += -sdr->sdr_tokens * 1000000000ULL / im->im_rate;
+		}
+	}
+
+	if ((im->im_delay > 0 || im->im_jitter > 0) &&
+	    !(im->im_reorder > 0 && drand48() < im->im_reorder)) {
+		when += im->im_delay;
+		if (im->im_jitter > 0) {
+			jitter = (int64_t)((2*drand48() - 1) * im->im_jitter);
+			if (jitter < 0 && (uint64_t)-jitter > when - now) {
+				when = now;
+			}
+			else {
+				when += jitter;
+			}
+		}
+	}
+
+	if (when <= now) {
+		sendone(sdr, pkt, len);
+		return;
+	}
+
+	if (sdr->sdr_waiting >= im->im_limit) {
+		sdr->sdr_lost++;
+		if (im->im_rate > 0) {
+			/* it never went, so give the tokens back */
+			sdr->sdr_tokens += len;
+		}
+		return;
+	}
+
+	d = malloc(sizeof(*d) + len);
+	if (d == NULL) {
+		fprintf(stderr, "hub161: Out of memory\n");
+		exit(1);
+	}
+	d->d_when = when;
+	d->d_to = sdr->sdr_addr;
+	d->d_len = len;
+	memcpy(d+1, pkt, len);
+	timer_add(d);
+	sdr->sdr_waiting++;
+}
+
+static
+void
+deliver(struct sender *sdr, const char *pkt, size_t len)
+{
+	struct impairment *im = sdr->sdr_imp;
+
+	if (im == NULL) {
+		sendone(sdr, pkt, len);
+		return;
+	}
+
+	if (im->im_loss > 0 && drand48() < im->im_loss) {
+		sdr->sdr_lost++;
+		return;
+	}
+	impaired_send(sdr, pkt, len);
+	if (im->im_dup > 0 && drand48() < im->im_dup) {
+		sdr->sdr_duped++;
+		impaired_send(sdr, pkt, len);
+	}
+}
+
+/*
+ * Parse a percentage into a probability.
+ */
+static
+int
+getpercent(const char *s, double *ret)
+{
+	char *end;
+	double val;
+
+	val = strtod(s, &end);
+	if (end == s || (*end != 0 && strcmp(end, "%") != 0) ||
+	    val < 0 || val > 100) {
+		return -1;
+	}
+	*ret = val / 100;
+	return 0;
+}
+
+/*
+ * Parse a time, in ms unless it has a suffix, into ns.
+ */
+static
+int
+gettime(const char *s, uint64_t *ret)
+{
+	char *end;
+	double val, scale;
+
+	val = strtod(s, &end);
+	if (end == s || val < 0) {
+		return -1;
+	}
+	if (!strcmp(end, "") || !strcmp(end, "ms")) scale = 1000000;
+	else if (!strcmp(end, "s")) scale = 1000000000;
+	else if (!strcmp(end, "us")) scale = 1000;
+	else if (!strcmp(end, "ns")) scale = 1;
+	else return -1;
+	*ret = val * scale;
+	return 0;
+}
+
+/*
+ * Parse a byte count with optional K, M, or G suffix.
+ */
+static
+int
+getbytes(const char *s, uint64_t *ret)
+{
+	char *end;
+	uint64_t val;
+
+	val = strtoull(s, &end, 0);
+	if (end == s) {
+		return -1;
+	}
+	if (!strcmp(end, "")) ;
+	else if (!strcmp(end, "K") || !strcmp(end, "k")) val *= 1024;
+	else if (!strcmp(end, "M") || !strcmp(end, "m")) val *= 1024*1024;
+	else if (!strcmp(end, "G") || !strcmp(end, "g")) val *= 1024*1024*1024;
+	else return -1;
+	*ret = val;
+	return 0;
+}
+
+/*
+ * Handle a -i option: [addr:]key=val,key=val,...
+ */
+static
+void
+addimpairment(const char *arg)
+{
+	struct impairment *im;
+	char *spec, *s, *val, *next, *end;
+	uint64_t limit;
+	unsigned long addr;
+	int bad;
+
+	im = malloc(sizeof(*im));
+	spec = strdup(arg);
+	if (im == NULL || spec == NULL) {
+		fprintf(stderr, "hub161: Out of memory\n");
+		exit(1);
+	}
+	memset(im, 0, sizeof(*im));
+	im->im_limit = DEFAULT_LIMIT;
+
+	s = spec;
+	if (strchr(s, ':') != NULL) {
+		addr = strtoul(s, &end, 16);
+		if (end == s || *end != ':' || addr == HUB_ADDR ||
+		    addr >= BROADCAST_ADDR) {
+			fprintf(stderr, "hub161: -i %s: bad address\n", arg);
+			exit(3);
+		}
+		im->im_hasaddr = 1;
+		im->im_addr = addr;
+		s = end+1;
+	}
+
+	for (; s != NULL; s = next) {
+		next = strchr(s, ',');
+		if (next != NULL) {
+			*next++ = 0;
+		}
+		val = strchr(s, '=');
+		if (val == NULL) {
+			fprintf(stderr, "hub161: -i %s: expected key=value\n",
+				arg);
+			exit(3);
+		}
+		*val++ = 0;
+
+		if (!strcmp(s, "loss")) {
+			bad = getpercent(val, &im->im_loss);
+		}
+		else if (!strcmp(s, "dup")) {
+			bad = getpercent(val, &im->im_dup);
+		}
+		else if (!strcmp(s, "reorder")) {
+			bad = getpercent(val, &im->im_reorder);
+		}
+		else if (!strcmp(s, "delay")) {
+			bad = gettime(val, &im->im_delay);
+		}
+		else if (!strcmp(s, "jitter")) {
+			bad = gettime(val, &im->im_jitter);
+		}
+		else if (!strcmp(s, "rate")) {
+			bad = getbytes(val, &im->im_rate);
+		}
+		else if (!strcmp(s, "burst")) {
+			bad = getbytes(val, &im->im_burst);
+		}
+		else if (!strcmp(s, "limit")) {
+			bad = getbytes(val, &limit);
+			if (!bad && (limit == 0 || limit > 1000000)) {
+				bad = 1;
+			}
+			im->im_limit = limit;
+		}
+		else {
+			fprintf(stderr, "hub161: -i %s: unknown setting %s\n",
+				arg, s);
+			exit(3);
+		}
+		if (bad) {
+			fprintf(stderr, "hub161: -i %s: bad value for %s\n",
+				arg, s);
+			exit(3);
+		}
+	}
+	free(spec);
+
+	if (im->im_rate > 0 && im->im_burst < MAXPACKET) {
+		/* must be able to hold at least one packet */
+		im->im_burst = MAXPACKET;
+	}
+
+	if (impairments == NULL) {
+		impairments = array_create();
+		if (impairments == NULL) {
+			fprintf(stderr, "hub161: Out of memory\n");
+			exit(1);
+		}
+	}
+	if (array_add(impairments, im)) {
+		fprintf(stderr, "hub161: Out of memory\n");
+		exit(1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Forward a packet. FROM is the port it came in on; in switch mode
+ * floods aren't sent back there.
+ */
+static
+void
+dosend(struct sender *from, uint16_t to, const char *pkt, size_t len)
+{
+	struct sender *sdr;
+	int n, i;
 
 	assert(senders != NULL);
 	assert(pkt != NULL);
 
+	npackets++;
+
+	if (switching && to != BROADCAST_ADDR) {
+		sdr = findsender(to);
+		if (sdr != NULL) {
+			deliver(sdr, pkt, len);
+			return;
+		}
+		nflooded++;
+	}
+
 	n = array_getnum(senders);
 	for (i=0; i<n; i++) {
 		sdr = array_getguy(senders, i);
 		assert(sdr != NULL);
-		r = sendto(sock, pkt, len, 0, 
-			   (struct sockaddr *)&sdr->sdr_sun,
-			   sdr->sdr_len);
-		if (r < 0) {
-			fprintf(stderr, "hub161: sendto %04x: %s\n",
-				sdr->sdr_addr, strerror(errno));
-			sdr->sdr_errors++;
+		if (switching && sdr == from) {
+			continue;
 		}
+		deliver(sdr, pkt, len);
 	}
 }
 
@@ -141,6 +876,8 @@ killsenders(void)
 
 		if (sdr->sdr_errors > 5) {
 			printf("hub161: dropping %04x\n", sdr->sdr_addr);
+			printsender(sdr);
+			unhashsender(sdr);
 			array_remove(senders, i);
 			i--;
 			n--;
@@ -209,82 +946,290 @@ closesock(void)
 
 static
 void
-loop(void)
+opencapture(const char *path)
 {
-	char packetbuf[MAXPACKET];
-	size_t packetlen;
-	struct sockaddr_un rsun;
-	socklen_t rlen;
-	struct linkheader *lh;
-	int r;
-	
-	while (1) {
-		rlen = sizeof(rsun);
-		r = recvfrom(sock, packetbuf, sizeof(packetbuf), 0,
-			     (struct sockaddr *)&rsun, &rlen);
-		if (r<0) {
-			fprintf(stderr, "hub161: recvfrom: %s\n", 
-				strerror(errno));
-			continue;
+	struct pcapfmt_filehdr pf;
+
+	capfile = fopen(path, "wb");
+	if (capfile == NULL) {
+		fprintf(stderr, "hub161: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	setvbuf(capfile, NULL, _IOFBF, 65536);
+	capname = path;
+
+	pf.pf_magic = PCAPFMT_MAGIC_NSEC;
+	pf.pf_major = PCAPFMT_VERSION_MAJOR;
+	pf.pf_minor = PCAPFMT_VERSION_MINOR;
+	pf.pf_thiszone = 0;
+	pf.pf_sigfigs = 0;
+	pf.pf_snaplen = MAXPACKET;
+	pf.pf_linktype = PCAPFMT_LINKTYPE_SYS161;
+	if (fwrite(&pf, sizeof(pf), 1, capfile) != 1) {
+		fprintf(stderr, "hub161: %s: write error\n", path);
+		exit(1);
+	}
+}
+
+static
+void
+closecapture(void)
+{
+	if (capfile != NULL) {
+		if (fclose(capfile)) {
+			fprintf(stderr, "hub161: %s: write error\n", capname);
 		}
-		packetlen = r;
+		capfile = NULL;
+	}
+}
+
+/*
+ * Record a frame as it comes in. The timestamps are host time, since
+ * the hub has no idea of any machine's virtual time.
+ */
+static
+void
+capture(const char *pkt, size_t len)
+{
+	struct pcapfmt_rechdr pr;
+	struct timespec ts;
+
+	if (capfile == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pr.pr_sec = ts.tv_sec;
+	pr.pr_nsec = ts.tv_nsec;
+	pr.pr_caplen = len;
+	pr.pr_len = len;
+	if (fwrite(&pr, sizeof(pr), 1, capfile) != 1 ||
+	    fwrite(pkt, len, 1, capfile) != 1) {
+		fprintf(stderr, "hub161: %s: write error; capture stopped\n",
+			capname);
+		fclose(capfile);
+		capfile = NULL;
+	}
+}
 
-		assert(rlen <= sizeof(rsun));
-		assert(rsun.sun_family==AF_UNIX);
-		assert(packetlen <= sizeof(packetbuf));
+////////////////////////////////////////////////////////////
+
+static
+void
+onsigusr1(int sig)
+{
+	(void)sig;
+	wantstats = 1;
+}
+
+static
+void
+onquit(int sig)
+{
+	(void)sig;
+	wantquit = 1;
+}
+
+static
+void
+setsignals(void)
+{
+	struct sigaction sa;
+
+	/* no SA_RESTART, so poll wakes up to act on these */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onsigusr1;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* exit cleanly, so the capture file is complete */
+	sa.sa_handler = onquit;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Check a packet and pass it on.
+ */
+static
+void
+handlepacket(char *packetbuf, size_t packetlen,
+	     struct sockaddr_un *rsun, socklen_t rlen)
+{
+	struct linkheader *lh;
+	struct sender *sdr;
+
+	assert(rlen <= sizeof(*rsun));
+	assert(rsun->sun_family==AF_UNIX);
+	assert(packetlen <= MAXPACKET);
 #ifdef HAS_SUN_LEN
-		assert(rlen <= rsun.sun_len);
-		if (rlen < rsun.sun_len) {
-			/*
-			 * This means the address (pathname) didn't fit
-			 * in the sockaddr.
-			 *
-			 * Beware: rsun.sun_path isn't necessarily null
-			 * terminated, so don't print it without a length
-			 * limit.
-			 */
-			fprintf(stderr, "hub161: packet from too-long "
-				"pathname\n");
-			continue;
-		}
-		assert(rlen == rsun.sun_len);
+	assert(rlen <= rsun->sun_len);
+	if (rlen < rsun->sun_len) {
+		/*
+		 * This means the address (pathname) didn't fit
+		 * in the sockaddr.
+		 *
+		 * Beware: rsun->sun_path isn't necessarily null
+		 * terminated, so don't print it without a length
+		 * limit.
+		 */
+		fprintf(stderr, "hub161: packet from too-long "
+			"pathname\n");
+		nbadpackets++;
+		return;
+	}
+	assert(rlen == rsun->sun_len);
 #endif
 
-		if (packetlen < sizeof(struct linkheader)) {
-			fprintf(stderr, "hub161: runt packet (size %lu)\n",
-				(unsigned long) packetlen);
-			continue;
-		}
+	if (packetlen < sizeof(struct linkheader)) {
+		fprintf(stderr, "hub161: runt packet (size %lu)\n",
+			(unsigned long) packetlen);
+		nbadpackets++;
+		return;
+	}
 
-		lh = (struct linkheader *)packetbuf;
+	lh = (struct linkheader *)packetbuf;
 
-		if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
-			fprintf(stderr, "hub161: frame error [%04x]\n",
-				ntohs(lh->lh_frame));
-			continue;
-		}
+	if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
+		fprintf(stderr, "hub161: frame error [%04x]\n",
+			ntohs(lh->lh_frame));
+		nbadpackets++;
+		return;
+	}
 
-		if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
-			fprintf(stderr, "hub161: bad size [%04x %04lx]\n",
-				ntohs(lh->lh_packetlen),
-				(unsigned long) packetlen);
-			continue;
-		}
+	if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
+		fprintf(stderr, "hub161: bad size [%04x %04lx]\n",
+			ntohs(lh->lh_packetlen),
+			(unsigned long) packetlen);
+		nbadpackets++;
+		return;
+	}
 
-		if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
-			fprintf(stderr, "hub161: packet came from broadcast "
-				"addr (dropped)\n");
-			continue;
+	if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
+		fprintf(stderr, "hub161: packet came from broadcast "
+			"addr (dropped)\n");
+		nbadpackets++;
+		return;
+	}
+
+	sdr = checksender(ntohs(lh->lh_from), rsun, rlen);
+	sdr->sdr_rpkts++;
+	sdr->sdr_rbytes += packetlen;
+
+	capture(packetbuf, packetlen);
+
+	if (ntohs(lh->lh_to) == HUB_ADDR) {
+		/* to us - don't forward it */
+		return;
+	}
+
+	dosend(sdr, ntohs(lh->lh_to), packetbuf, packetlen);
+}
+
+/*
+ * Receive as many packets as are waiting, up to BATCH. Returns the
+ * number received.
+ */
+static
+unsigned
+recvbatch(void)
+{
+	struct inpacket *ip;
+	unsigned i;
+	int r;
+
+#ifdef HAS_MMSG
+	static struct mmsghdr mm[BATCH];
+	static struct iovec iov[BATCH];
+
+	for (i=0; i<BATCH; i++) {
+		ip = &inpackets[i];
+		iov[i].iov_base = ip->ip_buf;
+		iov[i].iov_len = sizeof(ip->ip_buf);
+		memset(&mm[i], 0, sizeof(mm[i]));
+		mm[i].msg_hdr.msg_name = &ip->ip_sun;
+		mm[i].msg_hdr.msg_namelen = sizeof(ip->ip_sun);
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+	r = recvmmsg(sock, mm, BATCH, MSG_DONTWAIT, NULL);
+	if (r < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			fprintf(stderr, "hub161: recvmmsg: %s\n",
+				strerror(errno));
 		}
+		return 0;
+	}
+	for (i=0; i<(unsigned)r; i++) {
+		inpackets[i].ip_len = mm[i].msg_len;
+		inpackets[i].ip_sunlen = mm[i].msg_hdr.msg_namelen;
+	}
+	return r;
+#else
+	for (i=0; i<BATCH; i++) {
+		ip = &inpackets[i];
+		ip->ip_sunlen = sizeof(ip->ip_sun);
+		r = recvfrom(sock, ip->ip_buf, sizeof(ip->ip_buf),
+			     MSG_DONTWAIT,
+			     (struct sockaddr *)&ip->ip_sun, &ip->ip_sunlen);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR) {
+				fprintf(stderr, "hub161: recvfrom: %s\n", 
+					strerror(errno));
+			}
+			break;
+		}
+		ip->ip_len = r;
+	}
+	return i;
+#endif
+}
 
-		checksender(ntohs(lh->lh_from), &rsun, rlen);
+static
+void
+loop(void)
+{
+	struct pollfd pfd;
+	struct inpacket *ip;
+	unsigned i, n;
+	int r;
+	
+	while (!wantquit) {
+		if (wantstats) {
+			wantstats = 0;
+			printstats();
+			if (capfile != NULL) {
+				fflush(capfile);
+			}
+		}
 
-		if (ntohs(lh->lh_to) == HUB_ADDR) {
-			/* to us - don't forward it */
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		r = poll(&pfd, 1, timer_wait());
+		if (r<0) {
+			if (errno != EINTR) {
+				fprintf(stderr, "hub161: poll: %s\n",
+					strerror(errno));
+			}
 			continue;
 		}
 
-		dosend(packetbuf, packetlen);
+		timer_run();
+		n = r > 0 ? recvbatch() : 0;
+		for (i=0; i<n; i++) {
+			ip = &inpackets[i];
+			handlepacket(ip->ip_buf, ip->ip_len,
+				     &ip->ip_sun, ip->ip_sunlen);
+		}
+		flushout();
+		timer_cleanup();
 		killsenders();
 	}
 }
@@ -295,7 +1240,20 @@ static
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: hub161 [socketname]\n");
+	fprintf(stderr, "Usage: hub161 [-s] [-w capfile] "
+		"[-i [addr:]key=val,...] [-R seed]\n");
+	fprintf(stderr, "              [socketname]\n");
+	fprintf(stderr, "    -s    Switch packets by address instead of "
+		"sending them everywhere\n");
+	fprintf(stderr, "    -w    Write all packets to capfile in pcap "
+		"format\n");
+	fprintf(stderr, "    -i    Impair packets sent to addr (hex), or "
+		"to all ports; settings are\n");
+	fprintf(stderr, "          loss=%%, dup=%%, reorder=%%, delay=ms, "
+		"jitter=ms, rate=bytes/sec,\n");
+	fprintf(stderr, "          burst=bytes, limit=packets\n");
+	fprintf(stderr, "    -R    Seed for the impairment random "
+		"numbers\n");
 	fprintf(stderr, "    Default socket is %s\n", DEFAULT_SOCKET);
 	exit(3);
 }
@@ -304,10 +1262,16 @@ int
 main(int argc, char *argv[])
 {
 	const char *sockname = DEFAULT_SOCKET;
+	const char *capturefile = NULL;
+	long seed = time(NULL);
 	int ch;
 
-	while ((ch = getopt(argc, argv, ""))!=-1) {
+	while ((ch = getopt(argc, argv, "sw:i:R:"))!=-1) {
 		switch (ch) {
+		    case 's': switching = 1; break;
+		    case 'w': capturefile = optarg; break;
+		    case 'i': addimpairment(optarg); break;
+		    case 'R': seed = atol(optarg); break;
 		    default: usage();
 		}
 	}
@@ -324,10 +1288,19 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	srand48(seed);
+
+	if (capturefile != NULL) {
+		opencapture(capturefile);
+	}
 	opensock(sockname);
-	printf("hub161: Listening on %s\n", sockname);
+	setsignals();
+	printf("hub161: %s on %s\n", switching ? "Switching" : "Listening",
+	       sockname);
 	loop();
 	closesock();
+	closecapture();
+	printf("hub161: Exiting\n");
 
 	return 0;
 }
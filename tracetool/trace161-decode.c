@@ -0,0 +1,968 @@
+/*
+ * trace161-decode
+ *
+ * Reads a binary trace written by trace161 -B, and prints it as text
+ * or summarizes it.
+ */
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#include "tracefmt.h"
+
+/* How many entries to print in each top-N list of the summary */
+#define SUMMARY_TOP 20
+
+/* Record, in host byte order */
+struct rec {
+	unsigned kind;
+	unsigned cpu;
+	unsigned flag;
+	unsigned status;
+	uint64_t time;
+	uint32_t pc;
+	uint32_t insn;
+	uint32_t a, b, c;
+};
+
+////////////////////////////////////////////////////////////
+// input
+
+static const char *infile;
+#ifdef HAS_ZLIB
+static gzFile ingz;
+#else
+static FILE *inf;
+#endif
+
+static
+void
+openinput(const char *file)
+{
+	infile = file;
+#ifdef HAS_ZLIB
+	/* gzread reads uncompressed files too */
+	if (!strcmp(file, "-")) {
+		ingz = gzdopen(STDIN_FILENO, "rb");
+	}
+	else {
+		ingz = gzopen(file, "rb");
+	}
+	if (ingz == NULL) {
+		fprintf(stderr, "trace161-decode: %s: %s\n",
+			file, strerror(errno));
+		exit(1);
+	}
+#else
+	if (!strcmp(file, "-")) {
+		inf = stdin;
+	}
+	else {
+		inf = fopen(file, "rb");
+	}
+	if (inf == NULL) {
+		fprintf(stderr, "trace161-decode: %s: %s\n",
+			file, strerror(errno));
+		exit(1);
+	}
+#endif
+}
+
+/*
+ * Read LEN bytes. Returns 0 at end of file, if it comes before any
+ * of them.
+ */
+static
+int
+readbytes(void *buf, size_t len)
+{
+	size_t got;
+
+#ifdef HAS_ZLIB
+	int r;
+
+	r = gzread(ingz, buf, len);
+	if (r < 0) {
+		int err;
+
+		fprintf(stderr, "trace161-decode: %s: %s\n", infile,
+			gzerror(ingz, &err));
+		exit(1);
+	}
+	got = r;
+#else
+	got = fread(buf, 1, len, inf);
+	if (ferror(inf)) {
+		fprintf(stderr, "trace161-decode: %s: %s\n", infile,
+			strerror(errno));
+		exit(1);
+	}
+#endif
+	if (got == 0) {
+		return 0;
+	}
+	if (got != len) {
+		fprintf(stderr, "trace161-decode: %s: Unexpected EOF "
+			"(trace truncated?)\n", infile);
+		exit(1);
+	}
+	return 1;
+}
+
+static
+void
+readheader(void)
+{
+	struct tracefmt_header th;
+
+	if (!readbytes(&th, sizeof(th)) ||
+	    strncmp(th.th_magic, TRACEFMT_MAGIC, sizeof(th.th_magic)) != 0) {
+		fprintf(stderr, "trace161-decode: %s: Not a binary trace\n",
+			infile);
+		exit(1);
+	}
+	if (ntohl(th.th_version) != TRACEFMT_VERSION) {
+		fprintf(stderr, "trace161-decode: %s: Unsupported version %u\n",
+			infile, (unsigned)ntohl(th.th_version));
+		exit(1);
+	}
+	if (ntohl(th.th_recsize) != sizeof(struct tracefmt_rec)) {
+		fprintf(stderr, "trace161-decode: %s: Wrong record size %u\n",
+			infile, (unsigned)ntohl(th.th_recsize));
+		exit(1);
+	}
+}
+
+/*
+ * Read the next record, and for text records the text, which is
+ * returned null-terminated in TEXT. Returns 0 at end of file.
+ */
+static
+int
+readrec(struct rec *r, char *text, size_t maxtext)
+{
+	struct tracefmt_rec tr;
+
+	if (!readbytes(&tr, sizeof(tr))) {
+		return 0;
+	}
+	r->kind = tr.tr_kind;
+	r->cpu = tr.tr_cpu;
+	r->flag = tr.tr_flag;
+	r->status = tr.tr_status;
+	r->time = ((uint64_t)ntohl(tr.tr_timehi) << 32) | ntohl(tr.tr_timelo);
+	r->pc = ntohl(tr.tr_pc);
+	r->insn = ntohl(tr.tr_insn);
+	r->a = ntohl(tr.tr_a);
+	r->b = ntohl(tr.tr_b);
+	r->c = ntohl(tr.tr_c);
+
+	switch (r->kind) {
+	    case TRACEFMT_INSN:
+	    case TRACEFMT_CONSOLE:
+		break;
+	    case TRACEFMT_CPUTEXT:
+	    case TRACEFMT_HWTEXT:
+		if (r->a >= maxtext) {
+			fprintf(stderr, "trace161-decode: %s: Invalid text "
+				"length %u\n", infile, (unsigned)r->a);
+			exit(1);
+		}
+		if (r->a > 0 && !readbytes(text, r->a)) {
+			fprintf(stderr, "trace161-decode: %s: Unexpected EOF "
+				"(trace truncated?)\n", infile);
+			exit(1);
+		}
+		text[r->a] = 0;
+		break;
+	    default:
+		fprintf(stderr, "trace161-decode: %s: Invalid record kind %u\n",
+			infile, r->kind);
+		exit(1);
+	}
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+// disassembly
+
+/* Operand layouts */
+enum forms {
+	F_ILL,		/* not an instruction */
+	F_NONE,		/* no operands */
+	F_ALU3,		/* rd, rs, rt */
+	F_SHIFT,	/* rd, rt, sh */
+	F_SHIFTV,	/* rd, rt, rs */
+	F_JR,		/* rs */
+	F_JALR,		/* rd, rs */
+	F_MULDIV,	/* rs, rt */
+	F_MFHILO,	/* rd */
+	F_MTHILO,	/* rs */
+	F_IMM,		/* rt, rs, signed immediate */
+	F_IMMU,		/* rt, rs, unsigned immediate */
+	F_LUI,		/* rt, immediate */
+	F_LOAD,		/* rt, offset(rs) */
+	F_STORE,	/* rt, offset(rs) */
+	F_BR2,		/* rs, rt, target */
+	F_BR1,		/* rs, target */
+	F_J,		/* target */
+	F_MFC0,		/* rt, cop0 reg */
+	F_MTC0,		/* rt, cop0 reg */
+	F_CACHE,	/* op, offset(rs) */
+	F_COP,		/* coprocessor operation */
+};
+
+struct insninfo {
+	const char *ii_name;
+	enum forms ii_form;
+	unsigned long long ii_count;	/* for the summary */
+};
+
+static struct insninfo ill = { "(illegal)", F_ILL, 0 };
+
+static struct insninfo specialtab[64] = {
+	[0x00] = { "sll", F_SHIFT, 0 },
+	[0x02] = { "srl", F_SHIFT, 0 },
+	[0x03] = { "sra", F_SHIFT, 0 },
+	[0x04] = { "sllv", F_SHIFTV, 0 },
+	[0x06] = { "srlv", F_SHIFTV, 0 },
+	[0x07] = { "srav", F_SHIFTV, 0 },
+	[0x08] = { "jr", F_JR, 0 },
+	[0x09] = { "jalr", F_JALR, 0 },
+	[0x0c] = { "syscall", F_NONE, 0 },
+	[0x0d] = { "break", F_NONE, 0 },
+	[0x0f] = { "sync", F_NONE, 0 },
+	[0x10] = { "mfhi", F_MFHILO, 0 },
+	[0x11] = { "mthi", F_MTHILO, 0 },
+	[0x12] = { "mflo", F_MFHILO, 0 },
+	[0x13] = { "mtlo", F_MTHILO, 0 },
+	[0x18] = { "mult", F_MULDIV, 0 },
+	[0x19] = { "multu", F_MULDIV, 0 },
+	[0x1a] = { "div", F_MULDIV, 0 },
+	[0x1b] = { "divu", F_MULDIV, 0 },
+	[0x20] = { "add", F_ALU3, 0 },
+	[0x21] = { "addu", F_ALU3, 0 },
+	[0x22] = { "sub", F_ALU3, 0 },
+	[0x23] = { "subu", F_ALU3, 0 },
+	[0x24] = { "and", F_ALU3, 0 },
+	[0x25] = { "or", F_ALU3, 0 },
+	[0x26] = { "xor", F_ALU3, 0 },
+	[0x27] = { "nor", F_ALU3, 0 },
+	[0x2a] = { "slt", F_ALU3, 0 },
+	[0x2b] = { "sltu", F_ALU3, 0 },
+};
+
+static struct insninfo bcondtab[4] = {
+	{ "bltz", F_BR1, 0 },
+	{ "bgez", F_BR1, 0 },
+	{ "bltzal", F_BR1, 0 },
+	{ "bgezal", F_BR1, 0 },
+};
+
+static struct insninfo maintab[64] = {
+	[0x02] = { "j", F_J, 0 },
+	[0x03] = { "jal", F_J, 0 },
+	[0x04] = { "beq", F_BR2, 0 },
+	[0x05] = { "bne", F_BR2, 0 },
+	[0x06] = { "blez", F_BR1, 0 },
+	[0x07] = { "bgtz", F_BR1, 0 },
+	[0x08] = { "addi", F_IMM, 0 },
+	[0x09] = { "addiu", F_IMM, 0 },
+	[0x0a] = { "slti", F_IMM, 0 },
+	[0x0b] = { "sltiu", F_IMM, 0 },
+	[0x0c] = { "andi", F_IMMU, 0 },
+	[0x0d] = { "ori", F_IMMU, 0 },
+	[0x0e] = { "xori", F_IMMU, 0 },
+	[0x0f] = { "lui", F_LUI, 0 },
+	[0x11] = { "cop1", F_COP, 0 },
+	[0x12] = { "cop2", F_COP, 0 },
+	[0x13] = { "cop3", F_COP, 0 },
+	[0x20] = { "lb", F_LOAD, 0 },
+	[0x21] = { "lh", F_LOAD, 0 },
+	[0x22] = { "lwl", F_LOAD, 0 },
+	[0x23] = { "lw", F_LOAD, 0 },
+	[0x24] = { "lbu", F_LOAD, 0 },
+	[0x25] = { "lhu", F_LOAD, 0 },
+	[0x26] = { "lwr", F_LOAD, 0 },
+	[0x28] = { "sb", F_STORE, 0 },
+	[0x29] = { "sh", F_STORE, 0 },
+	[0x2a] = { "swl", F_STORE, 0 },
+	[0x2b] = { "sw", F_STORE, 0 },
+	[0x2e] = { "swr", F_STORE, 0 },
+	[0x2f] = { "cache", F_CACHE, 0 },
+	[0x30] = { "ll", F_LOAD, 0 },
+	[0x31] = { "lwc1", F_LOAD, 0 },
+	[0x32] = { "lwc2", F_LOAD, 0 },
+	[0x33] = { "lwc3", F_LOAD, 0 },
+	[0x38] = { "sc", F_STORE, 0 },
+	[0x39] = { "swc1", F_STORE, 0 },
+	[0x3a] = { "swc2", F_STORE, 0 },
+	[0x3b] = { "swc3", F_STORE, 0 },
+};
+
+static struct insninfo mfc0 = { "mfc0", F_MFC0, 0 };
+static struct insninfo mtc0 = { "mtc0", F_MTC0, 0 };
+static struct insninfo cop0tab[64] = {
+	[0x01] = { "tlbr", F_NONE, 0 },
+	[0x02] = { "tlbwi", F_NONE, 0 },
+	[0x06] = { "tlbwr", F_NONE, 0 },
+	[0x08] = { "tlbp", F_NONE, 0 },
+	[0x10] = { "rfe", F_NONE, 0 },
+	[0x20] = { "wait", F_NONE, 0 },
+};
+
+static
+struct insninfo *
+lookup(uint32_t insn)
+{
+	struct insninfo *ii;
+	unsigned op, rs, rt;
+
+	op = insn >> 26;
+	rs = (insn >> 21) & 31;
+	rt = (insn >> 16) & 31;
+	switch (op) {
+	    case 0:
+		ii = &specialtab[insn & 0x3f];
+		break;
+	    case 1:
+		if ((rt & 0xf) > 1) {
+			return &ill;
+		}
+		ii = &bcondtab[(rt >> 3) | (rt & 1)];
+		break;
+	    case 0x10:
+		if (rs == 0) {
+			return &mfc0;
+		}
+		if (rs == 4) {
+			return &mtc0;
+		}
+		if (rs < 16) {
+			return &ill;
+		}
+		ii = &cop0tab[insn & 0x3f];
+		break;
+	    default:
+		ii = &maintab[op];
+		break;
+	}
+	return ii->ii_name != NULL ? ii : &ill;
+}
+
+static
+const char *
+regname(unsigned reg)
+{
+	static const char *const names[32] = {
+		"$z0", "$at", "$v0", "$v1", "$a0", "$a1", "$a2", "$a3",
+		"$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
+		"$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
+		"$t8", "$t9", "$k0", "$k1", "$gp", "$sp", "$s8", "$ra",
+	};
+	return names[reg & 31];
+}
+
+/*
+ * The text trace stops at the arrow when an instruction stalls or
+ * takes an exception, so do the same.
+ */
+static
+void
+printresult(const struct rec *r)
+{
+	if (r->status == TRACEFMT_RETIRED) {
+		printf(" -> 0x%x", r->c);
+	}
+	else {
+		printf(" ->");
+	}
+}
+
+static
+void
+printinsn(const struct rec *r)
+{
+	const struct insninfo *ii;
+	unsigned rs, rt, rd, sh;
+	int32_t imm;
+	uint32_t target;
+
+	rs = (r->insn >> 21) & 31;
+	rt = (r->insn >> 16) & 31;
+	rd = (r->insn >> 11) & 31;
+	sh = (r->insn >> 6) & 31;
+	imm = (int16_t)(r->insn & 0xffff);
+
+	printf("trace: %02x at %08x: ", r->cpu, r->pc);
+	ii = lookup(r->insn);
+	switch (ii->ii_form) {
+	    case F_ILL:
+		printf(".word 0x%08x", r->insn);
+		break;
+	    case F_NONE:
+	    case F_COP:
+		printf("%s", ii->ii_name);
+		break;
+	    case F_ALU3:
+		printf("%s %s, %s, %s: 0x%x, 0x%x", ii->ii_name,
+		       regname(rd), regname(rs), regname(rt), r->a, r->b);
+		printresult(r);
+		break;
+	    case F_SHIFT:
+		printf("%s %s, %s, %u: 0x%x", ii->ii_name,
+		       regname(rd), regname(rt), sh, r->b);
+		printresult(r);
+		break;
+	    case F_SHIFTV:
+		printf("%s %s, %s, %s: 0x%x, %u", ii->ii_name,
+		       regname(rd), regname(rt), regname(rs),
+		       r->b, r->a & 31);
+		printresult(r);
+		break;
+	    case F_JR:
+		printf("%s %s: 0x%x", ii->ii_name, regname(rs), r->a);
+		break;
+	    case F_JALR:
+		printf("%s %s, %s: 0x%x", ii->ii_name,
+		       regname(rd), regname(rs), r->a);
+		break;
+	    case F_MULDIV:
+		printf("%s %s, %s: 0x%x, 0x%x", ii->ii_name,
+		       regname(rs), regname(rt), r->a, r->b);
+		break;
+	    case F_MFHILO:
+		printf("%s %s:", ii->ii_name, regname(rd));
+		printresult(r);
+		break;
+	    case F_MTHILO:
+		printf("%s %s: 0x%x", ii->ii_name, regname(rs), r->a);
+		break;
+	    case F_IMM:
+		printf("%s %s, %s, %d: 0x%x", ii->ii_name,
+		       regname(rt), regname(rs), (int)imm, r->a);
+		printresult(r);
+		break;
+	    case F_IMMU:
+		printf("%s %s, %s, 0x%x: 0x%x", ii->ii_name,
+		       regname(rt), regname(rs), r->insn & 0xffff, r->a);
+		printresult(r);
+		break;
+	    case F_LUI:
+		printf("%s %s, 0x%x", ii->ii_name,
+		       regname(rt), r->insn & 0xffff);
+		break;
+	    case F_LOAD:
+		printf("%s %s, %d(%s): [0x%08x]", ii->ii_name,
+		       regname(rt), (int)imm, regname(rs), r->a + imm);
+		printresult(r);
+		break;
+	    case F_STORE:
+		printf("%s %s, %d(%s): 0x%x -> [0x%08x]", ii->ii_name,
+		       regname(rt), (int)imm, regname(rs),
+		       r->b, r->a + imm);
+		break;
+	    case F_BR2:
+		target = r->pc + 4 + (imm << 2);
+		printf("%s %s, %s, %08x: 0x%x, 0x%x", ii->ii_name,
+		       regname(rs), regname(rt), target, r->a, r->b);
+		break;
+	    case F_BR1:
+		target = r->pc + 4 + (imm << 2);
+		printf("%s %s, %08x: 0x%x", ii->ii_name,
+		       regname(rs), target, r->a);
+		break;
+	    case F_J:
+		target = ((r->pc + 4) & 0xf0000000) |
+			((r->insn & 0x03ffffff) << 2);
+		printf("%s %08x", ii->ii_name, target);
+		break;
+	    case F_MFC0:
+		printf("%s %s, $%u:", ii->ii_name, regname(rt), rd);
+		printresult(r);
+		break;
+	    case F_MTC0:
+		printf("%s %s, $%u: 0x%x", ii->ii_name,
+		       regname(rt), rd, r->b);
+		break;
+	    case F_CACHE:
+		printf("%s %u, %d(%s)", ii->ii_name, rt, (int)imm,
+		       regname(rs));
+		break;
+	}
+	printf("\n");
+}
+
+////////////////////////////////////////////////////////////
+// text output
+
+static int printtimes;
+
+static
+void
+printconsole(int c)
+{
+	/* same as console_putc in main/console.c */
+	printf("console: ");
+	if ((c >= 32 && c < 127) || (c >= 32+128 && c < 255)) {
+		printf("`%c'", c);
+	}
+	else {
+		switch (c) {
+		    case '\a': printf("`\\a'"); break;
+		    case '\b': printf("`\\b'"); break;
+		    case '\t': printf("`\\t'"); break;
+		    case '\n': printf("`\\n'"); break;
+		    case '\v': printf("`\\v'"); break;
+		    case '\f': printf("`\\f'"); break;
+		    case '\r': printf("`\\r'"); break;
+		    default: printf("`\\%02x'", c); break;
+		}
+	}
+	printf(" (%d / 0x%x)\n", c, c);
+}
+
+static
+void
+printrec(const struct rec *r, const char *text)
+{
+	if (printtimes) {
+		printf("[%llu.%09llu] ",
+		       (unsigned long long)(r->time / 1000000000),
+		       (unsigned long long)(r->time % 1000000000));
+	}
+	switch (r->kind) {
+	    case TRACEFMT_INSN:
+		printinsn(r);
+		break;
+	    case TRACEFMT_CPUTEXT:
+		printf("trace: %02x %s\n", r->cpu, text);
+		break;
+	    case TRACEFMT_HWTEXT:
+		printf("trace: -- %s\n", text);
+		break;
+	    case TRACEFMT_CONSOLE:
+		printconsole(r->a & 0xff);
+		break;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// summary
+
+#define MAXCPUS 32
+
+struct pccount {
+	uint32_t pc;
+	unsigned long long count;
+};
+
+static unsigned long long nrecs[TRACEFMT_CONSOLE + 1];
+static unsigned long long nstalled, ntrapped;	/* insn cycles not retired */
+static unsigned long long ninsns[MAXCPUS][2];	/* kernel, user */
+static uint64_t firsttime, lasttime;
+static int sawtime;
+
+/* open-addressed hash table of instruction addresses */
+static struct pccount *pctable;
+static unsigned pctablesize, pctablecount;
+
+static
+void *
+domalloc(size_t len)
+{
+	void *p;
+
+	p = malloc(len);
+	if (p == NULL) {
+		fprintf(stderr, "trace161-decode: Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static
+void
+pcinsert(uint32_t pc, unsigned long long count)
+{
+	unsigned ix;
+
+	ix = (pc >> 2) * 2654435761U % pctablesize;
+	while (pctable[ix].count != 0 && pctable[ix].pc != pc) {
+		ix = (ix + 1) % pctablesize;
+	}
+	if (pctable[ix].count == 0) {
+		pctable[ix].pc = pc;
+		pctablecount++;
+	}
+	pctable[ix].count += count;
+}
+
+static
+void
+pcgrow(void)
+{
+	struct pccount *old;
+	unsigned oldsize, i;
+
+	old = pctable;
+	oldsize = pctablesize;
+	pctablesize = oldsize ? oldsize * 2 : 4096;
+	pctable = domalloc(pctablesize * sizeof(*pctable));
+	memset(pctable, 0, pctablesize * sizeof(*pctable));
+	pctablecount = 0;
+	for (i=0; i<oldsize; i++) {
+		if (old[i].count != 0) {
+			pcinsert(old[i].pc, old[i].count);
+		}
+	}
+	free(old);
+}
+
+static
+void
+summarize(const struct rec *r)
+{
+	if (!sawtime) {
+		firsttime = r->time;
+		sawtime = 1;
+	}
+	lasttime = r->time;
+	nrecs[r->kind]++;
+
+	if (r->kind == TRACEFMT_INSN && r->status == TRACEFMT_STALLED) {
+		nstalled++;
+	}
+	else if (r->kind == TRACEFMT_INSN && r->status != TRACEFMT_RETIRED) {
+		ntrapped++;
+	}
+	else if (r->kind == TRACEFMT_INSN) {
+		ninsns[r->cpu % MAXCPUS][r->flag == 1]++;
+		lookup(r->insn)->ii_count++;
+		if (pctablecount * 2 >= pctablesize) {
+			pcgrow();
+		}
+		pcinsert(r->pc, 1);
+	}
+}
+
+static
+int
+pccmp(const void *av, const void *bv)
+{
+	const struct pccount *a = av, *b = bv;
+
+	if (a->count != b->count) {
+		return a->count > b->count ? -1 : 1;
+	}
+	return a->pc < b->pc ? -1 : a->pc > b->pc;
+}
+
+static
+int
+namecmp(const void *av, const void *bv)
+{
+	const struct pccount *a = av, *b = bv;
+
+	if (a->count != b->count) {
+		return a->count > b->count ? -1 : 1;
+	}
+	return 0;
+}
+
+static
+void
+addnames(struct insninfo *tab, unsigned num,
+	 const char **names, struct pccount *counts, unsigned *n)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		if (tab[i].ii_count == 0) {
+			continue;
+		}
+		/* pc here is the index into names */
+		names[*n] = tab[i].ii_name;
+		counts[*n].pc = *n;
+		counts[*n].count = tab[i].ii_count;
+		(*n)++;
+	}
+}
+
+static
+void
+printsummary(void)
+{
+	static const char *names[64*4 + 4 + 3];
+	static struct pccount counts[64*4 + 4 + 3];
+	unsigned long long total;
+	unsigned i, j, n;
+
+	total = nrecs[TRACEFMT_INSN] - nstalled - ntrapped;
+	printf("Records: %llu instructions, %llu stalled, %llu trapped, "
+	       "%llu cpu text, %llu device text, %llu console\n",
+	       total, nstalled, ntrapped, nrecs[TRACEFMT_CPUTEXT],
+	       nrecs[TRACEFMT_HWTEXT], nrecs[TRACEFMT_CONSOLE]);
+	if (sawtime) {
+		printf("Time: %llu.%09llu to %llu.%09llu\n",
+		       (unsigned long long)(firsttime / 1000000000),
+		       (unsigned long long)(firsttime % 1000000000),
+		       (unsigned long long)(lasttime / 1000000000),
+		       (unsigned long long)(lasttime % 1000000000));
+	}
+	if (total == 0) {
+		return;
+	}
+
+	printf("\nInstructions by cpu:\n");
+	printf("  cpu       kernel         user\n");
+	for (i=0; i<MAXCPUS; i++) {
+		if (ninsns[i][0] + ninsns[i][1] == 0) {
+			continue;
+		}
+		printf("  %3u %12llu %12llu\n", i, ninsns[i][0], ninsns[i][1]);
+	}
+
+	qsort(pctable, pctablesize, sizeof(*pctable), pccmp);
+	printf("\nTop %u instruction addresses (of %u):\n",
+	       SUMMARY_TOP, pctablecount);
+	for (i=0; i<SUMMARY_TOP && i<pctablecount; i++) {
+		printf("  %08x %12llu %5.1f%%\n", pctable[i].pc,
+		       pctable[i].count, 100.0 * pctable[i].count / total);
+	}
+
+	n = 0;
+	addnames(specialtab, 64, names, counts, &n);
+	addnames(bcondtab, 4, names, counts, &n);
+	addnames(maintab, 64, names, counts, &n);
+	addnames(cop0tab, 64, names, counts, &n);
+	addnames(&mfc0, 1, names, counts, &n);
+	addnames(&mtc0, 1, names, counts, &n);
+	addnames(&ill, 1, names, counts, &n);
+	qsort(counts, n, sizeof(counts[0]), namecmp);
+	printf("\nTop %u instructions (of %u):\n", SUMMARY_TOP, n);
+	for (i=0; i<SUMMARY_TOP && i<n; i++) {
+		j = counts[i].pc;
+		printf("  %-10s %12llu %5.1f%%\n", names[j],
+		       counts[i].count, 100.0 * counts[i].count / total);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// filters
+
+static uint32_t cpumask = 0xffffffff;
+static int showconsole = 1;
+static int showflag[sizeof(TRACEFMT_FLAGLETTERS)];
+static int pcfilter;
+static uint32_t pclo, pchi;
+static uint64_t timelo, timehi = UINT64_MAX;
+
+static void usage(void);
+
+static
+void
+setcpus(const char *spec)
+{
+	char *end;
+	unsigned long cpu;
+
+	cpumask = 0;
+	while (*spec) {
+		cpu = strtoul(spec, &end, 0);
+		if (end == spec || cpu >= MAXCPUS ||
+		    (*end != ',' && *end != 0)) {
+			usage();
+		}
+		cpumask |= (uint32_t)1 << cpu;
+		spec = *end ? end + 1 : end;
+	}
+}
+
+static
+void
+setkinds(const char *letters)
+{
+	const char *p;
+	unsigned i;
+
+	showconsole = 0;
+	for (i=0; i<sizeof(showflag)/sizeof(showflag[0]); i++) {
+		showflag[i] = 0;
+	}
+	for (; *letters; letters++) {
+		if (*letters == 'c') {
+			showconsole = 1;
+			continue;
+		}
+		p = strchr(TRACEFMT_FLAGLETTERS, *letters);
+		if (p == NULL) {
+			usage();
+		}
+		showflag[p - TRACEFMT_FLAGLETTERS] = 1;
+	}
+}
+
+static
+void
+setpcrange(const char *spec)
+{
+	char *end;
+
+	pclo = strtoul(spec, &end, 16);
+	if (end == spec || *end != '-') {
+		usage();
+	}
+	spec = end + 1;
+	pchi = strtoul(spec, &end, 16);
+	if (end == spec || *end != 0 || pchi <= pclo) {
+		usage();
+	}
+	pcfilter = 1;
+}
+
+static
+uint64_t
+gettime(const char *spec, const char **end)
+{
+	char *e;
+	double secs;
+
+	secs = strtod(spec, &e);
+	if (e == spec || secs < 0) {
+		usage();
+	}
+	*end = e;
+	return (uint64_t)(secs * 1000000000.0 + 0.5);
+}
+
+static
+void
+settimerange(const char *spec)
+{
+	const char *end;
+
+	if (*spec != '-') {
+		timelo = gettime(spec, &end);
+		if (*end != '-') {
+			usage();
+		}
+		spec = end;
+	}
+	spec++;
+	if (*spec != 0) {
+		timehi = gettime(spec, &end);
+		if (*end != 0 || timehi <= timelo) {
+			usage();
+		}
+	}
+}
+
+static
+int
+wanted(const struct rec *r)
+{
+	if (r->time < timelo || r->time >= timehi) {
+		return 0;
+	}
+	if (r->kind == TRACEFMT_CONSOLE) {
+		return showconsole;
+	}
+	if (r->kind != TRACEFMT_HWTEXT &&
+	    (r->cpu >= MAXCPUS || (cpumask & ((uint32_t)1 << r->cpu)) == 0)) {
+		return 0;
+	}
+	if (r->flag < sizeof(showflag)/sizeof(showflag[0]) &&
+	    !showflag[r->flag]) {
+		return 0;
+	}
+	if (pcfilter && r->kind == TRACEFMT_INSN &&
+	    (r->pc < pclo || r->pc >= pchi)) {
+		return 0;
+	}
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+// main
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: trace161-decode [options] tracefile\n");
+	fprintf(stderr, "   -a lo-hi    Only instructions at addresses "
+		"lo to hi (hex)\n");
+	fprintf(stderr, "   -c cpus     Only cpus listed (e.g. 0,2)\n");
+	fprintf(stderr, "   -k kinds    Only these kinds: trace flags "
+		"[kujtxidne], or c for console\n");
+	fprintf(stderr, "   -s          Print summary instead of trace\n");
+	fprintf(stderr, "   -T from-to  Only virtual times from to to "
+		"(seconds)\n");
+	fprintf(stderr, "   -v          Print virtual time of each line\n");
+	exit(3);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char text[65536];
+	struct rec r;
+	int summary = 0;
+	unsigned i;
+	int ch;
+
+	for (i=0; i<sizeof(showflag)/sizeof(showflag[0]); i++) {
+		showflag[i] = 1;
+	}
+
+	while ((ch = getopt(argc, argv, "a:c:k:sT:v"))!=-1) {
+		switch (ch) {
+		    case 'a': setpcrange(optarg); break;
+		    case 'c': setcpus(optarg); break;
+		    case 'k': setkinds(optarg); break;
+		    case 's': summary = 1; break;
+		    case 'T': settimerange(optarg); break;
+		    case 'v': printtimes = 1; break;
+		    default: usage();
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+	}
+
+	openinput(argv[optind]);
+	readheader();
+	while (readrec(&r, text, sizeof(text))) {
+		if (!wanted(&r)) {
+			continue;
+		}
+		if (summary) {
+			summarize(&r);
+		}
+		else {
+			printrec(&r, text);
+		}
+	}
+	if (summary) {
+		printsummary();
+	}
+	if (fflush(stdout) != 0) {
+		fprintf(stderr, "trace161-decode: stdout: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	return 0;
+}